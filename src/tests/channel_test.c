@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "channel.h"
+#include "code/hashing.h"
+#include "code/shared_strings.h"
+
+// A two stage pipeline: a producer vm and a consumer vm, on their own threads,
+// talk through a small channel so both sides have to wait on each other. The
+// consumer reports back to the main thread through a second channel. One vm
+// uses the shared intern table and the other doesn't, so strings go both ways.
+
+static const char* producer_source =
+    "var jobs = channel(\"jobs\", 4);\n"
+    "var i = 0;\n"
+    "while (i < 1000) {\n"
+    "    send(jobs, i);\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "send(jobs, \"tail\" + \"-\" + \"built\");\n"
+    "send(jobs, \"done\");\n";
+
+static const char* consumer_source =
+    "var jobs = channel(\"jobs\", 4);\n"
+    "var results = channel(\"results\");\n"
+    "var sum = 0;\n"
+    "var i = 0;\n"
+    "while (i < 1000) {\n"
+    "    sum = sum + recv(jobs);\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var built = recv(jobs);\n"
+    "send(results, sum);\n"
+    "send(results, built == \"tail-built\");\n"
+    "send(results, recv(jobs) == \"done\");\n";
+
+typedef struct {
+    const char* source;
+    bool use_shared_strings;
+    InterpretResult result;
+} Stage;
+
+static void* run_stage(void* arg) {
+    Stage* stage = (Stage*)arg;
+    VM vm;
+    if (stage->use_shared_strings)
+        vm_init_shared(&vm);
+    else
+        vm_init(&vm);
+    stage->result = vm_execsource(&vm, stage->source);
+    vm_free(&vm);
+    return NULL;
+}
+
+int main() {
+    int failures = 0;
+    // the main thread hashes a name of its own before any vm is created
+    hash_seed_init();
+
+    Stage producer = {producer_source, false, INTERPRET_OK};
+    Stage consumer = {consumer_source, true, INTERPRET_OK};
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, run_stage, &producer);
+    pthread_create(&threads[1], NULL, run_stage, &consumer);
+
+    Channel* results = channel_open(shared_strings_intern("results", 7, hash_string("results", 7)), 64);
+    Value sum = channel_recv(results);
+    Value built_ok = channel_recv(results);
+    Value done_ok = channel_recv(results);
+
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    if (producer.result != INTERPRET_OK || consumer.result != INTERPRET_OK) {
+        fprintf(stderr, "a stage failed\n");
+        failures++;
+    }
+    if (!IS_VAL_NUMBERLIKE(sum) || NUMBERLIKE_AS_NUM(sum) != 499500) {
+        fprintf(stderr, "wrong sum\n");
+        failures++;
+    }
+    if (!IS_VAL_BOOL(built_ok) || !VAL_AS_BOOL(built_ok) || !IS_VAL_BOOL(done_ok) || !VAL_AS_BOOL(done_ok)) {
+        fprintf(stderr, "strings did not arrive intact\n");
+        failures++;
+    }
+
+    // only plain values can cross over
+    VM vm;
+    vm_init_shared(&vm);
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "send(channel(\"results\"), clock);\n") != INTERPRET_RUNTIME_ERROR) {
+        fprintf(stderr, "sending a function did not fail\n");
+        failures++;
+    }
+    fclose(err);
+    vm_free(&vm);
+
+    printf("pipeline of 2 stages, %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
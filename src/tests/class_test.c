@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs methods and field accesses over instances of a few shapes, more than
+// a cache holds for some of the accesses. Then checks that instances which got
+// the same fields in the same order share their shape, and what the caches of
+// a function remember.
+
+static const char* source =
+    "class Point {\n"
+    "    init(x, y) { this.x = x; this.y = y; }\n"
+    "    sum() { return this.x + this.y; }\n"
+    "    shift(d) { this.x = this.x + d; return this; }\n"
+    "}\n"
+    "class Named {\n"
+    "    init(name) { this.name = name; this.x = 100; }\n"
+    "    sum() { return this.x; }\n"
+    "}\n"
+    "class Bag {}\n"
+    "fun get_x(o) { return o.x; }\n"
+    "var a = Point(1, 2);\n"
+    "var b = Point(3, 4);\n"
+    "var objs = [a, b, Named(\"n\")];\n"
+    "var i = 0;\n"
+    "while (i < 6) {\n"
+    "    var bag = Bag();\n"
+    "    var j = 0;\n"
+    "    while (j < i) { bag.pad = j; j = j + 1; }\n"
+    "    bag.x = i;\n"
+    "    push(objs, bag);\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var total = 0;\n"
+    "var rounds = 0;\n"
+    "while (rounds < 100) {\n"
+    "    i = 0;\n"
+    "    while (i < len(objs)) { total = total + get_x(objs[i]); i = i + 1; }\n"
+    "    total = total + a.sum() + objs[2].sum();\n"
+    "    rounds = rounds + 1;\n"
+    "}\n"
+    "var bound = b.shift;\n"
+    "var shifted = bound(10).shift(1).x;\n"
+    "var c = Bag();\n"
+    "c.y = 1;\n"
+    "c.x = 2;\n";
+
+static int cached_shapes(PropertyCache* cache) {
+    int count = 0;
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++)
+        count += cache->entries[i].shape != NULL;
+    return count;
+}
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        vm_free(&vm);
+        return 1;
+    }
+
+    // 1 + 3 + 100 + 0..5 for get_x, then 3 + 100 for the methods
+    Value total = global_value(&vm, "total");
+    Value shifted = global_value(&vm, "shifted");
+    if (!IS_VAL_NUMBERLIKE(total) || NUMBERLIKE_AS_NUM(total) != 100 * (104 + 15 + 103) ||
+        !IS_VAL_NUMBERLIKE(shifted) || NUMBERLIKE_AS_NUM(shifted) != 14) {
+        fprintf(stderr, "wrong results from the script\n");
+        failures++;
+    }
+
+    ObjInstance* a = OBJ_AS_INSTANCE(global_value(&vm, "a"));
+    ObjInstance* b = OBJ_AS_INSTANCE(global_value(&vm, "b"));
+    ObjInstance* c = OBJ_AS_INSTANCE(global_value(&vm, "c"));
+    ObjInstance* last_bag = OBJ_AS_INSTANCE(OBJ_AS_LIST(global_value(&vm, "objs"))->items.values[8]);
+    if (a->shape != b->shape || a->shape->field_count != 2 ||
+        c->shape == last_bag->shape || c->shape->klass != last_bag->shape->klass) {
+        fprintf(stderr, "shapes aren't shared the right way\n");
+        failures++;
+    }
+
+    // get_x has a single access, which saw 9 shapes (Point, Named and 6 Bags
+    // with 1 to 6 fields... 7 in all, only the first 4 are kept)
+    ObjFunction* get_x = OBJ_AS_FUNC(global_value(&vm, "get_x"));
+    if (get_x->cache_count != 1 || cached_shapes(&get_x->caches[0]) != PROPERTY_CACHE_WAYS ||
+        get_x->caches[0].entries[0].shape != a->shape || get_x->caches[0].entries[0].slot != 0) {
+        fprintf(stderr, "the cache of get_x is wrong\n");
+        failures++;
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    const char* bad[] = {
+        "var n = 1; n.x;\n",
+        "class E {} E().x;\n",
+        "class E {} E(1);\n",
+        "class E { init(a) {} } E();\n",
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        if (vm_execsource(&vm, bad[i]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[i]);
+            failures++;
+        }
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("classes: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
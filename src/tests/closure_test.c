@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs closures that share, copy and outlive the variables they capture, with
+// enough garbage made on the way for some collections. Then checks that only
+// the assigned variables got an upvalue (initializers don't count), and that functions capturing nothing
+// aren't wrapped in a closure at all.
+
+static const char* source =
+    "fun make_counter() {\n"
+    "    var n = 0;\n"
+    "    fun inc() { n = n + 1; return n; }\n"
+    "    return inc;\n"
+    "}\n"
+    "fun make_adder(x) {\n"
+    "    fun add(y) { return x + y; }\n"
+    "    return add;\n"
+    "}\n"
+    "fun make_pair() {\n"
+    "    var v = 0;\n"
+    "    fun get() { fun deeper() { return v; } return deeper(); }\n"
+    "    fun set(x) { v = x; }\n"
+    "    return [get, set];\n"
+    "}\n"
+    "fun make_greeter() {\n"
+    "    var x = 41;\n"
+    "    fun inner() { return x + 1; }\n"
+    "    return inner;\n"
+    "}\n"
+    "fun plain(a) { return a * 2; }\n"
+    "var counter = make_counter();\n"
+    "var adder = make_adder(10);\n"
+    "var greeter = make_greeter();\n"
+    "var pair = make_pair();\n"
+    "var fns = [];\n"
+    "var i = 0;\n"
+    "while (i < 2000) {\n"
+    "    var j = i;\n"
+    "    fun get() { return j; }\n"
+    "    push(fns, get);\n"
+    "    counter();\n"
+    "    pair[1](pair[0]() + 1);\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var copies = fns[0]() + fns[1999]();\n"
+    "var shared = counter() + pair[0]() + adder(5);\n"
+    "var depth = 0;\n"
+    "{\n"
+    "    fun down(n) { if (n == 0) return 0; return 1 + down(n - 1); }\n"
+    "    depth = down(50);\n"
+    "}\n"
+    "fun make_gen() {\n"
+    "    var k = 0;\n"
+    "    fun body() { while (true) { k = k + 1; yield k; } }\n"
+    "    return fiber(body);\n"
+    "}\n"
+    "var gen = make_gen();\n"
+    "gen(); gen();\n"
+    "var yielded = gen();\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        vm_free(&vm);
+        return 1;
+    }
+
+    if (!global_is(&vm, "copies", 1999) || !global_is(&vm, "shared", 2001 + 2000 + 15) ||
+        !global_is(&vm, "depth", 50) || !global_is(&vm, "yielded", 3) ||
+        !IS_OBJ_CLOSURE(global_value(&vm, "greeter"))) {
+        fprintf(stderr, "wrong results from the script\n");
+        failures++;
+    }
+
+    // n is assigned so it's boxed, the parameter x and the initialized local x
+    // aren't so they're copied
+    Value counter = global_value(&vm, "counter");
+    Value adder = global_value(&vm, "adder");
+    Value greeter = global_value(&vm, "greeter");
+    if (!IS_OBJ_CLOSURE(counter) || !IS_OBJ_CLOSURE(adder) || !IS_OBJ_CLOSURE(greeter) ||
+        !is_obj_type(OBJ_AS_CLOSURE(counter)->captures[0], OBJ_UPVALUE) ||
+        !IS_VAL_NUMBERLIKE(OBJ_AS_CLOSURE(adder)->captures[0]) ||
+        !IS_VAL_NUMBERLIKE(OBJ_AS_CLOSURE(greeter)->captures[0])) {
+        fprintf(stderr, "captured the wrong way\n");
+        failures++;
+    }
+    if (!IS_OBJ_FUNC(global_value(&vm, "plain"))) {
+        fprintf(stderr, "a function capturing nothing got a closure\n");
+        failures++;
+    }
+    // the upvalues were closed when their frames returned
+    if (vm.open_upvalues != NULL) {
+        fprintf(stderr, "upvalues left open\n");
+        failures++;
+    }
+
+    vm_free(&vm);
+    printf("closures: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
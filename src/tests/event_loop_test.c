@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Tasks that sleep for different times finish in the order of their deadlines,
+// and an echo server task talks to the main script over a unix socket. Both
+// only work if waiting never blocks the whole vm.
+
+static const char* source =
+    "var order = \"\";\n"
+    "fun slow() { sleep(0.03); order = order + \"s\"; }\n"
+    "fun fast() { sleep(0.01); order = order + \"f\"; }\n"
+    "fun busy() { var i = 0; while (i < 3) { order = order + \"b\"; yield; i = i + 1; } }\n"
+    "async(slow); async(fast); async(busy);\n"
+    "var server = listen_unix(path);\n"
+    "fun serve() {\n"
+    "    var conn = accept(server);\n"
+    "    var got = read(conn);\n"
+    "    while (got != \"\") {\n"
+    "        write(conn, got + \"!\");\n"
+    "        got = read(conn);\n"
+    "    }\n"
+    "    close(conn);\n"
+    "}\n"
+    "async(serve);\n"
+    "var client = connect_unix(path);\n"
+    "write(client, \"ping\");\n"
+    "var reply = read(client);\n"
+    "close(client);\n"
+    "close(server);\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/volt_loop_test_%d.sock", (int)getpid());
+    ObjString* path_key = copy_string(&vm, "path", 4);
+    vm_pushstack(&vm, MK_VAL_OBJ(path_key));
+    hashtable_set(&vm, &vm.globals, path_key, MK_VAL_OBJ(copy_string(&vm, path, (int)strlen(path))));
+    vm_popstack(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    } else {
+        if (!global_is_string(&vm, "order", "bbbfs")) {
+            fprintf(stderr, "tasks ran in the wrong order\n");
+            failures++;
+        }
+        if (!global_is_string(&vm, "reply", "ping!")) {
+            fprintf(stderr, "wrong reply from the echo server\n");
+            failures++;
+        }
+    }
+    unlink(path);
+
+    // an error in a task stops the script, and forgets whatever else waited
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "fun bad() { sleep(0.01); return nil + 1; }\nasync(bad);\nasync(slow);\nsleep(1);\n") != INTERPRET_RUNTIME_ERROR ||
+        vm.fiber != NULL || vm_execsource(&vm, "var done = false;\nfun t() { done = true; }\nasync(t);\n") != INTERPRET_OK) {
+        fprintf(stderr, "an error in a task broke the vm\n");
+        failures++;
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("event loop: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
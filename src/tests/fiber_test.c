@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs generators and nested fibers, with a collection on the way, and checks
+// the values they passed back and forth. Also checks that an error inside a
+// fiber leaves the vm usable.
+
+static const char* source =
+    "fun range(n) {\n"
+    "    var i = 0;\n"
+    "    while (i < n) {\n"
+    "        yield i;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "}\n"
+    "fun sum(n) {\n"
+    "    var r = fiber(range);\n"
+    "    var total = 0;\n"
+    "    var value = r(n);\n"
+    "    while (!is_done(r)) {\n"
+    "        total = total + value;\n"
+    "        value = r();\n"
+    "    }\n"
+    "    return total;\n"
+    "}\n"
+    "fun echo(first) {\n"
+    "    var got = first;\n"
+    "    while (true) got = yield got + \"!\";\n"
+    "}\n"
+    "var summer = fiber(sum);\n"
+    "var result = summer(1000);\n"
+    "var e = fiber(echo);\n"
+    "var text = e(\"a\") + e(\"b\");\n"
+    "var i = 0;\n"
+    "while (i < 5000) {\n"
+    "    text = text + \"\";\n"
+    "    fiber(range);\n"
+    "    i = i + 1;\n"
+    "}\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    Value result, text;
+    if (vm_execsource(&vm, source) != INTERPRET_OK ||
+        !get_global(&vm, "result", &result) || !IS_VAL_NUMBERLIKE(result) || NUMBERLIKE_AS_NUM(result) != 499500 ||
+        !get_global(&vm, "text", &text) || !IS_OBJ_STRINGLIKE(text)) {
+        fprintf(stderr, "wrong results\n");
+        failures++;
+    } else {
+        vm_pushstack(&vm, text);
+        if (strcmp(stringlike_flatten(&vm, VAL_AS_OBJ(text))->chars, "a!b!") != 0) {
+            fprintf(stderr, "wrong values passed through yield\n");
+            failures++;
+        }
+        vm_popstack(&vm);
+    }
+
+    // the error unwinds the fibers back to the main script
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "fun f() { yield 1; return nil + 1; }\nvar x = fiber(f);\nx();\nx();\n") != INTERPRET_RUNTIME_ERROR ||
+        vm.fiber != NULL || vm_execsource(&vm, "var ok = sum(10);\n") != INTERPRET_OK) {
+        fprintf(stderr, "an error in a fiber broke the vm\n");
+        failures++;
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("fibers: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
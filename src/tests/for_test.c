@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs range loops (nested, empty, with fractional bounds, assigning to the
+// loop variable, captured by closures, returned out of) and C style for loops
+// with and without each clause, and checks the bounds are only evaluated once
+// and that double counters past 2^53 still end.
+
+static const char* source =
+    "var total = 0;\n"
+    "for (i in 0..100) total = total + i;\n"
+    "fun pairs(n) { var t = 0; for (i in 0..n) for (j in i..n) t = t + 1; return t; }\n"
+    "var nested = pairs(10);\n"
+    "var empty = 0;\n"
+    "for (i in 5..5) empty = empty + 1;\n"
+    "for (i in 5..-5) empty = empty + 1;\n"
+    "var halves = 0;\n"
+    "for (i in 0.5..3) halves = halves + i;\n"
+    "var huge = 0;\n"
+    "for (i in 9007199254740992.0..9007199254740994.0) huge = huge + 1;\n"
+    "var runs = 0;\n"
+    "for (i in 0..4) { i = 100; runs = runs + 1; }\n"
+    "var calls = 0;\n"
+    "fun limit() { calls = calls + 1; return 3; }\n"
+    "for (i in 0..limit()) {}\n"
+    "var fs = [];\n"
+    "for (i in 0..3) { fun get() { return i * 10; } push(fs, get); }\n"
+    "var captured = fs[0]() + fs[1]() + fs[2]();\n"
+    "fun find(l, x) { for (i in 0..len(l)) { if (l[i] == x) return i; } return -1; }\n"
+    "var found = find([4, 8, 15, 16], 15) * 10 + find([], 1);\n"
+    "var c_style = 0;\n"
+    "for (var i = 0; i < 10; i = i + 2) c_style = c_style + i;\n"
+    "var k = 0;\n"
+    "for (; k < 7;) k = k + 1;\n"
+    "fun first_big(n) { for (;;) { if (n > 100) return n; n = n * 2; } }\n"
+    "var big = first_big(3);\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    }
+    else {
+        if (!global_is(&vm, "total", 4950) || !global_is(&vm, "nested", 55) ||
+            !global_is(&vm, "empty", 0) || !global_is(&vm, "halves", 0.5 + 1.5 + 2.5) ||
+            !global_is(&vm, "huge", 1)) {
+            fprintf(stderr, "wrong results from the range loops\n");
+            failures++;
+        }
+        if (!global_is(&vm, "runs", 4) || !global_is(&vm, "calls", 1)) {
+            fprintf(stderr, "the loop variable or the limit changed the loop\n");
+            failures++;
+        }
+        if (!global_is(&vm, "captured", 30) || !global_is(&vm, "found", 19)) {
+            fprintf(stderr, "closures or returns in range loops don't work\n");
+            failures++;
+        }
+        if (!global_is(&vm, "c_style", 20) || !global_is(&vm, "k", 7) || !global_is(&vm, "big", 192)) {
+            fprintf(stderr, "wrong results from the C style loops\n");
+            failures++;
+        }
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "for (i in 0..\"ten\") {}\n") != INTERPRET_RUNTIME_ERROR ||
+        vm_execsource(&vm, "for (i in nil..1) {}\n") != INTERPRET_RUNTIME_ERROR ||
+        vm_execsource(&vm, "for (i in 0, 1) {}\n") != INTERPRET_COMPILE_ERROR) {
+        fprintf(stderr, "bad ranges aren't errors\n");
+        failures++;
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("for loops: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
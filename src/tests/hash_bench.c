@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "code/hashing.h"
+
+// Compares the string hash functions on identifier sized and kilobyte sized keys.
+// Also reports the average probe length that each one gives in a power of 2
+// open addressing table, which is how hash_table.c indexes its buckets.
+
+#define KEY_COUNT 4096
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+static uint64_t bench_seed = 0x9e3779b97f4a7c15ull;
+
+static uint32_t fnv1a(const char* key, int length) { return hash_fnv1a(key, length); }
+static uint32_t wyhash(const char* key, int length) { return hash_wyhash(key, length, bench_seed); }
+
+static char* make_keys(int key_len) {
+    char* keys = malloc((size_t)KEY_COUNT * key_len);
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char* key = keys + (size_t)i * key_len;
+        // similar keys, like the identifiers of a real program ("item_0", "item_1"...)
+        memset(key, 'a' + i % 26, key_len);
+        snprintf(key, key_len, "item_%d", i);
+        key[strlen(key)] = '_';
+    }
+    return keys;
+}
+
+static double time_hash(HashFn fn, const char* keys, int key_len, int rounds) {
+    volatile uint32_t sink = 0;
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < KEY_COUNT; i++) {
+            sink ^= fn(keys + (size_t)i * key_len, key_len);
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return seconds * 1e9 / ((double)rounds * KEY_COUNT);
+}
+
+// average no. of probes for a successful lookup with linear probing
+static double avg_probes(HashFn fn, const char* keys, int key_len) {
+    int capacity = 8192; // ~50% full, like a freshly grown table
+    char* used = calloc(capacity, 1);
+    long probes = 0;
+    for (int i = 0; i < KEY_COUNT; i++) {
+        uint32_t index = fn(keys + (size_t)i * key_len, key_len) & (capacity - 1);
+        probes++;
+        while (used[index]) {
+            index = (index + 1) & (capacity - 1);
+            probes++;
+        }
+        used[index] = 1;
+    }
+    free(used);
+    return (double)probes / KEY_COUNT;
+}
+
+static void run(const char* label, int key_len, int rounds) {
+    char* keys = make_keys(key_len);
+    printf("%-18s fnv1a %8.2f ns/key %5.2f probes | wyhash %8.2f ns/key %5.2f probes\n",
+        label,
+        time_hash(fnv1a, keys, key_len, rounds), avg_probes(fnv1a, keys, key_len),
+        time_hash(wyhash, keys, key_len, rounds), avg_probes(wyhash, keys, key_len));
+    free(keys);
+}
+
+int main() {
+    run("identifier (12 B)", 12, 2000);
+    run("1 KB", 1024, 40);
+    run("4 KB", 4096, 10);
+    return 0;
+}
@@ -1,32 +1,130 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "hash_table.h"
 #include "vm.h"
 #include "code/object.h"
 
+// Sets and gets a couple of keys. Then grows a table past the size that's
+// rehashed incrementally, and checks every key through get and findstr while
+// the old array is migrated (with keys overwritten and deleted halfway
+// through) and after it's done.
 
+// enough keys for the table to grow from 1024 to 2048 entries, and past the
+// point where it's rehashed incrementally
+#define REHASH_KEY_COUNT 1200
 
 typedef struct {
     const char* start;
     int len;
 } string_t;
 
-void set_table(HashTable* table, string_t key, string_t val) {
-    ObjString* keyobj = copy_string(key.start, key.len);
-    ObjString* valobj = copy_string(val.start, val.len);
-    Value val_ = MK_VAL_OBJ(valobj);
-    hashtable_set(table, keyobj, val_);
+// the key (and value) are on the stack while the table grows, which can collect
+static void set_rooted(VM* vm, HashTable* table, ObjString* key, Value value) {
+    vm_pushstack(vm, MK_VAL_OBJ(key));
+    vm_pushstack(vm, value);
+    hashtable_set(vm, table, key, value);
+    vm_popstack(vm);
+    vm_popstack(vm);
 }
 
-char* get_table(HashTable* table, string_t key) {
-    ObjString* keyobj = copy_string(key.start, key.len);
+// leaves the key and value on the stack, since the table isn't a root
+void set_table(VM* vm, HashTable* table, string_t key, string_t val) {
+    ObjString* keyobj = copy_string(vm, key.start, key.len);
+    vm_pushstack(vm, MK_VAL_OBJ(keyobj));
+    ObjString* valobj = copy_string(vm, val.start, val.len);
+    vm_pushstack(vm, MK_VAL_OBJ(valobj));
+    hashtable_set(vm, table, keyobj, MK_VAL_OBJ(valobj));
+}
+
+char* get_table(VM* vm, HashTable* table, string_t key) {
+    ObjString* keyobj = copy_string(vm, key.start, key.len);
     Value res;
-    hashtable_get(table, keyobj, &res);
+    hashtable_get(vm, table, keyobj, &res);
     return AS_CSTRING(res);
 }
 
+static ObjString* numbered_key(VM* vm, int i) {
+    char chars[32];
+    int length = snprintf(chars, sizeof(chars), "key_%d", i);
+    return copy_string(vm, chars, length);
+}
+
+// what key i should hold once the first deleted keys are deleted and the
+// first overwritten ones are overwritten
+static bool has_expected(VM* vm, HashTable* table, int i, int deleted, int overwritten) {
+    ObjString* key = numbered_key(vm, i);
+    Value value;
+    bool found = hashtable_get(vm, table, key, &value);
+    if (i < deleted)
+        return !found;
+    int64_t expected = i < overwritten ? -i : i;
+    return found && IS_VAL_INT(value) && VAL_AS_INT(value) == expected &&
+           hashtable_findstr(table, key->chars, key->length, key->hash) == key;
+}
+
+static int check_incremental_rehash(VM* vm) {
+    int failures = 0;
+    // the globals are a root, which keeps the keys alive through collections
+    HashTable* table = &vm->globals;
+
+    int started_at = -1;
+    for (int i = 0; i < REHASH_KEY_COUNT && started_at < 0; i++) {
+        set_rooted(vm, table, numbered_key(vm, i), MK_VAL_INT(i));
+        if (table->old_entries != NULL && table->old_capacity >= 1024)
+            started_at = i;
+    }
+    if (started_at < 0) {
+        fprintf(stderr, "the table was never rehashed incrementally\n");
+        return 1;
+    }
+
+    // findstr doesn't migrate anything, so this is all still halfway
+    for (int i = 0; i <= started_at; i++) {
+        ObjString* key = numbered_key(vm, i);
+        if (hashtable_findstr(table, key->chars, key->length, key->hash) != key) {
+            fprintf(stderr, "key %d lost when the rehash started\n", i);
+            failures++;
+        }
+    }
+
+    // deletes and overwrites while some keys are in either array, which leaves
+    // tombstones in both. Every operation migrates a few more buckets, so
+    // only a handful fit in before the rehash is over
+    int deleted = 0, overwritten = 0;
+    while (table->old_entries != NULL && deleted < 8) {
+        hashtable_delete(vm, table, numbered_key(vm, deleted));
+        deleted++;
+    }
+    overwritten = deleted;
+    while (table->old_entries != NULL && overwritten < deleted + 8) {
+        set_rooted(vm, table, numbered_key(vm, overwritten), MK_VAL_INT(-overwritten));
+        overwritten++;
+    }
+    if (deleted == 0 || overwritten == deleted) {
+        fprintf(stderr, "the rehash ended before the keys were changed\n");
+        failures++;
+    }
+
+    for (int i = started_at + 1; i < REHASH_KEY_COUNT; i++)
+        set_rooted(vm, table, numbered_key(vm, i), MK_VAL_INT(i));
+    if (table->old_entries != NULL) {
+        fprintf(stderr, "the rehash never finished\n");
+        failures++;
+    }
+
+    for (int i = 0; i < REHASH_KEY_COUNT; i++) {
+        if (!has_expected(vm, table, i, deleted, overwritten)) {
+            fprintf(stderr, "key %d is wrong after the rehash\n", i);
+            failures++;
+        }
+    }
+    return failures;
+}
+
 int main() {
-    vm_init();
+    VM vm;
+    vm_init(&vm);
     // printf("Testing...\n");
 
     HashTable table;
@@ -38,13 +136,18 @@ int main() {
     string_t val2 = { "test_value_2", 12 };
     string_t key2 = { "test_key_2", 10 };
 
-    set_table(&table, key1, val1);
-    set_table(&table, key2, val2);
+    set_table(&vm, &table, key1, val1);
+    set_table(&vm, &table, key2, val2);
+
+    printf("%s\n", get_table(&vm, &table, key1));
+    printf("%s\n", get_table(&vm, &table, key2));
 
-    printf("%s\n", get_table(&table, key1));
-    printf("%s\n", get_table(&table, key2));
+    hashtable_free(&vm, &table);
+    for (int i = 0; i < 4; i++)
+        vm_popstack(&vm);
 
-    hashtable_free(&table);
-    vm_free();
-    return 0;
+    int failures = check_incremental_rehash(&vm);
+    vm_free(&vm);
+    printf("hash tables: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "heap.h"
+#include "code/object.h"
+
+// Allocates objects of every small size and checks each one lands in the
+// smallest size class that fits it, and that anything bigger is a large object.
+// Then marks every other object, sweeps, and checks that exactly the unmarked
+// ones were finalized, that the marks were cleared, that the freed slots are
+// reused and that a sweep with nothing marked gives the pages back.
+
+#define SWEPT_COUNT 5000
+#define LARGE_COUNT 10
+
+#define PAGE_OF(object) ((HeapPage*)((uintptr_t)(object) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+static void count_finalized(void* context, Obj* object) {
+    (void)object;
+    (*(int*)context)++;
+}
+
+static uint32_t smallest_fitting_slot(Heap* heap, size_t size) {
+    for (int i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+        if (heap->objects[i].slot_size >= size)
+            return heap->objects[i].slot_size;
+    }
+    return 0;
+}
+
+static int page_count(SizeClass* size_class) {
+    int count = 0;
+    for (HeapPage* page = size_class->pages; page != NULL; page = page->next)
+        count++;
+    return count;
+}
+
+static int check_size_classes(Heap* heap) {
+    int failures = 0;
+    for (size_t size = sizeof(Obj); size <= HEAP_MAX_SMALL_SIZE; size++) {
+        Obj* object = heap_alloc_object(heap, size);
+        HeapPage* page = PAGE_OF(object);
+        if ((object->flags & OBJ_FLAG_LARGE) || page->heap != heap || !heap_owns(heap, object) ||
+            page->slot_size != smallest_fitting_slot(heap, size) || (uintptr_t)object % 16 != 0) {
+            fprintf(stderr, "a %zu byte object got a %u byte slot\n", size, page->slot_size);
+            failures++;
+        }
+    }
+
+    size_t large_sizes[] = { HEAP_MAX_SMALL_SIZE + 1, 4096, 1 << 20 };
+    for (int i = 0; i < 3; i++) {
+        Obj* object = heap_alloc_object(heap, large_sizes[i]);
+        memset(object + 1, 0xab, large_sizes[i] - sizeof(Obj));
+        if (!(object->flags & OBJ_FLAG_LARGE) || !heap_owns(heap, object) || heap_is_marked(object)) {
+            fprintf(stderr, "a %zu byte object isn't a large object\n", large_sizes[i]);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int check_sweep(Heap* heap) {
+    int failures = 0;
+    static Obj* objects[SWEPT_COUNT];
+    Obj* large[LARGE_COUNT];
+    SizeClass* size_class = &heap->objects[1];
+
+    for (int i = 0; i < SWEPT_COUNT; i++) {
+        objects[i] = heap_alloc_object(heap, size_class->slot_size);
+        objects[i]->type = OBJ_STRING;
+    }
+    for (int i = 0; i < LARGE_COUNT; i++)
+        large[i] = heap_alloc_object(heap, HEAP_MAX_SMALL_SIZE * 2);
+    if (page_count(size_class) < 2) {
+        fprintf(stderr, "the objects fit in a single page\n");
+        failures++;
+    }
+
+    for (int i = 0; i < SWEPT_COUNT; i += 2)
+        heap_set_marked(objects[i]);
+    for (int i = 0; i < LARGE_COUNT; i += 2)
+        heap_set_marked(large[i]);
+
+    int finalized = 0;
+    heap_sweep(heap, count_finalized, &finalized);
+    if (finalized != SWEPT_COUNT / 2 + LARGE_COUNT / 2) {
+        fprintf(stderr, "%d objects were finalized\n", finalized);
+        failures++;
+    }
+    for (int i = 0; i < SWEPT_COUNT; i += 2) {
+        if (heap_is_marked(objects[i])) {
+            fprintf(stderr, "the marks weren't cleared\n");
+            failures++;
+            break;
+        }
+    }
+    for (int i = 0; i < LARGE_COUNT; i += 2) {
+        if (heap_is_marked(large[i])) {
+            fprintf(stderr, "the marks of large objects weren't cleared\n");
+            failures++;
+            break;
+        }
+    }
+
+    // the slots freed by the sweep are handed out again before any new page
+    int pages = page_count(size_class);
+    for (int i = 1; i < SWEPT_COUNT; i += 2) {
+        Obj* object = heap_alloc_object(heap, size_class->slot_size);
+        object->type = OBJ_STRING;
+    }
+    if (page_count(size_class) != pages) {
+        fprintf(stderr, "the freed slots weren't reused\n");
+        failures++;
+    }
+
+    // nothing marked, so everything goes and only the first page is kept
+    finalized = 0;
+    heap_sweep(heap, count_finalized, &finalized);
+    if (finalized != SWEPT_COUNT + LARGE_COUNT / 2 || page_count(size_class) != 1 ||
+        size_class->pages->live_count != 0 || heap->large_objects != NULL) {
+        fprintf(stderr, "a sweep with nothing marked kept %d pages\n", page_count(size_class));
+        failures++;
+    }
+    return failures;
+}
+
+int main() {
+    int finalized = 0;
+    Heap heap;
+    heap_init(&heap);
+    int failures = check_size_classes(&heap);
+    heap_free(&heap, count_finalized, &finalized);
+
+    heap_init(&heap);
+    failures += check_sweep(&heap);
+    heap_free(&heap, count_finalized, &finalized);
+
+    printf("heap: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/opcodes.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Calls small global functions from expressions with temporaries under them,
+// nested in each other's arguments and with locals of their own, and checks
+// which calls got inlined, and that many calls don't run out of constants.
+// Then declares one of them again, so the guards of the calls inlined before fail
+// and the new function is called instead.
+
+static const char* source =
+    "var offset = 100;\n"
+    "fun add(a, b) { return a + b; }\n"
+    "fun sq(x) { return x * x; }\n"
+    "fun shifted(x) { return -x + offset; }\n"
+    "fun second(l) { return l[1]; }\n"
+    "fun less(a, b) { return !(a < b); }\n"
+    "fun nothing() {}\n"
+    "fun fact(n) { if (n < 2) return 1; return n * fact(n - 1); }\n"
+    "fun moved(x) { return x; }\n"
+    "moved = sq;\n"
+    "fun calls() { return 1 + add(2, sq(add(1, 2))) * shifted(3); }\n"
+    "fun others() { return second([4, 5, 6]) + fact(4) + moved(3); }\n"
+    "fun flags() { return less(1, 2) == false and nothing() == nil; }\n"
+    "fun summed(a, b) { var x = a + b; return x * x; }\n"
+    "fun locals() { return [summed(1, 2), summed(3, 4)][1] + 10 * summed(1, 1); }\n"
+    "var with_locals = locals();\n"
+    "var total = calls() + others();\n"
+    "var ok = flags();\n"
+    "fun use(x) { return add(x, 1); }\n"
+    "var before = use(2);\n"
+    "fun add(a, b) { return a * b; }\n"
+    "var after = use(2);\n";
+
+static int count_guards(VM* vm, const char* name) {
+    Chunk* chunk = &OBJ_AS_FUNC(global_value(vm, name))->chunk;
+    // not a real walk over the instructions, but their operands here are all small
+    int count = 0;
+    for (int i = 0; i < chunk->count; i++)
+        count += chunk->code[i] == OP_INLINE_GUARD;
+    return count;
+}
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        vm_free(&vm);
+        return 1;
+    }
+
+    // 1 + (2 + 9) * 97, then 5 + 24 + 9
+    Value total = global_value(&vm, "total");
+    Value ok = global_value(&vm, "ok");
+    Value before = global_value(&vm, "before");
+    Value after = global_value(&vm, "after");
+    Value with_locals = global_value(&vm, "with_locals");
+    if (!IS_VAL_NUMBERLIKE(total) || NUMBERLIKE_AS_NUM(total) != 1068 + 38 || !IS_VAL_BOOL(ok) || !VAL_AS_BOOL(ok)) {
+        fprintf(stderr, "wrong results from the inlined calls\n");
+        failures++;
+    }
+    if (!IS_VAL_NUMBERLIKE(before) || NUMBERLIKE_AS_NUM(before) != 3 || !IS_VAL_NUMBERLIKE(after) || NUMBERLIKE_AS_NUM(after) != 2) {
+        fprintf(stderr, "the guard didn't see the new function\n");
+        failures++;
+    }
+    // 49 + 10 * 4, the locals of the inlined calls are popped with them
+    if (!IS_VAL_NUMBERLIKE(with_locals) || NUMBERLIKE_AS_NUM(with_locals) != 89) {
+        fprintf(stderr, "wrong results from inlined calls with locals\n");
+        failures++;
+    }
+
+    // fact calls something and moved is assigned to, so they're called as usual
+    if (count_guards(&vm, "calls") != 4 || count_guards(&vm, "others") != 1 ||
+        count_guards(&vm, "flags") != 2 || count_guards(&vm, "locals") != 3 || count_guards(&vm, "fact") != 0) {
+        fprintf(stderr, "the wrong calls were inlined\n");
+        failures++;
+    }
+
+    // more inlined calls than a chunk has constants, they share the callee's
+    char many[16384] = "var k = 1;\nfun twice(a) { return a * 2 + k; }\nvar many = 0;\n";
+    for (int i = 0; i < 300; i++)
+        strcat(many, "many = many + twice(1);\n");
+    if (vm_execsource(&vm, many) != INTERPRET_OK || !IS_VAL_NUMBERLIKE(global_value(&vm, "many")) ||
+        NUMBERLIKE_AS_NUM(global_value(&vm, "many")) != 900) {
+        fprintf(stderr, "many inlined calls didn't compile or run\n");
+        failures++;
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+
+    // an error in inlined code is on the callee's line
+    char trace[256] = "";
+    if (vm_execsource(&vm, "fun bad(a) {\n  return a +\n    nil;\n}\nbad(1);\n") != INTERPRET_RUNTIME_ERROR) {
+        fprintf(stderr, "no error from inlined code\n");
+        failures++;
+    } else {
+        rewind(err);
+        fread(trace, 1, sizeof(trace) - 1, err);
+        if (strstr(trace, "[line 3]") == NULL) {
+            fprintf(stderr, "the error isn't on the callee's line: %s", trace);
+            failures++;
+        }
+    }
+
+    const char* bad[] = {
+        "fun inc(x) { return x + 1; } inc(nil);\n",
+        "fun inc(x) { return x + 1; } inc(1, 2);\n",
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        if (vm_execsource(&vm, bad[i]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[i]);
+            failures++;
+        }
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("inlining: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
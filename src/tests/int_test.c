@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Checks that integer literals and arithmetic on them stay exact past 2^53,
+// that overflow and mixing with doubles give doubles, the bitwise and shift
+// operators (and their precedence), hex literals, that 1 and 1.0 are the same
+// map key, that comparing an int with a double is exact, and that bad operands
+// are runtime errors.
+
+static const char* source =
+    "var big = 9007199254740993;\n"
+    "var big_sum = 9007199254740992 + 1;\n"
+    "var overflow = 9223372036854775807 + 1;\n"
+    "var product = 3037000500 * 3037000500;\n"
+    "var lowest = -(-9223372036854775807 - 1);\n"
+    "var half = 7 / 2;\n"
+    "var mixed = 2 * 1.5;\n"
+    "var same = 1 == 1.0 and 2.5 != 2 and 3 < 3.5;\n"
+    "var near = 9007199254740992.0;\n"
+    "var ordered = 9007199254740993 > near and near < 9007199254740993 and\n"
+    "    !(9007199254740993 < near) and 9007199254740992 <= near and\n"
+    "    -3 < -2.5 and -2 > -2.5 and 2 < 2.5 and 3 > 2.5 and\n"
+    "    9223372036854775807 < 9223372036854775808.0 and\n"
+    "    -9223372036854775807 - 1 >= -9223372036854775808.0;\n"
+    "var unordered = 1 < 0 / 0 or 1 > 0 / 0 or 0 / 0 < 1 or 0 / 0 > 1;\n"
+    "var bits = (0xff & 0x0f) | (6 ^ 3) << 8;\n"
+    "var inverted = ~0;\n"
+    "var top = 1 << 63;\n"
+    "var sign = -8 >> 1;\n"
+    "var all_ones = 0xffffffffffffffff;\n"
+    "var precedence = 1 | 2 == 3;\n"
+    "var whole = 4.0 & 5;\n"
+    "var h = 0;\n"
+    "for (i in 0..1000) h = (h * 31 + i) & 0xffffffff;\n"
+    "var m = {};\n"
+    "m[1.0] = \"one\";\n"
+    "m[1] = \"uno\";\n"
+    "var keyed = len(m) == 1 and m[1.0] == \"uno\";\n"
+    "var l = [1, 2, 3];\n"
+    "var indexed = l[2.0] + l[0];\n";
+
+// the hash the script works out, in C
+static int64_t expected_hash() {
+    int64_t h = 0;
+    for (int64_t i = 0; i < 1000; i++)
+        h = (h * 31 + i) & 0xffffffff;
+    return h;
+}
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    } else {
+        if (!global_is_int(&vm, "big", 9007199254740993LL) || !global_is_int(&vm, "big_sum", 9007199254740993LL)) {
+            fprintf(stderr, "integers above 2^53 aren't exact\n");
+            failures++;
+        }
+        if (!global_is_num(&vm, "overflow", 9223372036854775808.0) ||
+            !global_is_num(&vm, "product", 3037000500.0 * 3037000500.0) ||
+            !global_is_num(&vm, "lowest", 9223372036854775808.0)) {
+            fprintf(stderr, "overflow doesn't give a double\n");
+            failures++;
+        }
+        if (!global_is_num(&vm, "half", 3.5) || !global_is_num(&vm, "mixed", 3) || !global_is_true(&vm, "same") ||
+            !global_is_true(&vm, "ordered") || global_is_true(&vm, "unordered")) {
+            fprintf(stderr, "wrong mixed arithmetic\n");
+            failures++;
+        }
+        if (!global_is_int(&vm, "bits", 15 | (5 << 8)) || !global_is_int(&vm, "inverted", -1) ||
+            !global_is_int(&vm, "top", INT64_MIN) || !global_is_int(&vm, "sign", -4) ||
+            !global_is_int(&vm, "all_ones", -1) || !global_is_true(&vm, "precedence") ||
+            !global_is_int(&vm, "whole", 4) || !global_is_int(&vm, "h", expected_hash())) {
+            fprintf(stderr, "wrong bitwise results\n");
+            failures++;
+        }
+        if (!global_is_true(&vm, "keyed") || !global_is_int(&vm, "indexed", 4)) {
+            fprintf(stderr, "whole doubles don't work as keys or indices\n");
+            failures++;
+        }
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    const char* bad[] = {
+        "1 << 64;\n",
+        "1 >> -1;\n",
+        "1.5 & 1;\n",
+        "~\"a\";\n",
+        "nil | 1;\n",
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        if (vm_execsource(&vm, bad[i]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[i]);
+            failures++;
+        }
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("integers: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "mem.h"
+#include "hash_table.h"
+#include "code/object.h"
+
+// Interns lots of strings that nothing points to and checks that a collection
+// drops them from the interned strings (which only hold them weakly) and shrinks
+// the table, while strings still in use and the names of globals stay interned.
+
+#define GARBAGE_COUNT 5000
+
+static ObjString* find_interned(VM* vm, const char* chars) {
+    int length = (int)strlen(chars);
+    return hashtable_findstr(&vm->interned_strings, chars, length, hash_string(chars, length));
+}
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, "var survivor = 1;\n") != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    }
+
+    ObjString* kept = copy_string(&vm, "kept", 4);
+    vm_pushstack(&vm, MK_VAL_OBJ(kept));
+
+    char chars[32];
+    for (int i = 0; i < GARBAGE_COUNT; i++) {
+        int length = snprintf(chars, sizeof(chars), "garbage_%d", i);
+        copy_string(&vm, chars, length);
+    }
+    int grown = vm.interned_strings.capacity;
+
+    collect_garbage(&vm);
+
+    int left = 0;
+    for (int i = 0; i < GARBAGE_COUNT; i++) {
+        snprintf(chars, sizeof(chars), "garbage_%d", i);
+        if (find_interned(&vm, chars) != NULL)
+            left++;
+    }
+    if (left != 0) {
+        fprintf(stderr, "%d unused strings are still interned\n", left);
+        failures++;
+    }
+    if (vm.interned_strings.capacity > grown || vm.interned_strings.capacity >= GARBAGE_COUNT) {
+        fprintf(stderr, "the interned strings weren't shrunk: %d entries\n", vm.interned_strings.capacity);
+        failures++;
+    }
+    if (find_interned(&vm, "kept") != kept || find_interned(&vm, "survivor") == NULL) {
+        fprintf(stderr, "strings in use were dropped\n");
+        failures++;
+    }
+
+    // interning the same contents again gives a fresh string
+    ObjString* again = copy_string(&vm, "garbage_0", 9);
+    if (find_interned(&vm, "garbage_0") != again) {
+        fprintf(stderr, "a swept string can't be interned again\n");
+        failures++;
+    }
+
+    vm_popstack(&vm);
+    vm_free(&vm);
+    printf("interned strings: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
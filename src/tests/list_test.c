@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Builds lists through literals, push() and index assignment with
+// collections on the way, and checks what ends up in them. Also checks
+// that bad indices are runtime errors that leave the vm usable.
+
+static const char* source =
+    "var squares = [];\n"
+    "var i = 0;\n"
+    "while (i < 1000) {\n"
+    "    push(squares, i * i);\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "i = 0;\n"
+    "var total = 0;\n"
+    "while (i < len(squares)) {\n"
+    "    total = total + squares[i];\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var nested = [[1, 2], [\"a\" + \"b\", nil,], []];\n"
+    "nested[1][1] = nested[0][0] = 5;\n"
+    "var last = pop(squares);\n"
+    "var text = \"\";\n"
+    "i = 0;\n"
+    "while (i < 2000) {\n"
+    "    text = [text + \"\", [i]][0];\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var shape = len(nested) * 100 + len(nested[1]) * 10 + len(squares) - 990;\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    Value nested;
+    if (vm_execsource(&vm, source) != INTERPRET_OK ||
+        !global_is(&vm, "total", 332833500) || !global_is(&vm, "last", 998001) ||
+        !global_is(&vm, "shape", 329)) {
+        fprintf(stderr, "wrong results\n");
+        failures++;
+    } else if (!get_global(&vm, "nested", &nested) || !IS_OBJ_LIST(nested)) {
+        fprintf(stderr, "nested isn't a list\n");
+        failures++;
+    } else {
+        ObjList* inner = OBJ_AS_LIST(OBJ_AS_LIST(nested)->items.values[1]);
+        if (inner->items.count != 2 || !IS_VAL_NUMBERLIKE(inner->items.values[1]) ||
+            NUMBERLIKE_AS_NUM(inner->items.values[1]) != 5) {
+            fprintf(stderr, "index assignment didn't stick\n");
+            failures++;
+        }
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    const char* bad[] = {
+        "var l = [1]; l[1];\n",
+        "var l = [1]; l[-1];\n",
+        "var l = [1]; l[0.5] = 2;\n",
+        "var l = [1]; l[\"0\"];\n",
+        "var n = 3; n[0];\n",
+        "pop([]);\n",
+    };
+    for (int j = 0; j < (int)(sizeof(bad) / sizeof(bad[0])); j++) {
+        if (vm_execsource(&vm, bad[j]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[j]);
+            failures++;
+        }
+    }
+    if (vm_execsource(&vm, "var ok = [1, 2, 3][2];\n") != INTERPRET_OK || !global_is(&vm, "ok", 3)) {
+        fprintf(stderr, "an indexing error broke the vm\n");
+        failures++;
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("lists: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
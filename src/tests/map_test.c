@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "map.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Fills a map from a script with collections on the way, removes most of it
+// again and checks what's left, the order of the keys and the odd number keys.
+// Also checks that adding and removing the same key over and over doesn't
+// keep growing the map, that runtime strings used as keys keep their hash, and
+// that bad keys are runtime errors.
+
+static const char* source =
+    "var m = {\"name\": \"volt\", 1: true, nil: 2,};\n"
+    "var i = 0;\n"
+    "while (i < 5000) { m[i * 3] = [i]; i = i + 1; }\n"
+    "i = 0;\n"
+    "while (i < 5000) { if (i > 2) map_remove(m, i * 3); i = i + 1; }\n"
+    "m[-0] = \"zero\";\n"
+    "m[0 / 0] = \"nan\";\n"
+    "var nan_found = m[0 / 0] == \"nan\";\n"
+    "var zero_found = m[0] == \"zero\";\n"
+    "var size = len(m);\n"
+    "var order = map_keys(m);\n"
+    "var churn = {};\n"
+    "i = 0;\n"
+    "while (i < 10000) { churn[\"k\" + \"ey\"] = i; map_remove(churn, \"key\"); i = i + 1; }\n"
+    "var missing = m[\"nothing\"];\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    Value size, order, churn, missing;
+    if (vm_execsource(&vm, source) != INTERPRET_OK ||
+        !get_global(&vm, "size", &size) || !get_global(&vm, "order", &order) ||
+        !get_global(&vm, "churn", &churn) || !get_global(&vm, "missing", &missing)) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    } else {
+        // name, 1, nil, 0 (set twice), 3, 6 and NaN
+        if (!IS_VAL_NUMBERLIKE(size) || NUMBERLIKE_AS_NUM(size) != 7 || !IS_VAL_NIL(missing)) {
+            fprintf(stderr, "wrong size or lookup\n");
+            failures++;
+        }
+        if (!global_is_true(&vm, "nan_found") || !global_is_true(&vm, "zero_found")) {
+            fprintf(stderr, "-0 or NaN keys don't work\n");
+            failures++;
+        }
+
+        ObjList* keys = OBJ_AS_LIST(order);
+        if (keys->items.count != 7 || !IS_OBJ_STRING(keys->items.values[0]) ||
+            !IS_VAL_NUMBERLIKE(keys->items.values[3]) || NUMBERLIKE_AS_NUM(keys->items.values[3]) != 0 ||
+            !IS_VAL_NUMBERLIKE(keys->items.values[5]) || NUMBERLIKE_AS_NUM(keys->items.values[5]) != 6) {
+            fprintf(stderr, "keys are out of order\n");
+            failures++;
+        }
+
+        ObjMap* map = OBJ_AS_MAP(churn);
+        if (map->live_count != 0 || map->index_capacity > 16) {
+            fprintf(stderr, "adding and removing a key grew the map to %d\n", map->index_capacity);
+            failures++;
+        }
+    }
+
+    // two runtime strings with the same contents, neither interned
+    ObjString* set_key = allocate_string(&vm, 3);
+    memcpy(set_key->chars, "key", 3);
+    vm_pushstack(&vm, MK_VAL_OBJ(set_key));
+    ObjString* get_key = allocate_string(&vm, 3);
+    memcpy(get_key->chars, "key", 3);
+    vm_pushstack(&vm, MK_VAL_OBJ(get_key));
+    ObjMap* keyed = new_map(&vm);
+    vm_pushstack(&vm, MK_VAL_OBJ(keyed));
+    map_set(&vm, keyed, MK_VAL_OBJ(set_key), MK_VAL_BOOL(true));
+    Value found;
+    if (!map_get(&vm, keyed, MK_VAL_OBJ(get_key), &found) || !get_key->is_hashed ||
+        get_key->hash != hash_string("key", 3) || get_key->is_interned) {
+        fprintf(stderr, "a runtime string key doesn't keep its hash\n");
+        failures++;
+    }
+    vm_popstack(&vm);
+    vm_popstack(&vm);
+    vm_popstack(&vm);
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "var bad = {[1]: 2};\n") != INTERPRET_RUNTIME_ERROR ||
+        vm_execsource(&vm, "var bad = {}; bad[bad] = 1;\n") != INTERPRET_RUNTIME_ERROR ||
+        vm_execsource(&vm, "var ok = {1: 2}[1];\n") != INTERPRET_OK) {
+        fprintf(stderr, "bad keys aren't errors\n");
+        failures++;
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("maps: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
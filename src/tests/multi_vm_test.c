@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs many independent vms at once, each one on its own thread, and checks
+// that every one of them computes the right result. Half of the vms intern
+// their strings in the process wide table, the others share nothing. Either
+// way this must pass, and be clean under -fsanitize=thread.
+
+#define THREAD_COUNT 8
+#define RUNS_PER_THREAD 4
+
+// recursion, globals and enough string building to start a few collections
+static const char* source =
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "var text = \"\";\n"
+    "var i = 0;\n"
+    "while (i < 20000) {\n"
+    "    text = text + \"volt\";\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var result = fib(18);\n"
+    "var same = text == text + \"\";\n";
+
+typedef struct {
+    int id;
+    int failures;
+} Worker;
+
+static void* run_worker(void* arg) {
+    Worker* worker = (Worker*)arg;
+
+    for (int run = 0; run < RUNS_PER_THREAD; run++) {
+        VM vm;
+        if (worker->id % 2 == 0)
+            vm_init(&vm);
+        else
+            vm_init_shared(&vm);
+
+        Value result, same;
+        if (vm_execsource(&vm, source) != INTERPRET_OK ||
+            !get_global(&vm, "result", &result) || !IS_VAL_NUMBERLIKE(result) || NUMBERLIKE_AS_NUM(result) != 2584 ||
+            !get_global(&vm, "same", &same) || !IS_VAL_BOOL(same) || !VAL_AS_BOOL(same)) {
+            fprintf(stderr, "worker %d: wrong result in run %d\n", worker->id, run);
+            worker->failures++;
+        }
+
+        vm_free(&vm);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[THREAD_COUNT];
+    Worker workers[THREAD_COUNT];
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        workers[i].id = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "could not start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    int failures = 0;
+
+    // vms using the shared table agree on a single object for every string
+    VM a, b;
+    vm_init_shared(&a);
+    vm_init_shared(&b);
+    ObjString* from_a = copy_string(&a, "shared", 6);
+    ObjString* from_b = copy_string(&b, "shared", 6);
+    ObjString* built = allocate_string(&b, 6);
+    memcpy(built->chars, "shared", 6);
+    if (from_a != from_b || string_intern(&b, built) != from_a) {
+        fprintf(stderr, "the shared strings are not the same object\n");
+        failures++;
+    }
+    vm_free(&b);
+    vm_free(&a);
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        failures += workers[i].failures;
+    }
+
+    printf("%d vms on %d threads, %d failures\n", THREAD_COUNT * RUNS_PER_THREAD, THREAD_COUNT, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pool.h"
+#include "mem.h"
+
+// Runs the same script many times on an IsolatePool and checks the captured
+// output of every run. Also checks that loading a source twice compiles it once,
+// that the cache stays bounded and the loader frees the programs dropped from
+// it, that a held program still runs after it's dropped, and that sources that
+// don't compile aren't cached.
+
+#define WORKER_COUNT 4
+#define JOB_COUNT 64
+#define LOAD_COUNT (POOL_MAX_PROGRAMS * 32)
+
+static const char* source =
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "var text = \"\";\n"
+    "var i = 0;\n"
+    "while (i < 5000) {\n"
+    "    text = text + \"volt\";\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "print(fib(15));\n"
+    "print(text == text + \"\");\n";
+
+static const char* failing_source = "print(\"before\");\nprint(1 + nil);\n";
+
+int main() {
+    IsolatePool pool;
+    pool_init(&pool, WORKER_COUNT);
+    int failures = 0;
+
+    PoolProgram* program = pool_load(&pool, source);
+    PoolProgram* again = pool_load(&pool, source);
+    if (program == NULL || again != program) {
+        fprintf(stderr, "the same source was not compiled exactly once\n");
+        failures++;
+    }
+    pool_release(&pool, again);
+
+    PoolJob* jobs[JOB_COUNT];
+    for (int i = 0; i < JOB_COUNT; i++)
+        jobs[i] = pool_submit(&pool, program, true);
+    PoolProgram* failing_program = pool_load(&pool, failing_source);
+    PoolJob* failing = pool_submit(&pool, failing_program, true);
+    pool_release(&pool, failing_program);
+
+    // many distinct sources push the first program out of the cache, but it's
+    // still held so its jobs keep running
+    char distinct[64];
+    size_t settled = 0;
+    for (int i = 0; i < LOAD_COUNT; i++) {
+        snprintf(distinct, sizeof(distinct), "var n = %d;\nprint(n * 2 + 1);\n", i);
+        PoolProgram* loaded = pool_load(&pool, distinct);
+        if (loaded == NULL) {
+            fprintf(stderr, "program %d didn't compile\n", i);
+            failures++;
+            continue;
+        }
+        pool_release(&pool, loaded);
+        if (i == POOL_MAX_PROGRAMS * 2) {
+            collect_garbage(&pool.loader);
+            settled = pool.loader.bytes_allocated;
+        }
+    }
+    if (pool.cached_count > POOL_MAX_PROGRAMS) {
+        fprintf(stderr, "%d programs cached\n", pool.cached_count);
+        failures++;
+    }
+    if (pool.loader.bytes_allocated > pool.loader.next_gc + settled) {
+        fprintf(stderr, "the loader doesn't collect while loading\n");
+        failures++;
+    }
+    collect_garbage(&pool.loader);
+    if (pool.loader.bytes_allocated > settled * 2) {
+        fprintf(stderr, "the loader grew from %zu to %zu bytes\n", settled, pool.loader.bytes_allocated);
+        failures++;
+    }
+
+    PoolJob* evicted = pool_submit(&pool, program, true);
+    pool_release(&pool, program);
+    pool_wait(&pool, evicted);
+    if (evicted->result != INTERPRET_OK || strcmp(evicted->output, "610\ntrue\n") != 0) {
+        fprintf(stderr, "a held program didn't run after leaving the cache\n");
+        failures++;
+    }
+    pool_job_free(evicted);
+
+    int cached = pool.cached_count;
+    if (pool_load(&pool, "var = 1;\n") != NULL || pool.cached_count != cached) {
+        fprintf(stderr, "a source that doesn't compile was cached\n");
+        failures++;
+    }
+
+    for (int i = 0; i < JOB_COUNT; i++) {
+        pool_wait(&pool, jobs[i]);
+        if (jobs[i]->result != INTERPRET_OK || strcmp(jobs[i]->output, "610\ntrue\n") != 0) {
+            fprintf(stderr, "job %d: wrong output\n", i);
+            failures++;
+        }
+        pool_job_free(jobs[i]);
+    }
+
+    pool_wait(&pool, failing);
+    if (failing->result != INTERPRET_RUNTIME_ERROR || strcmp(failing->output, "before\n") != 0 ||
+        strstr(failing->errors, "[line 2]") == NULL) {
+        fprintf(stderr, "the failing job did not report its error\n");
+        failures++;
+    }
+    pool_job_free(failing);
+
+    pool_free(&pool);
+    printf("%d jobs on %d workers, %d failures\n", JOB_COUNT + 1, WORKER_COUNT, failures);
+    return failures == 0 ? 0 : 1;
+}
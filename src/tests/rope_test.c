@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Checks that concatenations build a rope from ROPE_MIN_LENGTH on (and a plain
+// string below it), that ropes work in ==, as map keys, with len and print, and
+// that a deep left leaning rope is flattened without recursing, on a thread
+// whose stack is far too small for one frame per level.
+
+#define DEEP_LENGTH 20000
+#define SMALL_STACK_SIZE (256 * 1024)
+
+static const char* source_format =
+    "var short = \"\";\n"
+    "for (i in 0..%d) short = short + \"a\";\n"
+    "var at_min = short + \"a\";\n"
+    "var other = short + \"a\";\n"
+    "var same = at_min == other and at_min != short + \"b\" and short + \"a\" == at_min;\n"
+    "var m = {};\n"
+    "m[at_min] = 1;\n"
+    "m[other] = 2;\n"
+    "var keyed = len(m) == 1 and m[short + \"a\"] == 2 and m[short] == nil;\n"
+    "var lengths = len(at_min) == %d and len(short) == %d;\n"
+    "var deep = \"\";\n"
+    "for (i in 0..%d) deep = deep + \"b\";\n"
+    "print(at_min);\n";
+
+typedef struct {
+    VM* vm;
+    ObjRope* rope;
+    ObjString* flat;
+} Flattening;
+
+static void* flatten_main(void* arg) {
+    Flattening* flattening = (Flattening*)arg;
+    flattening->flat = rope_flatten(flattening->vm, flattening->rope);
+    return NULL;
+}
+
+// the number of ropes down the left side
+static int left_depth(ObjRope* rope) {
+    int depth = 0;
+    for (Obj* node = (Obj*)rope; node->type == OBJ_ROPE; node = ((ObjRope*)node)->left)
+        depth++;
+    return depth;
+}
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+    FILE* out = tmpfile();
+    vm.out = out;
+
+    char source[1024];
+    snprintf(source, sizeof(source), source_format,
+             ROPE_MIN_LENGTH - 1, ROPE_MIN_LENGTH, ROPE_MIN_LENGTH - 1, DEEP_LENGTH);
+
+    Value short_string, at_min, deep;
+    if (vm_execsource(&vm, source) != INTERPRET_OK || !get_global(&vm, "short", &short_string) ||
+        !get_global(&vm, "at_min", &at_min) || !get_global(&vm, "deep", &deep)) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    } else {
+        if (!IS_OBJ_STRING(short_string) || !IS_OBJ_ROPE(at_min) || OBJ_AS_ROPE(at_min)->length != ROPE_MIN_LENGTH) {
+            fprintf(stderr, "ropes don't start at ROPE_MIN_LENGTH\n");
+            failures++;
+        }
+        if (!global_is_true(&vm, "same") || !global_is_true(&vm, "keyed") || !global_is_true(&vm, "lengths")) {
+            fprintf(stderr, "ropes don't work in ==, as keys or with len\n");
+            failures++;
+        }
+
+        char expected[ROPE_MIN_LENGTH + 2];
+        memset(expected, 'a', ROPE_MIN_LENGTH);
+        expected[ROPE_MIN_LENGTH] = '\n';
+        expected[ROPE_MIN_LENGTH + 1] = '\0';
+        char printed[sizeof(expected) + 8] = {0};
+        rewind(out);
+        fread(printed, 1, sizeof(printed) - 1, out);
+        if (strcmp(printed, expected) != 0) {
+            fprintf(stderr, "a rope printed as: %s", printed);
+            failures++;
+        }
+
+        ObjRope* rope = OBJ_AS_ROPE(deep);
+        if (!IS_OBJ_ROPE(deep) || rope->flat != NULL || left_depth(rope) < DEEP_LENGTH - ROPE_MIN_LENGTH) {
+            fprintf(stderr, "the deep rope isn't a left leaning chain\n");
+            failures++;
+        } else {
+            Flattening flattening = { &vm, rope, NULL };
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstacksize(&attr, SMALL_STACK_SIZE);
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, flatten_main, &flattening) != 0) {
+                fprintf(stderr, "couldn't start the flattening thread\n");
+                failures++;
+            } else {
+                pthread_join(thread, NULL);
+                ObjString* flat = flattening.flat;
+                bool all_b = flat->length == DEEP_LENGTH;
+                for (int i = 0; all_b && i < flat->length; i++)
+                    all_b = flat->chars[i] == 'b';
+                if (!all_b || rope->flat != flat || rope->left != NULL) {
+                    fprintf(stderr, "the deep rope was flattened wrong\n");
+                    failures++;
+                }
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    fclose(out);
+    vm_free(&vm);
+    printf("ropes: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// A parallel fibonacci, where every task splits its work into more tasks and
+// joins them, so the workers have to steal from each other and help out while
+// they wait. Also passes strings both ways and checks that a failed task only
+// fails its join().
+
+static const char* source =
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "fun pfib(n) {\n"
+    "    if (n < 15) return fib(n);\n"
+    "    var a = spawn(pfib, n - 1);\n"
+    "    var b = spawn(pfib, n - 2);\n"
+    "    return join(a) + join(b);\n"
+    "}\n"
+    "fun shout(text) { return text + \"!\"; }\n"
+    "var result = pfib(24);\n"
+    "var task = spawn(shout, \"hey\" + \" you\");\n"
+    "var text = join(task);\n"
+    "var again = join(task) == text;\n";
+
+int main() {
+    int failures = 0;
+    // more workers than this machine may have cores, to make them race
+    setenv("VOLT_WORKERS", "4", 1);
+
+    VM vm;
+    vm_init_shared(&vm);
+
+    Value result, text, again;
+    if (vm_execsource(&vm, source) != INTERPRET_OK ||
+        !get_global(&vm, "result", &result) || !IS_VAL_NUMBERLIKE(result) || NUMBERLIKE_AS_NUM(result) != 46368 ||
+        !get_global(&vm, "again", &again) || !IS_VAL_BOOL(again) || !VAL_AS_BOOL(again)) {
+        fprintf(stderr, "wrong results\n");
+        failures++;
+    } else if (!get_global(&vm, "text", &text) || !IS_OBJ_STRINGLIKE(text) ||
+               strcmp(stringlike_flatten(&vm, VAL_AS_OBJ(text))->chars, "hey you!") != 0) {
+        fprintf(stderr, "strings did not make it through the task\n");
+        failures++;
+    }
+
+    // the error goes to the worker's stderr
+    FILE* err = tmpfile();
+    vm.err = err;
+    if (vm_execsource(&vm, "fun bad() { return nil + 1; }\njoin(spawn(bad));\n") != INTERPRET_RUNTIME_ERROR ||
+        vm_execsource(&vm, "var ok = join(spawn(fib, 10));\n") != INTERPRET_OK) {
+        fprintf(stderr, "a failed task broke the vm\n");
+        failures++;
+    }
+    fclose(err);
+
+    // waits for the tasks that were never joined
+    vm_execsource(&vm, "var i = 0;\nwhile (i < 100) { spawn(fib, 12); i = i + 1; }\n");
+    vm_free(&vm);
+
+    printf("tasks: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Recurses far deeper than the vm has frames for, through `return f(...)`
+// in plain, mutual, closure and `and` / `or` tail calls. Also checks that an
+// upvalue of a frame that's replaced is closed first, that natives work in a
+// tail call, and that calls which aren't tail calls still overflow.
+
+static const char* source =
+    "fun count(n, total) { if (n == 0) return total; return count(n - 1, total + 1); }\n"
+    "fun is_even(n) { if (n == 0) return true; return is_odd(n - 1); }\n"
+    "fun is_odd(n) { if (n == 0) return false; return is_even(n - 1); }\n"
+    "fun all_big(n) { return n == 0 or (n > 0 and all_big(n - 1)); }\n"
+    "fun id(v) { return v; }\n"
+    "fun make(n) { var x = n; fun get() { return x; } x = x + 1; return id(get); }\n"
+    "fun down(n) { fun step(k) { if (k == 0) return 0; return down(k - 1); } return step(n); }\n"
+    "fun size(l) { return len(l); }\n"
+    "var counted = count(200000, 0);\n"
+    "var even = is_even(100001);\n"
+    "var big = all_big(100000);\n"
+    "var getter = make(41);\n"
+    "var captured = getter();\n"
+    "var stepped = down(100000);\n"
+    "var sized = size([1, 2, 3]);\n";
+
+int main() {
+    int failures = 0;
+    VM vm;
+    vm_init(&vm);
+
+    if (vm_execsource(&vm, source) != INTERPRET_OK) {
+        fprintf(stderr, "the script failed\n");
+        failures++;
+    }
+    else {
+        Value counted = global_value(&vm, "counted");
+        Value even = global_value(&vm, "even");
+        Value big = global_value(&vm, "big");
+        Value captured = global_value(&vm, "captured");
+        Value stepped = global_value(&vm, "stepped");
+        Value sized = global_value(&vm, "sized");
+        if (!IS_VAL_NUMBERLIKE(counted) || NUMBERLIKE_AS_NUM(counted) != 200000 ||
+            !IS_VAL_BOOL(even) || VAL_AS_BOOL(even) ||
+            !IS_VAL_BOOL(big) || !VAL_AS_BOOL(big) ||
+            !IS_VAL_NUMBERLIKE(stepped) || NUMBERLIKE_AS_NUM(stepped) != 0 ||
+            !IS_VAL_NUMBERLIKE(sized) || NUMBERLIKE_AS_NUM(sized) != 3) {
+            fprintf(stderr, "wrong results from the tail calls\n");
+            failures++;
+        }
+        if (!IS_VAL_NUMBERLIKE(captured) || NUMBERLIKE_AS_NUM(captured) != 42) {
+            fprintf(stderr, "the upvalue wasn't closed before the frame was reused\n");
+            failures++;
+        }
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    const char* bad[] = {
+        "fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; } deep(200000);\n",
+        "fun two(a, b) { return a; } fun one(a) { return two(a); } one(1);\n",
+        "fun bad() { return nil(); } bad();\n",
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        if (vm_execsource(&vm, bad[i]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[i]);
+            failures++;
+        }
+    }
+    fclose(err);
+
+    vm_free(&vm);
+    printf("tail calls: %d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string.h>
+
+#include "vm.h"
+#include "hash_table.h"
+#include "code/object.h"
+
+// Reading what a test script left in its globals
+
+// false if there's no such global
+static inline bool get_global(VM* vm, const char* name, Value* result) {
+    ObjString* key = copy_string(vm, name, (int)strlen(name));
+    return hashtable_get(vm, &vm->globals, key, result);
+}
+
+// the global's value, nil if there's no such global
+static inline Value global_value(VM* vm, const char* name) {
+    Value value = MK_VAL_NIL;
+    get_global(vm, name, &value);
+    return value;
+}
+
+// an int or a double equal to expected
+static inline bool global_is(VM* vm, const char* name, double expected) {
+    Value value;
+    return get_global(vm, name, &value) && IS_VAL_NUMBERLIKE(value) && NUMBERLIKE_AS_NUM(value) == expected;
+}
+
+static inline bool global_is_int(VM* vm, const char* name, int64_t expected) {
+    Value value;
+    return get_global(vm, name, &value) && IS_VAL_INT(value) && VAL_AS_INT(value) == expected;
+}
+
+static inline bool global_is_num(VM* vm, const char* name, double expected) {
+    Value value;
+    return get_global(vm, name, &value) && IS_VAL_NUM(value) && VAL_AS_NUM(value) == expected;
+}
+
+static inline bool global_is_true(VM* vm, const char* name) {
+    Value value;
+    return get_global(vm, name, &value) && IS_VAL_BOOL(value) && VAL_AS_BOOL(value);
+}
+
+// a string or rope with the expected characters, the vm must be able to
+// flatten it
+static inline bool global_is_string(VM* vm, const char* name, const char* expected) {
+    Value value;
+    if (!get_global(vm, name, &value) || !IS_OBJ_STRINGLIKE(value))
+        return false;
+    return strcmp(stringlike_flatten(vm, VAL_AS_OBJ(value))->chars, expected) == 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "kernels.h"
+#include "hash_table.h"
+#include "code/object.h"
+#include "test_helpers.h"
+
+// Runs every kernel set the cpu supports against the plain C one, on all the
+// lengths around the vector widths and at every offset (for the unaligned
+// loads). The values are small whole numbers so float sums are exact in any
+// order. Then checks the natives and indexing from a script.
+
+#define MAX_LENGTH 40
+
+static const char* source =
+    "var a = Float64Array(1000);\n"
+    "var i = 0;\n"
+    "while (i < 1000) { a[i] = i; i = i + 1; }\n"
+    "var b = Int64Array([3, -1, 4, 1, -5, 9, 2, 6]);\n"
+    "var total = array_sum(a);\n"
+    "var lowest = array_min(b) * 100 + array_max(b);\n"
+    "var d = array_dot(a, a);\n"
+    "var y = Float64Array(1000);\n"
+    "array_axpy(2, a, y);\n"
+    "array_scale(y, 0.5);\n"
+    "var running = array_prefix_sum(b);\n"
+    "var last = running[7] + array_mul(b, b)[4] + array_add(b, b)[5];\n"
+    "var found = array_search(y, 512) + array_search(b, 9) * 10000 + array_search(b, 0.5) * 100000;\n";
+
+// equal, or both NaN
+static bool same(double x, double y) {
+    return x == y || (x != x && y != y);
+}
+
+static bool all_same(const double* x, const double* y, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!same(x[i], y[i]))
+            return false;
+    }
+    return true;
+}
+
+static int compare_sets(const Kernels* k, const Kernels* s, const double* f, const int64_t* v) {
+    int failures = 0;
+    double fout[MAX_LENGTH], fexpect[MAX_LENGTH];
+    int64_t iout[MAX_LENGTH], iexpect[MAX_LENGTH];
+
+    for (int offset = 0; offset < 4; offset++) {
+        for (int n = 0; n + offset <= MAX_LENGTH; n++) {
+            const double* a = f + offset;
+            const int64_t* b = v + offset;
+            bool ok = same(k->sum_f64(a, n), s->sum_f64(a, n)) &&
+                      k->sum_i64(b, n) == s->sum_i64(b, n) &&
+                      k->min_f64(a, n) == s->min_f64(a, n) &&
+                      k->max_f64(a, n) == s->max_f64(a, n) &&
+                      same(k->dot_f64(a, f, n), s->dot_f64(a, f, n)) &&
+                      k->dot_i64(b, v, n) == s->dot_i64(b, v, n) &&
+                      k->search_f64(a, a[n / 2], n) == s->search_f64(a, a[n / 2], n) &&
+                      k->search_f64(a, 1000, n) == -1 &&
+                      k->search_i64(b, b[n / 2], n) == s->search_i64(b, b[n / 2], n) &&
+                      k->search_i64(b, INT64_MAX, n) == -1;
+            if (n > 0) {
+                ok = ok && k->min_i64(b, n) == s->min_i64(b, n) &&
+                           k->max_i64(b, n) == s->max_i64(b, n);
+            }
+
+            k->prefix_sum_f64(a, fout, n);
+            s->prefix_sum_f64(a, fexpect, n);
+            ok = ok && all_same(fout, fexpect, n);
+            k->prefix_sum_i64(b, iout, n);
+            s->prefix_sum_i64(b, iexpect, n);
+            ok = ok && memcmp(iout, iexpect, n * sizeof(int64_t)) == 0;
+
+            k->add_f64(a, f, fout, n);
+            s->add_f64(a, f, fexpect, n);
+            ok = ok && all_same(fout, fexpect, n);
+            k->mul_f64(a, f, fout, n);
+            s->mul_f64(a, f, fexpect, n);
+            ok = ok && all_same(fout, fexpect, n);
+            k->add_i64(b, v, iout, n);
+            s->add_i64(b, v, iexpect, n);
+            ok = ok && memcmp(iout, iexpect, n * sizeof(int64_t)) == 0;
+
+            memcpy(fout, a, n * sizeof(double));
+            memcpy(fexpect, a, n * sizeof(double));
+            k->scale_f64(fout, 3, n);
+            s->scale_f64(fexpect, 3, n);
+            k->axpy_f64(-2, f, fout, n);
+            s->axpy_f64(-2, f, fexpect, n);
+            ok = ok && all_same(fout, fexpect, n);
+
+            if (!ok) {
+                fprintf(stderr, "%s kernels differ for length %d at offset %d\n", k->name, n, offset);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    double f[MAX_LENGTH];
+    int64_t v[MAX_LENGTH];
+    srand(7);
+    for (int i = 0; i < MAX_LENGTH; i++) {
+        f[i] = rand() % 200 - 100;
+        v[i] = (int64_t)(rand() % 2000 - 1000) * 1000000000000LL;
+    }
+    // a NaN for min / max to skip
+    f[5] = 0.0 / 0.0;
+
+    const Kernels* scalar = kernels_for(KERNELS_SCALAR);
+    int sets = 0;
+    for (int level = KERNELS_SSE2; level <= KERNELS_AVX2; level++) {
+        const Kernels* k = kernels_for((KernelLevel)level);
+        if (k != NULL) {
+            failures += compare_sets(k, scalar, f, v);
+            sets++;
+        }
+    }
+
+    VM vm;
+    vm_init(&vm);
+    if (vm_execsource(&vm, source) != INTERPRET_OK ||
+        !global_is(&vm, "total", 499500) || !global_is(&vm, "lowest", -491) ||
+        !global_is(&vm, "d", 332833500) || !global_is(&vm, "last", 19 + 25 + 18) ||
+        !global_is(&vm, "found", 512 + 50000 - 100000)) {
+        fprintf(stderr, "wrong results from the script\n");
+        failures++;
+    }
+
+    FILE* err = tmpfile();
+    vm.err = err;
+    const char* bad[] = {
+        "Int64Array(1)[0] = 0.5;\n",
+        "Float64Array(1)[0] = nil;\n",
+        "Float64Array(2)[2];\n",
+        "Int64Array([1, nil]);\n",
+        "array_dot(Float64Array(2), Int64Array(2));\n",
+        "array_add(Float64Array(2), Float64Array(3));\n",
+    };
+    for (int i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+        if (vm_execsource(&vm, bad[i]) != INTERPRET_RUNTIME_ERROR) {
+            fprintf(stderr, "no error for: %s", bad[i]);
+            failures++;
+        }
+    }
+    fclose(err);
+    vm_free(&vm);
+
+    printf("typed arrays: %d vector kernel sets, %d failures\n", sets, failures);
+    return failures == 0 ? 0 : 1;
+}
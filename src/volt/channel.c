@@ -0,0 +1,272 @@
+#include "volt/channel.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "volt/vm.h"
+#include "volt/heap.h"
+
+// how many times a full (or empty) channel is retried before going to sleep
+#define CHANNEL_SPIN_LIMIT 64
+
+// A cell's sequence tells whose turn it is: pos for the sender that will
+// fill it at position pos, pos + 1 for the receiver that will empty it
+typedef struct {
+    _Atomic size_t sequence;
+    Value value;
+} Cell;
+
+struct Channel {
+    ObjString* name;
+    Channel* next;
+
+    Cell* cells;
+    size_t mask;
+
+    // the two positions are hammered by different threads, so keep them
+    // off each other's cache lines
+    _Alignas(64) _Atomic size_t send_pos;
+    _Alignas(64) _Atomic size_t recv_pos;
+
+    // only used for sleeping while the channel is full / empty
+    _Alignas(64) pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    _Atomic int waiting_senders;
+    _Atomic int waiting_receivers;
+};
+
+// all the channels, by name
+static Channel* channels = NULL;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* checked(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static Channel* new_channel(ObjString* name, size_t capacity) {
+    size_t size = (sizeof(Channel) + 63) & ~(size_t)63;
+    Channel* channel = (Channel*)checked(aligned_alloc(64, size));
+    channel->name = name;
+
+    size_t cell_count = 2;
+    while (cell_count < capacity)
+        cell_count *= 2;
+    channel->cells = (Cell*)checked(malloc(sizeof(Cell) * cell_count));
+    channel->mask = cell_count - 1;
+    for (size_t i = 0; i < cell_count; i++)
+        atomic_init(&channel->cells[i].sequence, i);
+
+    atomic_init(&channel->send_pos, 0);
+    atomic_init(&channel->recv_pos, 0);
+
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->not_full, NULL);
+    pthread_cond_init(&channel->not_empty, NULL);
+    atomic_init(&channel->waiting_senders, 0);
+    atomic_init(&channel->waiting_receivers, 0);
+    return channel;
+}
+
+Channel* channel_open(ObjString* name, size_t capacity) {
+    pthread_mutex_lock(&channels_lock);
+
+    // names are shared strings, so they can be compared by pointer
+    Channel* channel = channels;
+    while (channel != NULL && channel->name != name)
+        channel = channel->next;
+
+    if (channel == NULL) {
+        channel = new_channel(name, capacity);
+        channel->next = channels;
+        channels = channel;
+    }
+
+    pthread_mutex_unlock(&channels_lock);
+    return channel;
+}
+
+ObjString* channel_name(Channel* channel) { return channel->name; }
+
+/* The ring */
+
+static inline intptr_t turn_of(Cell* cell, size_t expected) {
+    return (intptr_t)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - expected);
+}
+
+static bool ring_push(Channel* channel, Value value) {
+    size_t pos = atomic_load_explicit(&channel->send_pos, memory_order_relaxed);
+    Cell* cell;
+
+    for (;;) {
+        cell = &channel->cells[pos & channel->mask];
+        intptr_t turn = turn_of(cell, pos);
+        if (turn == 0) {
+            // the cell is free, claim the position
+            if (atomic_compare_exchange_weak_explicit(&channel->send_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (turn < 0) {
+            // the receivers haven't emptied it yet, so the ring is full
+            return false;
+        } else {
+            // another sender got here first
+            pos = atomic_load_explicit(&channel->send_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_pop(Channel* channel, Value* value) {
+    size_t pos = atomic_load_explicit(&channel->recv_pos, memory_order_relaxed);
+    Cell* cell;
+
+    for (;;) {
+        cell = &channel->cells[pos & channel->mask];
+        intptr_t turn = turn_of(cell, pos + 1);
+        if (turn == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->recv_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (turn < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&channel->recv_pos, memory_order_relaxed);
+        }
+    }
+
+    *value = cell->value;
+    // hand the cell over to the sender one lap later
+    atomic_store_explicit(&cell->sequence, pos + channel->mask + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_is_full(Channel* channel) {
+    size_t pos = atomic_load_explicit(&channel->send_pos, memory_order_relaxed);
+    return turn_of(&channel->cells[pos & channel->mask], pos) < 0;
+}
+
+static bool ring_is_empty(Channel* channel) {
+    size_t pos = atomic_load_explicit(&channel->recv_pos, memory_order_relaxed);
+    return turn_of(&channel->cells[pos & channel->mask], pos + 1) < 0;
+}
+
+/* Sleeping */
+
+// The fences pair a waiter announcing itself and then checking the ring, with
+// the other side changing the ring and then checking for waiters. Atleast one
+// of them sees the other, so a wakeup is never lost
+static void wake(Channel* channel, _Atomic int* waiting, pthread_cond_t* cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&channel->lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+static void sleep_while(Channel* channel, bool (*is_blocked)(Channel*), _Atomic int* waiting, pthread_cond_t* cond) {
+    pthread_mutex_lock(&channel->lock);
+    atomic_fetch_add_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (is_blocked(channel))
+        pthread_cond_wait(cond, &channel->lock);
+
+    atomic_fetch_sub_explicit(waiting, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+bool channel_try_send(Channel* channel, Value value) {
+    if (!ring_push(channel, value))
+        return false;
+    wake(channel, &channel->waiting_receivers, &channel->not_empty);
+    return true;
+}
+
+bool channel_try_recv(Channel* channel, Value* value) {
+    if (!ring_pop(channel, value))
+        return false;
+    wake(channel, &channel->waiting_senders, &channel->not_full);
+    return true;
+}
+
+void channel_send(Channel* channel, Value value) {
+    for (int tries = 0; !channel_try_send(channel, value); tries++) {
+        if (tries < CHANNEL_SPIN_LIMIT)
+            sched_yield();
+        else
+            sleep_while(channel, ring_is_full, &channel->waiting_senders, &channel->not_full);
+    }
+}
+
+Value channel_recv(Channel* channel) {
+    Value value;
+    for (int tries = 0; !channel_try_recv(channel, &value); tries++) {
+        if (tries < CHANNEL_SPIN_LIMIT)
+            sched_yield();
+        else
+            sleep_while(channel, ring_is_empty, &channel->waiting_receivers, &channel->not_empty);
+    }
+    return value;
+}
+
+/* Passing values between vms */
+
+bool channel_export(VM* vm, Value value, Value* sendable) {
+    if (!IS_VAL_OBJ(value)) {
+        *sendable = value;
+        return true;
+    }
+    if (!IS_OBJ_STRINGLIKE(value))
+        return false;
+
+    ObjString* string = stringlike_flatten(vm, VAL_AS_OBJ(value));
+    if (string->obj.flags & OBJ_FLAG_IMMORTAL) {
+        *sendable = MK_VAL_OBJ(string);
+        return true;
+    }
+
+    // the sender's string stays with the sender's heap, the detached copy is
+    // owned by nobody until it's received
+    ObjString* copy = (ObjString*)heap_alloc_detached(STRING_ALLOC_SIZE(string->length));
+    copy->obj.type = OBJ_STRING;
+    copy->length = string->length;
+    copy->is_interned = false;
+    copy->is_hashed = string->is_hashed;
+    copy->hash = string->hash;
+    memcpy(copy->chars, string->chars, string->length + 1);
+
+    *sendable = MK_VAL_OBJ(copy);
+    return true;
+}
+
+Value channel_import(VM* vm, Value value) {
+    if (!IS_VAL_OBJ(value))
+        return value;
+
+    ObjString* string = OBJ_AS_STRING(value);
+    if (string->obj.flags & OBJ_FLAG_IMMORTAL) {
+        // a vm with its own intern table needs its own copy to compare by pointer
+        if (!vm->use_shared_strings)
+            return MK_VAL_OBJ(copy_string(vm, string->chars, string->length));
+        return value;
+    }
+
+    heap_adopt(&vm->heap, (Obj*)string);
+    vm->bytes_allocated += STRING_ALLOC_SIZE(string->length);
+    return value;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+#include "volt/code/object.h"
+
+/*
+* Channels pass values between vms running on different threads of the same
+* process, e.g the stages of a pipeline.
+*
+* A channel is a bounded multi producer, multi consumer ring buffer. Sending
+* and receiving don't take any lock unless the channel is full (or empty), in
+* which case the thread spins for a little while and then sleeps until the
+* other side makes progress.
+*
+* Channels are found by name in a process wide registry, so any vm can open
+* the same channel. They live until the process exits.
+*
+* Only nil, booleans, numbers and strings can be sent. The ring holds the
+* values as they are, so strings are never serialized:
+*   - strings from the shared intern table (see shared_strings.h) are immortal
+*     and are just passed by pointer
+*   - any other string is copied once, into a detached object (see
+*     heap_alloc_detached()) that the receiving vm adopts into its heap as it
+*     is. The sender's string can't be handed over itself: the sending vm has
+*     no way to tell whether anything else still points to it, and it lives in
+*     a slot of one of the sender's pages
+*/
+
+typedef struct Channel Channel;
+
+#define CHANNEL_DEFAULT_CAPACITY 64
+
+// Returns the channel with the given name, creating it with room for capacity
+// values (rounded up to a power of 2) if it doesn't exist yet. name must be a
+// shared string
+Channel* channel_open(ObjString* name, size_t capacity);
+
+ObjString* channel_name(Channel* channel);
+
+/*
+* Converts a value of the sending vm into one that can be put in a channel.
+* False if the value can't be sent. value must be reachable, since a rope is
+* flattened first
+*/
+bool channel_export(VM* vm, Value value, Value* sendable);
+
+// takes over a value that came out of a channel into the receiving vm
+Value channel_import(VM* vm, Value value);
+
+// Blocking send and receive, of exported values
+void channel_send(Channel* channel, Value value);
+Value channel_recv(Channel* channel);
+
+// non-blocking variants, false if the channel is full / empty
+bool channel_try_send(Channel* channel, Value value);
+bool channel_try_recv(Channel* channel, Value* value);
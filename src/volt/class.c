@@ -0,0 +1,44 @@
+#include "volt/class.h"
+
+#include "volt/vm.h"
+#include "volt/mem.h"
+#include "volt/hash_table.h"
+
+int shape_find(ObjShape* shape, ObjString* name) {
+    // names are interned, and each shape only adds one
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name)
+            return shape->field_count - 1;
+    }
+    return -1;
+}
+
+ObjShape* shape_add(VM* vm, ObjShape* shape, ObjString* name) {
+    Value next;
+    if (hashtable_get(vm, &shape->transitions, name, &next))
+        return (ObjShape*)VAL_AS_OBJ(next);
+
+    ObjShape* added = new_shape(vm, shape->klass, shape, name);
+    // on the stack while the table grows
+    vm_pushstack(vm, MK_VAL_OBJ(added));
+    hashtable_set(vm, &shape->transitions, name, MK_VAL_OBJ(added));
+    vm_popstack(vm);
+    return added;
+}
+
+void instance_add_field(VM* vm, ObjInstance* instance, ObjShape* shape, Value value) {
+    int slot = shape->field_count - 1;
+    if (slot == instance->capacity) {
+        int capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+        instance->fields = GROW_ARRAY(vm, Value, instance->fields, instance->capacity, capacity);
+        instance->capacity = capacity;
+    }
+
+    // later instances start out with room for all of these fields
+    ObjClass* klass = shape->klass;
+    if (klass->field_hint < shape->field_count)
+        klass->field_hint = shape->field_count;
+
+    instance->fields[slot] = value;
+    instance->shape = shape;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+#include "volt/code/object.h"
+
+/*
+* Operations on classes, shapes and instances (see object.h), and the property
+* caches of the instructions using them.
+*
+* In scripts, `class Name { method(params) { ... } }` makes a class, and
+* calling it makes an instance, running its init method (if any) with the
+* arguments. Fields are added by assigning to them (obj.field = value), and
+* read with obj.field, which gives a bound method if there's no such field but
+* a method. obj.method(args) calls a method without binding it first.
+*/
+
+// the slot of the field in instances of the shape, or -1
+int shape_find(ObjShape* shape, ObjString* name);
+
+// The shape with the field added, which is made the first time only. The shape
+// must be reachable, as this allocates
+ObjShape* shape_add(VM* vm, ObjShape* shape, ObjString* name);
+
+// Switches the instance to a shape with one more field, and sets that field.
+// Both the instance and the value must be reachable, as this allocates
+void instance_add_field(VM* vm, ObjInstance* instance, ObjShape* shape, Value value);
+
+static inline CacheEntry* cache_lookup(PropertyCache* cache, ObjShape* shape) {
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// remembers the shape, unless the cache is full
+static inline void cache_add(PropertyCache* cache, ObjShape* shape, int slot, Obj* target) {
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape == NULL) {
+            entry->shape = shape;
+            entry->slot = slot;
+            entry->target = target;
+            return;
+        }
+    }
+}
@@ -1,31 +1,116 @@
 #include "volt/code/chunk.h"
 
 #include <stddef.h>
+#include <string.h>
 #include "volt/mem.h"
+#include "volt/vm.h"
 
 void chunk_init(Chunk *cnk) {
     cnk->capacity = 0;
     cnk->count = 0;
     cnk->code = NULL;
     valarray_init(&cnk->constants);
+
+    cnk->lines = NULL;
+    cnk->line_count = 0;
+    cnk->line_capacity = 0;
+
+    cnk->is_packed = false;
 }
-void chunk_write(Chunk *cnk, byte_t byte) {
+void chunk_write(VM* vm, Chunk *cnk, byte_t byte, int line) {
     if (cnk->capacity <= cnk->count) {
         int old_cap = cnk->capacity;
         cnk->capacity = GROW_CAPACITY(old_cap);
-        cnk->code = GROW_ARRAY(byte_t, cnk->code, old_cap, cnk->capacity);
+        cnk->code = GROW_ARRAY(vm, byte_t, cnk->code, old_cap, cnk->capacity);
     }
 
     cnk->code[cnk->count] = byte;
     cnk->count++;
+
+    // still on the same line
+    if (cnk->line_count > 0 && cnk->lines[cnk->line_count - 1].line == line)
+        return;
+
+    if (cnk->line_capacity <= cnk->line_count) {
+        int old_cap = cnk->line_capacity;
+        cnk->line_capacity = GROW_CAPACITY(old_cap);
+        cnk->lines = GROW_ARRAY(vm, LineStart, cnk->lines, old_cap, cnk->line_capacity);
+    }
+
+    LineStart* line_start = &cnk->lines[cnk->line_count++];
+    line_start->offset = cnk->count - 1;
+    line_start->line = line;
 }
-void chunk_free(Chunk *cnk) {
-    FREE_ARRAY(byte_t, cnk->code, cnk->count);
-    valarray_free(&cnk->constants);
+void chunk_free(VM* vm, Chunk *cnk) {
+    // the block of a packed chunk belongs to its owner
+    if (!cnk->is_packed) {
+        FREE_ARRAY(vm, byte_t, cnk->code, cnk->capacity);
+        FREE_ARRAY(vm, LineStart, cnk->lines, cnk->line_capacity);
+        valarray_free(vm, &cnk->constants);
+    }
     chunk_init(cnk);
 }
 
-int chunk_addconst(Chunk* cnk, Value val) {
-    valarray_write(&cnk->constants, val);
+int chunk_addconst(VM* vm, Chunk* cnk, Value val) {
+    // the value may not be reachable from anywhere else yet, so keep
+    // it safe in case growing the array triggers a garbage collection
+    vm_pushstack(vm, val);
+    valarray_write(vm, &cnk->constants, val);
+    vm_popstack(vm);
     return cnk->constants.count - 1;
 }
+
+int chunk_get_line(Chunk* cnk, int offset) {
+    // binary search for the last run starting at or before offset
+    int low = 0;
+    int high = cnk->line_count - 1;
+    int line = 0;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (cnk->lines[mid].offset <= offset) {
+            line = cnk->lines[mid].line;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return line;
+}
+
+// the line table is placed after the code, aligned for its ints
+static inline size_t lines_offset(Chunk* cnk) {
+    size_t end_of_code = sizeof(Value) * cnk->constants.count + cnk->count;
+    return (end_of_code + _Alignof(LineStart) - 1) & ~(_Alignof(LineStart) - 1);
+}
+
+size_t chunk_packed_size(Chunk* cnk) {
+    return lines_offset(cnk) + sizeof(LineStart) * cnk->line_count;
+}
+
+// memcpy() must not be given a NULL buffer, even for 0 bytes
+static inline void copy_bytes(void* dest, const void* src, size_t size) {
+    if (size > 0)
+        memcpy(dest, src, size);
+}
+
+void chunk_pack(Chunk* cnk, Chunk* packed, void* block) {
+    char* base = (char*)block;
+
+    packed->constants.values = (Value*)base;
+    packed->constants.count = cnk->constants.count;
+    packed->constants.capacity = cnk->constants.count;
+    copy_bytes(packed->constants.values, cnk->constants.values, sizeof(Value) * cnk->constants.count);
+
+    packed->code = (byte_t*)(base + sizeof(Value) * cnk->constants.count);
+    packed->count = cnk->count;
+    packed->capacity = cnk->count;
+    copy_bytes(packed->code, cnk->code, cnk->count);
+
+    packed->lines = (LineStart*)(base + lines_offset(cnk));
+    packed->line_count = cnk->line_count;
+    packed->line_capacity = cnk->line_count;
+    copy_bytes(packed->lines, cnk->lines, sizeof(LineStart) * cnk->line_count);
+
+    packed->is_packed = true;
+}
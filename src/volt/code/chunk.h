@@ -1,10 +1,16 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 #include "volt/code/value.h"
 
 typedef uint8_t byte_t;
 
+typedef struct {
+    int offset; // the first byte of code from this line
+    int line;
+} LineStart;
+
 typedef struct {
     // pointer to start of chunk
     byte_t* code;
@@ -14,9 +20,31 @@ typedef struct {
     int count;
     // static constants that appear in code
     ValueArray constants;
+
+    // line numbers of the code, one entry per run of bytes from the same line
+    LineStart* lines;
+    int line_count;
+    int line_capacity;
+
+    // A packed chunk has everything above tightly packed in a single block, which
+    // it does not own (see chunk_pack()). It can't be written to anymore
+    bool is_packed;
 } Chunk;
 
 void chunk_init(Chunk* cnk);
-void chunk_write(Chunk* cnk, byte_t byte);
-void chunk_free(Chunk* cnk);
-int chunk_addconst(Chunk* cnk, Value val);
\ No newline at end of file
+void chunk_write(VM* vm, Chunk* cnk, byte_t byte, int line);
+void chunk_free(VM* vm, Chunk* cnk);
+int chunk_addconst(VM* vm, Chunk* cnk, Value val);
+
+// returns the source line of the byte at the given offset
+int chunk_get_line(Chunk* cnk, int offset);
+
+// no. of bytes needed to pack the chunk
+size_t chunk_packed_size(Chunk* cnk);
+
+/*
+* Copies the constants, the code and the lines of cnk (in that order) into block,
+* which must be atleast chunk_packed_size() bytes, and makes packed a read only
+* chunk backed by it. cnk itself is left untouched
+*/
+void chunk_pack(Chunk* cnk, Chunk* packed, void* block);
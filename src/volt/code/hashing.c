@@ -0,0 +1,139 @@
+#include "volt/code/hashing.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t hash_seed = 0;
+static pthread_once_t hash_seed_once = PTHREAD_ONCE_INIT;
+
+/* +======+ FNV-1a +======+ */
+
+// Fowler–Noll–Vo hash function
+// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+uint32_t hash_fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+/* +======+ WYHASH +======+ */
+
+// Based on wyhash (https://github.com/wangyi-fudan/wyhash, public domain).
+// Consumes 16 bytes per step (48 for long keys) with a 64x64->128 bit multiply
+// as the mixing step. The result is folded down to 32 bits.
+
+#define WY_P0 0xa0761d6478bd642full
+#define WY_P1 0xe7037ed1a0b428dbull
+#define WY_P2 0x8ebc6af09c88c6e3ull
+#define WY_P3 0x589965cc75374cc3ull
+
+// 64x64 -> 128 bit multiply, returns the low half in *a and the high half in *b
+static inline void wy_mum(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+// unaligned little endian reads, memcpy compiles down to a single load
+static inline uint64_t wy_r8(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t wy_r4(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t wy_r3(const uint8_t* p, int k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint32_t hash_wyhash(const char* key, int length, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)key;
+    uint64_t len = (uint64_t)length;
+    uint64_t a, b;
+
+    seed ^= wy_mix(seed ^ WY_P0, WY_P1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_r4(p) << 32) | wy_r4(p + ((len >> 3) << 2));
+            b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wy_r3(p, (int)len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint64_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_r8(p) ^ WY_P1, wy_r8(p + 8) ^ seed);
+                see1 = wy_mix(wy_r8(p + 16) ^ WY_P2, wy_r8(p + 24) ^ see1);
+                see2 = wy_mix(wy_r8(p + 32) ^ WY_P3, wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ WY_P1, wy_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+
+    a ^= WY_P1;
+    b ^= seed;
+    wy_mum(&a, &b);
+    uint64_t hash = wy_mix(a ^ WY_P0 ^ len, b ^ WY_P1);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* +======+ SELECTION +======+ */
+
+static void pick_seed() {
+    // there is no portable randomness source in C11, so mix whatever
+    // differs between runs: the time, and addresses randomized by ASLR
+    int local;
+    uint64_t entropy = (uint64_t)time(NULL);
+    entropy = wy_mix(entropy ^ WY_P0, (uint64_t)clock() ^ WY_P1);
+    entropy = wy_mix(entropy ^ (uint64_t)(uintptr_t)&local, WY_P2);
+    entropy = wy_mix(entropy ^ (uint64_t)(uintptr_t)&hash_seed_init, WY_P3);
+
+    hash_seed = entropy;
+}
+
+void hash_seed_init() {
+    // every vm calls this, possibly from different threads at once. They all
+    // have to agree on the seed so strings hash the same in all of them
+    pthread_once(&hash_seed_once, pick_seed);
+}
+
+uint32_t hash_string(const char* key, int length) {
+#ifdef VOLT_HASH_FNV1A
+    return hash_fnv1a(key, length);
+#else
+    return hash_wyhash(key, length, hash_seed);
+#endif
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+/*
+* String hash function used for interning and hash tables, selected at build time:
+*   VOLT_HASH_WYHASH (default) - wyhash style, reads 8 bytes at a time and is
+*                                seeded per process against hash flooding
+*   VOLT_HASH_FNV1A            - the classic byte at a time FNV-1a
+*/
+#if !defined(VOLT_HASH_WYHASH) && !defined(VOLT_HASH_FNV1A)
+#define VOLT_HASH_WYHASH
+#endif
+
+// picks the random per process seed, only the first call does anything and it is
+// safe to call from several threads. Must be called before any string is hashed
+void hash_seed_init();
+
+uint32_t hash_fnv1a(const char* key, int length);
+uint32_t hash_wyhash(const char* key, int length, uint64_t seed);
+
+// hashes a string with the selected function (and the process seed)
+uint32_t hash_string(const char* key, int length);
@@ -5,44 +5,151 @@
 #include "volt/mem.h"
 #include "volt/vm.h"
 #include "volt/hash_table.h"
+#include "volt/code/hashing.h"
+#include "volt/code/shared_strings.h"
+#include "volt/channel.h"
 
 /* +======+ STRINGS +======+ */
 
 
-// Fowler–Noll–Vo hash function
-// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
-static strhash_t hash_string(const char* key, int length) {
-    strhash_t hash = 2166136261u;
+static void print_func(VM* vm, ObjFunction* func) {
+    if (func->name == NULL) {
+        fprintf(vm->out, "<main>");
+        return;
+    }
+    fprintf(vm->out, "<fn %s>", func->name->chars);
+}
 
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+
+// the lists and maps being printed, from the innermost one out
+typedef struct Enclosing {
+    Obj* container;
+    struct Enclosing* outer;
+} Enclosing;
+
+static void print_nested(VM* vm, Value val, Enclosing* outer);
+
+static void print_list(VM* vm, ObjList* list, Enclosing* outer) {
+    Enclosing enclosing = {(Obj*)list, outer};
+    fprintf(vm->out, "[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0)
+            fprintf(vm->out, ", ");
+        print_nested(vm, list->items.values[i], &enclosing);
     }
+    fprintf(vm->out, "]");
+}
 
-    return hash;
+static void print_map(VM* vm, ObjMap* map, Enclosing* outer) {
+    Enclosing enclosing = {(Obj*)map, outer};
+    fprintf(vm->out, "{");
+    bool is_first = true;
+    for (int i = 0; i < map->entry_count; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->is_deleted)
+            continue;
+        if (!is_first)
+            fprintf(vm->out, ", ");
+        is_first = false;
+        print_val(vm, entry->key);
+        fprintf(vm->out, ": ");
+        print_nested(vm, entry->value, &enclosing);
+    }
+    fprintf(vm->out, "}");
 }
 
-static void print_func(ObjFunction* func) {
-    if (func->name == NULL) {
-        printf("<main>");
+static void print_nested(VM* vm, Value val, Enclosing* outer) {
+    if (!IS_OBJ_LIST(val) && !IS_OBJ_MAP(val)) {
+        print_val(vm, val);
         return;
     }
-    printf("<fn %s>", func->name->chars);
-}
 
+    // a container that holds itself, even through others, would print forever
+    for (Enclosing* e = outer; e != NULL; e = e->outer) {
+        if (e->container == VAL_AS_OBJ(val)) {
+            fprintf(vm->out, IS_OBJ_LIST(val) ? "[...]" : "{...}");
+            return;
+        }
+    }
 
-void print_obj(Value val) {
+    if (IS_OBJ_LIST(val))
+        print_list(vm, OBJ_AS_LIST(val), outer);
+    else
+        print_map(vm, OBJ_AS_MAP(val), outer);
+}
+
+void print_obj(VM* vm, Value val) {
     switch (OBJ_TYPE(val)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(val));
+            fprintf(vm->out, "%s", AS_CSTRING(val));
+            break;
+
+        case OBJ_ROPE:
+            fprintf(vm->out, "%s", rope_flatten(vm, OBJ_AS_ROPE(val))->chars);
             break;
 
         case OBJ_FUNCTION:
-            print_func(OBJ_AS_FUNC(val));
+            print_func(vm, OBJ_AS_FUNC(val));
+            break;
+
+        case OBJ_CLOSURE:
+            print_func(vm, OBJ_AS_CLOSURE(val)->func);
+            break;
+
+        case OBJ_UPVALUE:
+            fprintf(vm->out, "<upvalue>");
+            break;
+
+        case OBJ_CLASS:
+            fprintf(vm->out, "<class %s>", OBJ_AS_CLASS(val)->name->chars);
+            break;
+
+        case OBJ_SHAPE:
+            fprintf(vm->out, "<shape>");
+            break;
+
+        case OBJ_INSTANCE:
+            fprintf(vm->out, "<%s instance>", OBJ_AS_INSTANCE(val)->shape->klass->name->chars);
+            break;
+
+        case OBJ_BOUND_METHOD:
+            print_func(vm, value_to_function(MK_VAL_OBJ(OBJ_AS_BOUND_METHOD(val)->method)));
             break;
 
         case OBJ_NATIVEFN:
-            printf("<[native fn]>");
+            fprintf(vm->out, "<[native fn]>");
+            break;
+
+        case OBJ_FIBER:
+            fprintf(vm->out, "<fiber>");
+            break;
+
+        case OBJ_TASK:
+            fprintf(vm->out, "<task>");
+            break;
+
+        case OBJ_LIST:
+        case OBJ_MAP:
+            print_nested(vm, val, NULL);
+            break;
+
+        case OBJ_TYPED_ARRAY: {
+            ObjTypedArray* array = OBJ_AS_TYPED_ARRAY(val);
+            fprintf(vm->out, array->kind == ELEMS_F64 ? "Float64Array(" : "Int64Array(");
+            for (int i = 0; i < array->length; i++) {
+                if (i > 0)
+                    fprintf(vm->out, ", ");
+                if (array->kind == ELEMS_F64)
+                    print_val(vm, MK_VAL_NUM(TYPED_F64(array)[i]));
+                else
+                    fprintf(vm->out, "%lld", (long long)TYPED_I64(array)[i]);
+            }
+            fprintf(vm->out, ")");
+            break;
+        }
+
+        case OBJ_CHANNEL:
+            fprintf(vm->out, "<channel %s>", channel_name(OBJ_AS_CHANNEL(val)->channel)->chars);
             break;
         
         default: break; // Unreachable
@@ -50,76 +157,354 @@ void print_obj(Value val) {
 }
 
 // just lazy to cast back to a valid pointer
-#define ALLOCATE_OBJ(ctype, objtype) \
-    (ctype*)allocate_obj(sizeof(ctype), objtype)
+#define ALLOCATE_OBJ(vm, ctype, objtype) \
+    (ctype*)allocate_obj(vm, sizeof(ctype), objtype)
 
-Obj* allocate_obj(size_t size, ObjType type) {
-    Obj* obj = (Obj*)reallocate(NULL, 0, size);
+Obj* allocate_obj(VM* vm, size_t size, ObjType type) {
+    Obj* obj = allocate_obj_memory(vm, size);
     obj->type = type;
-
-    obj->next = vm.objects;
-    vm.objects = obj;
-
     return obj;
 }
 
-ObjString* allocate_string(char* chars, int length, strhash_t hash) {
-    ObjString* string_obj = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string_obj->chars = chars;
+ObjString* allocate_string(VM* vm, int length) {
+    ObjString* string_obj = (ObjString*)allocate_obj(vm, STRING_ALLOC_SIZE(length), OBJ_STRING);
     string_obj->length = length;
-    string_obj->hash = hash;
+    string_obj->hash = 0;
+    string_obj->is_interned = false;
+    string_obj->is_hashed = false;
+    string_obj->chars[length] = '\0';
+    return string_obj;
+}
 
-    hashtable_set(&vm.interned_strings, string_obj, MK_VAL_NIL);
+// adds a string, that is known to not be interned yet, to the interned strings
+static void intern_new_string(VM* vm, ObjString* string, strhash_t hash) {
+    string->hash = hash;
+    string->is_hashed = true;
+    string->is_interned = true;
 
-    return string_obj;
+    // growing the table can trigger a collection
+    vm_pushstack(vm, MK_VAL_OBJ(string));
+    hashtable_set(vm, &vm->interned_strings, string, MK_VAL_NIL);
+    vm_popstack(vm);
 }
 
-ObjString* copy_string(const char* chars, int length) {
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    strhash_t hash = hash_string(heap_chars, length);
+ObjString* copy_string(VM* vm, const char* chars, int length) {
+    strhash_t hash = hash_string(chars, length);
+    if (vm->use_shared_strings)
+        return shared_strings_intern(chars, length, hash);
 
     // Check if the string is already interned. If so, return it
     // instead of creating a new one
-    ObjString* interned = hashtable_findstr(&vm.interned_strings, chars, length, hash);
+    ObjString* interned = hashtable_findstr(&vm->interned_strings, chars, length, hash);
     if (interned != NULL)
         return interned;
 
-    return allocate_string(heap_chars, length, hash);
+    ObjString* string_obj = allocate_string(vm, length);
+    memcpy(string_obj->chars, chars, length);
+    intern_new_string(vm, string_obj, hash);
+
+    return string_obj;
 }
 
+ObjString* string_intern(VM* vm, ObjString* string) {
+    if (string->is_interned)
+        return string;
 
-ObjString* take_string(char* chars, int length) {
-    strhash_t hash = hash_string(chars, length);
+    strhash_t hash = string_hash(string);
+    // the shared table keeps its own copy, the string itself stays in the heap
+    if (vm->use_shared_strings)
+        return shared_strings_intern(string->chars, string->length, hash);
 
-    // Check if the string is already interned. If so, return it
-    // instead of creating a new one
-    ObjString* interned = hashtable_findstr(&vm.interned_strings, chars, length, hash);
-    if (interned != NULL) {
-        // free the chars, because we have their ownership now
-        FREE_ARRAY(char, chars, length + 1);
+    ObjString* interned = hashtable_findstr(&vm->interned_strings, string->chars, string->length, hash);
+    if (interned != NULL)
         return interned;
+
+    intern_new_string(vm, string, hash);
+    return string;
+}
+
+bool strings_equal(ObjString* a, ObjString* b) {
+    if (a == b)
+        return true;
+    // two distinct interned strings can never be equal
+    if (a->is_interned && b->is_interned)
+        return false;
+    if (a->is_hashed && b->is_hashed && a->hash != b->hash)
+        return false;
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+
+/* +======+ ROPES +======+ */
+
+ObjRope* new_rope(VM* vm, Obj* left, Obj* right) {
+    // don't keep the whole tree of an already flattened child alive
+    if (left->type == OBJ_ROPE && ((ObjRope*)left)->flat != NULL)
+        left = (Obj*)((ObjRope*)left)->flat;
+    if (right->type == OBJ_ROPE && ((ObjRope*)right)->flat != NULL)
+        right = (Obj*)((ObjRope*)right)->flat;
+
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = stringlike_length(left) + stringlike_length(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+ObjString* rope_flatten(VM* vm, ObjRope* rope) {
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    int length = rope->length;
+    ObjString* flat = allocate_string(vm, length);
+    char* chars = flat->chars;
+    // growing the pending stack below may trigger a collection
+    vm_pushstack(vm, MK_VAL_OBJ(flat));
+
+    // The buffer is filled from the end, visiting the right half of a rope
+    // before its left half. Pending left halves are kept on an explicit stack.
+    // For the usual left leaning ropes (s = s + x) it never holds more than one
+    // node, and there is no recursion that could overflow for deep ropes.
+    Obj** pending = NULL;
+    int pending_count = 0;
+    int pending_capacity = 0;
+
+    int end = length;
+    Obj* node = (Obj*)rope;
+    for (;;) {
+        if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat != NULL)
+            node = (Obj*)((ObjRope*)node)->flat;
+
+        if (node->type == OBJ_ROPE) {
+            ObjRope* node_rope = (ObjRope*)node;
+            if (pending_capacity < pending_count + 1) {
+                int old_capacity = pending_capacity;
+                pending_capacity = GROW_CAPACITY(old_capacity);
+                pending = GROW_ARRAY(vm, Obj*, pending, old_capacity, pending_capacity);
+            }
+            pending[pending_count++] = node_rope->left;
+            node = node_rope->right;
+            continue;
+        }
+
+        ObjString* piece = (ObjString*)node;
+        end -= piece->length;
+        memcpy(chars + end, piece->chars, piece->length);
+
+        if (pending_count == 0)
+            break;
+        node = pending[--pending_count];
     }
 
-    return allocate_string(chars, length, hash);
+    FREE_ARRAY(vm, Obj*, pending, pending_capacity);
+    vm_popstack(vm);
+
+    rope->flat = flat;
+    // the halves are not needed anymore, let them be collected
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+ObjString* stringlike_flatten(VM* vm, Obj* obj) {
+    if (obj->type == OBJ_ROPE)
+        return rope_flatten(vm, (ObjRope*)obj);
+    return (ObjString*)obj;
 }
 
 
 /* +======+ FUNCTIONS +======+ */
 
-ObjFunction* new_function() {
-    ObjFunction* func = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* new_function(VM* vm) {
+    ObjFunction* func = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     func->arity = 0;
+    func->capture_count = 0;
+    func->cache_count = 0;
+    func->caches = NULL;
     func->name = NULL;
     chunk_init(&func->chunk);
     return func;
 }
 
 
+ObjFunction* pack_function(VM* vm, ObjFunction* builder) {
+    size_t caches_size = sizeof(PropertyCache) * builder->cache_count;
+    size_t block_size = caches_size + chunk_packed_size(&builder->chunk);
+    ObjFunction* func = (ObjFunction*)allocate_obj(vm, sizeof(ObjFunction) + block_size, OBJ_FUNCTION);
+    func->arity = builder->arity;
+    func->capture_count = builder->capture_count;
+    func->name = builder->name;
+
+    // the caches start out empty
+    func->cache_count = builder->cache_count;
+    func->caches = (PropertyCache*)func->block;
+    memset(func->caches, 0, caches_size);
+    chunk_pack(&builder->chunk, &func->chunk, func->block + caches_size);
+
+    // the builder is garbage now, no need to wait for the collector to free its arrays
+    chunk_free(vm, &builder->chunk);
+    return func;
+}
+
+
+/* +======+ CLOSURES +======+ */
+ObjClosure* new_closure(VM* vm, ObjFunction* func) {
+    ObjClosure* closure = (ObjClosure*)allocate_obj(vm, CLOSURE_ALLOC_SIZE(func->capture_count), OBJ_CLOSURE);
+    closure->func = func;
+    closure->capture_count = func->capture_count;
+    for (int i = 0; i < closure->capture_count; i++)
+        closure->captures[i] = MK_VAL_NIL;
+    return closure;
+}
+
+ObjUpvalue* new_upvalue(VM* vm, Value* location, Obj* owner) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
+    upvalue->location = location;
+    upvalue->closed = MK_VAL_NIL;
+    upvalue->next = NULL;
+    upvalue->owner = owner;
+    return upvalue;
+}
+
+
+/* +======+ CLASSES +======+ */
+ObjClass* new_class(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+    klass->name = name;
+    hashtable_init(&klass->methods);
+    klass->initializer = MK_VAL_NIL;
+    klass->root_shape = NULL;
+    klass->field_hint = 0;
+
+    // on the stack while its root shape is made
+    vm_pushstack(vm, MK_VAL_OBJ(klass));
+    klass->root_shape = new_shape(vm, klass, NULL, NULL);
+    vm_popstack(vm);
+    return klass;
+}
+
+ObjShape* new_shape(VM* vm, ObjClass* klass, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    hashtable_init(&shape->transitions);
+    return shape;
+}
+
+ObjInstance* new_instance(VM* vm, ObjClass* klass) {
+    // the fields first, as the instance wouldn't be reachable yet
+    int capacity = klass->field_hint;
+    Value* fields = capacity > 0 ? ALLOCATE(vm, Value, capacity) : NULL;
+
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+    instance->shape = klass->root_shape;
+    instance->fields = fields;
+    instance->capacity = capacity;
+    return instance;
+}
+
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, Obj* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+
 /* +======+ NATIVE FUNCTIONS +======+ */
-ObjNativeFn* new_native(NativeFn fn) {
-    ObjNativeFn* native_obj = ALLOCATE_OBJ(ObjNativeFn, OBJ_NATIVEFN);
+ObjNativeFn* new_native(VM* vm, NativeFn fn) {
+    ObjNativeFn* native_obj = ALLOCATE_OBJ(vm, ObjNativeFn, OBJ_NATIVEFN);
     native_obj->fn = fn;
     return native_obj;
 }
+
+
+/* +======+ CHANNELS +======+ */
+ObjChannel* new_channel_handle(VM* vm, struct Channel* channel) {
+    ObjChannel* handle = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    return handle;
+}
+
+
+/* +======+ FIBERS +======+ */
+ObjFiber* new_fiber(VM* vm, Obj* entry) {
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->is_task = false;
+    fiber->entry = entry;
+    fiber->resumer = NULL;
+    fiber->stacks.frames = NULL;
+    fiber->stacks.frame_count = 0;
+    fiber->stacks.frame_capacity = 0;
+    fiber->stacks.stack = NULL;
+    fiber->stacks.stack_end = NULL;
+    fiber->stacks.stack_top = NULL;
+    fiber->stacks.open_upvalues = NULL;
+    return fiber;
+}
+
+
+/* +======+ TASKS +======+ */
+ObjTask* new_task_handle(VM* vm, struct Task* task) {
+    ObjTask* handle = ALLOCATE_OBJ(vm, ObjTask, OBJ_TASK);
+    handle->task = task;
+    return handle;
+}
+
+
+/* +======+ LISTS +======+ */
+ObjList* new_list(VM* vm) {
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    valarray_init(&list->items);
+    return list;
+}
+
+void list_append(VM* vm, ObjList* list, Value value) {
+    valarray_write(vm, &list->items, value);
+}
+
+/* +======+ TYPED ARRAYS +======+ */
+ObjTypedArray* new_typed_array(VM* vm, ElemKind kind, int length) {
+    ObjTypedArray* array = (ObjTypedArray*)allocate_obj(vm, TYPED_ARRAY_ALLOC_SIZE(length), OBJ_TYPED_ARRAY);
+    array->kind = kind;
+    array->length = length;
+    // all zero bits is 0 for both doubles and int64s
+    memset(array->elems, 0, (size_t)length * 8);
+    return array;
+}
+
+bool num_to_i64(double number, int64_t* result) {
+    // the range check comes first, converting anything outside of it is undefined
+    if (!(number >= -9223372036854775808.0 && number < 9223372036854775808.0))
+        return false;
+    int64_t whole = (int64_t)number;
+    if ((double)whole != number)
+        return false;
+    *result = whole;
+    return true;
+}
+
+bool typed_array_store(ObjTypedArray* array, int i, Value value) {
+    if (array->kind == ELEMS_I64)
+        return value_to_i64(value, &TYPED_I64(array)[i]);
+    if (!IS_VAL_NUMBERLIKE(value))
+        return false;
+    TYPED_F64(array)[i] = NUMBERLIKE_AS_NUM(value);
+    return true;
+}
+
+/* +======+ MAPS +======+ */
+ObjMap* new_map(VM* vm) {
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    map->entries = NULL;
+    map->entry_count = 0;
+    map->entry_capacity = 0;
+    map->live_count = 0;
+    map->index = NULL;
+    map->index_capacity = 0;
+    return map;
+}
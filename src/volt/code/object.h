@@ -1,6 +1,7 @@
 #pragma once
 #include "volt/code/value.h"
 #include "volt/code/chunk.h"
+#include "volt/code/hashing.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -8,18 +9,38 @@
 /* General Obj stuff */
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
     OBJ_FUNCTION,
-    OBJ_NATIVEFN
+    OBJ_NATIVEFN,
+    OBJ_CHANNEL,
+    OBJ_FIBER,
+    OBJ_TASK,
+    OBJ_LIST,
+    OBJ_TYPED_ARRAY,
+    OBJ_MAP,
+    OBJ_CLOSURE,
+    OBJ_UPVALUE,
+    OBJ_CLASS,
+    OBJ_SHAPE,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD
 } ObjType;
 
+// header flags
+#define OBJ_FLAG_LARGE  (1 << 0) // allocated outside the heap's slab pages
+#define OBJ_FLAG_IMMORTAL (1 << 2) // not owned by any heap, never freed (see shared_strings.h)
+
+// The object header is kept down to 4 bytes. The objects themselves are not
+// linked together, the heap walks its pages instead (see heap.h)
 struct Obj {
-    ObjType type;
-    struct Obj* next;
+    uint8_t type; // ObjType
+    uint8_t flags;
+    uint16_t slot; // index of the object in its heap page
 };
 
 #define OBJ_TYPE(val) (VAL_AS_OBJ(val)->type)
-void print_obj(Value val);
-Obj* allocate_obj(size_t size, ObjType type);
+void print_obj(VM* vm, Value val);
+Obj* allocate_obj(VM* vm, size_t size, ObjType type);
 
 static inline bool is_obj_type(Value val, ObjType type) { return IS_VAL_OBJ(val) && VAL_AS_OBJ(val)->type == type; }
 
@@ -30,36 +51,277 @@ typedef uint32_t strhash_t;
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
+    // Strings created at runtime (see allocate_string()) are neither hashed nor
+    // interned until they are needed. The hash is worked out the first time
+    // it's needed (see string_hash()) and then kept, and only interned strings
+    // can be compared by pointer
+    bool is_interned;
+    bool is_hashed;
     strhash_t hash;
+    // the characters are stored inline, right after the header in the same
+    // allocation, and are always null terminated
+    char chars[];
 };
 
-ObjString* allocate_string(char* chars, int length, strhash_t hash);
-ObjString* copy_string(const char* chars, int length);
-ObjString* take_string(char* chars, int length);
+// size of the allocation holding a string of the given length
+#define STRING_ALLOC_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+/*
+* Allocates a new, not yet interned string with room for length chars (the null
+* terminator is already in place). The caller fills in the characters
+*/
+ObjString* allocate_string(VM* vm, int length);
+
+// copies the chars into a new interned string (or returns the existing one)
+ObjString* copy_string(VM* vm, const char* chars, int length);
+
+/*
+* Returns the interned string with the same contents. That is either the string
+* itself (after interning it) or an existing one. Strings must go through this
+* before being used as a HashTable key
+*/
+ObjString* string_intern(VM* vm, ObjString* string);
+
+bool strings_equal(ObjString* a, ObjString* b);
+
+// the string's hash, worked out on the first call
+static inline strhash_t string_hash(ObjString* string) {
+    if (!string->is_hashed) {
+        string->hash = hash_string(string->chars, string->length);
+        string->is_hashed = true;
+    }
+    return string->hash;
+}
 
 #define IS_OBJ_STRING(val) is_obj_type(val, OBJ_STRING)
 #define OBJ_AS_STRING(val)   ((ObjString*)VAL_AS_OBJ(val))
 #define AS_CSTRING(val)  (((ObjString*)VAL_AS_OBJ(val))->chars)
 
 
+/* +======+ ROPES +======+ */
+
+/*
+* A lazily concatenated string. Instead of copying both halves on every '+', a
+* rope just points to them. The characters are only copied into a real ObjString
+* when the rope is flattened, which happens the first time it is printed,
+* compared or otherwise needs its characters. Building a string in a loop
+* is therefore linear instead of quadratic.
+*/
+typedef struct {
+    Obj obj;
+    int length;
+    // the two halves, each one either an ObjString or an ObjRope.
+    // Both are cleared after flattening
+    Obj* left;
+    Obj* right;
+    // the flattened string, NULL until the rope is flattened
+    ObjString* flat;
+} ObjRope;
+
+// concatenations shorter than this are copied right away, longer
+// ones build a rope
+#define ROPE_MIN_LENGTH 64
+
+#define IS_OBJ_ROPE(val) is_obj_type(val, OBJ_ROPE)
+#define OBJ_AS_ROPE(val) ((ObjRope*)VAL_AS_OBJ(val))
+
+// true for both strings and ropes
+#define IS_OBJ_STRINGLIKE(val) (IS_OBJ_STRING(val) || IS_OBJ_ROPE(val))
+
+static inline int stringlike_length(Obj* obj) {
+    return obj->type == OBJ_STRING ? ((ObjString*)obj)->length : ((ObjRope*)obj)->length;
+}
+
+ObjRope* new_rope(VM* vm, Obj* left, Obj* right);
+
+/*
+* Copies the rope's characters into a single string, and caches it. The rope
+* must be reachable (e.g on the vm stack) because this allocates
+*/
+ObjString* rope_flatten(VM* vm, ObjRope* rope);
+
+// returns the string itself, or the flattened string if a rope is given
+ObjString* stringlike_flatten(VM* vm, Obj* obj);
+
+
 /* +======+ USER FUNCTIONS +======+ */
+
+// how many shapes a property cache remembers, it's left as it is once full
+#define PROPERTY_CACHE_WAYS 4
+
+typedef struct {
+    struct ObjShape* shape; // NULL if unused
+    // the field's slot, or -1 if it's a method
+    int slot;
+    // the method for gets and invokes. For sets, the shape after adding the
+    // field, or NULL if the shape already has it
+    Obj* target;
+} CacheEntry;
+
+/*
+* The inline cache of a single property instruction. It remembers where the
+* property was found for the last few shapes, so instances of those shapes
+* skip the lookup. Only the vm that owns the function uses its caches (see
+* function_caches()), as other vms may be running the same code at the
+* same time, and their shapes would never match anyway
+*/
+typedef struct {
+    CacheEntry entries[PROPERTY_CACHE_WAYS];
+} PropertyCache;
+
 typedef struct {
     Obj obj;
     unsigned int arity;
+    // the variables of enclosing functions it uses, 0 for most functions,
+    // which don't need a closure (see ObjClosure)
+    int capture_count;
+    // one per property instruction, packed in front of the chunk
+    int cache_count;
+    PropertyCache* caches;
     Chunk chunk;
     ObjString* name;
+    // Once compiled, the chunk's constants, code and lines are packed right here
+    // after the header, in the same allocation (see pack_function())
+    char block[];
 } ObjFunction;
 
 #define IS_OBJ_FUNC(val) is_obj_type(val, OBJ_FUNCTION)
 #define OBJ_AS_FUNC(val) ((ObjFunction*)VAL_AS_OBJ(val))
 
-ObjFunction* new_function();
+// creates an empty function for the compiler to write into
+ObjFunction* new_function(VM* vm);
+
+/*
+* Makes the final, immutable copy of a compiled function, with its whole chunk
+* packed into a single tightly sized block. The growable arrays of the given
+* function are released. It must be reachable because this allocates
+*/
+ObjFunction* pack_function(VM* vm, ObjFunction* builder);
+
+
+/* +======+ CLOSURES +======+ */
+
+/*
+* A captured variable that is assigned somewhere, so all the closures that
+* captured it have to share it. While the variable's frame is still running it
+* is open, and location points at the variable's stack slot. Once the frame
+* returns (or the variable's scope ends) its value is moved into closed, and
+* location points there instead.
+*/
+typedef struct ObjUpvalue {
+    Obj obj;
+    Value* location;
+    Value closed;
+    // the next open upvalue of the same stack, they are kept sorted by
+    // location from the top of the stack down
+    struct ObjUpvalue* next;
+    // the fiber whose stack it points into while open, so that the stack isn't
+    // freed under it. NULL for the main script's stack, and once closed
+    Obj* owner;
+} ObjUpvalue;
+
+/*
+* A function along with the variables it captured from the functions it's
+* nested in. Variables that are never assigned after being declared can't
+* change, so a closure just keeps a copy of their value. Only the assigned ones
+* are captured through an ObjUpvalue. The compiler knows which is which, and
+* emits different instructions for each (see CaptureKind)
+*/
+typedef struct {
+    Obj obj;
+    ObjFunction* func;
+    int capture_count;
+    // the copied values, and the upvalues (as object values)
+    Value captures[];
+} ObjClosure;
+
+// size of the allocation holding a closure with the given number of captures
+#define CLOSURE_ALLOC_SIZE(count) (sizeof(ObjClosure) + sizeof(Value) * (count))
+
+#define IS_OBJ_CLOSURE(val) is_obj_type(val, OBJ_CLOSURE)
+#define OBJ_AS_CLOSURE(val) ((ObjClosure*)VAL_AS_OBJ(val))
+#define OBJ_AS_UPVALUE(val) ((ObjUpvalue*)VAL_AS_OBJ(val))
+
+// all the captures start out nil, the caller fills them in
+ObjClosure* new_closure(VM* vm, ObjFunction* func);
+ObjUpvalue* new_upvalue(VM* vm, Value* location, Obj* owner);
+
+// the function of a function or a closure, NULL for any other value
+static inline ObjFunction* value_to_function(Value val) {
+    if (IS_OBJ_FUNC(val))
+        return OBJ_AS_FUNC(val);
+    if (IS_OBJ_CLOSURE(val))
+        return OBJ_AS_CLOSURE(val)->func;
+    return NULL;
+}
+
+
+/* +======+ CLASSES +======+ */
+
+#include "volt/hash_table.h"
+
+/*
+* The layout of an instance's fields: which field is at which slot. Instances
+* get fields in the same order share their shapes, as each shape keeps the
+* shapes made from it by adding a field (a transition tree, starting from the
+* class's empty root shape). So a shape also tells the class of an instance,
+* and the slot of a field, which the property caches rely on
+*/
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjClass* klass;
+    struct ObjShape* parent;
+    // the field this shape added to its parent's, NULL for the root
+    ObjString* name;
+    int field_count;
+    // field name -> the shape with that field added
+    HashTable transitions;
+} ObjShape;
+
+typedef struct ObjClass {
+    Obj obj;
+    ObjString* name;
+    HashTable methods;
+    // the init method, or nil
+    Value initializer;
+    ObjShape* root_shape;
+    // the most fields an instance has had, which new ones get room for
+    int field_hint;
+} ObjClass;
+
+typedef struct {
+    Obj obj;
+    ObjShape* shape;
+    // shape->field_count of them are set
+    Value* fields;
+    int capacity;
+} ObjInstance;
+
+// a method along with the instance it was read from
+typedef struct {
+    Obj obj;
+    Value receiver;
+    Obj* method; // a function or a closure
+} ObjBoundMethod;
+
+#define IS_OBJ_CLASS(val) is_obj_type(val, OBJ_CLASS)
+#define OBJ_AS_CLASS(val) ((ObjClass*)VAL_AS_OBJ(val))
+#define IS_OBJ_INSTANCE(val) is_obj_type(val, OBJ_INSTANCE)
+#define OBJ_AS_INSTANCE(val) ((ObjInstance*)VAL_AS_OBJ(val))
+#define OBJ_AS_BOUND_METHOD(val) ((ObjBoundMethod*)VAL_AS_OBJ(val))
+
+ObjClass* new_class(VM* vm, ObjString* name);
+ObjShape* new_shape(VM* vm, ObjClass* klass, ObjShape* parent, ObjString* name);
+// an instance without fields, with room for the class's field_hint
+ObjInstance* new_instance(VM* vm, ObjClass* klass);
+// the receiver must be reachable
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, Obj* method);
 
 
 /* +======+ NATIVE FUNCTIONS +======+ */
 
-typedef Value (*NativeFn)(int argc, Value* args);
+// natives get the vm that called them
+typedef Value (*NativeFn)(VM* vm, int argc, Value* args);
 
 typedef struct {
     Obj obj;
@@ -70,4 +332,187 @@ typedef struct {
 #define OBJ_AS_NATIVEFN(val) ((ObjNativeFn*)VAL_AS_OBJ(val))
 
 // wraps a NativeFn in ObjNativeFn*
-ObjNativeFn* new_native(NativeFn fn);
+ObjNativeFn* new_native(VM* vm, NativeFn fn);
+
+
+/* +======+ CHANNELS +======+ */
+
+// a vm's handle to a process wide channel (see channel.h)
+typedef struct {
+    Obj obj;
+    struct Channel* channel;
+} ObjChannel;
+
+#define IS_OBJ_CHANNEL(val) is_obj_type(val, OBJ_CHANNEL)
+#define OBJ_AS_CHANNEL(val) ((ObjChannel*)VAL_AS_OBJ(val))
+
+ObjChannel* new_channel_handle(VM* vm, struct Channel* channel);
+
+
+/* +======+ FIBERS +======+ */
+
+typedef enum {
+    FIBER_NEW,       // not started yet
+    FIBER_SUSPENDED, // stopped at a yield
+    FIBER_RUNNING,   // running, or waiting for a fiber it resumed
+    FIBER_DONE       // returned, or failed with a runtime error
+} FiberState;
+
+// The value stack and call frames of a fiber, while they are not the ones the
+// vm is running on. Same meaning as the fields of the VM with the same names
+typedef struct {
+    struct CallFrame* frames;
+    unsigned int frame_count;
+    unsigned int frame_capacity;
+    Value* stack;
+    Value* stack_end;
+    Value* stack_top;
+    struct ObjUpvalue* open_upvalues;
+} FiberStacks;
+
+/*
+* A computation that can suspend itself (with yield) and be resumed later (by
+* calling it). Every fiber has its own stacks, so switching to it only swaps
+* the vm's stack and frame pointers. Fibers all run on the vm's thread, one
+* at a time.
+*/
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    // run by the event loop (see async()), rather than resumed by hand
+    bool is_task;
+    // the function or closure called with the first resume's value (if it
+    // takes a parameter)
+    Obj* entry;
+    // the fiber that resumed this one (NULL for the main script), which gets
+    // the control back when this one yields or returns
+    struct ObjFiber* resumer;
+    // allocated on the first resume, and freed as soon as the fiber is done
+    FiberStacks stacks;
+} ObjFiber;
+
+#define IS_OBJ_FIBER(val) is_obj_type(val, OBJ_FIBER)
+#define OBJ_AS_FIBER(val) ((ObjFiber*)VAL_AS_OBJ(val))
+
+ObjFiber* new_fiber(VM* vm, Obj* entry);
+
+
+/* +======+ TASKS +======+ */
+
+// a join handle of a task running on the scheduler's workers (see scheduler.h)
+typedef struct {
+    Obj obj;
+    struct Task* task;
+} ObjTask;
+
+#define IS_OBJ_TASK(val) is_obj_type(val, OBJ_TASK)
+#define OBJ_AS_TASK(val) ((ObjTask*)VAL_AS_OBJ(val))
+
+ObjTask* new_task_handle(VM* vm, struct Task* task);
+
+
+/* +======+ LISTS +======+ */
+
+// a growable array of values, indexed from 0
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+#define IS_OBJ_LIST(val) is_obj_type(val, OBJ_LIST)
+#define OBJ_AS_LIST(val) ((ObjList*)VAL_AS_OBJ(val))
+
+ObjList* new_list(VM* vm);
+// the value must be reachable, as growing the list may collect
+void list_append(VM* vm, ObjList* list, Value value);
+
+
+/* +======+ TYPED ARRAYS +======+ */
+
+typedef enum {
+    ELEMS_F64, // Float64Array
+    ELEMS_I64  // Int64Array
+} ElemKind;
+
+/*
+* A fixed length array of raw doubles or int64s, instead of boxed values, for
+* the numeric kernels (see kernels.h) to loop over
+*/
+typedef struct {
+    Obj obj;
+    uint8_t kind; // ElemKind
+    int length;
+    // the elements are stored inline, right after the header
+    _Alignas(16) unsigned char elems[];
+} ObjTypedArray;
+
+// the longest typed array, so that its size still fits in an int
+#define TYPED_ARRAY_MAX_LENGTH ((INT32_MAX - (int)sizeof(ObjTypedArray)) / 8)
+// size of the allocation holding a typed array of the given length
+#define TYPED_ARRAY_ALLOC_SIZE(length) (sizeof(ObjTypedArray) + (size_t)(length) * 8)
+
+#define IS_OBJ_TYPED_ARRAY(val) is_obj_type(val, OBJ_TYPED_ARRAY)
+#define OBJ_AS_TYPED_ARRAY(val) ((ObjTypedArray*)VAL_AS_OBJ(val))
+#define TYPED_F64(array) ((double*)(array)->elems)
+#define TYPED_I64(array) ((int64_t*)(array)->elems)
+
+// a new array, filled with zeros
+ObjTypedArray* new_typed_array(VM* vm, ElemKind kind, int length);
+
+static inline Value typed_array_load(ObjTypedArray* array, int i) {
+    if (array->kind == ELEMS_F64)
+        return MK_VAL_NUM(TYPED_F64(array)[i]);
+    return MK_VAL_INT(TYPED_I64(array)[i]);
+}
+
+// false if the value doesn't fit the array's elements (e.g 0.5 or nil in an
+// Int64Array)
+bool typed_array_store(ObjTypedArray* array, int i, Value value);
+
+// converts a number to an int64, if it's a whole number in range
+bool num_to_i64(double number, int64_t* result);
+
+// the value as an int64, if it's an integer or a number that num_to_i64() takes
+static inline bool value_to_i64(Value value, int64_t* result) {
+    if (IS_VAL_INT(value)) {
+        *result = VAL_AS_INT(value);
+        return true;
+    }
+    return IS_VAL_NUM(value) && num_to_i64(VAL_AS_NUM(value), result);
+}
+
+
+/* +======+ MAPS +======+ */
+
+typedef struct {
+    Value key;
+    Value value;
+    uint32_t hash;
+    // removed entries stay (with nil key and value) until the next rebuild
+    bool is_deleted;
+} MapEntry;
+
+/*
+* A hash map from numbers, strings, booleans and nil to any values, which
+* keeps its keys in the order they were added (see map.h).
+*
+* The entries themselves are kept dense, in that order, and what's probed is
+* a separate sparse index holding positions into them. Only the index has
+* empty slots, at 4 bytes each, instead of whole empty entries.
+*/
+typedef struct {
+    Obj obj;
+    MapEntry* entries;
+    int entry_count; // including the removed ones
+    int entry_capacity;
+    int live_count;
+    // positions of the entries, or -1 for an empty slot. Always a power of 2
+    // (or 0) long, and atmost 3/4 full
+    int32_t* index;
+    int index_capacity;
+} ObjMap;
+
+#define IS_OBJ_MAP(val) is_obj_type(val, OBJ_MAP)
+#define OBJ_AS_MAP(val) ((ObjMap*)VAL_AS_OBJ(val))
+
+ObjMap* new_map(VM* vm);
@@ -16,6 +16,13 @@ typedef enum {
     OP_GET_LOCAL,
     OP_SET_LOCAL,
 
+    // closures (see ObjClosure)
+    OP_CLOSURE, // the function's constant, then a CaptureKind and an index per capture
+    OP_GET_CAPTURE, // a captured value
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_CLOSE_UPVALUE, // closes the upvalue of the local on top, and pops it
+
     // instructions that put constants on the stack
     OP_NIL,
     OP_TRUE,
@@ -41,6 +48,9 @@ typedef enum {
     OP_BIT_NOT,
     OP_BIT_AND,
     OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT, // <<, the count must be from 0 to 63
+    OP_SHIFT_RIGHT, // >>, an arithmetic shift
 
     // jumps
     OP_JUMP_IF_FALSE,
@@ -48,7 +58,46 @@ typedef enum {
     OP_JUMP,
     OP_LOOP,
 
+    // `for (i in a..b)` loops. Both take the slot of the loop's hidden counter,
+    // which is followed by the limit and the loop variable, then a jump
+    OP_FOR_RANGE, // checks the bounds, and either starts the first iteration or jumps past the loop
+    OP_FOR_RANGE_LOOP, // counts up and jumps back to the body, unless the limit's reached
+
     // functions
-    OP_CALL
+    OP_CALL,
+    OP_TAIL_CALL, // a call in `return f(...)`, always followed by an OP_RETURN
+
+    // calls to small global functions, with the function's code copied into the
+    // caller (see cmpl_call). It runs in the caller's frame, on top of the callee
+    // and its arguments
+    OP_INLINE_GUARD, // the argument count, the function's constant and a jump to the inlined code, taken if it's the callee
+    OP_PEEK, // pushes the value that many below the top, the inlined code's parameters
+    OP_INLINE_RETURN, // the result on top replaces that many values below it (the callee, its arguments and its locals)
+    OP_YIELD,
+
+    // lists
+    OP_LIST_NEW,
+    OP_LIST_APPEND, // appends the value on top to the list below it
+    OP_INDEX_GET,
+    OP_INDEX_SET,
 
-} OpCode;
\ No newline at end of file
+    // maps
+    OP_MAP_NEW,
+    OP_MAP_INSERT, // inserts the key and value on top into the map below them
+
+    // classes. The property instructions take the name's constant, then the
+    // index of their cache in 2 bytes (OP_INVOKE has the argument count between)
+    OP_CLASS,
+    OP_METHOD, // adds the method on top to the class below it
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE // obj.name(args), without making a bound method
+
+} OpCode;
+
+// what OP_CLOSURE puts in each capture of the new closure
+typedef enum {
+    CAPTURE_LOCAL,     // a copy of a local of the enclosing function
+    CAPTURE_LOCAL_BOX, // the upvalue of a local of the enclosing function
+    CAPTURE_OUTER      // the same capture as the enclosing closure, either kind
+} CaptureKind;
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "volt/code/shared_strings.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRIPE_BITS 6
+#define STRIPE_COUNT (1 << STRIPE_BITS)
+#define STRIPE_MIN_CAPACITY 64
+#define STRIPE_MAX_LOAD 0.75
+
+typedef struct SlotArray SlotArray;
+
+// The slots of a stripe. A grown stripe gets a new array, and the old one is
+// kept around (retired), since lookups may still be probing it
+struct SlotArray {
+    uint32_t capacity;
+    SlotArray* retired;
+    _Atomic(ObjString*) slots[];
+};
+
+typedef struct {
+    // written only by inserts (under the lock), read by everyone
+    _Atomic(SlotArray*) array;
+    uint32_t count;
+    pthread_mutex_t lock;
+} Stripe;
+
+// each stripe on its own cache line, so inserting into one doesn't slow down
+// the lookups in the neighbouring ones
+typedef union {
+    Stripe stripe;
+    char padding[128];
+} PaddedStripe;
+
+static PaddedStripe stripes[STRIPE_COUNT];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void* checked(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void init_stripes() {
+    for (int i = 0; i < STRIPE_COUNT; i++) {
+        Stripe* stripe = &stripes[i].stripe;
+        atomic_init(&stripe->array, NULL);
+        stripe->count = 0;
+        pthread_mutex_init(&stripe->lock, NULL);
+    }
+}
+
+static inline Stripe* stripe_of(strhash_t hash) {
+    // the bucket index uses the low bits, so pick the stripe by the high ones
+    return &stripes[hash >> (32 - STRIPE_BITS)].stripe;
+}
+
+static ObjString* find_in(SlotArray* array, const char* chars, int length, strhash_t hash) {
+    if (array == NULL)
+        return NULL;
+
+    uint32_t mask = array->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        // Slots only ever go from NULL to a string. The acquire pairs with
+        // the release of the insert, so the string is fully written
+        ObjString* string = atomic_load_explicit(&array->slots[index], memory_order_acquire);
+        if (string == NULL)
+            return NULL;
+        if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0)
+            return string;
+    }
+}
+
+static SlotArray* new_array(uint32_t capacity) {
+    SlotArray* array = (SlotArray*)checked(malloc(sizeof(SlotArray) + sizeof(ObjString*) * capacity));
+    array->capacity = capacity;
+    array->retired = NULL;
+    for (uint32_t i = 0; i < capacity; i++)
+        atomic_init(&array->slots[i], NULL);
+    return array;
+}
+
+// the caller holds the stripe's lock, and string is known to be absent
+static void insert_into(SlotArray* array, ObjString* string) {
+    uint32_t mask = array->capacity - 1;
+    uint32_t index = string->hash & mask;
+    while (atomic_load_explicit(&array->slots[index], memory_order_relaxed) != NULL)
+        index = (index + 1) & mask;
+    atomic_store_explicit(&array->slots[index], string, memory_order_release);
+}
+
+static void grow_stripe(Stripe* stripe) {
+    SlotArray* old_array = atomic_load_explicit(&stripe->array, memory_order_relaxed);
+    uint32_t capacity = old_array == NULL ? STRIPE_MIN_CAPACITY : old_array->capacity * 2;
+    SlotArray* array = new_array(capacity);
+
+    if (old_array != NULL) {
+        for (uint32_t i = 0; i < old_array->capacity; i++) {
+            ObjString* string = atomic_load_explicit(&old_array->slots[i], memory_order_relaxed);
+            if (string != NULL)
+                insert_into(array, string);
+        }
+        array->retired = old_array;
+    }
+
+    atomic_store_explicit(&stripe->array, array, memory_order_release);
+}
+
+static ObjString* new_immortal_string(const char* chars, int length, strhash_t hash) {
+    ObjString* string = (ObjString*)checked(malloc(STRING_ALLOC_SIZE(length)));
+    string->obj.type = OBJ_STRING;
+    string->obj.flags = OBJ_FLAG_IMMORTAL;
+    string->obj.slot = 0;
+    string->length = length;
+    string->is_interned = true;
+    string->is_hashed = true;
+    string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString* shared_strings_find(const char* chars, int length, strhash_t hash) {
+    pthread_once(&stripes_once, init_stripes);
+    Stripe* stripe = stripe_of(hash);
+    return find_in(atomic_load_explicit(&stripe->array, memory_order_acquire), chars, length, hash);
+}
+
+ObjString* shared_strings_intern(const char* chars, int length, strhash_t hash) {
+    ObjString* string = shared_strings_find(chars, length, hash);
+    if (string != NULL)
+        return string;
+
+    Stripe* stripe = stripe_of(hash);
+    pthread_mutex_lock(&stripe->lock);
+
+    // someone else may have added it meanwhile
+    SlotArray* array = atomic_load_explicit(&stripe->array, memory_order_relaxed);
+    string = find_in(array, chars, length, hash);
+    if (string == NULL) {
+        if (array == NULL || stripe->count + 1 > array->capacity * STRIPE_MAX_LOAD) {
+            grow_stripe(stripe);
+            array = atomic_load_explicit(&stripe->array, memory_order_relaxed);
+        }
+
+        string = new_immortal_string(chars, length, hash);
+        insert_into(array, string);
+        stripe->count++;
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+    return string;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "volt/code/object.h"
+
+/*
+* A process wide table of interned strings, shared by all the vms that have
+* VM::use_shared_strings set. Every string has a single object for the whole
+* process, so interned strings can still be compared by pointer when they are
+* passed between vms (and identifiers of different scripts are stored once).
+*
+* The strings in the table are immortal. They live outside of every vm's heap
+* (see OBJ_FLAG_IMMORTAL), are never collected and are never freed.
+*
+* The table is split into stripes, picked by the top bits of the hash. Each
+* stripe is an open addressing set of its own. Lookups don't take any lock,
+* only inserts take the lock of their stripe, so threads only ever contend on
+* inserting strings with hashes from the same stripe.
+*/
+
+// Returns the shared string with the given contents, or NULL
+ObjString* shared_strings_find(const char* chars, int length, strhash_t hash);
+
+// Returns the shared string with the given contents, creating it if needed
+ObjString* shared_strings_intern(const char* chars, int length, strhash_t hash);
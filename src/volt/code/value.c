@@ -1,47 +1,53 @@
 #include "volt/code/value.h"
 
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include "volt/code/object.h"
 #include "volt/mem.h"
+#include "volt/vm.h"
 
 void valarray_init(ValueArray* valarr) {
     valarr->count = 0;
     valarr->capacity = 0;
     valarr->values = NULL;
 }
-void valarray_write(ValueArray* valarr, Value val) {
+void valarray_write(VM* vm, ValueArray* valarr, Value val) {
     if (valarr->capacity <= valarr->count) {
         int old_cap = valarr->capacity;
         valarr->capacity = GROW_CAPACITY(old_cap);
-        valarr->values = GROW_ARRAY(Value, valarr->values, old_cap, valarr->capacity);
+        valarr->values = GROW_ARRAY(vm, Value, valarr->values, old_cap, valarr->capacity);
     }
 
     valarr->values[valarr->count] = val;
     valarr->count++;
 }
-void valarray_free(ValueArray* valarr) {
-    FREE_ARRAY(Value, valarr->values, valarr->capacity);
+void valarray_free(VM* vm, ValueArray* valarr) {
+    FREE_ARRAY(vm, Value, valarr->values, valarr->capacity);
     valarray_init(valarr);
 }
 
-void print_val(Value val) {
+void print_val(VM* vm, Value val) {
     switch (val.type) {
         case VAL_BOOL:
-            printf("%s", VAL_AS_BOOL(val) ? "true" : "false");
+            fprintf(vm->out, "%s", VAL_AS_BOOL(val) ? "true" : "false");
             break;
 
         case VAL_NUMBER:
-            printf("%g", VAL_AS_NUM(val));
+            fprintf(vm->out, "%g", VAL_AS_NUM(val));
+            break;
+
+        case VAL_INT:
+            fprintf(vm->out, "%" PRId64, VAL_AS_INT(val));
             break;
 
         case VAL_NIL:
-            printf("nil");
+            fprintf(vm->out, "nil");
             break;
 
         case VAL_OBJ:
-            print_obj(val);
+            print_obj(vm, val);
             break;
 
         default:
@@ -50,26 +56,34 @@ void print_val(Value val) {
 }
 
 
-bool values_equal(Value v1, Value v2) {
-    if (v1.type != v2.type)
+bool values_equal(VM* vm, Value v1, Value v2) {
+    if (v1.type != v2.type) {
+        // exactly, without rounding the integer to a double
+        int64_t whole;
+        if (IS_VAL_INT(v1) && IS_VAL_NUM(v2))
+            return num_to_i64(VAL_AS_NUM(v2), &whole) && whole == VAL_AS_INT(v1);
+        if (IS_VAL_NUM(v1) && IS_VAL_INT(v2))
+            return num_to_i64(VAL_AS_NUM(v1), &whole) && whole == VAL_AS_INT(v2);
         return false;
+    }
     
     switch (v1.type) {
         case VAL_BOOL:      return VAL_AS_BOOL(v1) == VAL_AS_BOOL(v2);
         case VAL_NUMBER:    return VAL_AS_NUM(v1) == VAL_AS_NUM(v2);
+        case VAL_INT:       return VAL_AS_INT(v1) == VAL_AS_INT(v2);
         case VAL_NIL:       return true;
-        case VAL_OBJ: { // we only have strings yet.... 
-            // after string internalization is implemented,
-            // we can just compare if v1 and v2 point to the
-            // same ObjString i.e OBJ_AS_STRING(v1) == OBJ_AS_STRING(v2)
-
-            // ObjString* a = OBJ_AS_STRING(v1);
-            // ObjString* b = OBJ_AS_STRING(v2);
-            
-            // if (a->length != b->length) return false;
-            // return memcmp(a->chars, b->chars, a->length) == 0;
+        case VAL_OBJ: {
+            if (IS_OBJ_STRINGLIKE(v1) && IS_OBJ_STRINGLIKE(v2)) {
+                // ropes are compared by their flattened strings
+                if (stringlike_length(VAL_AS_OBJ(v1)) != stringlike_length(VAL_AS_OBJ(v2)))
+                    return false;
+                return strings_equal(
+                    stringlike_flatten(vm, VAL_AS_OBJ(v1)),
+                    stringlike_flatten(vm, VAL_AS_OBJ(v2))
+                );
+            }
 
-            return OBJ_AS_STRING(v1) == OBJ_AS_STRING(v2);
+            return VAL_AS_OBJ(v1) == VAL_AS_OBJ(v2);
         }
 
         default: return false; // Unreachable
@@ -1,12 +1,19 @@
 #pragma once
+#include <stdint.h>
+
 #include "volt/bool.h"
 
 // forward declarations
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
 
+// Whole number literals and the results of integer arithmetic are VAL_INT,
+// the rest are VAL_NUMBER (doubles). Anything mixing the two is done in
+// doubles, and 1 == 1.0
 typedef enum {
     VAL_NUMBER,
+    VAL_INT,
     VAL_NIL,
     VAL_BOOL,
     VAL_OBJ
@@ -17,6 +24,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj* obj;
     } as;
 } Value;
@@ -24,21 +32,33 @@ typedef struct {
 
 // checks if the given value object is of a specific type
 #define IS_VAL_NUM(val)   ((val).type == VAL_NUMBER) 
+#define IS_VAL_INT(val)   ((val).type == VAL_INT)
 #define IS_VAL_NIL(val)   ((val).type == VAL_NIL)
 #define IS_VAL_BOOL(val)  ((val).type == VAL_BOOL)
 #define IS_VAL_OBJ(val)   ((val).type == VAL_OBJ)
 
 // wraps a native C value in a Value object
 #define MK_VAL_NUM(c_num)     ((Value){VAL_NUMBER, {.number = c_num}})
+#define MK_VAL_INT(c_int)     ((Value){VAL_INT, {.integer = c_int}})
 #define MK_VAL_NIL            ((Value){VAL_NIL, {.number = 0}})
 #define MK_VAL_BOOL(c_bool)   ((Value){VAL_BOOL, {.boolean = c_bool}})
 #define MK_VAL_OBJ(c_obj_ptr) ((Value){VAL_OBJ, {.obj = (Obj*)c_obj_ptr}})
 
 // Converts a Value object to a native C value
 #define VAL_AS_NUM(val)   ((val).as.number)
+#define VAL_AS_INT(val)   ((val).as.integer)
 #define VAL_AS_BOOL(val)  ((val).as.boolean)
 #define VAL_AS_OBJ(val)   ((val).as.obj)
 
+// either kind of number, and its value as a double
+#define IS_VAL_NUMBERLIKE(val)  (IS_VAL_NUM(val) || IS_VAL_INT(val))
+#define NUMBERLIKE_AS_NUM(val)  numberlike_as_num(val)
+
+// a function, so the value is only evaluated once
+static inline double numberlike_as_num(Value val) {
+    return IS_VAL_INT(val) ? (double)VAL_AS_INT(val) : VAL_AS_NUM(val);
+}
+
 typedef struct {
     Value* values;
     int capacity; // total capacity
@@ -46,8 +66,10 @@ typedef struct {
 } ValueArray;
 
 void valarray_init(ValueArray* valarr);
-void valarray_write(ValueArray* valarr, Value val);
-void valarray_free(ValueArray* valarr);
+void valarray_write(VM* vm, ValueArray* valarr, Value val);
+void valarray_free(VM* vm, ValueArray* valarr);
 
-void print_val(Value val);
-bool values_equal(Value v1, Value v2);
\ No newline at end of file
+// Both of these may flatten ropes, which allocates. So the values
+// must be reachable (e.g on the vm stack) while calling them
+void print_val(VM* vm, Value val);
+bool values_equal(VM* vm, Value v1, Value v2);
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "volt/compiling/compiler.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,8 @@
 #include "volt/code/opcodes.h"
 #include "volt/code/value.h"
 #include "volt/bool.h"
+#include "volt/mem.h"
+#include "volt/vm.h"
 
 #include "volt/debugging/switches.h"
 #ifdef DEBUG_SHOW_COMPILED_CODE
@@ -16,11 +19,37 @@
 
 #define MAX_BYTE_COUNT (UINT8_MAX + 1)
 
+// limits on the functions that calls are inlined for (see cmpl_call)
+#define INLINE_MAX_FUNCTIONS 64
+#define INLINE_MAX_CODE 32
+#define INLINE_MAX_ARITY 8
+
+// a global function that calls to can be inlined
 typedef struct {
+    Token name;
+    ObjFunction* func;
+} Inlinable;
+
+// All the state of a single compilation, which lives on the C stack of
+// compile(). Every compiling function gets a pointer to it
+typedef struct Parser {
+    VM* vm;
+    Scanner scanner;
+
     Token previous;
     Token current;
     bool had_error;
     bool panic_mode;
+
+    // the function currently being compiled
+    struct Compiler* compiler;
+    // how many class bodies the code being compiled is in, for `this`
+    int class_depth;
+
+    // the global functions declared so far that can be inlined. They're
+    // constants of the script, so the collector finds them through it
+    Inlinable inlinable[INLINE_MAX_FUNCTIONS];
+    int inlinable_count;
 } Parser;
 
 typedef enum {
@@ -30,14 +59,18 @@ typedef enum {
     PREC_AND,         // and
     PREC_EQUALITY,    // == !=
     PREC_COMPARISON,  // < > <= >=
+    PREC_BIT_OR,      // |
+    PREC_BIT_XOR,     // ^
+    PREC_BIT_AND,     // &
+    PREC_SHIFT,       // << >>
     PREC_TERM,        // + -
     PREC_FACTOR,      // * /
-    PREC_UNARY,       // ! -
+    PREC_UNARY,       // ! - ~
     PREC_CALL,        // . ()
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+typedef void (*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct {
     ParseFn prefix_fn;
@@ -48,11 +81,23 @@ typedef struct {
 typedef struct {
     Token name;
     int depth;
+    // captured through an upvalue, which has to be closed when it goes out of scope
+    bool is_boxed;
 } Local;
 
+// a variable of an enclosing function, captured by the one being compiled
+typedef struct {
+    byte_t kind; // CaptureKind
+    byte_t index;
+    // through an upvalue, rather than a copy of the value
+    bool is_boxed;
+} Capture;
+
 
 typedef enum {
     FTYPE_FUNC,
+    FTYPE_METHOD,
+    FTYPE_INITIALIZER, // the init method, which returns the instance
     FTYPE_SCRIPT
 } FunctionType;
 
@@ -64,39 +109,70 @@ typedef struct Compiler {
     int locals_count;
     int scope_depth; // the current scope depth
 
+    Capture captures[MAX_BYTE_COUNT];
+
+    // Where the function's source starts, and the names assigned to anywhere
+    // in it. Those are only looked for once one of its locals is captured
+    const char* source;
+    Token* assigned;
+    int assigned_count;
+    int assigned_capacity;
+    bool found_assigned;
+
+    // where the last OP_CALL ends, to see if a return's value is a call
+    int call_end;
+    // where the last read of a global ends and its name, to see if a call's
+    // callee is a global
+    int global_end;
+    Token global_name;
+
     struct Compiler* parent;
 } Compiler;
 
-Parser parser;
-Compiler* cur_compiler = NULL;
-static inline Chunk* current_chunk() { return &cur_compiler->function->chunk; }
+static inline Chunk* current_chunk(Parser* parser) { return &parser->compiler->function->chunk; }
 
-static void init_compiler(Compiler* compiler, FunctionType func_type) {
-    compiler->parent = cur_compiler;
+static void init_compiler(Parser* parser, Compiler* compiler, FunctionType func_type) {
+    compiler->parent = parser->compiler;
     compiler->function = NULL; // free the old function for garbage collection
 
     compiler->locals_count = 0;
     compiler->scope_depth = 0;
     compiler->ftype = func_type;
-    compiler->function = new_function();
-
-    cur_compiler = compiler;
+    // a function's parameters start right after its name
+    compiler->source = func_type == FTYPE_SCRIPT ? parser->scanner.start : parser->current.start;
+    compiler->assigned = NULL;
+    compiler->assigned_count = 0;
+    compiler->assigned_capacity = 0;
+    compiler->found_assigned = false;
+    compiler->call_end = -1;
+    compiler->global_end = -1;
+    compiler->function = new_function(parser->vm);
+
+    parser->compiler = compiler;
 
     if (func_type != FTYPE_SCRIPT) {
-        cur_compiler->function->name = copy_string(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = copy_string(parser->vm, parser->previous.start, parser->previous.length);
     }
 
-    Local* local = &cur_compiler->locals[cur_compiler->locals_count++];
-    local->name.length = 0;
-    local->name.start = "";
+    // the first slot holds what was called, which is the instance for methods
+    Local* local = &parser->compiler->locals[parser->compiler->locals_count++];
+    if (func_type == FTYPE_METHOD || func_type == FTYPE_INITIALIZER) {
+        local->name.length = 4;
+        local->name.start = "this";
+    }
+    else {
+        local->name.length = 0;
+        local->name.start = "";
+    }
     local->depth = 0;
+    local->is_boxed = false;
 }
 
 /* Error handling */
 #if 1
-static void error_token(Token* token, const char* msg) {
-    if (parser.panic_mode) return;
-    parser.panic_mode = true;
+static void error_token(Parser* parser, Token* token, const char* msg) {
+    if (parser->panic_mode) return;
+    parser->panic_mode = true;
     fprintf(stderr, "[line %d] Syntax error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -108,82 +184,111 @@ static void error_token(Token* token, const char* msg) {
     }
 
     fprintf(stderr, ": %s\n", msg);
-    parser.had_error = true;
+    parser->had_error = true;
 }
 #endif
 
 /* Token navigation helpers */
 #if 1
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
     // jump through all consective error tokens at once in one advance call
     for (;;) {
-        parser.current = scan_token();
-        if (parser.current.type == TOKEN_ERROR) {
+        parser->current = scan_token(&parser->scanner);
+        if (parser->current.type == TOKEN_ERROR) {
             // report error
-            error_token(&parser.current, parser.current.start);
+            error_token(parser, &parser->current, parser->current.start);
         } else {
             break;
         }
     }
 }
 
-static inline bool check_token(TokenType type) { return parser.current.type == type; }
+static inline bool check_token(Parser* parser, TokenType type) { return parser->current.type == type; }
 
-static bool match(TokenType type)
+static bool match(Parser* parser, TokenType type)
 {
-    if (check_token(type)) {
-        advance();
+    if (check_token(parser, type)) {
+        advance(parser);
         return true;
     }
     return false;
 }
 
-static void consume(TokenType type, const char* msg)
+static void consume(Parser* parser, TokenType type, const char* msg)
 {
-    if (parser.current.type == type) {
-        advance();
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    error_token(&parser.current, msg);
+    error_token(parser, &parser->current, msg);
 }
 #endif
 
 /* Code generation helpers */
 #if 1
-static inline int store_constant(Value val) {
-    int constant_loc = chunk_addconst(current_chunk(), val);
+// Constants are the same if they're the same value of the same type. Numbers
+// are compared by their bits (so 0 and -0 stay apart) and objects by identity,
+// which is enough for the interned strings of names
+static bool same_constant(Value a, Value b) {
+    if (a.type != b.type)
+        return false;
+    switch (a.type) {
+        case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+        case VAL_INT:    return VAL_AS_INT(a) == VAL_AS_INT(b);
+        case VAL_BOOL:   return VAL_AS_BOOL(a) == VAL_AS_BOOL(b);
+        case VAL_NIL:    return true;
+        default:         return VAL_AS_OBJ(a) == VAL_AS_OBJ(b);
+    }
+}
+
+// reuses the chunk's constant if it already has the value
+static inline int store_constant(Parser* parser, Value val) {
+    ValueArray* constants = &current_chunk(parser)->constants;
+    for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+        if (same_constant(constants->values[i], val))
+            return i;
+    }
+    int constant_loc = chunk_addconst(parser->vm, current_chunk(parser), val);
     if (constant_loc > UINT8_MAX) {
-        error_token(&parser.previous, "Too many constants in one chunk");
+        error_token(parser, &parser->previous, "Too many constants in one chunk");
     }
     return constant_loc;
 }
 
-static inline void emit_byte(byte_t byte) {
-    chunk_write(current_chunk(), byte);
+static inline void emit_byte(Parser* parser, byte_t byte) {
+    chunk_write(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
-static inline void emit_bytes(byte_t byte1, byte_t byte2) {
-    emit_byte(byte1);
-    emit_byte(byte2);
+static inline void emit_bytes(Parser* parser, byte_t byte1, byte_t byte2) {
+    emit_byte(parser, byte1);
+    emit_byte(parser, byte2);
 }
 
-static inline void emit_const(Value val) {
-    byte_t constant_loc = (byte_t)store_constant(val);
-    emit_bytes(OP_LOADCONST, constant_loc);
+// the index of a new property cache, in 2 bytes
+static void emit_cache(Parser* parser) {
+    int cache = parser->compiler->function->cache_count++;
+    if (cache > UINT16_MAX)
+        error_token(parser, &parser->previous, "Too many property accesses in one function.");
+    emit_bytes(parser, (cache >> 8) & 0xff, cache & 0xff);
+}
+
+static inline void emit_const(Parser* parser, Value val) {
+    byte_t constant_loc = (byte_t)store_constant(parser, val);
+    emit_bytes(parser, OP_LOADCONST, constant_loc);
 }
 
 
 /* =========== JUMPS =========== */
 // return the index of the immediate next byte after the jump
-static int emit_jump(int jmp_opcode) {
-    emit_byte(jmp_opcode);
-    emit_bytes(0xff, 0xff);
-    return current_chunk()->count - 2;
+static int emit_jump(Parser* parser, int jmp_opcode) {
+    emit_byte(parser, jmp_opcode);
+    emit_bytes(parser, 0xff, 0xff);
+    return current_chunk(parser)->count - 2;
 }
 
-static void patch_jump(int jmp_opcode_offset) {
-    Chunk* cnk = current_chunk();
+static void patch_jump(Parser* parser, int jmp_opcode_offset) {
+    Chunk* cnk = current_chunk(parser);
 
     // calculate the offset
     // at this time count is the index of the taget (future) instruction
@@ -191,7 +296,7 @@ static void patch_jump(int jmp_opcode_offset) {
     
     if (offset > UINT16_MAX) 
     {
-        error_token(&parser.previous, "Too long jump.");
+        error_token(parser, &parser->previous, "Too long jump.");
         return;
     }
 
@@ -199,112 +304,138 @@ static void patch_jump(int jmp_opcode_offset) {
     cnk->code[jmp_opcode_offset + 1] = offset & 0xff;
 }
 
-static void emit_loop(int start_offset) {
-    unsigned int jmp_offset = current_chunk()->count - start_offset + 3;
+static void emit_loop(Parser* parser, int start_offset) {
+    unsigned int jmp_offset = current_chunk(parser)->count - start_offset + 3;
 
     if (jmp_offset > UINT16_MAX) {
-        error_token(&parser.previous, "Loop body too large.");
+        error_token(parser, &parser->previous, "Loop body too large.");
     }
 
-    emit_byte(OP_LOOP);
-    emit_byte((jmp_offset >> 8) & 0xff);
-    emit_byte(jmp_offset & 0xff);
+    emit_byte(parser, OP_LOOP);
+    emit_byte(parser, (jmp_offset >> 8) & 0xff);
+    emit_byte(parser, jmp_offset & 0xff);
 }
 #endif
 
 /* Pratt's Parser */
-static void parse_precedence(Precedence min_prec);
+static void parse_precedence(Parser* parser, Precedence min_prec);
 static ParseRule* get_rule(TokenType token_type);
 
 
 /* Actual compilation logic */
 #if 1 /* ==========EXPRESSIONS============= */
-static inline void cmpl_expression() {
-    parse_precedence(PREC_ASSIGNMENT);
+static inline void cmpl_expression(Parser* parser) {
+    parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void cmpl_number(bool can_assign) {
-    double val = strtod(parser.previous.start, NULL);
-    emit_const(MK_VAL_NUM(val));
+// Literals without a '.' are ints, unless they don't fit in 64 bits. Hex ones
+// are the bits of the int, so 0xffffffffffffffff is -1
+static void cmpl_number(Parser* parser, bool can_assign) {
+    const char* start = parser->previous.start;
+    int length = parser->previous.length;
+    if (length > 2 && (start[1] == 'x' || start[1] == 'X')) {
+        errno = 0;
+        unsigned long long bits = strtoull(start + 2, NULL, 16);
+        if (errno == ERANGE)
+            error_token(parser, &parser->previous, "Hex literal doesn't fit in 64 bits");
+        emit_const(parser, MK_VAL_INT((int64_t)bits));
+        return;
+    }
+    if (memchr(start, '.', length) == NULL) {
+        errno = 0;
+        long long val = strtoll(start, NULL, 10);
+        if (errno != ERANGE) {
+            emit_const(parser, MK_VAL_INT(val));
+            return;
+        }
+    }
+    emit_const(parser, MK_VAL_NUM(strtod(start, NULL)));
 }
-static void cmpl_unary(bool can_assign) {
-    TokenType operator_type = parser.previous.type;
+static void cmpl_unary(Parser* parser, bool can_assign) {
+    TokenType operator_type = parser->previous.type;
 
-    parse_precedence(PREC_UNARY);
+    parse_precedence(parser, PREC_UNARY);
 
     switch (operator_type) {
-        case TOKEN_MINUS:   emit_byte(OP_NEGATE);       break;
-        case TOKEN_BANG:    emit_byte(OP_LOGIC_NOT);    break;
+        case TOKEN_MINUS:   emit_byte(parser, OP_NEGATE);       break;
+        case TOKEN_BANG:    emit_byte(parser, OP_LOGIC_NOT);    break;
+        case TOKEN_TILDE:   emit_byte(parser, OP_BIT_NOT);      break;
         default: break; // Unreachable  
     }
 }
-static void cmpl_binary(bool can_assign) {
-    TokenType infix_oper_type = parser.previous.type;
+static void cmpl_binary(Parser* parser, bool can_assign) {
+    TokenType infix_oper_type = parser->previous.type;
 
     ParseRule* rule = get_rule(infix_oper_type);
-    parse_precedence((Precedence)(rule->precedence + 1));
+    parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (infix_oper_type) {
-        case TOKEN_PLUS:    emit_byte(OP_ADD);      break;
-        case TOKEN_MINUS:   emit_byte(OP_SUBTRACT); break;
-        case TOKEN_STAR:    emit_byte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:   emit_byte(OP_DIVIDE);   break;
+        case TOKEN_PLUS:    emit_byte(parser, OP_ADD);      break;
+        case TOKEN_MINUS:   emit_byte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:    emit_byte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:   emit_byte(parser, OP_DIVIDE);   break;
+
+        case TOKEN_AMPERSAND:       emit_byte(parser, OP_BIT_AND);      break;
+        case TOKEN_PIPE:            emit_byte(parser, OP_BIT_OR);       break;
+        case TOKEN_CARET:           emit_byte(parser, OP_BIT_XOR);      break;
+        case TOKEN_LESS_LESS:       emit_byte(parser, OP_SHIFT_LEFT);   break;
+        case TOKEN_GREATER_GREATER: emit_byte(parser, OP_SHIFT_RIGHT);  break;
         
-        case TOKEN_EQUAL_EQUAL: emit_byte(OP_LOGIC_EQUAL);      break;
-        case TOKEN_GREATER:     emit_byte(OP_LOGIC_GREATER);    break;
-        case TOKEN_LESS:        emit_byte(OP_LOGIC_LESS);       break;
+        case TOKEN_EQUAL_EQUAL: emit_byte(parser, OP_LOGIC_EQUAL);      break;
+        case TOKEN_GREATER:     emit_byte(parser, OP_LOGIC_GREATER);    break;
+        case TOKEN_LESS:        emit_byte(parser, OP_LOGIC_LESS);       break;
 
-        case TOKEN_BANG_EQUAL:      emit_bytes(OP_LOGIC_EQUAL, OP_LOGIC_NOT);   break;
-        case TOKEN_GREATER_EQUAL:   emit_bytes(OP_LOGIC_LESS, OP_LOGIC_NOT);    break;
-        case TOKEN_LESS_EQUAL:      emit_bytes(OP_LOGIC_GREATER, OP_LOGIC_NOT); break;
+        case TOKEN_BANG_EQUAL:      emit_bytes(parser, OP_LOGIC_EQUAL, OP_LOGIC_NOT);   break;
+        case TOKEN_GREATER_EQUAL:   emit_bytes(parser, OP_LOGIC_LESS, OP_LOGIC_NOT);    break;
+        case TOKEN_LESS_EQUAL:      emit_bytes(parser, OP_LOGIC_GREATER, OP_LOGIC_NOT); break;
         default: break; // Unreachable
     }
 }
-static void cmpl_grouping(bool can_assign) {
-    cmpl_expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected closing ')'");
+static void cmpl_grouping(Parser* parser, bool can_assign) {
+    cmpl_expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected closing ')'");
 }
-static void cmpl_literal(bool can_assign) {
-    switch(parser.previous.type) {
-        case TOKEN_TRUE:    emit_byte(OP_TRUE);     break;
-        case TOKEN_FALSE:   emit_byte(OP_FALSE);    break;
-        case TOKEN_NIL:     emit_byte(OP_NIL);      break;
+static void cmpl_literal(Parser* parser, bool can_assign) {
+    switch(parser->previous.type) {
+        case TOKEN_TRUE:    emit_byte(parser, OP_TRUE);     break;
+        case TOKEN_FALSE:   emit_byte(parser, OP_FALSE);    break;
+        case TOKEN_NIL:     emit_byte(parser, OP_NIL);      break;
         default: break; // Unreachable
     }
 }
-static void cmpl_string(bool can_assign) {
-    emit_const(MK_VAL_OBJ(copy_string( // skip the start and end quotes
-        parser.previous.start + 1, 
-        parser.previous.length - 2
+static void cmpl_string(Parser* parser, bool can_assign) {
+    emit_const(parser, MK_VAL_OBJ(copy_string(parser->vm, // skip the start and end quotes
+        parser->previous.start + 1, 
+        parser->previous.length - 2
     )));
 }
-static void cmpl_lgc_and(bool can_assign) {
-    int jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
-    patch_jump(jump);
+static void cmpl_lgc_and(Parser* parser, bool can_assign) {
+    int jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_AND);
+    patch_jump(parser, jump);
 }
-static void cmpl_lgc_or(bool can_assign) {
-    int jump = emit_jump(OP_JUMP_IF_TRUE);
-    emit_byte(OP_POP);
-    parse_precedence(PREC_OR);
-    patch_jump(jump);
+static void cmpl_lgc_or(Parser* parser, bool can_assign) {
+    int jump = emit_jump(parser, OP_JUMP_IF_TRUE);
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, jump);
 }
 
 // ========= VARIABLES AND IDENTIFIERS===============
 
-static inline int identifier_constant(Token* name) {
-    return store_constant(MK_VAL_OBJ(copy_string(name->start, name->length)));
+static inline int identifier_constant(Parser* parser, Token* name) {
+    return store_constant(parser, MK_VAL_OBJ(copy_string(parser->vm, name->start, name->length)));
 }
 
 // reads the next variable identifier, stores it in constants table, and returns it location 
-static inline byte_t parse_variable(const char* msg) {
-    consume(TOKEN_IDENTIFIER, msg);
-    if (cur_compiler->scope_depth > 0) return 0;
-    return (byte_t) identifier_constant(&parser.previous);
+static inline byte_t parse_variable(Parser* parser, const char* msg) {
+    consume(parser, TOKEN_IDENTIFIER, msg);
+    if (parser->compiler->scope_depth > 0) return 0;
+    return (byte_t) identifier_constant(parser, &parser->previous);
 }
 
-static inline void consume_semicolon() { consume(TOKEN_SEMICOLON, "Expected ';' after statment."); }
+static inline void consume_semicolon(Parser* parser) { consume(parser, TOKEN_SEMICOLON, "Expected ';' after statment."); }
 
 static inline bool identifiers_equal(Token* a, Token* b) {
     if (a->length != b->length) 
@@ -313,9 +444,9 @@ static inline bool identifiers_equal(Token* a, Token* b) {
 }
 
 
-static int resolve_local(Token* name) {
-    for (int i = cur_compiler->locals_count - 1; i >= 0; i--) {
-        Local* local = cur_compiler->locals + i;
+static int resolve_local(Compiler* compiler, Token* name) {
+    for (int i = compiler->locals_count - 1; i >= 0; i--) {
+        Local* local = compiler->locals + i;
         if (identifiers_equal(name, &local->name)) {
 
             if (local->depth == -1) {
@@ -329,319 +460,883 @@ static int resolve_local(Token* name) {
     return -1;
 }
 
-static void cmpl_variable(bool can_assign) {
-    // byte_t varloc = identifier_constant(&parser.previous); 
+// ========= CAPTURES===============
+
+// Variables that are never assigned to after being declared can be captured
+// by copying their value, which spares allocating an upvalue, and closing it
+// when the variable's frame returns. Telling which ones are is done by name,
+// any assignment to the name in the function (nested functions included)
+// counts, even if it's to another variable with the same name
+static bool is_assigned(Compiler* compiler, Token* name) {
+    for (int i = 0; i < compiler->assigned_count; i++) {
+        if (identifiers_equal(&compiler->assigned[i], name))
+            return true;
+    }
+    return false;
+}
+
+// scans the rest of the function's source ahead, for `name =` that isn't the
+// initializer of a `var name =`
+static void find_assigned(Parser* parser, Compiler* compiler) {
+    Scanner scanner;
+    scanner_init(&scanner, compiler->source);
+    Token before_previous = {TOKEN_EOF};
+    Token previous = {TOKEN_EOF};
+    int depth = 0;
+
+    for (;;) {
+        Token token = scan_token(&scanner);
+        if (token.type == TOKEN_EOF)
+            break;
+        if (token.type == TOKEN_LEFT_BRACE)
+            depth++;
+        // the end of the function's body
+        else if (token.type == TOKEN_RIGHT_BRACE && --depth == 0 && compiler->ftype != FTYPE_SCRIPT)
+            break;
+        else if (token.type == TOKEN_EQUAL && previous.type == TOKEN_IDENTIFIER &&
+                 before_previous.type != TOKEN_VAR && !is_assigned(compiler, &previous)) {
+            if (compiler->assigned_count == compiler->assigned_capacity) {
+                int capacity = GROW_CAPACITY(compiler->assigned_capacity);
+                compiler->assigned = GROW_ARRAY(parser->vm, Token, compiler->assigned, compiler->assigned_capacity, capacity);
+                compiler->assigned_capacity = capacity;
+            }
+            compiler->assigned[compiler->assigned_count++] = previous;
+        }
+        before_previous = previous;
+        previous = token;
+    }
+    compiler->found_assigned = true;
+}
+
+static int add_capture(Parser* parser, Compiler* compiler, CaptureKind kind, int index, bool is_boxed) {
+    int count = compiler->function->capture_count;
+    for (int i = 0; i < count; i++) {
+        if (compiler->captures[i].kind == kind && compiler->captures[i].index == index)
+            return i;
+    }
+
+    if (count == MAX_BYTE_COUNT) {
+        error_token(parser, &parser->previous, "Too many captured variables in a function.");
+        return 0;
+    }
+    compiler->captures[count].kind = (byte_t)kind;
+    compiler->captures[count].index = (byte_t)index;
+    compiler->captures[count].is_boxed = is_boxed;
+    return compiler->function->capture_count++;
+}
+
+// The capture of a variable of an enclosing function, or -1 if there's none
+// by that name (so it's a global)
+static int resolve_capture(Parser* parser, Compiler* compiler, Token* name) {
+    Compiler* parent = compiler->parent;
+    if (parent == NULL)
+        return -1;
+
+    int local = resolve_local(parent, name);
+    if (local >= 0) {
+        if (!parent->found_assigned)
+            find_assigned(parser, parent);
+        Local* captured = &parent->locals[local];
+        captured->is_boxed = is_assigned(parent, name);
+        return add_capture(parser, compiler, captured->is_boxed ? CAPTURE_LOCAL_BOX : CAPTURE_LOCAL,
+                           local, captured->is_boxed);
+    }
+
+    int outer = resolve_capture(parser, parent, name);
+    if (outer >= 0)
+        return add_capture(parser, compiler, CAPTURE_OUTER, outer, parent->captures[outer].is_boxed);
+    return -1;
+}
+
+static void named_variable(Parser* parser, Token* name, bool can_assign) {
     byte_t get_op, set_op;
-    // error_token(name, "Cannot access variable in its own initializer.");
-    Token* name = &parser.previous;
-    int varloc = resolve_local(name);
+    int varloc = resolve_local(parser->compiler, name);
     // defined but not yet initialized
     if (varloc == -2) {
-        error_token(name, "Cannot access variable in its own initializer.");
+        error_token(parser, name, "Cannot access variable in its own initializer.");
         return;
     }
+    // local variable
+    else if (varloc >= 0) {
+        get_op = OP_GET_LOCAL;
+        set_op = OP_SET_LOCAL;
+    }
+    // a variable of an enclosing function. Assigning to a copied one can't
+    // happen, the assignment would've made it boxed
+    else if ((varloc = resolve_capture(parser, parser->compiler, name)) >= 0) {
+        bool is_boxed = parser->compiler->captures[varloc].is_boxed;
+        get_op = is_boxed ? OP_GET_UPVALUE : OP_GET_CAPTURE;
+        set_op = OP_SET_UPVALUE;
+    }
     // global variable
-    else if (varloc == -1) {
+    else {
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
-        varloc = (int)identifier_constant(name);
+        varloc = (int)identifier_constant(parser, name);
+    }
+
+
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        cmpl_expression(parser);
+        emit_bytes(parser, set_op, (byte_t)varloc);
     }
-    // local variable
     else {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
+        emit_bytes(parser, get_op, (byte_t)varloc);
+        if (get_op == OP_GET_GLOBAL) {
+            parser->compiler->global_end = current_chunk(parser)->count;
+            parser->compiler->global_name = *name;
+        }
     }
+}
 
+static void cmpl_variable(Parser* parser, bool can_assign) {
+    Token name = parser->previous;
+    named_variable(parser, &name, can_assign);
+}
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        cmpl_expression();
-        emit_bytes(set_op, (byte_t)varloc);
+static void cmpl_this(Parser* parser, bool _ca) {
+    if (parser->class_depth == 0) {
+        error_token(parser, &parser->previous, "Cannot use 'this' outside of a class.");
+        return;
     }
-    else {
-        emit_bytes(get_op, (byte_t)varloc);
+    // it's the first local of methods, and captured like any other in functions
+    // nested in them
+    cmpl_variable(parser, false);
+}
+
+
+// ========= INLINING===============
+
+// Calls to global functions that are small enough are inlined. Their code
+// is copied into the caller, after a guard that checks the global still holds
+// the same function (otherwise it's called as usual). Only straight line code
+// that reads its parameters, constants and globals, upto the first return,
+// is inlined. So the function can't call itself, or anything else.
+//
+// The caller's compiler doesn't know how deep its stack is, so parameters are
+// read relative to the top (OP_PEEK), as the inlined code's depth is known
+
+// The change in the stack's depth from the instructions that can be inlined,
+// or INT8_MIN for the rest
+static int inlined_stack_effect(byte_t op) {
+    switch (op) {
+        case OP_LOADCONST:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return 1;
+        case OP_NEGATE:
+        case OP_LOGIC_NOT:
+        case OP_BIT_NOT:
+            return 0;
+        case OP_POP:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_LOGIC_EQUAL:
+        case OP_LOGIC_GREATER:
+        case OP_LOGIC_LESS:
+        case OP_INDEX_GET:
+            return -1;
+        default:
+            return INT8_MIN;
+    }
+}
+
+static inline int operand_count(byte_t op) {
+    return op == OP_LOADCONST || op == OP_GET_LOCAL || op == OP_GET_GLOBAL ? 1 : 0;
+}
+
+static bool is_inlinable(ObjFunction* func) {
+    if (func->capture_count > 0 || func->arity > INLINE_MAX_ARITY)
+        return false;
+    Chunk* chunk = &func->chunk;
+    for (int offset = 0; offset < chunk->count && offset < INLINE_MAX_CODE;) {
+        byte_t op = chunk->code[offset];
+        if (op == OP_RETURN)
+            return true;
+        if (inlined_stack_effect(op) == INT8_MIN)
+            return false;
+        offset += 1 + operand_count(op);
     }
+    return false;
 }
 
+static Inlinable* find_inlinable(Parser* parser, Token* name) {
+    for (int i = 0; i < parser->inlinable_count; i++) {
+        if (identifiers_equal(&parser->inlinable[i].name, name))
+            return &parser->inlinable[i];
+    }
+    return NULL;
+}
+
+// Called for each function declared in the script's top level. Functions
+// whose name is assigned to anywhere aren't inlined, the guard would fail
+static void add_inlinable(Parser* parser, Token* name, ObjFunction* func) {
+    Compiler* script = parser->compiler;
+    Inlinable* existing = find_inlinable(parser, name);
+    if (existing != NULL) {
+        // declared again, which is just like an assignment
+        *existing = parser->inlinable[--parser->inlinable_count];
+        return;
+    }
+
+    if (!is_inlinable(func) || parser->inlinable_count == INLINE_MAX_FUNCTIONS)
+        return;
+    if (!script->found_assigned)
+        find_assigned(parser, script);
+    if (is_assigned(script, name))
+        return;
+    parser->inlinable[parser->inlinable_count].name = *name;
+    parser->inlinable[parser->inlinable_count].func = func;
+    parser->inlinable_count++;
+}
+
+//      OP_INLINE_GUARD argc func -> inlined
+//      OP_CALL argc
+//      OP_JUMP -> end
+// inlined:
+//      the function's code
+//      OP_INLINE_RETURN count (the callee, its arguments and its locals)
+// end:
+static void emit_inlined_call(Parser* parser, ObjFunction* func, unsigned int arg_count) {
+    byte_t func_loc = (byte_t)store_constant(parser, MK_VAL_OBJ(func));
+    emit_bytes(parser, OP_INLINE_GUARD, (byte_t)arg_count);
+    emit_bytes(parser, func_loc, 0xff);
+    emit_byte(parser, 0xff);
+    int inlined_jump = current_chunk(parser)->count - 2;
+
+    emit_bytes(parser, OP_CALL, (byte_t)arg_count);
+    int end_jump = emit_jump(parser, OP_JUMP);
+    patch_jump(parser, inlined_jump);
+
+    // the callee and its arguments are the first values of the inlined code's
+    // stack. The code keeps the callee's lines, so errors in it point there
+    // (though the trace has no frame for the callee)
+    Chunk* chunk = &func->chunk;
+    Chunk* caller = current_chunk(parser);
+    int depth = func->arity + 1;
+    for (int offset = 0; chunk->code[offset] != OP_RETURN;) {
+        byte_t op = chunk->code[offset];
+        int line = chunk_get_line(chunk, offset);
+        switch (op) {
+            case OP_GET_LOCAL:
+                chunk_write(parser->vm, caller, OP_PEEK, line);
+                chunk_write(parser->vm, caller, (byte_t)(depth - 1 - chunk->code[offset + 1]), line);
+                break;
+            case OP_LOADCONST:
+            case OP_GET_GLOBAL: {
+                // the constant is the function's, the caller gets its own
+                Value constant = chunk->constants.values[chunk->code[offset + 1]];
+                byte_t constant_loc = (byte_t)store_constant(parser, constant);
+                chunk_write(parser->vm, caller, op, line);
+                chunk_write(parser->vm, caller, constant_loc, line);
+                break;
+            }
+            default:
+                chunk_write(parser->vm, caller, op, line);
+                break;
+        }
+        depth += inlined_stack_effect(op);
+        offset += 1 + operand_count(op);
+    }
+    // the body's locals are still on the stack too, everything below the result goes
+    emit_bytes(parser, OP_INLINE_RETURN, (byte_t)(depth - 1));
+    patch_jump(parser, end_jump);
+}
 
 // ========= FUNCTION CALLS===============
 
-static unsigned int call_arg_list() {
+static unsigned int call_arg_list(Parser* parser) {
     unsigned int arg_count = 0;
-    if (!check_token(TOKEN_RIGHT_PAREN)) {
+    if (!check_token(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            cmpl_expression();
+            cmpl_expression(parser);
             arg_count++;
 
             if (arg_count > 255) {
-                error_token(&parser.current, "Cannot have more than 255 arguments.");
+                error_token(parser, &parser->current, "Cannot have more than 255 arguments.");
             }
 
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after argument list.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after argument list.");
     return arg_count;
 }
 
-static void cmpl_call(bool _ca) {
-    unsigned int arg_count = call_arg_list();
-    emit_bytes(OP_CALL, (byte_t)arg_count);
+static void emit_inlined_call(Parser* parser, ObjFunction* func, unsigned int arg_count);
+
+static void cmpl_call(Parser* parser, bool _ca) {
+    Compiler* compiler = parser->compiler;
+    // the callee is a global, read right before the arguments
+    Inlinable* inlinable = NULL;
+    if (compiler->global_end == current_chunk(parser)->count)
+        inlinable = find_inlinable(parser, &compiler->global_name);
+
+    unsigned int arg_count = call_arg_list(parser);
+    // inlining may add all of the callee's constants, and the function itself
+    Chunk* chunk = current_chunk(parser);
+    if (inlinable != NULL && inlinable->func->arity == (int)arg_count &&
+        chunk->constants.count + inlinable->func->chunk.constants.count < UINT8_MAX) {
+        emit_inlined_call(parser, inlinable->func, arg_count);
+        return;
+    }
+    emit_bytes(parser, OP_CALL, (byte_t)arg_count);
+    parser->compiler->call_end = current_chunk(parser)->count;
+}
+
+
+// ========= PROPERTIES===============
+
+// obj.name, obj.name = value, or obj.name(args)
+static void cmpl_dot(Parser* parser, bool can_assign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expected property name after '.'.");
+    byte_t name = (byte_t)identifier_constant(parser, &parser->previous);
+
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        cmpl_expression(parser);
+        emit_bytes(parser, OP_SET_PROPERTY, name);
+    }
+    else if (match(parser, TOKEN_LEFT_PAREN)) {
+        unsigned int arg_count = call_arg_list(parser);
+        emit_bytes(parser, OP_INVOKE, name);
+        emit_byte(parser, (byte_t)arg_count);
+    }
+    else {
+        emit_bytes(parser, OP_GET_PROPERTY, name);
+    }
+    emit_cache(parser);
+}
+
+
+// ========= LISTS===============
+
+// [a, b, c], the elements are appended one at a time so there's no limit on them
+static void cmpl_list(Parser* parser, bool _ca) {
+    emit_byte(parser, OP_LIST_NEW);
+    if (!check_token(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            // allows a trailing comma
+            if (check_token(parser, TOKEN_RIGHT_BRACKET))
+                break;
+            cmpl_expression(parser);
+            emit_byte(parser, OP_LIST_APPEND);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expected ']' after list elements.");
+}
+
+// {key: value, ...}, which can only start an expression, a '{' starting a
+// statement is a block
+static void cmpl_map(Parser* parser, bool _ca) {
+    emit_byte(parser, OP_MAP_NEW);
+    if (!check_token(parser, TOKEN_RIGHT_BRACE)) {
+        do {
+            // allows a trailing comma
+            if (check_token(parser, TOKEN_RIGHT_BRACE))
+                break;
+            cmpl_expression(parser);
+            consume(parser, TOKEN_COLON, "Expected ':' after map key.");
+            cmpl_expression(parser);
+            emit_byte(parser, OP_MAP_INSERT);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after map entries.");
+}
+
+// list[index], or list[index] = value
+static void cmpl_index(Parser* parser, bool can_assign) {
+    cmpl_expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expected ']' after index.");
+
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        cmpl_expression(parser);
+        emit_byte(parser, OP_INDEX_SET);
+    }
+    else {
+        emit_byte(parser, OP_INDEX_GET);
+    }
 }
 
 #endif
 
 #if 1 /* ==========STATEMENTS============= */
 // forward declare because they refer each other
-static void cmpl_statement();
-static void cmpl_declaration();
-static void cmpl_block();
-static ObjFunction* end_compiler();
+static void cmpl_statement(Parser* parser);
+static void cmpl_declaration(Parser* parser);
+static void cmpl_block(Parser* parser);
+static ObjFunction* end_compiler(Parser* parser);
+static void syncronize(Parser* parser);
 
 
-static inline void begin_scope() { cur_compiler->scope_depth++; }
-static void end_scope() { 
-    int scope_local_count = 0;
-    while (cur_compiler->locals_count > 0 && cur_compiler->locals[cur_compiler->locals_count - 1].depth == cur_compiler->scope_depth) {
-        scope_local_count++;
-        cur_compiler->locals_count--;
-    }
-    cur_compiler->scope_depth--;
+static inline void begin_scope(Parser* parser) { parser->compiler->scope_depth++; }
 
-    switch(scope_local_count) {
+static void emit_pops(Parser* parser, int count) {
+    switch(count) {
         case 0: break;  // do nothing
-        case 1: emit_byte(OP_POP); break;
-        default: emit_bytes(OP_POPN, (byte_t)scope_local_count); break;
+        case 1: emit_byte(parser, OP_POP); break;
+        default: emit_bytes(parser, OP_POPN, (byte_t)count); break;
     }
 }
 
-static inline void mark_initialized() {
-    if (cur_compiler->scope_depth == 0) return;
-    cur_compiler->locals[cur_compiler->locals_count - 1].depth = cur_compiler->scope_depth;
+static void end_scope(Parser* parser) { 
+    int scope_local_count = 0;
+    while (parser->compiler->locals_count > 0 && parser->compiler->locals[parser->compiler->locals_count - 1].depth == parser->compiler->scope_depth) {
+        // boxed locals are closed one at a time, the rest popped together
+        if (parser->compiler->locals[parser->compiler->locals_count - 1].is_boxed) {
+            emit_pops(parser, scope_local_count);
+            scope_local_count = 0;
+            emit_byte(parser, OP_CLOSE_UPVALUE);
+        }
+        else {
+            scope_local_count++;
+        }
+        parser->compiler->locals_count--;
+    }
+    parser->compiler->scope_depth--;
+
+    emit_pops(parser, scope_local_count);
+}
+
+static inline void mark_initialized(Parser* parser) {
+    if (parser->compiler->scope_depth == 0) return;
+    parser->compiler->locals[parser->compiler->locals_count - 1].depth = parser->compiler->scope_depth;
 }
 
 // stores the local name in locals array
-static void declare_if_local(Token name) {
+static void declare_if_local(Parser* parser, Token name) {
 
-    if (cur_compiler->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
 
-    if (cur_compiler->locals_count > MAX_BYTE_COUNT) {
-        error_token(&name, "Too many locals in a scope.");
+    if (parser->compiler->locals_count > MAX_BYTE_COUNT) {
+        error_token(parser, &name, "Too many locals in a scope.");
         return;
     }
 
-    for (int i = cur_compiler->locals_count - 1; i >= 0; i--) {
-        Local* local = cur_compiler->locals + i;
-        if (cur_compiler->scope_depth != local->depth) {
+    for (int i = parser->compiler->locals_count - 1; i >= 0; i--) {
+        Local* local = parser->compiler->locals + i;
+        if (parser->compiler->scope_depth != local->depth) {
             break;
         }
         if (identifiers_equal(&name, &local->name)) {
-            error_token(&name, "Variable with the same name already exists in the given scope.");
+            error_token(parser, &name, "Variable with the same name already exists in the given scope.");
             return;
         }
     }
 
-    Local* local = &cur_compiler->locals[cur_compiler->locals_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->locals_count++];
     local->name = name;
     local->depth = -1; // keep it uninitialized
+    local->is_boxed = false;
 }
 
-static void cmpl_var_decl() {
+static void cmpl_var_decl(Parser* parser) {
 
     // if local on 'var' keyword:
     // get the name
     // add the name to the locals array
     // compile the expression
 
-    byte_t varloc = parse_variable("Expected variable name after 'var' keyword.");
+    byte_t varloc = parse_variable(parser, "Expected variable name after 'var' keyword.");
 
-    declare_if_local(parser.previous);
+    declare_if_local(parser, parser->previous);
 
-    if (match(TOKEN_EQUAL))
-        cmpl_expression();
+    if (match(parser, TOKEN_EQUAL))
+        cmpl_expression(parser);
     else
-        emit_byte(OP_NIL);
+        emit_byte(parser, OP_NIL);
 
-    consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
 
-    if (cur_compiler->scope_depth > 0) {
-        mark_initialized();
+    if (parser->compiler->scope_depth > 0) {
+        mark_initialized(parser);
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, varloc);
+    emit_bytes(parser, OP_DEFINE_GLOBAL, varloc);
 }
 
 
-static inline void emit_return() {
-    emit_byte(OP_NIL);
-    emit_byte(OP_RETURN);
+static inline void emit_return(Parser* parser) {
+    // initializers return the instance
+    if (parser->compiler->ftype == FTYPE_INITIALIZER)
+        emit_bytes(parser, OP_GET_LOCAL, 0);
+    else
+        emit_byte(parser, OP_NIL);
+    emit_byte(parser, OP_RETURN);
 }
 
-static void cmpl_fun_decl() {
-    byte_t funcname_loc = parse_variable("Expected function name after 'fun' keyword.");
-    declare_if_local(parser.previous);
-    mark_initialized();
-    
-    // START FUNCTION
+// compiles the parameters and the body of a function named by the previous
+// token, and loads it
+static ObjFunction* cmpl_function(Parser* parser, FunctionType ftype) {
     Compiler compiler;
-    init_compiler(&compiler, FTYPE_FUNC);
-    begin_scope();
+    init_compiler(parser, &compiler, ftype);
+    begin_scope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expected '(' before arguments list.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' before arguments list.");
 
-    if (!check_token(TOKEN_RIGHT_PAREN)) { // if there is atleast one argument
+    if (!check_token(parser, TOKEN_RIGHT_PAREN)) { // if there is atleast one argument
         do {
-            int arity = ++cur_compiler->function->arity;
+            int arity = ++parser->compiler->function->arity;
             if (arity > 255) {
-                error_token(&parser.current, "Cannot have more that 255 parameters.");
+                error_token(parser, &parser->current, "Cannot have more that 255 parameters.");
                 break;
             }
 
-            parse_variable("Expected parameter name.");
-            declare_if_local(parser.previous);
-            mark_initialized();
+            parse_variable(parser, "Expected parameter name.");
+            declare_if_local(parser, parser->previous);
+            mark_initialized(parser);
             
-        } while(match(TOKEN_COMMA));
+        } while(match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after arguments list.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after arguments list.");
 
-    consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
-    cmpl_block();
+    consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+    cmpl_block(parser);
 
-    ObjFunction* func = end_compiler();
-    emit_bytes(OP_LOADCONST, (byte_t)store_constant(MK_VAL_OBJ(func)));
-    // END FUNCTION
+    ObjFunction* func = end_compiler(parser);
+    byte_t func_loc = (byte_t)store_constant(parser, MK_VAL_OBJ(func));
+    // only functions that capture something need a closure
+    if (func->capture_count == 0) {
+        emit_bytes(parser, OP_LOADCONST, func_loc);
+    }
+    else {
+        emit_bytes(parser, OP_CLOSURE, func_loc);
+        for (int i = 0; i < func->capture_count; i++)
+            emit_bytes(parser, compiler.captures[i].kind, compiler.captures[i].index);
+    }
+    return func;
+}
 
-    if (cur_compiler->scope_depth == 0) {
-        emit_bytes(OP_DEFINE_GLOBAL, funcname_loc);
+static void cmpl_fun_decl(Parser* parser) {
+    byte_t funcname_loc = parse_variable(parser, "Expected function name after 'fun' keyword.");
+    Token name = parser->previous;
+    declare_if_local(parser, name);
+    mark_initialized(parser);
+
+    ObjFunction* func = cmpl_function(parser, FTYPE_FUNC);
+
+    if (parser->compiler->scope_depth == 0) {
+        emit_bytes(parser, OP_DEFINE_GLOBAL, funcname_loc);
+        add_inlinable(parser, &name, func);
     }
 }
 
-static void cmpl_return_stmt() {
+static void cmpl_method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expected method name.");
+    byte_t name_loc = (byte_t)identifier_constant(parser, &parser->previous);
+
+    FunctionType ftype = FTYPE_METHOD;
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0)
+        ftype = FTYPE_INITIALIZER;
+    cmpl_function(parser, ftype);
+
+    emit_bytes(parser, OP_METHOD, name_loc);
+}
+
+// class Name { method(params) { ... } ... }
+static void cmpl_class_decl(Parser* parser) {
+    byte_t name_loc = parse_variable(parser, "Expected class name after 'class' keyword.");
+    Token class_name = parser->previous;
+    if (parser->compiler->scope_depth > 0)
+        name_loc = (byte_t)identifier_constant(parser, &class_name);
+    declare_if_local(parser, class_name);
+
+    emit_bytes(parser, OP_CLASS, name_loc);
+    if (parser->compiler->scope_depth > 0)
+        mark_initialized(parser);
+    else
+        emit_bytes(parser, OP_DEFINE_GLOBAL, name_loc);
+
+    // the methods are added to the class on the stack
+    named_variable(parser, &class_name, false);
+    parser->class_depth++;
+    consume(parser, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+    while (!check_token(parser, TOKEN_RIGHT_BRACE) && !check_token(parser, TOKEN_EOF))
+        cmpl_method(parser);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+    parser->class_depth--;
+    emit_byte(parser, OP_POP);
+}
+
+static void cmpl_return_stmt(Parser* parser) {
 
-    if (cur_compiler->ftype == FTYPE_SCRIPT) {
-        error_token(&parser.previous, "Cannot return from top-level code.");
+    if (parser->compiler->ftype == FTYPE_SCRIPT) {
+        error_token(parser, &parser->previous, "Cannot return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emit_return();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emit_return(parser);
         return;
     }
-    cmpl_expression();
-    emit_byte(OP_RETURN);
-    consume(TOKEN_SEMICOLON, "Expected ';' after return statement");
+    if (parser->compiler->ftype == FTYPE_INITIALIZER)
+        error_token(parser, &parser->previous, "Cannot return a value from an initializer.");
+    cmpl_expression(parser);
+    // `return f(...)` replaces the frame with the callee's. Jumps to the end
+    // of the expression (from `and` / `or`) still land on the OP_RETURN
+    Chunk* chunk = current_chunk(parser);
+    if (parser->compiler->call_end == chunk->count)
+        chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+    emit_byte(parser, OP_RETURN);
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after return statement");
 }
 
 
-static inline void cmpl_print_stmt()
+static inline void cmpl_print_stmt(Parser* parser)
 {
-    cmpl_expression();
-    consume_semicolon();
-    emit_byte(OP_PRINT);
+    cmpl_expression(parser);
+    consume_semicolon(parser);
+    emit_byte(parser, OP_PRINT);
 }
 
-static void cmpl_while_stmt() {
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after while statement.");
-    int loop_start = current_chunk()->count;
-    cmpl_expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after while statement's condition.");
+static void cmpl_while_stmt(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after while statement.");
+    int loop_start = current_chunk(parser)->count;
+    cmpl_expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after while statement's condition.");
+
+    int exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+
+    cmpl_statement(parser);
+
+    emit_loop(parser, loop_start);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, OP_POP);
+}
+
+// the type of the token after the current one, without consuming anything
+static TokenType peek_next_type(Parser* parser) {
+    Scanner scanner = parser->scanner;
+    return scan_token(&scanner).type;
+}
+
+// a local that can't be named in the code, as it's not an identifier
+static void add_hidden_local(Parser* parser, const char* name) {
+    Token token = {TOKEN_IDENTIFIER, name, (int)strlen(name), parser->previous.line};
+    declare_if_local(parser, token);
+    mark_initialized(parser);
+}
+
+// for (i in a..b) body, where i counts from a upto b (not included). The
+// bounds are evaluated once, and kept in hidden locals with the counter. So
+// assigning to i in the body doesn't change how often it runs, and each
+// iteration is the body and a single OP_FOR_RANGE_LOOP. Closures capture the
+// i of the iteration they were made in
+static void cmpl_for_range(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expected the loop variable's name.");
+    Token name = parser->previous;
+    consume(parser, TOKEN_IN, "Expected 'in' after the loop variable.");
+
+    cmpl_expression(parser);
+    add_hidden_local(parser, "for counter");
+    consume(parser, TOKEN_DOT_DOT, "Expected '..' between the bounds of the range.");
+    cmpl_expression(parser);
+    add_hidden_local(parser, "for limit");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after the range.");
+
+    emit_byte(parser, OP_NIL);
+    declare_if_local(parser, name);
+    mark_initialized(parser);
+    byte_t slot = (byte_t)(parser->compiler->locals_count - 3);
+
+    emit_bytes(parser, OP_FOR_RANGE, slot);
+    emit_bytes(parser, 0xff, 0xff);
+    int exit_jump = current_chunk(parser)->count - 2;
+    int body_start = current_chunk(parser)->count;
+
+    cmpl_statement(parser);
+
+    unsigned int jmp_offset = current_chunk(parser)->count - body_start + 4;
+    if (jmp_offset > UINT16_MAX)
+        error_token(parser, &parser->previous, "Loop body too large.");
+    emit_bytes(parser, OP_FOR_RANGE_LOOP, slot);
+    emit_bytes(parser, (jmp_offset >> 8) & 0xff, jmp_offset & 0xff);
+    patch_jump(parser, exit_jump);
+}
+
+// for (initializer; condition; increment) body, any of the three can be left out
+static void cmpl_for_stmt(Parser* parser) {
+    begin_scope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after for.");
+    if (check_token(parser, TOKEN_IDENTIFIER) && peek_next_type(parser) == TOKEN_IN) {
+        cmpl_for_range(parser);
+        end_scope(parser);
+        return;
+    }
+
+    if (match(parser, TOKEN_VAR)) {
+        cmpl_var_decl(parser);
+    }
+    else if (!match(parser, TOKEN_SEMICOLON)) {
+        cmpl_expression(parser);
+        consume_semicolon(parser);
+        emit_byte(parser, OP_POP);
+    }
+
+    int loop_start = current_chunk(parser)->count;
+    int exit_jump = -1;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        cmpl_expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expected ';' after loop condition.");
+        exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+        emit_byte(parser, OP_POP);
+    }
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    // the increment comes after the body, which jumps back to it
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(parser, OP_JUMP);
+        int increment_start = current_chunk(parser)->count;
+        cmpl_expression(parser);
+        emit_byte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after for clauses.");
+        emit_loop(parser, loop_start);
+        loop_start = increment_start;
+        patch_jump(parser, body_jump);
+    }
 
-    cmpl_statement();
+    cmpl_statement(parser);
+    emit_loop(parser, loop_start);
 
-    emit_loop(loop_start);
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    if (exit_jump != -1) {
+        patch_jump(parser, exit_jump);
+        emit_byte(parser, OP_POP);
+    }
+    end_scope(parser);
 }
 
-static void cmpl_if_stmt() {
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after if statement.");
-    cmpl_expression();
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after if statement's condition.");
+static void cmpl_if_stmt(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after if statement.");
+    cmpl_expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after if statement's condition.");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    cmpl_statement();
+    int then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    cmpl_statement(parser);
 
-    int else_jump = emit_jump(OP_JUMP); 
-    patch_jump(then_jump);
+    int else_jump = emit_jump(parser, OP_JUMP); 
+    patch_jump(parser, then_jump);
 
-    emit_byte(OP_POP);
+    emit_byte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE))
-        cmpl_statement();
+    if (match(parser, TOKEN_ELSE))
+        cmpl_statement(parser);
 
-    patch_jump(else_jump);
+    patch_jump(parser, else_jump);
 }
 
-static void cmpl_block() {
-    while (!check_token(TOKEN_RIGHT_BRACE) && !check_token(TOKEN_EOF)) {
-        cmpl_declaration();
+static void cmpl_block(Parser* parser) {
+    while (!check_token(parser, TOKEN_RIGHT_BRACE) && !check_token(parser, TOKEN_EOF)) {
+        cmpl_declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
 }
 
-static void cmpl_statement()
+static void cmpl_statement(Parser* parser)
 {
     // print statement
-    if (match(TOKEN_PRINT)) {
-        cmpl_print_stmt();
+    if (match(parser, TOKEN_PRINT)) {
+        cmpl_print_stmt(parser);
     }
     // if statement
-    else if (match(TOKEN_IF)) {
-        cmpl_if_stmt();
+    else if (match(parser, TOKEN_IF)) {
+        cmpl_if_stmt(parser);
     }
     // while statement
-    else if (match(TOKEN_WHILE)) {
-        cmpl_while_stmt();
+    else if (match(parser, TOKEN_WHILE)) {
+        cmpl_while_stmt(parser);
+    }
+    // for statement, or a range loop
+    else if (match(parser, TOKEN_FOR)) {
+        cmpl_for_stmt(parser);
     }
     // block statement
-    else if (match(TOKEN_LEFT_BRACE)) {
-        begin_scope();
-        cmpl_block();
-        end_scope();
+    else if (match(parser, TOKEN_LEFT_BRACE)) {
+        begin_scope(parser);
+        cmpl_block(parser);
+        end_scope(parser);
+    }
+    else if (match(parser, TOKEN_FUN)) {
+        cmpl_fun_decl(parser);
     }
-    else if (match(TOKEN_FUN)) {
-        cmpl_fun_decl();
+    else if (match(parser, TOKEN_CLASS)) {
+        cmpl_class_decl(parser);
     }
-    else if (match(TOKEN_RETURN)) {
-        cmpl_return_stmt();
+    else if (match(parser, TOKEN_RETURN)) {
+        cmpl_return_stmt(parser);
     }
     else {
         // expression statement
-        cmpl_expression();
-        consume_semicolon();
-        emit_byte(OP_POP);
+        cmpl_expression(parser);
+        consume_semicolon(parser);
+        emit_byte(parser, OP_POP);
     }
 }
 
-static void cmpl_declaration()
+static void cmpl_declaration(Parser* parser)
 {
-    if (match(TOKEN_VAR)) {
-        cmpl_var_decl();
+    if (match(parser, TOKEN_VAR)) {
+        cmpl_var_decl(parser);
     }
     else {
-        cmpl_statement();
+        cmpl_statement(parser);
     }
+
+    // skips to the next statement, or the parser would be stuck on the error
+    if (parser->panic_mode)
+        syncronize(parser);
 }
 #endif
 /* Precedence and rule table */
+// yield, or yield <expression>. Evaluates to the value the fiber is resumed with
+static void cmpl_yield(Parser* parser, bool can_assign) {
+    if (parser->compiler->ftype == FTYPE_SCRIPT) {
+        error_token(parser, &parser->previous, "Cannot yield from the top level of a script.");
+        return;
+    }
+
+    switch (parser->current.type) {
+        case TOKEN_SEMICOLON:
+        case TOKEN_RIGHT_PAREN:
+        case TOKEN_COMMA:
+            emit_byte(parser, OP_NIL);
+            break;
+        default:
+            cmpl_expression(parser);
+            break;
+    }
+    emit_byte(parser, OP_YIELD);
+}
 // clang-format off
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN]      = {cmpl_grouping,   cmpl_call,      PREC_CALL},
     [TOKEN_RIGHT_PAREN]     = {NULL,            NULL,           PREC_NONE},
-    [TOKEN_LEFT_BRACE]      = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_LEFT_BRACE]      = {cmpl_map,        NULL,           PREC_NONE},
     [TOKEN_RIGHT_BRACE]     = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_LEFT_BRACKET]    = {cmpl_list,       cmpl_index,     PREC_CALL},
+    [TOKEN_RIGHT_BRACKET]   = {NULL,            NULL,           PREC_NONE},
     [TOKEN_COMMA]           = {NULL,            NULL,           PREC_NONE},
-    [TOKEN_DOT]             = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_DOT]             = {NULL,            cmpl_dot,       PREC_CALL},
     [TOKEN_MINUS]           = {cmpl_unary,      cmpl_binary,    PREC_TERM},
     [TOKEN_PLUS]            = {NULL,            cmpl_binary,    PREC_TERM},
     [TOKEN_SEMICOLON]       = {NULL,            NULL,           PREC_NONE},
     [TOKEN_SLASH]           = {NULL,            cmpl_binary,    PREC_FACTOR},
     [TOKEN_STAR]            = {NULL,            cmpl_binary,    PREC_FACTOR},
+    [TOKEN_COLON]           = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_AMPERSAND]       = {NULL,            cmpl_binary,    PREC_BIT_AND},
+    [TOKEN_PIPE]            = {NULL,            cmpl_binary,    PREC_BIT_OR},
+    [TOKEN_CARET]           = {NULL,            cmpl_binary,    PREC_BIT_XOR},
+    [TOKEN_TILDE]           = {cmpl_unary,      NULL,           PREC_NONE},
     [TOKEN_BANG]            = {cmpl_unary,      NULL,           PREC_NONE},
     [TOKEN_BANG_EQUAL]      = {NULL,            cmpl_binary,    PREC_EQUALITY},
     [TOKEN_EQUAL]           = {NULL,            NULL,           PREC_NONE},
@@ -650,6 +1345,9 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL]   = {NULL,            cmpl_binary,    PREC_COMPARISON},
     [TOKEN_LESS]            = {NULL,            cmpl_binary,    PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]      = {NULL,            cmpl_binary,    PREC_COMPARISON},
+    [TOKEN_DOT_DOT]         = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_LESS_LESS]       = {NULL,            cmpl_binary,    PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL,            cmpl_binary,    PREC_SHIFT},
     [TOKEN_IDENTIFIER]      = {cmpl_variable,   NULL,           PREC_NONE},
     [TOKEN_STRING]          = {cmpl_string,     NULL,           PREC_NONE},
     [TOKEN_NUMBER]          = {cmpl_number,     NULL,           PREC_NONE},
@@ -660,15 +1358,17 @@ ParseRule rules[] = {
     [TOKEN_FOR]             = {NULL,            NULL,           PREC_NONE},
     [TOKEN_FUN]             = {NULL,            NULL,           PREC_NONE},
     [TOKEN_IF]              = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_IN]              = {NULL,            NULL,           PREC_NONE},
     [TOKEN_NIL]             = {cmpl_literal,    NULL,           PREC_NONE},
     [TOKEN_OR]              = {NULL,            cmpl_lgc_or,    PREC_OR},
     [TOKEN_PRINT]           = {NULL,            NULL,           PREC_NONE},
     [TOKEN_RETURN]          = {NULL,            NULL,           PREC_NONE},
     [TOKEN_SUPER]           = {NULL,            NULL,           PREC_NONE},
-    [TOKEN_THIS]            = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_THIS]            = {cmpl_this,       NULL,           PREC_NONE},
     [TOKEN_TRUE]            = {cmpl_literal,    NULL,           PREC_NONE},
     [TOKEN_VAR]             = {NULL,            NULL,           PREC_NONE},
     [TOKEN_WHILE]           = {NULL,            NULL,           PREC_NONE},
+    [TOKEN_YIELD]           = {cmpl_yield,      NULL,           PREC_NONE},
     [TOKEN_ERROR]           = {NULL,            NULL,           PREC_NONE},
     [TOKEN_EOF]             = {NULL,            NULL,           PREC_NONE},
 };
@@ -681,39 +1381,39 @@ static ParseRule* get_rule(TokenType token_type) {
     return &rules[token_type];
 }
 
-static void parse_precedence(Precedence min_prec) {
-    ParseFn prefix_fn = get_rule(parser.current.type)->prefix_fn;
+static void parse_precedence(Parser* parser, Precedence min_prec) {
+    ParseFn prefix_fn = get_rule(parser->current.type)->prefix_fn;
     if (prefix_fn == NULL) {
-        error_token(&parser.previous, "Expected expression.");
+        error_token(parser, &parser->previous, "Expected expression.");
         return;
     }
 
-    advance();
+    advance(parser);
     bool can_assign = min_prec <= PREC_ASSIGNMENT;
-    prefix_fn(can_assign);
+    prefix_fn(parser, can_assign);
 
     for (;;) {
-        ParseRule* current_rule = get_rule(parser.current.type);
+        ParseRule* current_rule = get_rule(parser->current.type);
         if (current_rule->precedence < min_prec) {
             break;
         }
-        advance();
-        current_rule->infix_fn(can_assign);
+        advance(parser);
+        current_rule->infix_fn(parser, can_assign);
     }
 
-    if (can_assign && match(TOKEN_EQUAL))
-        error_token(&parser.previous, "Invalid assignment target.");
+    if (can_assign && match(parser, TOKEN_EQUAL))
+        error_token(parser, &parser->previous, "Invalid assignment target.");
 }
 
-static void syncronize()
+static void syncronize(Parser* parser)
 {
-    parser.panic_mode = false;
+    parser->panic_mode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
 
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -727,7 +1427,7 @@ static void syncronize()
             default: break; // Do nothing.
         }
 
-        advance();
+        advance(parser);
     }
 }
 #endif
@@ -736,39 +1436,63 @@ static void syncronize()
 #if 1
 
 
-static ObjFunction* end_compiler() {
-    emit_return();
+static ObjFunction* end_compiler(Parser* parser) {
+    emit_return(parser);
 
-    ObjFunction* func = cur_compiler->function;
+    // the compiler still holds the unpacked function, keeping it safe while packing
+    ObjFunction* func = pack_function(parser->vm, parser->compiler->function);
 
 #ifdef DEBUG_SHOW_COMPILED_CODE
-    if (!parser.had_error) {
-        disassemble_chunk(&func->chunk, func->name == NULL ? "<script>" : func->name->chars);
+    if (!parser->had_error) {
+        disassemble_chunk(parser->vm, &func->chunk, func->name == NULL ? "<script>" : func->name->chars);
     }
 #endif
 
-    cur_compiler = cur_compiler->parent;
+    FREE_ARRAY(parser->vm, Token, parser->compiler->assigned, parser->compiler->assigned_capacity);
+    parser->compiler = parser->compiler->parent;
 
     return func;
 }
 
-ObjFunction* compile(const char* source) {
-    scanner_init(source);
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser_state;
+    Parser* parser = &parser_state;
+    parser->vm = vm;
+    parser->compiler = NULL;
+    parser->class_depth = 0;
+    parser->inlinable_count = 0;
+    scanner_init(&parser->scanner, source);
+
+    // let the collector find the functions being compiled
+    Parser* enclosing = vm->parser;
+    vm->parser = parser;
 
     Compiler compiler;
-    init_compiler(&compiler, FTYPE_SCRIPT);
+    init_compiler(parser, &compiler, FTYPE_SCRIPT);
     
-    parser.had_error = false;
-    parser.panic_mode = false;
+    parser->had_error = false;
+    parser->panic_mode = false;
 
-    advance();
+    advance(parser);
 
-    while (!match(TOKEN_EOF)) {
-        cmpl_declaration();
+    while (!match(parser, TOKEN_EOF)) {
+        cmpl_declaration(parser);
     }
 
-    ObjFunction* func = end_compiler();
-    return parser.had_error ? NULL : func;
+    ObjFunction* func = end_compiler(parser);
+    vm->parser = enclosing;
+    return parser->had_error ? NULL : func;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+void mark_compiler_roots(VM* vm) {
+    if (vm->parser == NULL)
+        return;
+
+    Compiler* compiler = vm->parser->compiler;
+    while (compiler != NULL) {
+        mark_object(vm, (Obj*)compiler->function);
+        compiler = compiler->parent;
+    }
+}
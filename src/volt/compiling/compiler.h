@@ -4,4 +4,8 @@
 #include "volt/code/chunk.h"
 #include "volt/code/object.h"
 
-ObjFunction* compile(const char* source);
\ No newline at end of file
+// Compiles the source into a function owned by the given vm. Returns NULL on
+// a syntax error. All the compilation state is local to the call
+ObjFunction* compile(VM* vm, const char* source);
+// marks the functions currently being compiled by the vm
+void mark_compiler_roots(VM* vm);
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include "volt/code/opcodes.h"
 #include "volt/code/value.h"
+#include "volt/code/object.h"
 
 // pretty prints an instruction that takes no operand
 static int simple_instruction(const char* name, int offset)
@@ -32,39 +33,102 @@ static int jump_instruction(const char* name, int sign,
 
 
 
+// the slot of a range loop's counter, then a jump
+static int range_instruction(const char* name, int sign, int offset, Chunk* cnk)
+{
+    uint16_t jump = (uint16_t)(cnk->code[offset + 2] << 8 | cnk->code[offset + 3]);
+    printf("%-16s %4d -> %d\n", name, cnk->code[offset + 1], offset + 4 + sign * jump);
+    return offset + 4;
+}
+
 // pretty prints an instruction that takes index of a constant as an operand
-static int const_instruction(const char* name, int offset, Chunk* cnk)
+static int const_instruction(VM* vm, const char* name, int offset, Chunk* cnk)
 {
     byte_t constant_loc = cnk->code[offset + 1]; // the next byte
     printf("%-16s %4d '", name, constant_loc); // print the index
-    print_val(cnk->constants.values[constant_loc]); // print the actual value
+    print_val(vm, cnk->constants.values[constant_loc]); // print the actual value
     printf("'\n");
     return offset + 2;
 }
 
-void disassemble_chunk(Chunk* cnk, const char* chunk_name)
+// the name's constant, then the argument count for OP_INVOKE, then the cache
+static int property_instruction(VM* vm, const char* name, int offset, Chunk* cnk)
+{
+    byte_t name_loc = cnk->code[offset + 1];
+    int arg_count = -1;
+    if (cnk->code[offset] == OP_INVOKE)
+        arg_count = cnk->code[offset++ + 2];
+    uint16_t cache = (uint16_t)(cnk->code[offset + 2] << 8 | cnk->code[offset + 3]);
+
+    printf("%-16s %4d '", name, name_loc);
+    print_val(vm, cnk->constants.values[name_loc]);
+    if (arg_count >= 0)
+        printf("' (%d args) cache %d\n", arg_count, cache);
+    else
+        printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+// the argument count, the function's constant and the jump to the inlined code
+static int inline_guard_instruction(VM* vm, int offset, Chunk* cnk)
+{
+    byte_t arg_count = cnk->code[offset + 1];
+    byte_t func_loc = cnk->code[offset + 2];
+    uint16_t jump = (uint16_t)(cnk->code[offset + 3] << 8 | cnk->code[offset + 4]);
+    printf("%-16s %4d '", "OP_INLINE_GUARD", func_loc);
+    print_val(vm, cnk->constants.values[func_loc]);
+    printf("' (%d args) -> %d\n", arg_count, offset + 5 + jump);
+    return offset + 5;
+}
+
+// the function's constant, followed by a kind and an index for each capture
+static int closure_instruction(VM* vm, int offset, Chunk* cnk)
+{
+    offset = const_instruction(vm, "OP_CLOSURE", offset, cnk);
+    ObjFunction* func = OBJ_AS_FUNC(cnk->constants.values[cnk->code[offset - 1]]);
+    static const char* kinds[] = {"local", "boxed local", "outer"};
+    for (int i = 0; i < func->capture_count; i++) {
+        printf("%04d    |                     %s %d\n", offset, kinds[cnk->code[offset]], cnk->code[offset + 1]);
+        offset += 2;
+    }
+    return offset;
+}
+
+void disassemble_chunk(VM* vm, Chunk* cnk, const char* chunk_name)
 {
     printf("==== %s ====\n", chunk_name);
     for (int offset = 0; offset < cnk->count;) {
-        offset = disassemble_instruction(cnk, offset);
+        offset = disassemble_instruction(vm, cnk, offset);
     }
     printf("/====/ END CHUNK: %s /====/\n\n", chunk_name);
 }
 
-int disassemble_instruction(Chunk* cnk, int offset)
+int disassemble_instruction(VM* vm, Chunk* cnk, int offset)
 {
     printf("%04d ", offset);
+    int line = chunk_get_line(cnk, offset);
+    if (offset > 0 && line == chunk_get_line(cnk, offset - 1)) {
+        printf("   | ");
+    } else {
+        printf("%4d ", line);
+    }
     byte_t instruction = cnk->code[offset];
     switch (instruction) {
     // clang-format off
-        case OP_LOADCONST:      return const_instruction("OP_LOADCONST", offset, cnk);
-        case OP_DEFINE_GLOBAL:  return const_instruction("OP_DEFINE_GLOBAL", offset, cnk);
+        case OP_LOADCONST:      return const_instruction(vm, "OP_LOADCONST", offset, cnk);
+        case OP_DEFINE_GLOBAL:  return const_instruction(vm, "OP_DEFINE_GLOBAL", offset, cnk);
 
-        case OP_GET_GLOBAL:     return const_instruction("OP_GET_GLOBAL", offset, cnk);
-        case OP_SET_GLOBAL:     return const_instruction("OP_SET_GLOBAL", offset, cnk);
+        case OP_GET_GLOBAL:     return const_instruction(vm, "OP_GET_GLOBAL", offset, cnk);
+        case OP_SET_GLOBAL:     return const_instruction(vm, "OP_SET_GLOBAL", offset, cnk);
         case OP_GET_LOCAL:      return byte_instruction("OP_GET_LOCAL", offset, cnk);
         case OP_SET_LOCAL:      return byte_instruction("OP_SET_LOCAL", offset, cnk);
 
+        case OP_CLOSURE:        return closure_instruction(vm, offset, cnk);
+        case OP_GET_CAPTURE:    return byte_instruction("OP_GET_CAPTURE", offset, cnk);
+        case OP_GET_UPVALUE:    return byte_instruction("OP_GET_UPVALUE", offset, cnk);
+        case OP_SET_UPVALUE:    return byte_instruction("OP_SET_UPVALUE", offset, cnk);
+        case OP_CLOSE_UPVALUE:  return simple_instruction("OP_CLOSE_UPVALUE", offset);
+
         case OP_POPN:       return byte_instruction("OP_POPN", offset, cnk);
         case OP_RETURN:     return simple_instruction("OP_RETURN", offset);
         case OP_POP:        return simple_instruction("OP_POP", offset);
@@ -91,13 +155,36 @@ int disassemble_instruction(Chunk* cnk, int offset)
         case OP_BIT_NOT:    return simple_instruction("OP_BIT_NOT", offset);
         case OP_BIT_AND:    return simple_instruction("OP_BIT_AND", offset);
         case OP_BIT_OR:     return simple_instruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:    return simple_instruction("OP_BIT_XOR", offset);
+        case OP_SHIFT_LEFT: return simple_instruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT: return simple_instruction("OP_SHIFT_RIGHT", offset);
 
         case OP_JUMP_IF_FALSE:  return jump_instruction("OP_JUMP_IF_FALSE", 1, offset, cnk);
         case OP_JUMP_IF_TRUE:  return jump_instruction("OP_JUMP_IF_TRUE", 1, offset, cnk);
         case OP_JUMP:           return jump_instruction("OP_JUMP", 1, offset, cnk);
         case OP_LOOP:           return jump_instruction("OP_LOOP", -1, offset, cnk);
+        case OP_FOR_RANGE:      return range_instruction("OP_FOR_RANGE", 1, offset, cnk);
+        case OP_FOR_RANGE_LOOP: return range_instruction("OP_FOR_RANGE_LOOP", -1, offset, cnk);
 
         case OP_CALL:   return byte_instruction("OP_CALL", offset, cnk);
+        case OP_TAIL_CALL: return byte_instruction("OP_TAIL_CALL", offset, cnk);
+        case OP_INLINE_GUARD:   return inline_guard_instruction(vm, offset, cnk);
+        case OP_PEEK:           return byte_instruction("OP_PEEK", offset, cnk);
+        case OP_INLINE_RETURN:  return byte_instruction("OP_INLINE_RETURN", offset, cnk);
+        case OP_YIELD:  return simple_instruction("OP_YIELD", offset);
+
+        case OP_LIST_NEW:       return simple_instruction("OP_LIST_NEW", offset);
+        case OP_LIST_APPEND:    return simple_instruction("OP_LIST_APPEND", offset);
+        case OP_INDEX_GET:      return simple_instruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:      return simple_instruction("OP_INDEX_SET", offset);
+        case OP_MAP_NEW:        return simple_instruction("OP_MAP_NEW", offset);
+        case OP_MAP_INSERT:     return simple_instruction("OP_MAP_INSERT", offset);
+
+        case OP_CLASS:          return const_instruction(vm, "OP_CLASS", offset, cnk);
+        case OP_METHOD:         return const_instruction(vm, "OP_METHOD", offset, cnk);
+        case OP_GET_PROPERTY:   return property_instruction(vm, "OP_GET_PROPERTY", offset, cnk);
+        case OP_SET_PROPERTY:   return property_instruction(vm, "OP_SET_PROPERTY", offset, cnk);
+        case OP_INVOKE:         return property_instruction(vm, "OP_INVOKE", offset, cnk);
 
         default:
             printf("Unknown opcode %d\n", instruction);
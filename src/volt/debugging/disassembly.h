@@ -2,5 +2,6 @@
 
 #include "volt/code/chunk.h"
 
-void disassemble_chunk(Chunk* cnk, const char* chunk_name);
-int disassemble_instruction(Chunk* cnk, int offset);
\ No newline at end of file
+// the vm is only needed to print the constants
+void disassemble_chunk(VM* vm, Chunk* cnk, const char* chunk_name);
+int disassemble_instruction(VM* vm, Chunk* cnk, int offset);
\ No newline at end of file
@@ -2,4 +2,7 @@
 #pragma once
 
 // #define DEBUG_SHOW_COMPILED_CODE
-// #define DEBUG_TRACE_EXECUTION
\ No newline at end of file
+// #define DEBUG_TRACE_EXECUTION
+
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
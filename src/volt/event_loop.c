@@ -0,0 +1,569 @@
+#include "volt/event_loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "volt/vm.h"
+#include "volt/mem.h"
+
+// how many bytes a single read() returns atmost
+#define READ_CHUNK_SIZE (64 * 1024)
+#define EPOLL_BATCH_SIZE 64
+
+static void* checked_realloc(void* ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+double loop_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+void loop_init(EventLoop* loop) {
+    loop->epoll_fd = -1;
+
+    loop->ready = NULL;
+    loop->ready_head = 0;
+    loop->ready_count = 0;
+    loop->ready_capacity = 0;
+
+    loop->timers = NULL;
+    loop->timer_count = 0;
+    loop->timer_capacity = 0;
+
+    loop->io_slots = NULL;
+    loop->io_slot_capacity = 0;
+    loop->io_waiting = 0;
+
+    loop->task_count = 0;
+    loop->is_draining = false;
+}
+
+void loop_free(EventLoop* loop) {
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+    free(loop->ready);
+    free(loop->timers);
+    free(loop->io_slots);
+    loop_init(loop);
+}
+
+void loop_reset(EventLoop* loop) {
+    // closing the epoll instance drops all the registrations at once
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+    for (int fd = 0; fd < loop->io_slot_capacity; fd++)
+        memset(&loop->io_slots[fd], 0, sizeof(IoSlot));
+
+    loop->ready_head = 0;
+    loop->ready_count = 0;
+    loop->timer_count = 0;
+    loop->io_waiting = 0;
+    loop->task_count = 0;
+    loop->is_draining = false;
+}
+
+/* Ready queue */
+
+void loop_make_ready(EventLoop* loop, ObjFiber* fiber, bool has_value, Value value) {
+    if (loop->ready_count == loop->ready_capacity) {
+        int capacity = loop->ready_capacity < 8 ? 8 : loop->ready_capacity * 2;
+        ReadyWaiter* ready = (ReadyWaiter*)checked_realloc(NULL, sizeof(ReadyWaiter) * capacity);
+        // unwrap the ring while copying it over
+        for (int i = 0; i < loop->ready_count; i++)
+            ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+        free(loop->ready);
+        loop->ready = ready;
+        loop->ready_head = 0;
+        loop->ready_capacity = capacity;
+    }
+
+    ReadyWaiter* waiter = &loop->ready[(loop->ready_head + loop->ready_count) % loop->ready_capacity];
+    waiter->fiber = fiber;
+    waiter->has_value = has_value;
+    waiter->value = value;
+    loop->ready_count++;
+}
+
+/* Timers */
+
+static void swap_timers(Timer* a, Timer* b) {
+    Timer temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+void loop_add_timer(EventLoop* loop, ObjFiber* fiber, double deadline) {
+    if (loop->timer_count == loop->timer_capacity) {
+        loop->timer_capacity = loop->timer_capacity < 8 ? 8 : loop->timer_capacity * 2;
+        loop->timers = (Timer*)checked_realloc(loop->timers, sizeof(Timer) * loop->timer_capacity);
+    }
+
+    int i = loop->timer_count++;
+    loop->timers[i].deadline = deadline;
+    loop->timers[i].fiber = fiber;
+
+    // sift up
+    while (i > 0 && loop->timers[(i - 1) / 2].deadline > loop->timers[i].deadline) {
+        swap_timers(&loop->timers[(i - 1) / 2], &loop->timers[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void pop_timer(EventLoop* loop) {
+    loop->timers[0] = loop->timers[--loop->timer_count];
+
+    // sift down
+    int i = 0;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < loop->timer_count && loop->timers[left].deadline < loop->timers[smallest].deadline)
+            smallest = left;
+        if (right < loop->timer_count && loop->timers[right].deadline < loop->timers[smallest].deadline)
+            smallest = right;
+        if (smallest == i)
+            break;
+        swap_timers(&loop->timers[i], &loop->timers[smallest]);
+        i = smallest;
+    }
+}
+
+static void expire_timers(EventLoop* loop) {
+    double now = loop_now();
+    while (loop->timer_count > 0 && loop->timers[0].deadline <= now) {
+        loop_make_ready(loop, loop->timers[0].fiber, true, MK_VAL_NIL);
+        pop_timer(loop);
+    }
+}
+
+/* File descriptors */
+
+// points epoll at whatever the slot's waiters are waiting for
+static void update_registration(EventLoop* loop, int fd) {
+    IoSlot* slot = &loop->io_slots[fd];
+    struct epoll_event event;
+    event.events = (slot->has_reader ? EPOLLIN : 0) | (slot->has_writer ? EPOLLOUT : 0);
+    event.data.fd = fd;
+
+    if (event.events == 0) {
+        if (slot->is_registered)
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        slot->is_registered = false;
+        return;
+    }
+
+    int op = slot->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    slot->is_registered = epoll_ctl(loop->epoll_fd, op, fd, &event) == 0;
+}
+
+FdWait loop_wait_fd(EventLoop* loop, ObjFiber* fiber, int fd, bool for_writing) {
+    if (fd < 0)
+        return FD_WAIT_UNSUPPORTED;
+
+    if (loop->epoll_fd == -1) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd == -1)
+            return FD_WAIT_UNSUPPORTED;
+    }
+
+    if (fd >= loop->io_slot_capacity) {
+        int capacity = loop->io_slot_capacity < 16 ? 16 : loop->io_slot_capacity;
+        while (capacity <= fd)
+            capacity *= 2;
+        loop->io_slots = (IoSlot*)checked_realloc(loop->io_slots, sizeof(IoSlot) * capacity);
+        memset(loop->io_slots + loop->io_slot_capacity, 0, sizeof(IoSlot) * (capacity - loop->io_slot_capacity));
+        loop->io_slot_capacity = capacity;
+    }
+
+    IoSlot* slot = &loop->io_slots[fd];
+    if (for_writing ? slot->has_writer : slot->has_reader)
+        return FD_WAIT_BUSY;
+
+    if (for_writing) {
+        slot->writer = fiber;
+        slot->has_writer = true;
+    } else {
+        slot->reader = fiber;
+        slot->has_reader = true;
+    }
+
+    update_registration(loop, fd);
+    if (!slot->is_registered) {
+        // e.g a regular file, which epoll refuses since it's always ready
+        if (for_writing)
+            slot->has_writer = false;
+        else
+            slot->has_reader = false;
+        return FD_WAIT_UNSUPPORTED;
+    }
+
+    loop->io_waiting++;
+    return FD_WAIT_OK;
+}
+
+// wakes whoever waits for the given events of the descriptor
+static void wake_fd(EventLoop* loop, int fd, uint32_t events) {
+    IoSlot* slot = &loop->io_slots[fd];
+    // errors and hangups wake both sides, they find out when they retry
+    if (slot->has_reader && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        loop_make_ready(loop, slot->reader, false, MK_VAL_NIL);
+        slot->has_reader = false;
+        loop->io_waiting--;
+    }
+    if (slot->has_writer && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        loop_make_ready(loop, slot->writer, false, MK_VAL_NIL);
+        slot->has_writer = false;
+        loop->io_waiting--;
+    }
+    update_registration(loop, fd);
+}
+
+void loop_forget_fd(EventLoop* loop, int fd) {
+    if (fd >= 0 && fd < loop->io_slot_capacity)
+        wake_fd(loop, fd, EPOLLERR);
+}
+
+static void poll_fds(EventLoop* loop, int timeout_ms) {
+    struct epoll_event events[EPOLL_BATCH_SIZE];
+    int count = epoll_wait(loop->epoll_fd, events, EPOLL_BATCH_SIZE, timeout_ms);
+    // EINTR just means trying again in the caller
+    for (int i = 0; i < count; i++)
+        wake_fd(loop, events[i].data.fd, events[i].events);
+}
+
+bool loop_next(EventLoop* loop, ReadyWaiter* next) {
+    while (loop->ready_count == 0) {
+        if (loop->timer_count == 0 && loop->io_waiting == 0)
+            return false;
+
+        int timeout_ms = -1;
+        if (loop->timer_count > 0) {
+            double wait = loop->timers[0].deadline - loop_now();
+            // rounded up, waking up early would just mean waiting again
+            timeout_ms = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+        }
+
+        if (loop->io_waiting > 0) {
+            poll_fds(loop, timeout_ms);
+        } else if (timeout_ms > 0) {
+            struct timespec wait = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+            nanosleep(&wait, NULL);
+        }
+        expire_timers(loop);
+    }
+
+    *next = loop->ready[loop->ready_head];
+    loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+    loop->ready_count--;
+    return true;
+}
+
+void loop_mark(VM* vm, EventLoop* loop) {
+    for (int i = 0; i < loop->ready_count; i++) {
+        ReadyWaiter* waiter = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+        mark_object(vm, (Obj*)waiter->fiber);
+        if (waiter->has_value)
+            mark_value(vm, waiter->value);
+    }
+    for (int i = 0; i < loop->timer_count; i++)
+        mark_object(vm, (Obj*)loop->timers[i].fiber);
+    for (int fd = 0; fd < loop->io_slot_capacity; fd++) {
+        IoSlot* slot = &loop->io_slots[fd];
+        if (slot->has_reader)
+            mark_object(vm, (Obj*)slot->reader);
+        if (slot->has_writer)
+            mark_object(vm, (Obj*)slot->writer);
+    }
+}
+
+
+/* +======+ NATIVES +======+ */
+
+// The natives below never block the vm. Whenever they would, they park the
+// running waiter and are called again once the descriptor is ready. File
+// descriptors are plain numbers. System errors make them return nil.
+
+static bool get_fd(Value val, int* fd) {
+    int64_t number;
+    if (!value_to_i64(val, &number) || number < 0 || number > INT_MAX)
+        return false;
+    *fd = (int)number;
+    return true;
+}
+
+static bool is_ready(int fd, short events) {
+    struct pollfd poll_fd = {fd, events, 0};
+    // an invalid descriptor counts as ready, the actual call reports the error
+    return poll(&poll_fd, 1, 0) != 0;
+}
+
+// parks the running waiter until fd is ready. Returns false if it can't be waited for
+static Value wait_for(VM* vm, int fd, bool for_writing, bool* can_wait) {
+    switch (loop_wait_fd(&vm->loop, vm->fiber, fd, for_writing)) {
+        case FD_WAIT_OK:
+            *can_wait = true;
+            return native_park(vm, PARK_RETRY);
+        case FD_WAIT_BUSY:
+            *can_wait = true;
+            return native_error(vm, "Another fiber is already waiting for this file descriptor");
+        default:
+            *can_wait = false;
+            return MK_VAL_NIL;
+    }
+}
+
+// async(fn), runs fn in a new task. Returns the task's fiber
+static Value async_native(VM* vm, int argc, Value* args) {
+    ObjFunction* func = argc == 1 ? value_to_function(args[0]) : NULL;
+    if (func == NULL || func->arity != 0)
+        return native_error(vm, "async() takes a function without parameters");
+
+    ObjFiber* task = new_fiber(vm, VAL_AS_OBJ(args[0]));
+    task->is_task = true;
+    vm->loop.task_count++;
+    loop_make_ready(&vm->loop, task, false, MK_VAL_NIL);
+    return MK_VAL_OBJ(task);
+}
+
+// sleep(seconds), lets everything else run meanwhile
+static Value sleep_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_VAL_NUMBERLIKE(args[0]) || NUMBERLIKE_AS_NUM(args[0]) < 0)
+        return native_error(vm, "sleep() takes a non negative number of seconds");
+
+    loop_add_timer(&vm->loop, vm->fiber, loop_now() + NUMBERLIKE_AS_NUM(args[0]));
+    return native_park(vm, PARK_RESULT);
+}
+
+// read(fd), returns the bytes available (upto 64K), "" at the end of the input
+static Value read_native(VM* vm, int argc, Value* args) {
+    int fd;
+    if (argc != 1 || !get_fd(args[0], &fd))
+        return native_error(vm, "read() takes a file descriptor");
+
+    bool can_wait;
+    if (!is_ready(fd, POLLIN)) {
+        Value result = wait_for(vm, fd, false, &can_wait);
+        if (can_wait)
+            return result;
+    }
+
+    char buffer[READ_CHUNK_SIZE];
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // someone else got the data first
+        Value result = wait_for(vm, fd, false, &can_wait);
+        if (can_wait)
+            return result;
+    }
+    if (count < 0)
+        return MK_VAL_NIL;
+
+    ObjString* string = allocate_string(vm, (int)count);
+    memcpy(string->chars, buffer, count);
+    return MK_VAL_OBJ(string);
+}
+
+// write(fd, string), returns how many bytes were written, which may be less
+// than the whole string
+static Value write_native(VM* vm, int argc, Value* args) {
+    int fd;
+    if (argc != 2 || !get_fd(args[0], &fd) || !IS_OBJ_STRINGLIKE(args[1]))
+        return native_error(vm, "write() takes a file descriptor and a string");
+
+    bool can_wait;
+    if (!is_ready(fd, POLLOUT)) {
+        Value result = wait_for(vm, fd, true, &can_wait);
+        if (can_wait)
+            return result;
+    }
+
+    ObjString* string = stringlike_flatten(vm, VAL_AS_OBJ(args[1]));
+    size_t length = (size_t)string->length;
+    // a blocking pipe that's ready still only takes PIPE_BUF bytes without blocking
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && !(flags & O_NONBLOCK) && length > PIPE_BUF)
+        length = PIPE_BUF;
+
+    ssize_t count = write(fd, string->chars, length);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        Value result = wait_for(vm, fd, true, &can_wait);
+        if (can_wait)
+            return result;
+    }
+    if (count < 0)
+        return MK_VAL_NIL;
+    return MK_VAL_INT(count);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static Value finish_socket(int fd, int result) {
+    if (result != 0 || set_nonblocking(fd) != 0) {
+        close(fd);
+        return MK_VAL_NIL;
+    }
+    return MK_VAL_INT(fd);
+}
+
+static bool get_port(Value val, struct sockaddr_in* address) {
+    int64_t port;
+    if (!value_to_i64(val, &port) || port < 0 || port > 65535)
+        return false;
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t)port);
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return true;
+}
+
+static bool get_path(Value val, struct sockaddr_un* address) {
+    if (!IS_OBJ_STRING(val) || OBJ_AS_STRING(val)->length >= (int)sizeof(address->sun_path))
+        return false;
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, AS_CSTRING(val), OBJ_AS_STRING(val)->length);
+    return true;
+}
+
+static Value listen_on(int domain, struct sockaddr* address, socklen_t size) {
+    int fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return MK_VAL_NIL;
+    int yes = 1;
+    if (domain == AF_INET)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    return finish_socket(fd, bind(fd, address, size) == 0 ? listen(fd, SOMAXCONN) : -1);
+}
+
+// Connecting to loopback or a unix socket completes (or fails) right away, so
+// this doesn't need to wait
+static Value connect_to(int domain, struct sockaddr* address, socklen_t size) {
+    int fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return MK_VAL_NIL;
+    return finish_socket(fd, connect(fd, address, size));
+}
+
+// listen(port), a tcp socket listening on the loopback address
+static Value listen_native(VM* vm, int argc, Value* args) {
+    struct sockaddr_in address;
+    if (argc != 1 || !get_port(args[0], &address))
+        return native_error(vm, "listen() takes a port number");
+    return listen_on(AF_INET, (struct sockaddr*)&address, sizeof(address));
+}
+
+static Value listen_unix_native(VM* vm, int argc, Value* args) {
+    struct sockaddr_un address;
+    if (argc != 1 || !get_path(args[0], &address))
+        return native_error(vm, "listen_unix() takes a socket path");
+    return listen_on(AF_UNIX, (struct sockaddr*)&address, sizeof(address));
+}
+
+// connect(port), to a tcp socket on the loopback address
+static Value connect_native(VM* vm, int argc, Value* args) {
+    struct sockaddr_in address;
+    if (argc != 1 || !get_port(args[0], &address))
+        return native_error(vm, "connect() takes a port number");
+    return connect_to(AF_INET, (struct sockaddr*)&address, sizeof(address));
+}
+
+static Value connect_unix_native(VM* vm, int argc, Value* args) {
+    struct sockaddr_un address;
+    if (argc != 1 || !get_path(args[0], &address))
+        return native_error(vm, "connect_unix() takes a socket path");
+    return connect_to(AF_UNIX, (struct sockaddr*)&address, sizeof(address));
+}
+
+// accept(fd), waits for the next connection on a listening socket
+static Value accept_native(VM* vm, int argc, Value* args) {
+    int fd;
+    if (argc != 1 || !get_fd(args[0], &fd))
+        return native_error(vm, "accept() takes a file descriptor");
+
+    int client = accept(fd, NULL, NULL);
+    if (client == -1) {
+        bool can_wait;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            Value result = wait_for(vm, fd, false, &can_wait);
+            if (can_wait)
+                return result;
+        }
+        return MK_VAL_NIL;
+    }
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    return finish_socket(client, 0);
+}
+
+// pipe(), a list of the read end and the write end, or nil
+static Value pipe_native(VM* vm, int argc, Value* args) {
+    (void)args;
+    if (argc != 0)
+        return native_error(vm, "pipe() takes no arguments");
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        return MK_VAL_NIL;
+    for (int i = 0; i < 2; i++) {
+        if (set_nonblocking(fds[i]) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return MK_VAL_NIL;
+        }
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    ObjList* list = new_list(vm);
+    // on the stack while it grows
+    vm_pushstack(vm, MK_VAL_OBJ(list));
+    list_append(vm, list, MK_VAL_INT(fds[0]));
+    list_append(vm, list, MK_VAL_INT(fds[1]));
+    return vm_popstack(vm);
+}
+
+static Value close_native(VM* vm, int argc, Value* args) {
+    int fd;
+    if (argc != 1 || !get_fd(args[0], &fd))
+        return native_error(vm, "close() takes a file descriptor");
+
+    // anyone still waiting for it finds out it's gone when they retry
+    loop_forget_fd(&vm->loop, fd);
+    return MK_VAL_BOOL(close(fd) == 0);
+}
+
+void define_loop_natives(VM* vm) {
+    vm_define_native(vm, "async", async_native);
+    vm_define_native(vm, "sleep", sleep_native);
+    vm_define_native(vm, "read", read_native);
+    vm_define_native(vm, "write", write_native);
+    vm_define_native(vm, "listen", listen_native);
+    vm_define_native(vm, "listen_unix", listen_unix_native);
+    vm_define_native(vm, "connect", connect_native);
+    vm_define_native(vm, "connect_unix", connect_unix_native);
+    vm_define_native(vm, "accept", accept_native);
+    vm_define_native(vm, "close", close_native);
+    vm_define_native(vm, "pipe", pipe_native);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+#include "volt/code/object.h"
+
+/*
+* The event loop of a vm, which lets fibers wait for I/O and timers without
+* blocking the whole vm.
+*
+* Anything that can run is called a waiter here: a fiber, or the main script
+* (a NULL fiber). A native that would block (e.g read() on an empty pipe)
+* instead parks the running waiter in the loop and the vm switches over to the
+* next ready one. When all of them are waiting, the vm sleeps in epoll_wait()
+* until some file descriptor is ready or the earliest timer expires.
+*
+* Tasks are fibers that are run by the loop (see async()) instead of being
+* resumed by hand. The main script doesn't finish until all the tasks have.
+*/
+
+typedef struct {
+    ObjFiber* fiber;
+    // pushed on the fiber's stack when it continues, as the result of
+    // whatever it was waiting in
+    bool has_value;
+    Value value;
+} ReadyWaiter;
+
+typedef struct {
+    double deadline;
+    ObjFiber* fiber;
+} Timer;
+
+// the waiters of one file descriptor, atmost one for each direction
+typedef struct {
+    ObjFiber* reader;
+    ObjFiber* writer;
+    bool has_reader;
+    bool has_writer;
+    bool is_registered;
+} IoSlot;
+
+typedef struct {
+    // created on the first wait for a file descriptor
+    int epoll_fd;
+
+    // ring of the waiters that can continue
+    ReadyWaiter* ready;
+    int ready_head;
+    int ready_count;
+    int ready_capacity;
+
+    // binary min heap, by deadline
+    Timer* timers;
+    int timer_count;
+    int timer_capacity;
+
+    // indexed by file descriptor
+    IoSlot* io_slots;
+    int io_slot_capacity;
+    int io_waiting;
+
+    // tasks that haven't finished yet
+    int task_count;
+    // the main script has returned, and waits for the tasks
+    bool is_draining;
+} EventLoop;
+
+void loop_init(EventLoop* loop);
+void loop_free(EventLoop* loop);
+// forgets all the waiters, e.g after a runtime error
+void loop_reset(EventLoop* loop);
+
+void loop_make_ready(EventLoop* loop, ObjFiber* fiber, bool has_value, Value value);
+
+// the fiber continues with nil once the deadline (see loop_now()) has passed
+void loop_add_timer(EventLoop* loop, ObjFiber* fiber, double deadline);
+
+typedef enum {
+    FD_WAIT_OK,
+    // e.g a regular file, which is always ready anyway
+    FD_WAIT_UNSUPPORTED,
+    // someone else waits for the same descriptor, in the same direction
+    FD_WAIT_BUSY
+} FdWait;
+
+// parks the fiber until the file descriptor is ready for reading / writing
+FdWait loop_wait_fd(EventLoop* loop, ObjFiber* fiber, int fd, bool for_writing);
+
+// wakes up the waiters of a descriptor that is about to be closed
+void loop_forget_fd(EventLoop* loop, int fd);
+
+// Takes the next ready waiter, sleeping until there is one. False if nothing
+// is waiting anymore, so nothing ever will be ready
+bool loop_next(EventLoop* loop, ReadyWaiter* next);
+
+// seconds on a monotonic clock
+double loop_now();
+
+void loop_mark(VM* vm, EventLoop* loop);
+
+// defines the I/O natives, see event_loop.c
+void define_loop_natives(VM* vm);
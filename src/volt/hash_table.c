@@ -1,13 +1,33 @@
 #include "volt/hash_table.h"
 #include <string.h>
 #include "volt/mem.h"
+#include "volt/heap.h"
 
 // the maximun load factor for a table
 #define HTABLE_MAX_LOAD 0.75
 
+// Note: capacities are always powers of 2 (see GROW_CAPACITY() and
+// hashtable_remove_white()), so buckets are picked by masking the hash
+// rather than with the much slower modulo
+
+// a table whose live entries drop below this load factor is considered sparse
+// and gets shrunk by hashtable_remove_white()
+#define HTABLE_MIN_LOAD 0.25
+
+// tables smaller than this are still rehashed in one go, since it is cheap
+// enough and avoids the extra probe into the old array on every lookup
+#define HTABLE_INCREMENTAL_MIN_CAPACITY 1024
+
+// no. of old buckets migrated on each table operation during an incremental
+// rehash. It must be atleast 2 so that the migration always finishes before the
+// new array itself hits the maximum load factor (see hashtable_set())
+#define HTABLE_REHASH_STEP 32
+
+#define IS_REHASHING(table) ((table)->old_entries != NULL)
+
 static HashTableEntry* find_entry(HashTableEntry* entries, int capacity, ObjString* key)
 {
-    strhash_t index = key->hash % capacity;
+    strhash_t index = key->hash & (capacity - 1);
     HashTableEntry* tombstone = NULL;
 
     // this loop assumes that there is atleast one empty entry (excluding tombstones)
@@ -16,7 +36,7 @@ static HashTableEntry* find_entry(HashTableEntry* entries, int capacity, ObjStri
 
         if (ent->key == NULL) {
             // Check if it is NOT a tombstone.
-            // The default value of an empty entry is NIL ( which was set in adjust_capacity() ) 
+            // The default value of an empty entry is NIL ( which was set in allocate_entries() ) 
             if (IS_VAL_NIL(ent->value)) {
                 // if we previouly found a tombstone then return it
                 return tombstone == NULL ? ent : tombstone; 
@@ -35,34 +55,101 @@ static HashTableEntry* find_entry(HashTableEntry* entries, int capacity, ObjStri
             // we found the key
             return ent;
         }
-        index = (index + 1) % capacity;
+        index = (index + 1) & (capacity - 1);
     }
 }
 
-static void adjust_capacity(HashTable* table, int new_capacity)
+static inline void place_tombstone(HashTableEntry* ent) {
+    ent->key = NULL;
+    ent->value = MK_VAL_BOOL(true);
+}
+
+// looks up a live entry with the given key in the old array, if any
+static HashTableEntry* find_old_entry(HashTable* table, ObjString* key)
+{
+    if (!IS_REHASHING(table))
+        return NULL;
+
+    HashTableEntry* ent = find_entry(table->old_entries, table->old_capacity, key);
+    return ent->key == NULL ? NULL : ent;
+}
+
+static HashTableEntry* allocate_entries(VM* vm, int capacity)
 {
-    HashTableEntry* new_entries = ALLOCATE(HashTableEntry, new_capacity);
-    for (int i = 0; i < new_capacity; i++) {
-        new_entries[i].key = NULL;
-        new_entries[i].value = MK_VAL_NIL;
+    HashTableEntry* entries = ALLOCATE(vm, HashTableEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NULL;
+        entries[i].value = MK_VAL_NIL;
     }
+    return entries;
+}
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        HashTableEntry* old_entry = table->entries + i;
-        if (old_entry->key == NULL) {
+// insert a key that is known to be absent from table->entries
+static void insert_new_key(HashTable* table, ObjString* key, Value val)
+{
+    HashTableEntry* dest = find_entry(table->entries, table->capacity, key);
+    if (IS_VAL_NIL(dest->value))
+        table->count++; // only increase count if not reusing a tombstone
+    dest->key = key;
+    dest->value = val;
+}
+
+// migrates atmost max_buckets buckets from the old array to the new one
+static void rehash_step(VM* vm, HashTable* table, int max_buckets)
+{
+    int end = table->rehash_index + max_buckets;
+    if (end > table->old_capacity)
+        end = table->old_capacity;
+
+    for (int i = table->rehash_index; i < end; i++) {
+        HashTableEntry* old_entry = table->old_entries + i;
+        if (old_entry->key == NULL)
             continue;
-        }
 
-        HashTableEntry* dest = find_entry(table->entries, new_capacity, old_entry->key);
-        dest->key = old_entry->key;
-        dest->value = old_entry->value;
-        table->count++;
+        insert_new_key(table, old_entry->key, old_entry->value);
+        // Leave a tombstone (rather than an empty slot) behind so that the probe
+        // sequences of the not yet migrated keys stay intact
+        place_tombstone(old_entry);
+    }
+    table->rehash_index = end;
+
+    if (table->rehash_index == table->old_capacity) {
+        FREE_ARRAY(vm, HashTableEntry, table->old_entries, table->old_capacity);
+        table->old_entries = NULL;
+        table->old_capacity = 0;
+        table->rehash_index = 0;
     }
+}
+
+static void adjust_capacity(VM* vm, HashTable* table, int new_capacity)
+{
+    HashTableEntry* new_entries = allocate_entries(vm, new_capacity);
+
+    // Allocating may have triggered a garbage collection which in turn may have
+    // resized this very table (see hashtable_remove_white()), so only read the
+    // table's state after the allocation
+    hashtable_finish_rehash(vm, table);
+    HashTableEntry* old_entries = table->entries;
+    int old_capacity = table->capacity;
 
-    FREE_ARRAY(HashTableEntry, table->entries, table->capacity);
     table->entries = new_entries;
     table->capacity = new_capacity;
+    table->count = 0;
+
+    table->old_entries = old_entries;
+    table->old_capacity = old_capacity;
+    table->rehash_index = 0;
+
+    if (old_capacity < HTABLE_INCREMENTAL_MIN_CAPACITY) {
+        // small table, just move everything right now
+        hashtable_finish_rehash(vm, table);
+    }
+}
+
+void hashtable_finish_rehash(VM* vm, HashTable* table)
+{
+    if (IS_REHASHING(table))
+        rehash_step(vm, table, table->old_capacity);
 }
 
 void hashtable_init(HashTable* table)
@@ -70,68 +157,108 @@ void hashtable_init(HashTable* table)
     table->capacity = 0;
     table->count = 0;
     table->entries = NULL;
+
+    table->old_entries = NULL;
+    table->old_capacity = 0;
+    table->rehash_index = 0;
 }
 
-void hashtable_free(HashTable* table)
+void hashtable_free(VM* vm, HashTable* table)
 {
-    FREE_ARRAY(HashTableEntry, table->entries, table->capacity);
+    FREE_ARRAY(vm, HashTableEntry, table->entries, table->capacity);
+    FREE_ARRAY(vm, HashTableEntry, table->old_entries, table->old_capacity);
     hashtable_init(table);
 }
 
-void hashtable_add_all(HashTable* from, HashTable* to)
+void hashtable_add_all(VM* vm, HashTable* from, HashTable* to)
 {
     for (int i = 0; i < from->capacity; i++) {
         HashTableEntry* source_ent = from->entries + i;
         if (source_ent->key != NULL)
-            hashtable_set(to, source_ent->key, source_ent->value);
+            hashtable_set(vm, to, source_ent->key, source_ent->value);
+    }
+
+    // the not yet migrated entries
+    for (int i = from->rehash_index; i < from->old_capacity; i++) {
+        HashTableEntry* source_ent = from->old_entries + i;
+        if (source_ent->key != NULL)
+            hashtable_set(vm, to, source_ent->key, source_ent->value);
     }
 }
 
-bool hashtable_set(HashTable* table, ObjString* key, Value val)
+bool hashtable_set(VM* vm, HashTable* table, ObjString* key, Value val)
 {
+    if (IS_REHASHING(table))
+        rehash_step(vm, table, HTABLE_REHASH_STEP);
+
     // grow the array when we hit the maximum load factor
     if (table->count + 1 > table->capacity * HTABLE_MAX_LOAD) {
+        // With HTABLE_REHASH_STEP >= 2 the previous migration is always done
+        // by now, but better be safe than overwrite old_entries
+        hashtable_finish_rehash(vm, table);
         int new_capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, new_capacity);
+        adjust_capacity(vm, table, new_capacity);
     }
 
     HashTableEntry* entry = find_entry(table->entries, table->capacity, key);
     bool is_new_key = (entry->key == NULL);
-    if (is_new_key && IS_VAL_NIL(entry->value))
-        table->count++; // only increase count if not reusing a tombstone
+
+    if (is_new_key) {
+        // The key might still be sitting in the old array, in which case we
+        // move it over to the new one right now
+        HashTableEntry* old_entry = find_old_entry(table, key);
+        if (old_entry != NULL) {
+            place_tombstone(old_entry);
+            is_new_key = false;
+        }
+        if (IS_VAL_NIL(entry->value))
+            table->count++; // only increase count if not reusing a tombstone
+    }
+
     entry->key = key;
     entry->value = val;
 
     return is_new_key;
 }
 
-bool hashtable_get(HashTable* table, ObjString* key, Value* result_val)
+bool hashtable_get(VM* vm, HashTable* table, ObjString* key, Value* result_val)
 {
-    if (table->count == 0)
+    if (table->count == 0 && !IS_REHASHING(table))
         return false;
 
+    if (IS_REHASHING(table))
+        rehash_step(vm, table, HTABLE_REHASH_STEP);
+
     HashTableEntry* ent = find_entry(table->entries, table->capacity, key);
-    if (ent->key == NULL)
-        return false;
+    if (ent->key == NULL) {
+        ent = find_old_entry(table, key);
+        if (ent == NULL)
+            return false;
+    }
 
     *result_val = ent->value;
     return true;
 }
 
-bool hashtable_delete(HashTable* table, ObjString* key)
+bool hashtable_delete(VM* vm, HashTable* table, ObjString* key)
 {
-    if (table->count == 0)
+    if (table->count == 0 && !IS_REHASHING(table))
         return false;
+
+    if (IS_REHASHING(table))
+        rehash_step(vm, table, HTABLE_REHASH_STEP);
     
     HashTableEntry* ent = find_entry(table->entries, table->capacity, key);
 
-    // if no entry is found, return false
-    if (ent == NULL)
-        return false;
+    // if no entry is found, look into the old array
+    if (ent->key == NULL) {
+        ent = find_old_entry(table, key);
+        if (ent == NULL)
+            return false;
+    }
 
     // place a tombstone
-    ent->key = NULL;
-    ent->value = MK_VAL_BOOL(true);
+    place_tombstone(ent);
 
     // Note that table->count is not decremented
     // because it includes tombstones
@@ -139,16 +266,12 @@ bool hashtable_delete(HashTable* table, ObjString* key)
     return true;
 }
 
-
-ObjString* hashtable_findstr(HashTable* table, const char* key_str, int len, strhash_t hash)
+static ObjString* findstr_in(HashTableEntry* entries, int capacity, const char* key_str, int len, strhash_t hash)
 {
-    if (table->count == 0)
-        return NULL;
-
-    strhash_t index = hash % table->capacity;
+    strhash_t index = hash & (capacity - 1);
     
     for (;;) {
-        HashTableEntry* ent = table->entries + index;
+        HashTableEntry* ent = entries + index;
 
         if (ent->key == NULL) {
             // return null if we found a non-empty tombstone
@@ -160,6 +283,61 @@ ObjString* hashtable_findstr(HashTable* table, const char* key_str, int len, str
             return ent->key;
         }
 
-        index = (index + 1) % table->capacity;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+ObjString* hashtable_findstr(HashTable* table, const char* key_str, int len, strhash_t hash)
+{
+    ObjString* key = NULL;
+
+    if (table->count != 0)
+        key = findstr_in(table->entries, table->capacity, key_str, len, hash);
+
+    if (key == NULL && IS_REHASHING(table))
+        key = findstr_in(table->old_entries, table->old_capacity, key_str, len, hash);
+
+    return key;
+}
+
+void hashtable_mark(VM* vm, HashTable* table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        HashTableEntry* ent = table->entries + i;
+        mark_object(vm, (Obj*)ent->key);
+        mark_value(vm, ent->value);
+    }
+
+    for (int i = table->rehash_index; i < table->old_capacity; i++) {
+        HashTableEntry* ent = table->old_entries + i;
+        mark_object(vm, (Obj*)ent->key);
+        mark_value(vm, ent->value);
+    }
+}
+
+void hashtable_remove_white(VM* vm, HashTable* table)
+{
+    hashtable_finish_rehash(vm, table);
+
+    int live_count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        HashTableEntry* ent = table->entries + i;
+        if (ent->key == NULL)
+            continue;
+
+        if (heap_is_marked((Obj*)ent->key))
+            live_count++;
+        else
+            place_tombstone(ent);
+    }
+
+    // shrink the table if most of it is now tombstones and empty slots
+    if (table->capacity > 8 && live_count < table->capacity * HTABLE_MIN_LOAD) {
+        int new_capacity = 8;
+        while (new_capacity * HTABLE_MAX_LOAD / 2 < live_count)
+            new_capacity *= 2;
+
+        adjust_capacity(vm, table, new_capacity);
+        hashtable_finish_rehash(vm, table);
     }
 }
@@ -1,7 +1,6 @@
 #pragma once
 
 #include "volt/code/value.h"
-#include "volt/code/object.h"
 #include "volt/bool.h"
 
 typedef struct {
@@ -13,25 +12,56 @@ typedef struct {
     int capacity;
     int count; // no. of actual entries + no. of tombstones
     HashTableEntry* entries;
+
+    // Incremental rehashing state. Large tables don't move all of their entries
+    // at once when they grow. Instead the old array is kept alongside the new one
+    // and a few buckets are migrated on every set/get/delete. While old_entries
+    // is not NULL, a key may live in either of the two arrays.
+    HashTableEntry* old_entries;
+    int old_capacity;
+    int rehash_index; // next bucket of old_entries to be migrated
 } HashTable;
 
+// after the tables, which object.h needs for classes
+#include "volt/code/object.h"
+
 void hashtable_init(HashTable* table);
-void hashtable_free(HashTable* table);
+void hashtable_free(VM* vm, HashTable* table);
 
 // Fully duplicate a hashtable
-void hashtable_add_all(HashTable* from, HashTable* to);
+void hashtable_add_all(VM* vm, HashTable* from, HashTable* to);
+
+/*
+* The vm passed to the functions below is the one the table's memory belongs to.
+* Keys are compared by pointer, so they must be interned strings (see string_intern())
+*/
 
 /*
 * Set the key with the given value
 * returns true on adding a new key, and false on overwriting an existing ket
 */
-bool hashtable_set(HashTable* table, ObjString* key, Value val);
+bool hashtable_set(VM* vm, HashTable* table, ObjString* key, Value val);
 
 // returns true on success, false otherwise
-bool hashtable_get(HashTable* table, ObjString* key, Value* result_val);
+bool hashtable_get(VM* vm, HashTable* table, ObjString* key, Value* result_val);
 
 // returns true on success, false otherwise
-bool hashtable_delete(HashTable* table, ObjString* key);
+bool hashtable_delete(VM* vm, HashTable* table, ObjString* key);
 
 // return pointer to key of the entry from looked up from a c-style string  
-ObjString* hashtable_findstr(HashTable* table, const char* key_str, int len, strhash_t hash);
\ No newline at end of file
+ObjString* hashtable_findstr(HashTable* table, const char* key_str, int len, strhash_t hash);
+
+// migrate all the remaining buckets of an in-progress incremental rehash
+void hashtable_finish_rehash(VM* vm, HashTable* table);
+
+/* Garbage collection */
+
+// marks all the keys and values of the table
+void hashtable_mark(VM* vm, HashTable* table);
+
+/*
+* Removes all the entries whose key is not marked. This lets a table hold weak
+* references to strings (used by the interned strings table). The table is
+* shrunk afterwards if it has become sparse
+*/
+void hashtable_remove_white(VM* vm, HashTable* table);
@@ -0,0 +1,372 @@
+#include "volt/heap.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "volt/code/object.h"
+
+// slot sizes of the size classes, all multiples of 16 so every slot is 16 byte aligned
+static const uint32_t class_slot_sizes[HEAP_SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 256, 384, 512
+};
+
+// maps a size (in 16 byte granules, rounded up) to its size class
+static const uint8_t class_of_granules[HEAP_MAX_SMALL_SIZE / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7,  // 0 - 128
+    8, 8,                       // 129 - 160
+    9, 9,                       // 161 - 192
+    10, 10, 10, 10,             // 193 - 256
+    11, 11, 11, 11, 11, 11, 11, 11, // 257 - 384
+    12, 12, 12, 12, 12, 12, 12, 12, // 385 - 512
+};
+
+// header placed in front of objects that are too large for the slabs
+struct LargeObj {
+    LargeObj* next;
+    Heap* heap;
+    size_t size;
+    // kept out of the object header, which other threads may be reading (see
+    // scheduler.h) while the owner marks
+    bool is_marked;
+};
+
+#define PAGE_OF(ptr) ((HeapPage*)((uintptr_t)(ptr) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+#define SLOT_ADDRESS(page, index) ((page)->slots + (size_t)(index) * (page)->slot_size)
+#define LARGE_HEADER(object) ((LargeObj*)((char*)(object) - sizeof(LargeObj)))
+#define LARGE_OBJECT(large) ((Obj*)((char*)(large) + sizeof(LargeObj)))
+
+static inline int size_class_index(size_t size) {
+    return class_of_granules[(size + 15) / 16];
+}
+
+static void* checked(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Pages */
+
+static HeapPage* new_page(Heap* heap, SizeClass* size_class) {
+    HeapPage* page = (HeapPage*)checked(aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE));
+    page->heap = heap;
+
+    size_t header_size = (sizeof(HeapPage) + 15) & ~(size_t)15;
+    page->slots = (char*)page + header_size;
+    page->slot_size = size_class->slot_size;
+    page->slot_count = (uint32_t)((HEAP_PAGE_SIZE - header_size) / page->slot_size);
+    page->live_count = 0;
+    memset(page->alloc_bits, 0, sizeof(page->alloc_bits));
+    memset(page->mark_bits, 0, sizeof(page->mark_bits));
+
+    // thread the free list through the slots, in address order
+    page->free_list = NULL;
+    for (uint32_t i = page->slot_count; i > 0; i--) {
+        void** slot = (void**)SLOT_ADDRESS(page, i - 1);
+        *slot = page->free_list;
+        page->free_list = slot;
+    }
+
+    page->next = size_class->pages;
+    size_class->pages = page;
+
+    page->next_available = size_class->available;
+    size_class->available = page;
+    page->is_available = true;
+
+    return page;
+}
+
+static inline uint32_t slot_index(HeapPage* page, void* slot) {
+    return (uint32_t)(((char*)slot - page->slots) / page->slot_size);
+}
+
+static void* page_pop_slot(Heap* heap, SizeClass* size_class) {
+    HeapPage* page = size_class->available;
+    if (page == NULL)
+        page = new_page(heap, size_class);
+
+    void** slot = (void**)page->free_list;
+    page->free_list = *slot;
+    page->live_count++;
+
+    if (page->free_list == NULL) {
+        // page is full now
+        size_class->available = page->next_available;
+        page->is_available = false;
+    }
+    return slot;
+}
+
+static void page_push_slot(SizeClass* size_class, HeapPage* page, void* slot) {
+    *(void**)slot = page->free_list;
+    page->free_list = slot;
+    page->live_count--;
+
+    if (!page->is_available) {
+        page->next_available = size_class->available;
+        size_class->available = page;
+        page->is_available = true;
+    }
+}
+
+static void unlink_page(SizeClass* size_class, HeapPage* page) {
+    HeapPage** link = &size_class->pages;
+    while (*link != page)
+        link = &(*link)->next;
+    *link = page->next;
+
+    if (page->is_available) {
+        link = &size_class->available;
+        while (*link != page)
+            link = &(*link)->next_available;
+        *link = page->next_available;
+    }
+}
+
+static void free_pages(SizeClass* size_class) {
+    HeapPage* page = size_class->pages;
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        free(page);
+        page = next;
+    }
+    size_class->pages = NULL;
+    size_class->available = NULL;
+}
+
+/* Heap */
+
+void heap_init(Heap* heap) {
+    for (int i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+        heap->objects[i].slot_size = class_slot_sizes[i];
+        heap->objects[i].pages = NULL;
+        heap->objects[i].available = NULL;
+
+        heap->buffers[i].slot_size = class_slot_sizes[i];
+        heap->buffers[i].pages = NULL;
+        heap->buffers[i].available = NULL;
+    }
+    heap->large_objects = NULL;
+}
+
+void heap_free(Heap* heap, ObjFinalizer finalize, void* context) {
+    // finalize everything first, as that releases buffers into the buffer pages
+    for (int i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+        for (HeapPage* page = heap->objects[i].pages; page != NULL; page = page->next) {
+            for (int w = 0; w < HEAP_BITMAP_WORDS; w++) {
+                uint64_t bits = page->alloc_bits[w];
+                while (bits != 0) {
+                    int bit = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    finalize(context, (Obj*)SLOT_ADDRESS(page, w * 64 + bit));
+                }
+            }
+        }
+    }
+
+    LargeObj* large = heap->large_objects;
+    while (large != NULL) {
+        LargeObj* next = large->next;
+        finalize(context, LARGE_OBJECT(large));
+        free(large);
+        large = next;
+    }
+    heap->large_objects = NULL;
+
+    for (int i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+        free_pages(&heap->objects[i]);
+        free_pages(&heap->buffers[i]);
+    }
+}
+
+Obj* heap_alloc_object(Heap* heap, size_t size) {
+    if (size > HEAP_MAX_SMALL_SIZE) {
+        LargeObj* large = (LargeObj*)checked(malloc(sizeof(LargeObj) + size));
+        large->size = size;
+        large->heap = heap;
+        large->is_marked = false;
+        large->next = heap->large_objects;
+        heap->large_objects = large;
+
+        Obj* object = LARGE_OBJECT(large);
+        object->flags = OBJ_FLAG_LARGE;
+        object->slot = 0;
+        return object;
+    }
+
+    Obj* object = (Obj*)page_pop_slot(heap, &heap->objects[size_class_index(size)]);
+    HeapPage* page = PAGE_OF(object);
+    uint32_t index = slot_index(page, object);
+    page->alloc_bits[index / 64] |= (uint64_t)1 << (index % 64);
+
+    object->flags = 0;
+    object->slot = (uint16_t)index;
+    return object;
+}
+
+Obj* heap_alloc_detached(size_t size) {
+    LargeObj* large = (LargeObj*)checked(malloc(sizeof(LargeObj) + size));
+    large->size = size;
+    large->heap = NULL;
+    large->is_marked = false;
+    large->next = NULL;
+
+    Obj* object = LARGE_OBJECT(large);
+    object->flags = OBJ_FLAG_LARGE;
+    object->slot = 0;
+    return object;
+}
+
+void heap_free_detached(Obj* object) {
+    free(LARGE_HEADER(object));
+}
+
+void heap_adopt(Heap* heap, Obj* object) {
+    LargeObj* large = LARGE_HEADER(object);
+    large->heap = heap;
+    large->next = heap->large_objects;
+    heap->large_objects = large;
+}
+
+void heap_free_buffer(Heap* heap, void* buffer, size_t size) {
+    if (buffer == NULL)
+        return;
+
+    if (size > HEAP_MAX_SMALL_SIZE) {
+        free(buffer);
+        return;
+    }
+
+    SizeClass* size_class = &heap->buffers[size_class_index(size)];
+    HeapPage* page = PAGE_OF(buffer);
+    page_push_slot(size_class, page, buffer);
+
+    // give the page back once it is empty, unless it is the last one of its class
+    if (page->live_count == 0 && !(size_class->pages == page && page->next == NULL)) {
+        unlink_page(size_class, page);
+        free(page);
+    }
+}
+
+void* heap_realloc_buffer(Heap* heap, void* buffer, size_t old_size, size_t new_size) {
+    bool old_small = buffer != NULL && old_size <= HEAP_MAX_SMALL_SIZE;
+    bool new_small = new_size <= HEAP_MAX_SMALL_SIZE;
+
+    if (buffer == NULL)
+        old_size = 0;
+
+    // both large, let the libc handle it
+    if (buffer != NULL && !old_small && !new_small)
+        return checked(realloc(buffer, new_size));
+
+    // the slot is big enough already
+    if (old_small && new_small && size_class_index(old_size) == size_class_index(new_size))
+        return buffer;
+
+    void* new_buffer = new_small
+        ? page_pop_slot(heap, &heap->buffers[size_class_index(new_size)])
+        : checked(malloc(new_size));
+
+    if (buffer != NULL) {
+        memcpy(new_buffer, buffer, old_size < new_size ? old_size : new_size);
+        heap_free_buffer(heap, buffer, old_size);
+    }
+    return new_buffer;
+}
+
+/* Marking and sweeping */
+
+bool heap_owns(Heap* heap, Obj* object) {
+    if (object->flags & OBJ_FLAG_IMMORTAL)
+        return false;
+    if (object->flags & OBJ_FLAG_LARGE)
+        return LARGE_HEADER(object)->heap == heap;
+    return PAGE_OF(object)->heap == heap;
+}
+
+bool heap_is_marked(Obj* object) {
+    if (object->flags & OBJ_FLAG_LARGE)
+        return LARGE_HEADER(object)->is_marked;
+
+    HeapPage* page = PAGE_OF(object);
+    return (page->mark_bits[object->slot / 64] >> (object->slot % 64)) & 1;
+}
+
+void heap_set_marked(Obj* object) {
+    if (object->flags & OBJ_FLAG_LARGE) {
+        LARGE_HEADER(object)->is_marked = true;
+        return;
+    }
+
+    HeapPage* page = PAGE_OF(object);
+    page->mark_bits[object->slot / 64] |= (uint64_t)1 << (object->slot % 64);
+}
+
+static void sweep_class(SizeClass* size_class, ObjFinalizer finalize, void* context) {
+    size_class->available = NULL;
+
+    HeapPage** link = &size_class->pages;
+    while (*link != NULL) {
+        HeapPage* page = *link;
+
+        for (int w = 0; w < HEAP_BITMAP_WORDS; w++) {
+            uint64_t dead = page->alloc_bits[w] & ~page->mark_bits[w];
+            page->alloc_bits[w] &= page->mark_bits[w];
+            page->mark_bits[w] = 0;
+
+            while (dead != 0) {
+                int bit = __builtin_ctzll(dead);
+                dead &= dead - 1;
+
+                void* slot = SLOT_ADDRESS(page, w * 64 + bit);
+                finalize(context, (Obj*)slot);
+
+                *(void**)slot = page->free_list;
+                page->free_list = slot;
+                page->live_count--;
+            }
+        }
+
+        // release empty pages, but keep the first one around
+        if (page->live_count == 0 && link != &size_class->pages) {
+            *link = page->next;
+            free(page);
+            continue;
+        }
+
+        // rebuild the list of pages with free slots
+        page->is_available = page->free_list != NULL;
+        if (page->is_available) {
+            page->next_available = size_class->available;
+            size_class->available = page;
+        }
+
+        link = &page->next;
+    }
+}
+
+void heap_sweep(Heap* heap, ObjFinalizer finalize, void* context) {
+    for (int i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+        sweep_class(&heap->objects[i], finalize, context);
+    }
+
+    LargeObj** link = &heap->large_objects;
+    while (*link != NULL) {
+        LargeObj* large = *link;
+        Obj* object = LARGE_OBJECT(large);
+
+        if (large->is_marked) {
+            large->is_marked = false;
+            link = &large->next;
+            continue;
+        }
+
+        *link = large->next;
+        finalize(context, object);
+        free(large);
+    }
+}
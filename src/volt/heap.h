@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+
+/*
+* Size class slab allocator backing the vm's memory.
+*
+* Small allocations (upto HEAP_MAX_SMALL_SIZE bytes) are served from pages of
+* HEAP_PAGE_SIZE bytes, each one split into equal slots of a single size class.
+* Allocation pops a slot off the page's free list. Objects and plain buffers
+* (arrays, table entries etc.) use separate pages so that walking the heap only
+* ever visits objects.
+*
+* Object pages keep two bitmaps: which slots are allocated and which ones were
+* marked by the collector. Sweeping is then a sequential scan of the bitmaps
+* rather than chasing a linked list of objects. Pages are aligned to their size
+* so the page of any object is found by masking its address.
+*
+* Anything bigger than HEAP_MAX_SMALL_SIZE goes straight to malloc. Such large
+* objects are kept in a list and carry their mark in a small header of their own,
+* right before the object.
+*/
+
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_MAX_SMALL_SIZE 512
+#define HEAP_SIZE_CLASS_COUNT 13
+
+// enough bits for a page full of the smallest (16 byte) slots
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / 16 / 64)
+
+typedef struct HeapPage HeapPage;
+typedef struct LargeObj LargeObj;
+
+typedef struct {
+    uint32_t slot_size;
+    // all the pages of this size class
+    HeapPage* pages;
+    // the pages that have atleast one free slot
+    HeapPage* available;
+} SizeClass;
+
+struct HeapPage {
+    // the heap the page belongs to
+    struct Heap* heap;
+    HeapPage* next;
+    HeapPage* next_available;
+    bool is_available;
+
+    uint32_t slot_size;
+    uint32_t slot_count;
+    uint32_t live_count;
+
+    // singly linked list threaded through the free slots
+    void* free_list;
+    char* slots;
+
+    uint64_t alloc_bits[HEAP_BITMAP_WORDS];
+    uint64_t mark_bits[HEAP_BITMAP_WORDS];
+};
+
+typedef struct Heap {
+    SizeClass objects[HEAP_SIZE_CLASS_COUNT];
+    SizeClass buffers[HEAP_SIZE_CLASS_COUNT];
+    LargeObj* large_objects;
+} Heap;
+
+// called on each object being freed, to release whatever memory it owns.
+// context is passed through as is from heap_free() / heap_sweep()
+typedef void (*ObjFinalizer)(void* context, Obj* object);
+
+void heap_init(Heap* heap);
+
+// finalizes all the remaining objects and releases all the memory of the heap
+void heap_free(Heap* heap, ObjFinalizer finalize, void* context);
+
+// Returns memory for an object of the given size. Only the slot (and the large
+// flag) of the header are set, everything else is left to the caller
+Obj* heap_alloc_object(Heap* heap, size_t size);
+
+// Returns memory for an object that belongs to no heap yet, so it can be handed
+// over to another thread (see channel.h). It stays untouched by every collector
+// until a heap takes it with heap_adopt()
+Obj* heap_alloc_detached(size_t size);
+void heap_adopt(Heap* heap, Obj* object);
+// for a detached object that no heap is going to take
+void heap_free_detached(Obj* object);
+
+void* heap_realloc_buffer(Heap* heap, void* buffer, size_t old_size, size_t new_size);
+void heap_free_buffer(Heap* heap, void* buffer, size_t size);
+
+// true if the object was allocated from the given heap. A vm can see objects of
+// other vms (e.g code shared by an IsolatePool), which it must never mark or free
+bool heap_owns(Heap* heap, Obj* object);
+
+bool heap_is_marked(Obj* object);
+void heap_set_marked(Obj* object);
+
+// frees all the objects which are not marked, and clears the marks of the rest
+void heap_sweep(Heap* heap, ObjFinalizer finalize, void* context);
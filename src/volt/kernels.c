@@ -0,0 +1,612 @@
+#include "volt/kernels.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define X86_KERNELS
+#include <immintrin.h>
+// only the functions marked with this are compiled for avx2, the rest of
+// the binary still runs on any x86-64
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+/* Plain C */
+
+static double sum_f64_scalar(const double* a, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += a[i];
+    return total;
+}
+
+// int64s are added up as unsigned, to wrap around instead of overflowing
+static int64_t sum_i64_scalar(const int64_t* a, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += (uint64_t)a[i];
+    return (int64_t)total;
+}
+
+// written the way minpd / maxpd work, so a NaN never replaces the result
+static double min_f64_scalar(const double* a, size_t n) {
+    double result = INFINITY;
+    for (size_t i = 0; i < n; i++)
+        result = a[i] < result ? a[i] : result;
+    return result;
+}
+
+static double max_f64_scalar(const double* a, size_t n) {
+    double result = -INFINITY;
+    for (size_t i = 0; i < n; i++)
+        result = a[i] > result ? a[i] : result;
+    return result;
+}
+
+static int64_t min_i64_scalar(const int64_t* a, size_t n) {
+    int64_t result = a[0];
+    for (size_t i = 1; i < n; i++)
+        result = a[i] < result ? a[i] : result;
+    return result;
+}
+
+static int64_t max_i64_scalar(const int64_t* a, size_t n) {
+    int64_t result = a[0];
+    for (size_t i = 1; i < n; i++)
+        result = a[i] > result ? a[i] : result;
+    return result;
+}
+
+static double dot_f64_scalar(const double* a, const double* b, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+static int64_t dot_i64_scalar(const int64_t* a, const int64_t* b, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += (uint64_t)a[i] * (uint64_t)b[i];
+    return (int64_t)total;
+}
+
+static void scale_f64_scalar(double* a, double k, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        a[i] *= k;
+}
+
+static void scale_i64_scalar(int64_t* a, int64_t k, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        a[i] = (int64_t)((uint64_t)a[i] * (uint64_t)k);
+}
+
+static void axpy_f64_scalar(double alpha, const double* x, double* y, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        y[i] += alpha * x[i];
+}
+
+static void axpy_i64_scalar(int64_t alpha, const int64_t* x, int64_t* y, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        y[i] = (int64_t)((uint64_t)y[i] + (uint64_t)alpha * (uint64_t)x[i]);
+}
+
+static void add_f64_scalar(const double* a, const double* b, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] + b[i];
+}
+
+static void add_i64_scalar(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+}
+
+static void mul_f64_scalar(const double* a, const double* b, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = a[i] * b[i];
+}
+
+static void mul_i64_scalar(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int64_t)((uint64_t)a[i] * (uint64_t)b[i]);
+}
+
+static void prefix_sum_f64_scalar(const double* a, double* out, size_t n) {
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        out[i] = total += a[i];
+}
+
+static void prefix_sum_i64_scalar(const int64_t* a, int64_t* out, size_t n) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int64_t)(total += (uint64_t)a[i]);
+}
+
+static ptrdiff_t search_f64_scalar(const double* a, double x, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == x)
+            return (ptrdiff_t)i;
+    }
+    return -1;
+}
+
+static ptrdiff_t search_i64_scalar(const int64_t* a, int64_t x, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == x)
+            return (ptrdiff_t)i;
+    }
+    return -1;
+}
+
+static const Kernels scalar_kernels = {
+    "scalar",
+    sum_f64_scalar, sum_i64_scalar,
+    min_f64_scalar, max_f64_scalar, min_i64_scalar, max_i64_scalar,
+    dot_f64_scalar, dot_i64_scalar,
+    scale_f64_scalar, scale_i64_scalar,
+    axpy_f64_scalar, axpy_i64_scalar,
+    add_f64_scalar, add_i64_scalar, mul_f64_scalar, mul_i64_scalar,
+    prefix_sum_f64_scalar, prefix_sum_i64_scalar,
+    search_f64_scalar, search_i64_scalar
+};
+
+#ifdef X86_KERNELS
+
+/*
+* The vector loops below all go over the arrays a whole vector at a time, and
+* leave whatever is left at the end (less than a vector) to the plain loop.
+* Loads and stores are unaligned, objects are only 16 byte aligned.
+*
+* SSE2 has no 64 bit integer compares or multiplies, and AVX2 has no 64 bit
+* multiplies, so those kernels stay plain C.
+*/
+
+/* SSE2, which every x86-64 cpu has */
+
+static double hsum_sse2(__m128d v) {
+    return _mm_cvtsd_f64(v) + _mm_cvtsd_f64(_mm_unpackhi_pd(v, v));
+}
+
+static int64_t hsum_i64_sse2(__m128i v) {
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, v);
+    return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1]);
+}
+
+static double sum_f64_sse2(const double* a, size_t n) {
+    // a chain of dependent adds is slow, so keep 4 of them going
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    __m128d s2 = _mm_setzero_pd(), s3 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+        s2 = _mm_add_pd(s2, _mm_loadu_pd(a + i + 4));
+        s3 = _mm_add_pd(s3, _mm_loadu_pd(a + i + 6));
+    }
+    for (; i + 2 <= n; i += 2)
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+    double total = hsum_sse2(_mm_add_pd(_mm_add_pd(s0, s1), _mm_add_pd(s2, s3)));
+    return total + sum_f64_scalar(a + i, n - i);
+}
+
+static int64_t sum_i64_sse2(const int64_t* a, size_t n) {
+    __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_epi64(s0, _mm_loadu_si128((const __m128i*)(a + i)));
+        s1 = _mm_add_epi64(s1, _mm_loadu_si128((const __m128i*)(a + i + 2)));
+    }
+    int64_t total = hsum_i64_sse2(_mm_add_epi64(s0, s1));
+    return (int64_t)((uint64_t)total + (uint64_t)sum_i64_scalar(a + i, n - i));
+}
+
+static double min_f64_sse2(const double* a, size_t n) {
+    __m128d result = _mm_set1_pd(INFINITY);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        result = _mm_min_pd(_mm_loadu_pd(a + i), result);
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double tail = min_f64_scalar(a + i, n - i);
+    double low = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    return tail < low ? tail : low;
+}
+
+static double max_f64_sse2(const double* a, size_t n) {
+    __m128d result = _mm_set1_pd(-INFINITY);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        result = _mm_max_pd(_mm_loadu_pd(a + i), result);
+    double lanes[2];
+    _mm_storeu_pd(lanes, result);
+    double tail = max_f64_scalar(a + i, n - i);
+    double high = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    return tail > high ? tail : high;
+}
+
+static double dot_f64_sse2(const double* a, const double* b, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    return hsum_sse2(_mm_add_pd(s0, s1)) + dot_f64_scalar(a + i, b + i, n - i);
+}
+
+static void scale_f64_sse2(double* a, double k, size_t n) {
+    __m128d factor = _mm_set1_pd(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    scale_f64_scalar(a + i, k, n - i);
+}
+
+static void axpy_f64_sse2(double alpha, const double* x, double* y, size_t n) {
+    __m128d factor = _mm_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d product = _mm_mul_pd(factor, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+    }
+    axpy_f64_scalar(alpha, x + i, y + i, n - i);
+}
+
+static void add_f64_sse2(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    add_f64_scalar(a + i, b + i, out + i, n - i);
+}
+
+static void add_i64_sse2(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i sum = _mm_add_epi64(_mm_loadu_si128((const __m128i*)(a + i)),
+                                    _mm_loadu_si128((const __m128i*)(b + i)));
+        _mm_storeu_si128((__m128i*)(out + i), sum);
+    }
+    add_i64_scalar(a + i, b + i, out + i, n - i);
+}
+
+static void mul_f64_sse2(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mul_f64_scalar(a + i, b + i, out + i, n - i);
+}
+
+// each vector is summed up in the register (by adding a copy of it shifted
+// over by one lane) and then offset by the total of everything before it
+static void prefix_sum_f64_sse2(const double* a, double* out, size_t n) {
+    __m128d zero = _mm_setzero_pd();
+    __m128d carry = zero;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        x = _mm_add_pd(x, _mm_unpacklo_pd(zero, x));
+        x = _mm_add_pd(x, carry);
+        _mm_storeu_pd(out + i, x);
+        carry = _mm_unpackhi_pd(x, x);
+    }
+    double total = _mm_cvtsd_f64(carry);
+    for (; i < n; i++)
+        out[i] = total += a[i];
+}
+
+static void prefix_sum_i64_sse2(const int64_t* a, int64_t* out, size_t n) {
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi64(x, carry);
+        _mm_storeu_si128((__m128i*)(out + i), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    uint64_t total = i > 0 ? (uint64_t)out[i - 1] : 0;
+    for (; i < n; i++)
+        out[i] = (int64_t)(total += (uint64_t)a[i]);
+}
+
+static ptrdiff_t search_f64_sse2(const double* a, double x, size_t n) {
+    __m128d needle = _mm_set1_pd(x);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), needle));
+        if (mask != 0)
+            return (ptrdiff_t)(i + __builtin_ctz(mask));
+    }
+    ptrdiff_t found = search_f64_scalar(a + i, x, n - i);
+    return found < 0 ? -1 : (ptrdiff_t)i + found;
+}
+
+static ptrdiff_t search_i64_sse2(const int64_t* a, int64_t x, size_t n) {
+    __m128i needle = _mm_set1_epi64x(x);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        // no 64 bit compare, so both 32 bit halves have to be equal
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)), needle);
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(equal));
+        if (mask != 0)
+            return (ptrdiff_t)(i + __builtin_ctz(mask));
+    }
+    ptrdiff_t found = search_i64_scalar(a + i, x, n - i);
+    return found < 0 ? -1 : (ptrdiff_t)i + found;
+}
+
+static const Kernels sse2_kernels = {
+    "sse2",
+    sum_f64_sse2, sum_i64_sse2,
+    min_f64_sse2, max_f64_sse2, min_i64_scalar, max_i64_scalar,
+    dot_f64_sse2, dot_i64_scalar,
+    scale_f64_sse2, scale_i64_scalar,
+    axpy_f64_sse2, axpy_i64_scalar,
+    add_f64_sse2, add_i64_sse2, mul_f64_sse2, mul_i64_scalar,
+    prefix_sum_f64_sse2, prefix_sum_i64_sse2,
+    search_f64_sse2, search_i64_sse2
+};
+
+/* AVX2 */
+
+AVX2 static double hsum_avx2(__m256d v) {
+    return hsum_sse2(_mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));
+}
+
+AVX2 static double sum_f64_avx2(const double* a, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+        s2 = _mm256_add_pd(s2, _mm256_loadu_pd(a + i + 8));
+        s3 = _mm256_add_pd(s3, _mm256_loadu_pd(a + i + 12));
+    }
+    for (; i + 4 <= n; i += 4)
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    double total = hsum_avx2(_mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3)));
+    return total + sum_f64_scalar(a + i, n - i);
+}
+
+AVX2 static int64_t sum_i64_avx2(const int64_t* a, size_t n) {
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((const __m256i*)(a + i)));
+        s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((const __m256i*)(a + i + 4)));
+    }
+    __m256i sum = _mm256_add_epi64(s0, s1);
+    int64_t total = hsum_i64_sse2(_mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+    return (int64_t)((uint64_t)total + (uint64_t)sum_i64_scalar(a + i, n - i));
+}
+
+AVX2 static double min_f64_avx2(const double* a, size_t n) {
+    __m256d result = _mm256_set1_pd(INFINITY);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        result = _mm256_min_pd(_mm256_loadu_pd(a + i), result);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, result);
+    double low = min_f64_scalar(a + i, n - i);
+    for (int j = 0; j < 4; j++)
+        low = lanes[j] < low ? lanes[j] : low;
+    return low;
+}
+
+AVX2 static double max_f64_avx2(const double* a, size_t n) {
+    __m256d result = _mm256_set1_pd(-INFINITY);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        result = _mm256_max_pd(_mm256_loadu_pd(a + i), result);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, result);
+    double high = max_f64_scalar(a + i, n - i);
+    for (int j = 0; j < 4; j++)
+        high = lanes[j] > high ? lanes[j] : high;
+    return high;
+}
+
+AVX2 static int64_t min_i64_avx2(const int64_t* a, size_t n) {
+    __m256i result = _mm256_set1_epi64x(a[0]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        result = _mm256_blendv_epi8(result, x, _mm256_cmpgt_epi64(result, x));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, result);
+    int64_t low = lanes[0];
+    for (int j = 1; j < 4; j++)
+        low = lanes[j] < low ? lanes[j] : low;
+    for (; i < n; i++)
+        low = a[i] < low ? a[i] : low;
+    return low;
+}
+
+AVX2 static int64_t max_i64_avx2(const int64_t* a, size_t n) {
+    __m256i result = _mm256_set1_epi64x(a[0]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        result = _mm256_blendv_epi8(result, x, _mm256_cmpgt_epi64(x, result));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, result);
+    int64_t high = lanes[0];
+    for (int j = 1; j < 4; j++)
+        high = lanes[j] > high ? lanes[j] : high;
+    for (; i < n; i++)
+        high = a[i] > high ? a[i] : high;
+    return high;
+}
+
+// no fma, a fused multiply add would round differently than the others
+AVX2 static double dot_f64_avx2(const double* a, const double* b, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    return hsum_avx2(_mm256_add_pd(s0, s1)) + dot_f64_scalar(a + i, b + i, n - i);
+}
+
+AVX2 static void scale_f64_avx2(double* a, double k, size_t n) {
+    __m256d factor = _mm256_set1_pd(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    scale_f64_scalar(a + i, k, n - i);
+}
+
+AVX2 static void axpy_f64_avx2(double alpha, const double* x, double* y, size_t n) {
+    __m256d factor = _mm256_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d product = _mm256_mul_pd(factor, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+    }
+    axpy_f64_scalar(alpha, x + i, y + i, n - i);
+}
+
+AVX2 static void add_f64_avx2(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    add_f64_scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void add_i64_avx2(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i sum = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                       _mm256_loadu_si256((const __m256i*)(b + i)));
+        _mm256_storeu_si256((__m256i*)(out + i), sum);
+    }
+    add_i64_scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void mul_f64_avx2(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mul_f64_scalar(a + i, b + i, out + i, n - i);
+}
+
+// same as the sse2 one, with two shifts (by one lane, then by two) to sum up
+// the four lanes
+AVX2 static void prefix_sum_f64_avx2(const double* a, double* out, size_t n) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(out + i, x);
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    double total = _mm256_cvtsd_f64(carry);
+    for (; i < n; i++)
+        out[i] = total += a[i];
+}
+
+AVX2 static void prefix_sum_i64_avx2(const int64_t* a, int64_t* out, size_t n) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i carry = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0F));
+        x = _mm256_add_epi64(x, carry);
+        _mm256_storeu_si256((__m256i*)(out + i), x);
+        carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    uint64_t total = i > 0 ? (uint64_t)out[i - 1] : 0;
+    for (; i < n; i++)
+        out[i] = (int64_t)(total += (uint64_t)a[i]);
+}
+
+AVX2 static ptrdiff_t search_f64_avx2(const double* a, double x, size_t n) {
+    __m256d needle = _mm256_set1_pd(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(a + i), needle, _CMP_EQ_OQ));
+        if (mask != 0)
+            return (ptrdiff_t)(i + __builtin_ctz(mask));
+    }
+    ptrdiff_t found = search_f64_scalar(a + i, x, n - i);
+    return found < 0 ? -1 : (ptrdiff_t)i + found;
+}
+
+AVX2 static ptrdiff_t search_i64_avx2(const int64_t* a, int64_t x, size_t n) {
+    __m256i needle = _mm256_set1_epi64x(x);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(a + i)), needle);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+        if (mask != 0)
+            return (ptrdiff_t)(i + __builtin_ctz(mask));
+    }
+    ptrdiff_t found = search_i64_scalar(a + i, x, n - i);
+    return found < 0 ? -1 : (ptrdiff_t)i + found;
+}
+
+static const Kernels avx2_kernels = {
+    "avx2",
+    sum_f64_avx2, sum_i64_avx2,
+    min_f64_avx2, max_f64_avx2, min_i64_avx2, max_i64_avx2,
+    dot_f64_avx2, dot_i64_scalar,
+    scale_f64_avx2, scale_i64_scalar,
+    axpy_f64_avx2, axpy_i64_scalar,
+    add_f64_avx2, add_i64_avx2, mul_f64_avx2, mul_i64_scalar,
+    prefix_sum_f64_avx2, prefix_sum_i64_avx2,
+    search_f64_avx2, search_i64_avx2
+};
+
+#endif
+
+/* Picking a set */
+
+const Kernels* kernels_for(KernelLevel level) {
+    switch (level) {
+        case KERNELS_SCALAR:
+            return &scalar_kernels;
+#ifdef X86_KERNELS
+        case KERNELS_SSE2:
+            return &sse2_kernels;
+        case KERNELS_AVX2:
+            return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static const Kernels* best_kernels = NULL;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+static void pick_best_kernels() {
+    int level = KERNELS_AVX2;
+    const char* forced = getenv("VOLT_SIMD");
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+        level = KERNELS_SCALAR;
+    else if (forced != NULL && strcmp(forced, "sse2") == 0)
+        level = KERNELS_SSE2;
+
+    while ((best_kernels = kernels_for((KernelLevel)level)) == NULL)
+        level--;
+}
+
+const Kernels* kernels_get() {
+    pthread_once(&best_once, pick_best_kernels);
+    return best_kernels;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* The loops behind the typed array natives (see typed_array.h), over raw
+* arrays of doubles and int64s.
+*
+* Every kernel has a plain C version, and most have SSE2 and AVX2 ones too.
+* Which set is used is decided once, at runtime, by what the cpu supports
+* (or by $VOLT_SIMD, set to "scalar", "sse2" or "avx2", to force a lower one).
+* The sets only differ in speed, except that the vector versions add floats
+* up in a different order, so float sums can be off in the last bits.
+*
+* Int64 arithmetic wraps around on overflow.
+*/
+
+typedef enum {
+    KERNELS_SCALAR,
+    KERNELS_SSE2,
+    KERNELS_AVX2
+} KernelLevel;
+
+typedef struct {
+    const char* name;
+
+    double (*sum_f64)(const double* a, size_t n);
+    int64_t (*sum_i64)(const int64_t* a, size_t n);
+
+    // NaNs are skipped, so an empty (or all NaN) array gives +inf / -inf
+    double (*min_f64)(const double* a, size_t n);
+    double (*max_f64)(const double* a, size_t n);
+    // n must not be 0
+    int64_t (*min_i64)(const int64_t* a, size_t n);
+    int64_t (*max_i64)(const int64_t* a, size_t n);
+
+    double (*dot_f64)(const double* a, const double* b, size_t n);
+    int64_t (*dot_i64)(const int64_t* a, const int64_t* b, size_t n);
+
+    // a[i] *= k, in place
+    void (*scale_f64)(double* a, double k, size_t n);
+    void (*scale_i64)(int64_t* a, int64_t k, size_t n);
+
+    // y[i] += alpha * x[i], in place
+    void (*axpy_f64)(double alpha, const double* x, double* y, size_t n);
+    void (*axpy_i64)(int64_t alpha, const int64_t* x, int64_t* y, size_t n);
+
+    // out[i] = a[i] + b[i] / a[i] * b[i], out may be a or b
+    void (*add_f64)(const double* a, const double* b, double* out, size_t n);
+    void (*add_i64)(const int64_t* a, const int64_t* b, int64_t* out, size_t n);
+    void (*mul_f64)(const double* a, const double* b, double* out, size_t n);
+    void (*mul_i64)(const int64_t* a, const int64_t* b, int64_t* out, size_t n);
+
+    // out[i] = a[0] + ... + a[i]
+    void (*prefix_sum_f64)(const double* a, double* out, size_t n);
+    void (*prefix_sum_i64)(const int64_t* a, int64_t* out, size_t n);
+
+    // index of the first element equal to x, or -1
+    ptrdiff_t (*search_f64)(const double* a, double x, size_t n);
+    ptrdiff_t (*search_i64)(const int64_t* a, int64_t x, size_t n);
+} Kernels;
+
+// the best set this cpu supports
+const Kernels* kernels_get();
+
+// a specific set, or NULL if the cpu doesn't support it
+const Kernels* kernels_for(KernelLevel level);
@@ -6,6 +6,7 @@
 // #include "code/value.h"
 // #include "code/opcodes.h"
 #include "volt/vm.h"
+#include "volt/pool.h"
 // #include "debugging/disassembly.h"
 // #include "scanning/scanner.h"
 
@@ -43,7 +44,7 @@ static char* read_file(const char* path) {
     return buffer;
 }
 
-static void start_repl() {
+static void start_repl(VM* vm) {
     char line[1024];
 
     // Keeps reading for new lines until EOF and runs them
@@ -55,13 +56,13 @@ static void start_repl() {
         }
 
         // run the line
-        vm_execsource(line);
+        vm_execsource(vm, line);
     }
 }
 
-static void exec_file(const char* file_path) {
+static void exec_file(VM* vm, const char* file_path) {
     char * source = read_file(file_path);
-    InterpretResult result = vm_execsource(source);
+    InterpretResult result = vm_execsource(vm, source);
     free(source);
 
     // emit exit code based on result
@@ -69,19 +70,70 @@ static void exec_file(const char* file_path) {
     if (result == INTERPRET_RUNTIME_ERROR) exit(71);
 }
 
+// runs each file on its own isolate, upto job_count of them at the same time.
+// The output of every script is printed in the order of the files
+static int exec_files_parallel(int job_count, char** file_paths, int file_count) {
+    IsolatePool pool;
+    pool_init(&pool, job_count);
+
+    PoolJob** jobs = (PoolJob**)calloc(file_count, sizeof(PoolJob*));
+    int exit_code = 0;
+
+    for (int i = 0; i < file_count; i++) {
+        char* source = read_file(file_paths[i]);
+        PoolProgram* program = pool_load(&pool, source);
+        free(source);
+
+        if (program == NULL) {
+            exit_code = 65;
+            continue;
+        }
+        jobs[i] = pool_submit(&pool, program, true);
+        pool_release(&pool, program);
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        if (jobs[i] == NULL)
+            continue;
+
+        pool_wait(&pool, jobs[i]);
+        fwrite(jobs[i]->output, 1, jobs[i]->output_size, stdout);
+        fwrite(jobs[i]->errors, 1, jobs[i]->errors_size, stderr);
+
+        if (jobs[i]->result == INTERPRET_RUNTIME_ERROR && exit_code == 0)
+            exit_code = 71;
+        pool_job_free(jobs[i]);
+    }
+
+    free(jobs);
+    pool_free(&pool);
+    return exit_code;
+}
+
 int main(int argc, char** argv) {
-    vm_init();
+    if (argc >= 3 && strcmp(argv[1], "--jobs") == 0) {
+        int job_count = atoi(argv[2]);
+        if (job_count < 1 || argc == 3) {
+            fprintf(stderr, "Usage: volt --jobs N file...\n");
+            return 64;
+        }
+        return exec_files_parallel(job_count, argv + 3, argc - 3);
+    }
+
+    // the shared strings let spawn() hand the script's code to the workers
+    VM vm;
+    vm_init_shared(&vm);
     if (argc == 1) {
-        start_repl();
+        start_repl(&vm);
     }
     else if (argc == 2) {
-        exec_file(argv[1]);
+        exec_file(&vm, argv[1]);
     }
     else {
-        fprintf(stderr, "Usage: volt [file]\n");
+        fprintf(stderr, "Usage: volt [file]\n       volt --jobs N file...\n");
     }
 
-    vm_free();
+    vm_free(&vm);
     return 0;
 }
 
@@ -0,0 +1,233 @@
+#include "volt/map.h"
+
+#include <string.h>
+
+#include "volt/vm.h"
+#include "volt/mem.h"
+#include "volt/code/hashing.h"
+
+#define MAP_MIN_INDEX 8
+
+// Whole numbers are the same keys as the integers they're equal to (-0
+// included), and strings are looked up by their contents
+static Value normalize_key(VM* vm, Value key) {
+    int64_t whole;
+    if (IS_VAL_NUM(key) && num_to_i64(VAL_AS_NUM(key), &whole))
+        return MK_VAL_INT(whole);
+    if (IS_OBJ_ROPE(key))
+        return MK_VAL_OBJ(rope_flatten(vm, OBJ_AS_ROPE(key)));
+    return key;
+}
+
+// Nearby numbers only differ in a few of their bits, which would all land in
+// the same few slots if used as they are. So they're mixed with murmur3's
+// finalizer, which makes every bit of the input affect every bit of the hash
+static uint32_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hash_number(double number) {
+    uint64_t bits;
+    if (number != number)
+        bits = 0x7ff8000000000000ULL; // all NaNs are the same key
+    else
+        memcpy(&bits, &number, sizeof(bits));
+    return hash_bits(bits);
+}
+
+static uint32_t hash_key(Value key) {
+    switch (key.type) {
+        case VAL_NUMBER: return hash_number(VAL_AS_NUM(key));
+        case VAL_INT:    return hash_bits((uint64_t)VAL_AS_INT(key));
+        case VAL_BOOL:   return VAL_AS_BOOL(key) ? 0x9e3779b9u : 0x7f4a7c15u;
+        case VAL_NIL:    return 0x85ebca6bu;
+        default:         return string_hash(OBJ_AS_STRING(key));
+    }
+}
+
+// both keys are normalized
+static bool keys_equal(Value a, Value b) {
+    if (a.type != b.type)
+        return false;
+    switch (a.type) {
+        case VAL_NUMBER: {
+            double x = VAL_AS_NUM(a), y = VAL_AS_NUM(b);
+            return x == y || (x != x && y != y);
+        }
+        case VAL_INT:  return VAL_AS_INT(a) == VAL_AS_INT(b);
+        case VAL_BOOL: return VAL_AS_BOOL(a) == VAL_AS_BOOL(b);
+        case VAL_NIL:  return true;
+        default:       return strings_equal(OBJ_AS_STRING(a), OBJ_AS_STRING(b));
+    }
+}
+
+// The position of the key's entry, or -1. When it's not there, the empty
+// index slot the probe ended at is stored in empty_slot
+static int find_entry(ObjMap* map, Value key, uint32_t hash, uint32_t* empty_slot) {
+    if (map->index_capacity == 0)
+        return -1;
+
+    uint32_t mask = (uint32_t)map->index_capacity - 1;
+    // the index is never full, so this always ends
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        int32_t position = map->index[slot];
+        if (position < 0) {
+            *empty_slot = slot;
+            return -1;
+        }
+        MapEntry* entry = &map->entries[position];
+        if (entry->hash == hash && !entry->is_deleted && keys_equal(entry->key, key))
+            return position;
+    }
+}
+
+// Moves the live entries into fresh arrays, dropping the removed ones. The
+// map only grows if that wouldn't free up atleast half of the entries
+static void rebuild(VM* vm, ObjMap* map) {
+    int index_capacity = map->index_capacity;
+    if (index_capacity == 0)
+        index_capacity = MAP_MIN_INDEX;
+    else if (map->live_count >= map->entry_count / 2)
+        index_capacity *= 2;
+    int entry_capacity = index_capacity / 4 * 3;
+
+    // the old arrays stay in place until the end, in case these collect
+    MapEntry* entries = ALLOCATE(vm, MapEntry, entry_capacity);
+    int32_t* index = ALLOCATE(vm, int32_t, index_capacity);
+    memset(index, -1, sizeof(int32_t) * index_capacity);
+
+    uint32_t mask = (uint32_t)index_capacity - 1;
+    int count = 0;
+    for (int i = 0; i < map->entry_count; i++) {
+        if (map->entries[i].is_deleted)
+            continue;
+        entries[count] = map->entries[i];
+        uint32_t slot = entries[count].hash & mask;
+        while (index[slot] >= 0)
+            slot = (slot + 1) & mask;
+        index[slot] = count++;
+    }
+
+    FREE_ARRAY(vm, MapEntry, map->entries, map->entry_capacity);
+    FREE_ARRAY(vm, int32_t, map->index, map->index_capacity);
+    map->entries = entries;
+    map->entry_count = count;
+    map->entry_capacity = entry_capacity;
+    map->index = index;
+    map->index_capacity = index_capacity;
+}
+
+bool map_get(VM* vm, ObjMap* map, Value key, Value* value) {
+    key = normalize_key(vm, key);
+    uint32_t slot;
+    int position = find_entry(map, key, hash_key(key), &slot);
+    if (position < 0)
+        return false;
+    *value = map->entries[position].value;
+    return true;
+}
+
+void map_set(VM* vm, ObjMap* map, Value key, Value value) {
+    key = normalize_key(vm, key);
+    uint32_t hash = hash_key(key);
+    uint32_t slot;
+    int position = find_entry(map, key, hash, &slot);
+    if (position >= 0) {
+        map->entries[position].value = value;
+        return;
+    }
+
+    if (map->entry_count == map->entry_capacity) {
+        rebuild(vm, map);
+        find_entry(map, key, hash, &slot);
+    }
+
+    MapEntry* entry = &map->entries[map->entry_count];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->is_deleted = false;
+    map->index[slot] = map->entry_count++;
+    map->live_count++;
+}
+
+bool map_remove(VM* vm, ObjMap* map, Value key) {
+    key = normalize_key(vm, key);
+    uint32_t slot;
+    int position = find_entry(map, key, hash_key(key), &slot);
+    if (position < 0)
+        return false;
+
+    // the index slot keeps pointing at it, so probes still go past
+    MapEntry* entry = &map->entries[position];
+    entry->is_deleted = true;
+    entry->key = MK_VAL_NIL;
+    entry->value = MK_VAL_NIL;
+    map->live_count--;
+    return true;
+}
+
+void map_mark(VM* vm, ObjMap* map) {
+    for (int i = 0; i < map->entry_count; i++) {
+        mark_value(vm, map->entries[i].key);
+        mark_value(vm, map->entries[i].value);
+    }
+}
+
+void map_free(VM* vm, ObjMap* map) {
+    FREE_ARRAY(vm, MapEntry, map->entries, map->entry_capacity);
+    FREE_ARRAY(vm, int32_t, map->index, map->index_capacity);
+}
+
+/* Natives */
+
+// a list of the keys (or values) of the live entries, in order
+static Value entries_list(VM* vm, ObjMap* map, bool want_keys) {
+    ObjList* list = new_list(vm);
+    // on the stack while it grows
+    vm_pushstack(vm, MK_VAL_OBJ(list));
+    for (int i = 0; i < map->entry_count; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (!entry->is_deleted)
+            list_append(vm, list, want_keys ? entry->key : entry->value);
+    }
+    return vm_popstack(vm);
+}
+
+static Value keys_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_MAP(args[0]))
+        return native_error(vm, "map_keys() takes a map");
+    return entries_list(vm, OBJ_AS_MAP(args[0]), true);
+}
+
+static Value values_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_MAP(args[0]))
+        return native_error(vm, "map_values() takes a map");
+    return entries_list(vm, OBJ_AS_MAP(args[0]), false);
+}
+
+static Value has_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !IS_OBJ_MAP(args[0]))
+        return native_error(vm, "map_has() takes a map and a key");
+    Value value;
+    return MK_VAL_BOOL(map_key_valid(args[1]) && map_get(vm, OBJ_AS_MAP(args[0]), args[1], &value));
+}
+
+// map_remove(map, key), true if the key was there
+static Value remove_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !IS_OBJ_MAP(args[0]))
+        return native_error(vm, "map_remove() takes a map and a key");
+    return MK_VAL_BOOL(map_key_valid(args[1]) && map_remove(vm, OBJ_AS_MAP(args[0]), args[1]));
+}
+
+void define_map_natives(VM* vm) {
+    vm_define_native(vm, "map_keys", keys_native);
+    vm_define_native(vm, "map_values", values_native);
+    vm_define_native(vm, "map_has", has_native);
+    vm_define_native(vm, "map_remove", remove_native);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+#include "volt/code/object.h"
+
+/*
+* Operations on ObjMap (see object.h).
+*
+* Keys can be numbers, strings (ropes are flattened first), booleans and nil.
+* Numbers are compared the way == does, except that NaN is a key equal to
+* itself (so it can be found again). Whole numbers are stored as the integers
+* they're equal to, so 1.0 and 1 (and -0 and 0) are the same key.
+*
+* In scripts, {k: v, ...} makes a map, m[k] gets a value (nil if the key
+* isn't there) and m[k] = v sets one. The natives are map_keys(m) and
+* map_values(m) (lists, in the order the keys were added), map_has(m, k),
+* map_remove(m, k) and len(m), prefixed so scripts keep names like keys.
+*/
+
+// whether the value can be used as a map key
+static inline bool map_key_valid(Value key) {
+    return !IS_VAL_OBJ(key) || IS_OBJ_STRINGLIKE(key);
+}
+
+/*
+* The key must be valid. Everything passed to these must be reachable (e.g
+* on the vm stack), as flattening a rope key and growing the map allocate
+*/
+bool map_get(VM* vm, ObjMap* map, Value key, Value* value);
+void map_set(VM* vm, ObjMap* map, Value key, Value value);
+// false if the key wasn't there
+bool map_remove(VM* vm, ObjMap* map, Value key);
+
+void map_mark(VM* vm, ObjMap* map);
+void map_free(VM* vm, ObjMap* map);
+
+void define_map_natives(VM* vm);
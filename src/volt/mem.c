@@ -2,50 +2,372 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "volt/vm.h"
+#include "volt/scheduler.h"
+#include "volt/pool.h"
+#include "volt/map.h"
 #include "volt/code/object.h"
+#include "volt/compiling/compiler.h"
+#include "volt/debugging/switches.h"
+
+// the heap size after a collection is multiplied by this to get the next threshold
+#define GC_HEAP_GROW_FACTOR 2
+
+static inline void collect_if_needed(VM* vm) {
+    if (vm->is_shared)
+        return;
+#ifdef DEBUG_STRESS_GC
+    collect_garbage(vm);
+#endif
+    if (vm->bytes_allocated > vm->next_gc) {
+        collect_garbage(vm);
+    }
+}
 
 // All memory handling must be done here to pass through logging
-void* reallocate(void* buffer, int old_size, int new_size) {
+void* reallocate(VM* vm, void* buffer, int old_size, int new_size) {
+    vm->bytes_allocated += new_size - old_size;
+
+    if (new_size > old_size) {
+        collect_if_needed(vm);
+    }
+
     if (new_size == 0) {
-        free(buffer);
+        heap_free_buffer(&vm->heap, buffer, old_size);
         return NULL;
     }
 
-    void* result = realloc(buffer, new_size);
-    if (result == NULL) {
-        fprintf(stderr, "Failed to allocate memory\n");
-        exit(1);
-    }
-    return result;
+    return heap_realloc_buffer(&vm->heap, buffer, old_size, new_size);
+}
+
+Obj* allocate_obj_memory(VM* vm, size_t size) {
+    vm->bytes_allocated += size;
+    collect_if_needed(vm);
+    return heap_alloc_object(&vm->heap, size);
 }
 
-static void free_object(Obj* object) {
+// Releases whatever memory an object owns. The memory of the object itself
+// is given back by the heap, which calls this for every object it frees
+static void free_object(void* context, Obj* object) {
+    VM* vm = (VM*)context;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string_obj = (ObjString*) object;
-            FREE_ARRAY(char, string_obj->chars, string_obj->length + 1); // include the null terminator
-            FREE(ObjString, string_obj);
+            vm->bytes_allocated -= STRING_ALLOC_SIZE(string_obj->length);
+            break;
+        }
+        case OBJ_ROPE: {
+            vm->bytes_allocated -= sizeof(ObjRope);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* func = (ObjFunction*) object;
-            chunk_free(&func->chunk);
-            FREE(ObjFunction, func);
+            vm->bytes_allocated -= sizeof(ObjFunction);
+            if (func->chunk.is_packed)
+                vm->bytes_allocated -= sizeof(PropertyCache) * func->cache_count + chunk_packed_size(&func->chunk);
+            chunk_free(vm, &func->chunk);
             break;
         }
         case OBJ_NATIVEFN: {
-            FREE(ObjNativeFn, (ObjNativeFn*)object);
+            vm->bytes_allocated -= sizeof(ObjNativeFn);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            vm->bytes_allocated -= CLOSURE_ALLOC_SIZE(((ObjClosure*)object)->capture_count);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            vm->bytes_allocated -= sizeof(ObjUpvalue);
+            break;
+        }
+        case OBJ_CLASS: {
+            vm->bytes_allocated -= sizeof(ObjClass);
+            hashtable_free(vm, &((ObjClass*)object)->methods);
+            break;
+        }
+        case OBJ_SHAPE: {
+            vm->bytes_allocated -= sizeof(ObjShape);
+            hashtable_free(vm, &((ObjShape*)object)->transitions);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            vm->bytes_allocated -= sizeof(ObjInstance);
+            FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            vm->bytes_allocated -= sizeof(ObjBoundMethod);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            vm->bytes_allocated -= sizeof(ObjFiber);
+            free(fiber->stacks.stack);
+            free(fiber->stacks.frames);
+            break;
+        }
+        // the channel itself lives on, only the handle goes
+        case OBJ_CHANNEL: {
+            vm->bytes_allocated -= sizeof(ObjChannel);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            vm->bytes_allocated -= sizeof(ObjList);
+            valarray_free(vm, &list->items);
+            break;
+        }
+        case OBJ_MAP: {
+            vm->bytes_allocated -= sizeof(ObjMap);
+            map_free(vm, (ObjMap*)object);
+            break;
+        }
+        case OBJ_TYPED_ARRAY: {
+            vm->bytes_allocated -= TYPED_ARRAY_ALLOC_SIZE(((ObjTypedArray*)object)->length);
+            break;
+        }
+        // the task may still be running, it's freed once it's done too
+        case OBJ_TASK: {
+            vm->bytes_allocated -= sizeof(ObjTask);
+            task_release(((ObjTask*)object)->task);
+            break;
+        }
+    }
+}
+
+void free_objects(VM* vm) {
+    heap_free(&vm->heap, free_object, vm);
+}
+
+/* Garbage collection */
+
+void mark_object(VM* vm, Obj* object) {
+    if (object == NULL)
+        return;
+    // objects of other vms (shared code) are kept alive by their owners
+    if (!heap_owns(&vm->heap, object) || heap_is_marked(object))
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_val(vm, MK_VAL_OBJ(object));
+    printf("\n");
+#endif
+
+    heap_set_marked(object);
+
+    // The gray stack is deliberately not allocated through reallocate()
+    // because that could start a collection in the middle of this one
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack = (Obj**)realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
+        if (vm->gray_stack == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+void mark_value(VM* vm, Value val) {
+    if (IS_VAL_OBJ(val))
+        mark_object(vm, VAL_AS_OBJ(val));
+}
+
+static void mark_array(VM* vm, ValueArray* valarr) {
+    for (int i = 0; i < valarr->count; i++) {
+        mark_value(vm, valarr->values[i]);
+    }
+}
+
+// the list has to stay intact, even when nothing else uses the upvalues
+static void mark_open_upvalues(VM* vm, ObjUpvalue* upvalue) {
+    for (; upvalue != NULL; upvalue = upvalue->next)
+        mark_object(vm, (Obj*)upvalue);
+}
+
+static void mark_stacks(VM* vm, FiberStacks* stacks) {
+    for (Value* slot = stacks->stack; slot < stacks->stack_top; slot++)
+        mark_value(vm, *slot);
+    for (unsigned int i = 0; i < stacks->frame_count; i++)
+        mark_object(vm, (Obj*)stacks->frames[i].func);
+    mark_open_upvalues(vm, stacks->open_upvalues);
+}
+
+// marks all the objects referenced by the given (already marked) object
+static void blacken_object(VM* vm, Obj* object) {
+    switch (object->type) {
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            mark_object(vm, rope->left);
+            mark_object(vm, rope->right);
+            mark_object(vm, (Obj*)rope->flat);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* func = (ObjFunction*) object;
+            mark_object(vm, (Obj*)func->name);
+            mark_array(vm, &func->chunk.constants);
+            // the cached shapes have to stay, a new one at the same address
+            // would pass for them
+            for (int i = 0; i < func->cache_count && func->caches != NULL; i++) {
+                for (int j = 0; j < PROPERTY_CACHE_WAYS; j++) {
+                    mark_object(vm, (Obj*)func->caches[i].entries[j].shape);
+                    mark_object(vm, func->caches[i].entries[j].target);
+                }
+            }
+            break;
+        }
+
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            mark_object(vm, (Obj*)closure->func);
+            for (int i = 0; i < closure->capture_count; i++)
+                mark_value(vm, closure->captures[i]);
+            break;
+        }
+
+        case OBJ_UPVALUE: {
+            // an open one's value is on the owner's stack
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            mark_value(vm, upvalue->closed);
+            mark_object(vm, upvalue->owner);
+            break;
+        }
+
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            mark_object(vm, (Obj*)klass->name);
+            hashtable_mark(vm, &klass->methods);
+            mark_value(vm, klass->initializer);
+            mark_object(vm, (Obj*)klass->root_shape);
+            break;
+        }
+
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            mark_object(vm, (Obj*)shape->klass);
+            mark_object(vm, (Obj*)shape->parent);
+            mark_object(vm, (Obj*)shape->name);
+            hashtable_mark(vm, &shape->transitions);
+            break;
+        }
+
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            mark_object(vm, (Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->field_count; i++)
+                mark_value(vm, instance->fields[i]);
+            break;
+        }
+
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            mark_value(vm, bound->receiver);
+            mark_object(vm, bound->method);
+            break;
+        }
+
+        case OBJ_LIST:
+            mark_array(vm, &((ObjList*)object)->items);
+            break;
+
+        case OBJ_MAP:
+            map_mark(vm, (ObjMap*)object);
+            break;
+
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            mark_object(vm, (Obj*)fiber->entry);
+            mark_object(vm, (Obj*)fiber->resumer);
+            // the stacks of the running fiber are the vm's, and are roots
+            if (fiber != vm->fiber)
+                mark_stacks(vm, &fiber->stacks);
             break;
         }
+
+        // these don't reference any other object
+        case OBJ_STRING:
+        case OBJ_NATIVEFN:
+        case OBJ_CHANNEL:
+        case OBJ_TASK:
+            break;
+    }
+}
+
+static void mark_roots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
+        mark_value(vm, *slot);
     }
+
+    // the frames' closures are in their first slots, on the stack
+    for (unsigned int i = 0; i < vm->frame_count; i++) {
+        mark_object(vm, (Obj*)vm->frames[i].func);
+    }
+    mark_open_upvalues(vm, vm->open_upvalues);
+
+    // the main script's stacks, put aside while a fiber runs
+    if (vm->fiber != NULL) {
+        mark_object(vm, (Obj*)vm->fiber);
+        mark_stacks(vm, &vm->root_stacks);
+    }
+
+    // parked and ready waiters, tasks that haven't started yet
+    loop_mark(vm, &vm->loop);
+    // the code the tasks spawned from here are running on other threads
+    if (vm->task_origin != NULL)
+        scheduler_mark(vm);
+    // the programs a pool has cached or that its workers still run
+    if (vm->pool != NULL)
+        pool_mark(vm->pool);
+
+    hashtable_mark(vm, &vm->globals);
+    mark_compiler_roots(vm);
+
+    // Note that vm->interned_strings is NOT a root. It only holds weak references
+    // which are cleared by hashtable_remove_white() before sweeping
 }
 
-// takes a linked list of objects and frees them
-void free_objects(Obj* list_start) {
-    Obj* object = list_start;
-    while (object != NULL) {
-        Obj* next = object->next;
-        free_object(object);
-        object = next;
+static void trace_references(VM* vm) {
+    while (vm->gray_count > 0) {
+        Obj* object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object);
     }
 }
+
+void collect_garbage(VM* vm) {
+    // collecting is not reentrant, and shrinking the interned strings table
+    // below allocates
+    if (vm->is_collecting)
+        return;
+    vm->is_collecting = true;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytes_allocated;
+#endif
+
+    mark_roots(vm);
+    trace_references(vm);
+    hashtable_remove_white(vm, &vm->interned_strings);
+    heap_sweep(&vm->heap, free_object, vm);
+
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm->next_gc < GC_INITIAL_THRESHOLD)
+        vm->next_gc = GC_INITIAL_THRESHOLD;
+
+    vm->is_collecting = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->bytes_allocated, before, vm->bytes_allocated, vm->next_gc);
+#endif
+}
@@ -1,23 +1,26 @@
 #pragma once
 
+#include <stddef.h>
+#include "volt/code/value.h"
+
 // doubles a number with a minimun output of 8
 #define GROW_CAPACITY(cap) \
     ((cap) < 8 ? 8 : (cap) * 2)
 
-#define GROW_ARRAY(type, buffer, old_count, new_count) \
-    (type*)reallocate(buffer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define GROW_ARRAY(vm, type, buffer, old_count, new_count) \
+    (type*)reallocate(vm, buffer, sizeof(type) * (old_count), sizeof(type) * (new_count))
 
 // free array of count old_count
-#define FREE_ARRAY(type, buffer, old_count) \
-    reallocate(buffer, sizeof(type) * (old_count) , 0)
+#define FREE_ARRAY(vm, type, buffer, old_count) \
+    reallocate(vm, buffer, sizeof(type) * (old_count) , 0)
 
 // free an object
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) \
+    reallocate(vm, pointer, sizeof(type), 0)
 
 // a thin wrapper around allocate
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 /*
 ** if new_size == 0, it frees the buffer (regardless of what old_size is)
@@ -25,6 +28,29 @@
 ** if new_size < old_size, it shrinks the buffer
 ** if old_size == 0, it allocates a new block of memory and returns it
 * in any case returns NULL on failure
+*
+* Growing a buffer may trigger a garbage collection, so any object that is
+* not yet reachable from the roots must be protected (e.g pushed on the vm stack)
+* before calling it
+*
+* All the memory is taken from (and accounted to) the given vm, which must be
+* the one that owns the buffer
 */
-void* reallocate(void* buffer, int old_size, int new_size);
-void free_objects();
\ No newline at end of file
+void* reallocate(VM* vm, void* buffer, int old_size, int new_size);
+
+// Gets the memory for a new object from the vm's heap. It may trigger a garbage
+// collection just like reallocate(). Objects are never freed explicitly, the
+// collector gives their memory back to the heap
+Obj* allocate_obj_memory(VM* vm, size_t size);
+
+// frees all the objects of the vm's heap along with the heap itself
+void free_objects(VM* vm);
+
+/* Garbage collection */
+
+// the heap size at which the first collection happens
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+void mark_object(VM* vm, Obj* object);
+void mark_value(VM* vm, Value val);
+void collect_garbage(VM* vm);
@@ -0,0 +1,303 @@
+// for open_memstream()
+#define _GNU_SOURCE
+
+#include "volt/pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "volt/mem.h"
+#include "volt/code/hashing.h"
+#include "volt/compiling/compiler.h"
+
+static void run_job(IsolatePool* pool, VM* vm, PoolJob* job) {
+    FILE* out = NULL;
+    FILE* err = NULL;
+    if (job->capture) {
+        out = open_memstream(&job->output, &job->output_size);
+        err = open_memstream(&job->errors, &job->errors_size);
+        if (out == NULL || err == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        vm->out = out;
+        vm->err = err;
+    }
+
+    job->result = vm_run(vm, job->program->func);
+    // drops the globals pointing into the program before the job lets go of
+    // it, after which the loader may free it
+    vm_reset(vm);
+
+    if (job->capture) {
+        fclose(out);
+        fclose(err);
+        vm->out = stdout;
+        vm->err = stderr;
+    }
+}
+
+static void* worker_main(void* arg) {
+    PoolWorker* worker = (PoolWorker*)arg;
+    IsolatePool* pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->queue_lock);
+        while (pool->queue_head == NULL && !pool->is_stopping)
+            pthread_cond_wait(&pool->job_available, &pool->queue_lock);
+
+        PoolJob* job = pool->queue_head;
+        if (job == NULL) {
+            // stopping, and nothing left to run
+            pthread_mutex_unlock(&pool->queue_lock);
+            break;
+        }
+        pool->queue_head = job->next;
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+        pthread_mutex_unlock(&pool->queue_lock);
+
+        run_job(pool, &worker->vm, job);
+
+        pthread_mutex_lock(&pool->queue_lock);
+        job->is_done = true;
+        pthread_cond_broadcast(&pool->job_done);
+        pthread_mutex_unlock(&pool->queue_lock);
+    }
+
+    return NULL;
+}
+
+void pool_init(IsolatePool* pool, int worker_count) {
+    vm_init_shared(&pool->loader);
+    pool->loader.is_shared = true;
+    pool->loader.pool = pool;
+    pthread_mutex_init(&pool->load_lock, NULL);
+    pthread_mutex_init(&pool->programs_lock, NULL);
+    pool->programs = NULL;
+    pool->cached_count = 0;
+
+    pthread_mutex_init(&pool->queue_lock, NULL);
+    pthread_cond_init(&pool->job_available, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    pool->queue_head = NULL;
+    pool->queue_tail = NULL;
+    pool->is_stopping = false;
+
+    if (worker_count < 1)
+        worker_count = 1;
+    pool->worker_count = worker_count;
+    pool->workers = (PoolWorker*)malloc(sizeof(PoolWorker) * worker_count);
+    if (pool->workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        PoolWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        vm_init_shared(&worker->vm);
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start a worker thread\n");
+            exit(1);
+        }
+    }
+}
+
+void pool_free(IsolatePool* pool) {
+    pthread_mutex_lock(&pool->queue_lock);
+    pool->is_stopping = true;
+    pthread_cond_broadcast(&pool->job_available);
+    pthread_mutex_unlock(&pool->queue_lock);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        vm_free(&pool->workers[i].vm);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->worker_count = 0;
+
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_available);
+    pthread_mutex_destroy(&pool->queue_lock);
+    pthread_mutex_destroy(&pool->load_lock);
+    pthread_mutex_destroy(&pool->programs_lock);
+
+    PoolProgram* program = pool->programs;
+    while (program != NULL) {
+        PoolProgram* next = program->next;
+        free(program->source);
+        free(program);
+        program = next;
+    }
+    pool->programs = NULL;
+    pool->cached_count = 0;
+
+    vm_free(&pool->loader);
+}
+
+static void unlink_program(IsolatePool* pool, PoolProgram* program) {
+    if (program->prev != NULL)
+        program->prev->next = program->next;
+    else
+        pool->programs = program->next;
+    if (program->next != NULL)
+        program->next->prev = program->prev;
+}
+
+static void push_program(IsolatePool* pool, PoolProgram* program) {
+    program->prev = NULL;
+    program->next = pool->programs;
+    if (pool->programs != NULL)
+        pool->programs->prev = program;
+    pool->programs = program;
+}
+
+// Drops a program from the cache, and forgets it entirely once nothing holds
+// it. Its function is left for the loader to collect
+static void uncache_program(IsolatePool* pool, PoolProgram* program) {
+    free(program->source);
+    program->source = NULL;
+    pool->cached_count--;
+    if (program->holds == 0) {
+        unlink_program(pool, program);
+        free(program);
+    }
+}
+
+// Returns the cached program with the given source, held, or NULL
+static PoolProgram* find_program(IsolatePool* pool, const char* source, int length, uint32_t hash) {
+    pthread_mutex_lock(&pool->programs_lock);
+    PoolProgram* program = pool->programs;
+    while (program != NULL) {
+        if (program->source != NULL && program->hash == hash && program->length == length &&
+            memcmp(program->source, source, length) == 0)
+            break;
+        program = program->next;
+    }
+    if (program != NULL) {
+        program->holds++;
+        unlink_program(pool, program);
+        push_program(pool, program);
+    }
+    pthread_mutex_unlock(&pool->programs_lock);
+    return program;
+}
+
+static PoolProgram* cache_program(IsolatePool* pool, ObjFunction* func, const char* source, int length, uint32_t hash) {
+    PoolProgram* program = (PoolProgram*)malloc(sizeof(PoolProgram));
+    char* copy = (char*)malloc(length + 1);
+    if (program == NULL || copy == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    memcpy(copy, source, length + 1);
+    program->func = func;
+    program->source = copy;
+    program->length = length;
+    program->hash = hash;
+    program->holds = 1;
+
+    pthread_mutex_lock(&pool->programs_lock);
+    push_program(pool, program);
+    pool->cached_count++;
+    if (pool->cached_count > POOL_MAX_PROGRAMS) {
+        // the least recently loaded program that's still cached
+        PoolProgram* oldest = pool->programs;
+        while (oldest->next != NULL)
+            oldest = oldest->next;
+        while (oldest->source == NULL)
+            oldest = oldest->prev;
+        uncache_program(pool, oldest);
+    }
+    pthread_mutex_unlock(&pool->programs_lock);
+    return program;
+}
+
+PoolProgram* pool_load(IsolatePool* pool, const char* source) {
+    VM* loader = &pool->loader;
+    int length = (int)strlen(source);
+    uint32_t hash = hash_string(source, length);
+
+    pthread_mutex_lock(&pool->load_lock);
+    PoolProgram* program = find_program(pool, source, length, hash);
+    if (program == NULL) {
+        // the loader never collects by itself (see VM::is_shared), so it
+        // collects here, between compilations
+        if (loader->bytes_allocated > loader->next_gc)
+            collect_garbage(loader);
+
+        ObjFunction* func = compile(loader, source);
+        if (func != NULL)
+            program = cache_program(pool, func, source, length, hash);
+    }
+    pthread_mutex_unlock(&pool->load_lock);
+    return program;
+}
+
+void pool_release(IsolatePool* pool, PoolProgram* program) {
+    pthread_mutex_lock(&pool->programs_lock);
+    program->holds--;
+    if (program->holds == 0 && program->source == NULL) {
+        unlink_program(pool, program);
+        free(program);
+    }
+    pthread_mutex_unlock(&pool->programs_lock);
+}
+
+void pool_mark(IsolatePool* pool) {
+    pthread_mutex_lock(&pool->programs_lock);
+    for (PoolProgram* program = pool->programs; program != NULL; program = program->next)
+        mark_object(&pool->loader, (Obj*)program->func);
+    pthread_mutex_unlock(&pool->programs_lock);
+}
+
+PoolJob* pool_submit(IsolatePool* pool, PoolProgram* program, bool capture) {
+    PoolJob* job = (PoolJob*)malloc(sizeof(PoolJob));
+    if (job == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&pool->programs_lock);
+    program->holds++;
+    pthread_mutex_unlock(&pool->programs_lock);
+
+    job->pool = pool;
+    job->program = program;
+    job->result = INTERPRET_OK;
+    job->capture = capture;
+    job->output = NULL;
+    job->output_size = 0;
+    job->errors = NULL;
+    job->errors_size = 0;
+    job->is_done = false;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->queue_lock);
+    if (pool->queue_tail == NULL)
+        pool->queue_head = job;
+    else
+        pool->queue_tail->next = job;
+    pool->queue_tail = job;
+    pthread_cond_signal(&pool->job_available);
+    pthread_mutex_unlock(&pool->queue_lock);
+
+    return job;
+}
+
+void pool_wait(IsolatePool* pool, PoolJob* job) {
+    pthread_mutex_lock(&pool->queue_lock);
+    while (!job->is_done)
+        pthread_cond_wait(&pool->job_done, &pool->queue_lock);
+    pthread_mutex_unlock(&pool->queue_lock);
+}
+
+void pool_job_free(PoolJob* job) {
+    pool_release(job->pool, job->program);
+    free(job->output);
+    free(job->errors);
+    free(job);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "volt/bool.h"
+#include "volt/vm.h"
+
+/*
+* A pool of worker threads for running many independent scripts in parallel.
+*
+* Every worker owns an isolate: a vm of its own, with its own heap, stack and
+* globals, so the workers never need to synchronize while running a script.
+* Scripts are compiled once by the pool's loader vm and the compiled functions
+* are shared read only by all the workers. Loading the same source again just
+* returns the already compiled program.
+*
+* Up to POOL_MAX_PROGRAMS programs are cached by their source, the least
+* recently loaded ones are dropped first. A program stays alive while it's
+* cached or held: pool_load() holds it for the caller until pool_release(), and
+* each job holds its program until pool_job_free(). The loader vm collects the
+* rest, only ever while loading (so never in the middle of a compilation). Its
+* collections just read the objects the workers are running, and free ones
+* which no worker can reach anymore.
+*
+* All the vms of the pool intern their strings in the process wide table (see
+* shared_strings.h), so the strings in the compiled code are the same objects
+* for every worker.
+*/
+
+#define POOL_MAX_PROGRAMS 256
+
+typedef struct PoolProgram PoolProgram;
+typedef struct PoolJob PoolJob;
+
+struct PoolProgram {
+    ObjFunction* func;
+
+    // the source it was compiled from, a copy owned by the cache (NULL once
+    // it's dropped from the cache)
+    char* source;
+    int length;
+    uint32_t hash;
+
+    // the pool_load()s not released yet and the jobs not freed yet
+    int holds;
+    // all the programs that are cached or held, most recently loaded first
+    PoolProgram* next;
+    PoolProgram* prev;
+};
+
+struct PoolJob {
+    struct IsolatePool* pool;
+    PoolProgram* program;
+    InterpretResult result;
+
+    // When capturing, the output and the runtime errors of the script are
+    // written here (null terminated) instead of stdout and stderr
+    bool capture;
+    char* output;
+    size_t output_size;
+    char* errors;
+    size_t errors_size;
+
+    bool is_done;
+    PoolJob* next;
+};
+
+typedef struct {
+    pthread_t thread;
+    struct IsolatePool* pool;
+    VM vm;
+} PoolWorker;
+
+typedef struct IsolatePool {
+    VM loader;
+    // only one script is compiled at a time
+    pthread_mutex_t load_lock;
+    // guards the programs and their holds
+    pthread_mutex_t programs_lock;
+    PoolProgram* programs;
+    int cached_count;
+
+    PoolWorker* workers;
+    int worker_count;
+
+    // the queue of jobs waiting for a worker
+    pthread_mutex_t queue_lock;
+    pthread_cond_t job_available;
+    pthread_cond_t job_done;
+    PoolJob* queue_head;
+    PoolJob* queue_tail;
+    bool is_stopping;
+} IsolatePool;
+
+// starts a pool with the given no. of worker threads
+void pool_init(IsolatePool* pool, int worker_count);
+// waits for all the queued jobs and stops the workers
+void pool_free(IsolatePool* pool);
+
+// Compiles a script, or returns the already compiled one with the same
+// source. Returns NULL if the source has a syntax error. The program is held
+// for the caller until pool_release()
+PoolProgram* pool_load(IsolatePool* pool, const char* source);
+void pool_release(IsolatePool* pool, PoolProgram* program);
+
+// Queues a compiled program to be run by the next free worker. The job holds
+// the program, so the caller can release it right away
+PoolJob* pool_submit(IsolatePool* pool, PoolProgram* program, bool capture);
+
+// blocks until the job has finished
+void pool_wait(IsolatePool* pool, PoolJob* job);
+
+// frees a finished job along with its captured output
+void pool_job_free(PoolJob* job);
+
+// marks the programs that are cached or held, for the loader's collections
+void pool_mark(IsolatePool* pool);
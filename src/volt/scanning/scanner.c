@@ -2,38 +2,29 @@
 #include <string.h>
 #include "volt/bool.h"
 
-typedef struct {
-    int line;
-    // Note: pointers to chars instead of offsets
-    const char* start;
-    const char* current;
-} Scanner;
-
-Scanner scanner;
-
-void scanner_init(const char* source) {
-    scanner.line = 1;
-    scanner.start = source;
-    scanner.current = source;
+void scanner_init(Scanner* scanner, const char* source) {
+    scanner->line = 1;
+    scanner->start = source;
+    scanner->current = source;
 }
 
-static inline bool is_at_end() {
-    return *scanner.current == '\0';
+static inline bool is_at_end(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
-static Token make_token(TokenType type) {
+static Token make_token(Scanner* scanner, TokenType type) {
     Token token;
-    token.line = scanner.line;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
+    token.line = scanner->line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
     token.type = type;
 
     return token;
 }
 
-static Token error_token(const char* msg) {
+static Token error_token(Scanner* scanner, const char* msg) {
     Token token;
-    token.line = scanner.line;
+    token.line = scanner->line;
     token.start = msg;
     token.length = (int)strlen(msg);
     token.type = TOKEN_ERROR;
@@ -41,39 +32,39 @@ static Token error_token(const char* msg) {
     return token;
 }
 
-static inline char advance() {
-    scanner.current++;
-    return *(scanner.current - 1);
+static inline char advance(Scanner* scanner) {
+    scanner->current++;
+    return *(scanner->current - 1);
 }
 
-static inline char peek() {
-    return *scanner.current;
+static inline char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
-static inline char peek_next() {
-    if (is_at_end()) return '\0';
-    return *(scanner.current + 1);
+static inline char peek_next(Scanner* scanner) {
+    if (is_at_end(scanner)) return '\0';
+    return *(scanner->current + 1);
 }
 
-static bool match_next(char expected) {
-    if (is_at_end()) return false;
-    if (peek() != expected) return false;
-    scanner.current++;
+static bool match_next(Scanner* scanner, char expected) {
+    if (is_at_end(scanner)) return false;
+    if (peek(scanner) != expected) return false;
+    scanner->current++;
     return true;
 }
 
 /* NUMBERS AND STRINGS */
-static Token scan_string() {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+static Token scan_string(Scanner* scanner) {
+    while (peek(scanner) != '"' && !is_at_end(scanner)) {
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
 
-    if (is_at_end()) return error_token("Unterminated string.");
+    if (is_at_end(scanner)) return error_token(scanner, "Unterminated string.");
 
     // The closing quote.
-    advance();
-    return make_token(TOKEN_STRING);
+    advance(scanner);
+    return make_token(scanner, TOKEN_STRING);
 }
 
 static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
@@ -83,59 +74,79 @@ static bool is_alpha(char c) {
             c == '_';
 }
 
-static Token scan_number() {
-    while (is_digit(peek())) advance();
+static inline bool is_hex_digit(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static Token scan_number(Scanner* scanner) {
+    // 0x hex literals, always integers
+    if (scanner->start[0] == '0' && (peek(scanner) == 'x' || peek(scanner) == 'X') && is_hex_digit(peek_next(scanner))) {
+        advance(scanner);
+        while (is_hex_digit(peek(scanner))) advance(scanner);
+        return make_token(scanner, TOKEN_NUMBER);
+    }
+
+    while (is_digit(peek(scanner))) advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && is_digit(peek_next())) {
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
         // Consume the ".".
-        advance();
+        advance(scanner);
 
-        while (is_digit(peek())) advance();
+        while (is_digit(peek(scanner))) advance(scanner);
     }
 
-    return make_token(TOKEN_NUMBER);
+    return make_token(scanner, TOKEN_NUMBER);
 }
 
 /* IDENTIFIER TOKEN SCANNING */
-static TokenType check_keyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType check_keyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifier_type() {
-    switch (scanner.start[0]) {
-        case 'a': return check_keyword(1, 2, "nd",      TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass",    TOKEN_CLASS);
-        case 'e': return check_keyword(1, 3, "lse",     TOKEN_ELSE);
-        case 'i': return check_keyword(1, 1, "f",       TOKEN_IF);
-        case 'n': return check_keyword(1, 2, "il",      TOKEN_NIL);
-        case 'o': return check_keyword(1, 1, "r",       TOKEN_OR);
-        case 'p': return check_keyword(1, 4, "rint",    TOKEN_PRINT);
-        case 'r': return check_keyword(1, 5, "eturn",   TOKEN_RETURN);
-        case 's': return check_keyword(1, 4, "uper",    TOKEN_SUPER);
-        case 'v': return check_keyword(1, 2, "ar",      TOKEN_VAR);
-        case 'w': return check_keyword(1, 4, "hile",    TOKEN_WHILE);
+static TokenType identifier_type(Scanner* scanner) {
+    switch (scanner->start[0]) {
+        case 'a': return check_keyword(scanner, 1, 2, "nd",      TOKEN_AND);
+        case 'c': return check_keyword(scanner, 1, 4, "lass",    TOKEN_CLASS);
+        case 'e': return check_keyword(scanner, 1, 3, "lse",     TOKEN_ELSE);
+        case 'i': {
+            if (scanner->current - scanner->start == 2) {
+                switch (scanner->start[1]) {
+                    case 'f': return TOKEN_IF;
+                    case 'n': return TOKEN_IN;
+                }
+            }
+            break;
+        }
+        case 'n': return check_keyword(scanner, 1, 2, "il",      TOKEN_NIL);
+        case 'o': return check_keyword(scanner, 1, 1, "r",       TOKEN_OR);
+        case 'p': return check_keyword(scanner, 1, 4, "rint",    TOKEN_PRINT);
+        case 'r': return check_keyword(scanner, 1, 5, "eturn",   TOKEN_RETURN);
+        case 's': return check_keyword(scanner, 1, 4, "uper",    TOKEN_SUPER);
+        case 'v': return check_keyword(scanner, 1, 2, "ar",      TOKEN_VAR);
+        case 'w': return check_keyword(scanner, 1, 4, "hile",    TOKEN_WHILE);
+        case 'y': return check_keyword(scanner, 1, 4, "ield",    TOKEN_YIELD);
         case 'f': {
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return check_keyword(2, 1, "r",   TOKEN_FOR);
-                    case 'u': return check_keyword(2, 1, "n",   TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return check_keyword(scanner, 2, 1, "r",   TOKEN_FOR);
+                    case 'u': return check_keyword(scanner, 2, 1, "n",   TOKEN_FUN);
                 }
             }
             break;
         }
 
         case 't': {
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'h': return check_keyword(scanner, 2, 2, "is", TOKEN_THIS);
+                    case 'r': return check_keyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
@@ -144,32 +155,32 @@ static TokenType identifier_type() {
     return TOKEN_IDENTIFIER;
 }
 
-static Token scan_identifier() {
-    while (is_alpha(peek()) || is_digit(peek())) advance();
-    return make_token(identifier_type());
+static Token scan_identifier(Scanner* scanner) {
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner))) advance(scanner);
+    return make_token(scanner, identifier_type(scanner));
 }
 
 
-static void skip_whitespaces() {
+static void skip_whitespaces(Scanner* scanner) {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
 
             case '\n': {
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             }
 
             case '/': {
-                if (peek_next() == '/') {
+                if (peek_next(scanner) == '/') {
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !is_at_end()) advance();
+                    while (peek(scanner) != '\n' && !is_at_end(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -183,39 +194,52 @@ static void skip_whitespaces() {
 }
 
 // Scan the next token
-Token scan_token() {
-    skip_whitespaces();
-    scanner.start = scanner.current;
-    if (is_at_end()) return make_token(TOKEN_EOF);
+Token scan_token(Scanner* scanner) {
+    skip_whitespaces(scanner);
+    scanner->start = scanner->current;
+    if (is_at_end(scanner)) return make_token(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
     switch (c) {
         // single character tokens
-        case '(': return make_token(TOKEN_LEFT_PAREN);
-        case ')': return make_token(TOKEN_RIGHT_PAREN);
-        case '{': return make_token(TOKEN_LEFT_BRACE);
-        case '}': return make_token(TOKEN_RIGHT_BRACE);
-        case ';': return make_token(TOKEN_SEMICOLON);
-        case ',': return make_token(TOKEN_COMMA);
-        case '.': return make_token(TOKEN_DOT);
-        case '-': return make_token(TOKEN_MINUS);
-        case '+': return make_token(TOKEN_PLUS);
-        case '/': return make_token(TOKEN_SLASH);
-        case '*': return make_token(TOKEN_STAR);
+        case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
+        case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
+        case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+        case '[': return make_token(scanner, TOKEN_LEFT_BRACKET);
+        case ']': return make_token(scanner, TOKEN_RIGHT_BRACKET);
+        case ';': return make_token(scanner, TOKEN_SEMICOLON);
+        case ',': return make_token(scanner, TOKEN_COMMA);
+        case '.': return make_token(scanner,  match_next(scanner, '.') ? TOKEN_DOT_DOT : TOKEN_DOT );
+        case '-': return make_token(scanner, TOKEN_MINUS);
+        case '+': return make_token(scanner, TOKEN_PLUS);
+        case '/': return make_token(scanner, TOKEN_SLASH);
+        case '*': return make_token(scanner, TOKEN_STAR);
+        case ':': return make_token(scanner, TOKEN_COLON);
+        case '&': return make_token(scanner, TOKEN_AMPERSAND);
+        case '|': return make_token(scanner, TOKEN_PIPE);
+        case '^': return make_token(scanner, TOKEN_CARET);
+        case '~': return make_token(scanner, TOKEN_TILDE);
 
         // single and double character tokens
-        case '!': return make_token( match_next('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG );
-        case '=': return make_token( match_next('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL );
-        case '<': return make_token( match_next('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS );
-        case '>': return make_token( match_next('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER );
+        case '!': return make_token(scanner,  match_next(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG );
+        case '=': return make_token(scanner,  match_next(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL );
+        case '<': {
+            if (match_next(scanner, '<')) return make_token(scanner, TOKEN_LESS_LESS);
+            return make_token(scanner,  match_next(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS );
+        }
+        case '>': {
+            if (match_next(scanner, '>')) return make_token(scanner, TOKEN_GREATER_GREATER);
+            return make_token(scanner,  match_next(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER );
+        }
 
-        case '"': return scan_string();
+        case '"': return scan_string(scanner);
 
         default: {
-            if (is_digit(c)) return scan_number();
-            if (is_alpha(c)) return scan_identifier();
+            if (is_digit(c)) return scan_number(scanner);
+            if (is_alpha(c)) return scan_identifier(scanner);
             break;
         }
     }
-    return error_token("Unexpected character.");
+    return error_token(scanner, "Unexpected character.");
 }
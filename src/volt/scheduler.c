@@ -0,0 +1,754 @@
+#include "volt/scheduler.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "volt/vm.h"
+#include "volt/mem.h"
+#include "volt/heap.h"
+#include "volt/channel.h"
+#include "volt/hash_table.h"
+
+// how many times an idle worker looks for work before going to sleep
+#define SCHEDULER_SPIN_LIMIT 64
+// a worker helping out in join() can only nest this deep
+#define WORKER_MAX_DEPTH 16
+#define DEQUE_INITIAL_SIZE 64
+
+typedef enum {
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_DONE
+} TaskState;
+
+// the functions in the globals of the spawning vm, which is all a task sees
+typedef struct GlobalsSnapshot {
+    ObjString** names;
+    ObjFunction** functions;
+    int count;
+    // the tasks and worker vms using it, under the origin's lock
+    int holds;
+    struct GlobalsSnapshot* next;
+} GlobalsSnapshot;
+
+struct Task {
+    ObjFunction* func;
+    // The function of the task the origin spawned, that this one descends
+    // from. Every function a task can get to is either in its constants, or
+    // in the globals, so the origin keeps it alive along with them
+    ObjFunction* code_root;
+    Value* args; // exported, see channel_export()
+    int arg_count;
+    GlobalsSnapshot* globals;
+    TaskOrigin* origin;
+
+    // the origin's list of unfinished tasks
+    Task* prev_live;
+    Task* next_live;
+    // the shared queue of tasks spawned from outside the workers
+    Task* next_queued;
+
+    _Atomic int state;
+    bool failed;
+    Value result; // exported too
+    // one for the handle, one until the task is done
+    _Atomic int refs;
+};
+
+/*
+* The vm whose heap holds the code of a group of tasks. It keeps that code
+* alive, and can't be freed before all of them are done. Tasks spawned by a
+* task belong to the same origin as their parent
+*/
+struct TaskOrigin {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+
+    Task* live;
+    int live_count;
+
+    GlobalsSnapshot* snapshots;
+    // the newest snapshot, still matching the globals at current_version
+    GlobalsSnapshot* current;
+    unsigned long current_version;
+    // holds of all the snapshots
+    int holds;
+};
+
+/* The deques */
+
+typedef struct DequeArray {
+    int64_t size;
+    // arrays replaced by a bigger one, stealers may still be reading them
+    struct DequeArray* retired;
+    _Atomic(Task*) slots[];
+} DequeArray;
+
+// The owner pushes and takes at the bottom, the thieves steal from the top.
+// See "Correct and Efficient Work-Stealing for Weak Memory Models"
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic(DequeArray*) array;
+} Deque;
+
+static void* checked(void* ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static DequeArray* new_deque_array(int64_t size, DequeArray* retired) {
+    DequeArray* array = (DequeArray*)checked(malloc(sizeof(DequeArray) + sizeof(_Atomic(Task*)) * size));
+    array->size = size;
+    array->retired = retired;
+    return array;
+}
+
+static void deque_init(Deque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, new_deque_array(DEQUE_INITIAL_SIZE, NULL));
+}
+
+static void deque_push(Deque* deque, Task* task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->size - 1) {
+        DequeArray* bigger = new_deque_array(array->size * 2, array);
+        for (int64_t i = top; i < bottom; i++) {
+            Task* moved = atomic_load_explicit(&array->slots[i % array->size], memory_order_relaxed);
+            atomic_store_explicit(&bigger->slots[i % bigger->size], moved, memory_order_relaxed);
+        }
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+
+    atomic_store_explicit(&array->slots[bottom % array->size], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+static Task* deque_take(Deque* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // it was empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Task* task = atomic_load_explicit(&array->slots[bottom % array->size], memory_order_relaxed);
+    if (top == bottom) {
+        // the last one, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static Task* deque_steal(Deque* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+
+    DequeArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Task* task = atomic_load_explicit(&array->slots[top % array->size], memory_order_relaxed);
+    // lost to the owner or another thief, they'll run it
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static bool deque_is_empty(Deque* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return top >= bottom;
+}
+
+/* The workers */
+
+// a vm of a worker, along with the globals it has for the tasks
+typedef struct {
+    VM vm;
+    GlobalsSnapshot* installed;
+    TaskOrigin* installed_origin;
+    unsigned long installed_version;
+} WorkerVM;
+
+typedef struct {
+    pthread_t thread;
+    Deque deque;
+    // vms[d] runs the tasks started while d others are on the thread's stack,
+    // waiting in join(). Created when first needed
+    WorkerVM* vms[WORKER_MAX_DEPTH];
+    int depth;
+    unsigned int next_victim;
+} Worker;
+
+typedef struct {
+    Worker* workers;
+    int worker_count;
+
+    pthread_mutex_t queue_lock;
+    Task* queue_head;
+    Task* queue_tail;
+    _Atomic int queued;
+
+    // workers with nothing to do sleep here
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+    _Atomic int sleeping;
+
+    // and so do the threads waiting in join(), if they aren't workers
+    pthread_mutex_t done_lock;
+    pthread_cond_t task_done;
+    _Atomic int joining;
+} Scheduler;
+
+static Scheduler scheduler;
+static pthread_once_t scheduler_started = PTHREAD_ONCE_INIT;
+static _Thread_local Worker* current_worker = NULL;
+
+static void* worker_main(void* arg);
+
+static void start_scheduler() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* wanted = getenv("VOLT_WORKERS");
+    if (wanted != NULL && atoi(wanted) > 0)
+        cores = atoi(wanted);
+    scheduler.worker_count = cores < 1 ? 1 : (int)cores;
+    scheduler.workers = (Worker*)checked(calloc(scheduler.worker_count, sizeof(Worker)));
+
+    pthread_mutex_init(&scheduler.queue_lock, NULL);
+    scheduler.queue_head = NULL;
+    scheduler.queue_tail = NULL;
+    atomic_init(&scheduler.queued, 0);
+
+    pthread_mutex_init(&scheduler.idle_lock, NULL);
+    pthread_cond_init(&scheduler.work_available, NULL);
+    atomic_init(&scheduler.sleeping, 0);
+
+    pthread_mutex_init(&scheduler.done_lock, NULL);
+    pthread_cond_init(&scheduler.task_done, NULL);
+    atomic_init(&scheduler.joining, 0);
+
+    for (int i = 0; i < scheduler.worker_count; i++)
+        deque_init(&scheduler.workers[i].deque);
+
+    // the workers run until the process exits
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        Worker* worker = &scheduler.workers[i];
+        worker->next_victim = (unsigned int)i + 1;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start a worker thread\n");
+            exit(1);
+        }
+        pthread_detach(worker->thread);
+    }
+}
+
+// The fences pair a sleeper announcing itself and then looking for work, with
+// the other side adding work and then looking for sleepers (same as channel.c)
+static void wake_worker() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&scheduler.sleeping, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&scheduler.idle_lock);
+    pthread_cond_signal(&scheduler.work_available);
+    pthread_mutex_unlock(&scheduler.idle_lock);
+}
+
+static bool has_work() {
+    if (atomic_load_explicit(&scheduler.queued, memory_order_relaxed) > 0)
+        return true;
+    for (int i = 0; i < scheduler.worker_count; i++) {
+        if (!deque_is_empty(&scheduler.workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+static void queue_task(Task* task) {
+    Worker* worker = current_worker;
+    if (worker != NULL) {
+        deque_push(&worker->deque, task);
+    } else {
+        task->next_queued = NULL;
+        pthread_mutex_lock(&scheduler.queue_lock);
+        if (scheduler.queue_tail == NULL)
+            scheduler.queue_head = task;
+        else
+            scheduler.queue_tail->next_queued = task;
+        scheduler.queue_tail = task;
+        atomic_fetch_add_explicit(&scheduler.queued, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&scheduler.queue_lock);
+    }
+    wake_worker();
+}
+
+static Task* dequeue_task() {
+    if (atomic_load_explicit(&scheduler.queued, memory_order_relaxed) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&scheduler.queue_lock);
+    Task* task = scheduler.queue_head;
+    if (task != NULL) {
+        scheduler.queue_head = task->next_queued;
+        if (scheduler.queue_head == NULL)
+            scheduler.queue_tail = NULL;
+        atomic_fetch_sub_explicit(&scheduler.queued, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&scheduler.queue_lock);
+    return task;
+}
+
+// its own tasks first (the newest one, while its data is still in the cache),
+// then the shared queue, then the oldest task of some other worker
+static Task* find_task(Worker* worker) {
+    Task* task = deque_take(&worker->deque);
+    if (task == NULL)
+        task = dequeue_task();
+
+    for (int i = 0; task == NULL && i < scheduler.worker_count; i++) {
+        Worker* victim = &scheduler.workers[worker->next_victim++ % scheduler.worker_count];
+        if (victim != worker)
+            task = deque_steal(&victim->deque);
+    }
+    return task;
+}
+
+/* Globals */
+
+static void release_globals(TaskOrigin* origin, GlobalsSnapshot* snapshot) {
+    pthread_mutex_lock(&origin->lock);
+    snapshot->holds--;
+    if (--origin->holds == 0)
+        pthread_cond_broadcast(&origin->released);
+    pthread_mutex_unlock(&origin->lock);
+}
+
+static void drop_installed(WorkerVM* worker_vm) {
+    if (worker_vm->installed == NULL)
+        return;
+    release_globals(worker_vm->installed_origin, worker_vm->installed);
+    worker_vm->installed = NULL;
+    worker_vm->installed_origin = NULL;
+}
+
+// Once released, the origin may free the functions at any time, so they must
+// be gone from the vm before its collector comes across them
+static void uninstall_globals(WorkerVM* worker_vm) {
+    if (worker_vm->installed == NULL)
+        return;
+    drop_installed(worker_vm);
+    vm_reset(&worker_vm->vm);
+}
+
+// gives the vm the same global functions the task's spawner had. Anything a
+// previous task changed in them is dropped
+static void install_globals(WorkerVM* worker_vm, Task* task) {
+    VM* vm = &worker_vm->vm;
+    if (worker_vm->installed == task->globals && worker_vm->installed_version == vm->globals_version)
+        return;
+
+    // the new snapshot is held by the task, so the old functions can be
+    // released before they're dropped from the globals
+    drop_installed(worker_vm);
+    vm_reset(vm);
+    GlobalsSnapshot* snapshot = task->globals;
+    for (int i = 0; i < snapshot->count; i++)
+        hashtable_set(vm, &vm->globals, snapshot->names[i], MK_VAL_OBJ(snapshot->functions[i]));
+
+    pthread_mutex_lock(&task->origin->lock);
+    snapshot->holds++;
+    task->origin->holds++;
+    pthread_mutex_unlock(&task->origin->lock);
+
+    worker_vm->installed = snapshot;
+    worker_vm->installed_origin = task->origin;
+    worker_vm->installed_version = vm->globals_version;
+}
+
+static GlobalsSnapshot* take_snapshot(VM* vm) {
+    hashtable_finish_rehash(vm, &vm->globals);
+    HashTable* globals = &vm->globals;
+
+    GlobalsSnapshot* snapshot = (GlobalsSnapshot*)checked(malloc(sizeof(GlobalsSnapshot)));
+    snapshot->names = (ObjString**)checked(malloc(sizeof(ObjString*) * (globals->count + 1)));
+    snapshot->functions = (ObjFunction**)checked(malloc(sizeof(ObjFunction*) * (globals->count + 1)));
+    snapshot->count = 0;
+    snapshot->holds = 0;
+    snapshot->next = NULL;
+
+    for (int i = 0; i < globals->capacity; i++) {
+        HashTableEntry* entry = &globals->entries[i];
+        if (entry->key == NULL || !IS_OBJ_FUNC(entry->value))
+            continue;
+        snapshot->names[snapshot->count] = entry->key;
+        snapshot->functions[snapshot->count] = OBJ_AS_FUNC(entry->value);
+        snapshot->count++;
+    }
+    return snapshot;
+}
+
+static bool same_globals(GlobalsSnapshot* a, GlobalsSnapshot* b) {
+    if (a->count != b->count)
+        return false;
+    for (int i = 0; i < a->count; i++) {
+        if (a->names[i] != b->names[i] || a->functions[i] != b->functions[i])
+            return false;
+    }
+    return true;
+}
+
+static void free_snapshot(GlobalsSnapshot* snapshot) {
+    free(snapshot->names);
+    free(snapshot->functions);
+    free(snapshot);
+}
+
+// The snapshot of the vm's globals for a new task. Globals change all the
+// time (e.g loop counters), but the functions hardly ever do, so most of the
+// time the snapshot stays the same and the workers don't have to reinstall it
+static GlobalsSnapshot* current_globals(VM* vm, TaskOrigin* origin) {
+    if (origin->current != NULL && origin->current_version == vm->globals_version)
+        return origin->current;
+
+    GlobalsSnapshot* snapshot = take_snapshot(vm);
+    origin->current_version = vm->globals_version;
+    if (origin->current != NULL && same_globals(origin->current, snapshot)) {
+        free_snapshot(snapshot);
+        return origin->current;
+    }
+
+    // the old one is freed by scheduler_mark() once nothing holds it
+    pthread_mutex_lock(&origin->lock);
+    snapshot->next = origin->snapshots;
+    origin->snapshots = snapshot;
+    origin->current = snapshot;
+    pthread_mutex_unlock(&origin->lock);
+    return snapshot;
+}
+
+/* Tasks */
+
+static TaskOrigin* new_origin() {
+    TaskOrigin* origin = (TaskOrigin*)checked(malloc(sizeof(TaskOrigin)));
+    pthread_mutex_init(&origin->lock, NULL);
+    pthread_cond_init(&origin->released, NULL);
+    origin->live = NULL;
+    origin->live_count = 0;
+    origin->snapshots = NULL;
+    origin->current = NULL;
+    origin->current_version = 0;
+    origin->holds = 0;
+    return origin;
+}
+
+void task_release(Task* task) {
+    if (atomic_fetch_sub_explicit(&task->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (IS_VAL_OBJ(task->result) && !(VAL_AS_OBJ(task->result)->flags & OBJ_FLAG_IMMORTAL))
+        heap_free_detached(VAL_AS_OBJ(task->result));
+    free(task->args);
+    free(task);
+}
+
+static void finish_task(Task* task, bool failed, Value result) {
+    task->failed = failed;
+    task->result = result;
+
+    TaskOrigin* origin = task->origin;
+    pthread_mutex_lock(&origin->lock);
+    if (task->prev_live != NULL)
+        task->prev_live->next_live = task->next_live;
+    else
+        origin->live = task->next_live;
+    if (task->next_live != NULL)
+        task->next_live->prev_live = task->prev_live;
+    origin->live_count--;
+
+    task->globals->holds--;
+    origin->holds--;
+    if (origin->live_count == 0 || origin->holds == 0)
+        pthread_cond_broadcast(&origin->released);
+    pthread_mutex_unlock(&origin->lock);
+
+    atomic_store_explicit(&task->state, TASK_DONE, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&scheduler.joining, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&scheduler.done_lock);
+        pthread_cond_broadcast(&scheduler.task_done);
+        pthread_mutex_unlock(&scheduler.done_lock);
+    }
+
+    task_release(task);
+}
+
+static WorkerVM* vm_at_depth(Worker* worker, int depth) {
+    if (worker->vms[depth] == NULL) {
+        WorkerVM* worker_vm = (WorkerVM*)checked(malloc(sizeof(WorkerVM)));
+        vm_init_shared(&worker_vm->vm);
+        worker_vm->installed = NULL;
+        worker_vm->installed_origin = NULL;
+        worker_vm->installed_version = 0;
+        worker->vms[depth] = worker_vm;
+    }
+    return worker->vms[depth];
+}
+
+static void run_task(Worker* worker, Task* task) {
+    int depth = worker->depth;
+    WorkerVM* worker_vm = vm_at_depth(worker, depth);
+    VM* vm = &worker_vm->vm;
+    install_globals(worker_vm, task);
+
+    atomic_store_explicit(&task->state, TASK_RUNNING, memory_order_relaxed);
+    // taking over the arguments doesn't allocate, so none of them can be
+    // collected before they are on the stack
+    for (int i = 0; i < task->arg_count; i++)
+        task->args[i] = channel_import(vm, task->args[i]);
+
+    vm->running_task = task;
+    worker->depth++;
+    Value result = MK_VAL_NIL;
+    bool failed = vm_call(vm, task->func, task->arg_count, task->args, &result) != INTERPRET_OK;
+    worker->depth--;
+    vm->running_task = NULL;
+
+    Value sendable = MK_VAL_NIL;
+    if (!failed) {
+        vm_pushstack(vm, result);
+        if (!channel_export(vm, result, &sendable)) {
+            fprintf(vm->err, "A task can only return nil, booleans, numbers and strings\n");
+            failed = true;
+        }
+        vm_popstack(vm);
+    }
+    finish_task(task, failed, sendable);
+
+    // the vms for helping out are needed only every now and then
+    if (depth > 0)
+        uninstall_globals(worker_vm);
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    current_worker = worker;
+
+    int idle_rounds = 0;
+    for (;;) {
+        Task* task = find_task(worker);
+        if (task != NULL) {
+            run_task(worker, task);
+            idle_rounds = 0;
+            continue;
+        }
+
+        if (++idle_rounds < SCHEDULER_SPIN_LIMIT) {
+            sched_yield();
+            continue;
+        }
+
+        // let the origins go while sleeping, they may be waiting to be freed
+        if (worker->vms[0] != NULL)
+            uninstall_globals(worker->vms[0]);
+
+        pthread_mutex_lock(&scheduler.idle_lock);
+        atomic_fetch_add_explicit(&scheduler.sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!has_work())
+            pthread_cond_wait(&scheduler.work_available, &scheduler.idle_lock);
+        atomic_fetch_sub_explicit(&scheduler.sleeping, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&scheduler.idle_lock);
+        idle_rounds = 0;
+    }
+    return NULL;
+}
+
+static bool is_done(Task* task) {
+    return atomic_load_explicit(&task->state, memory_order_acquire) == TASK_DONE;
+}
+
+static void wait_for_task(Task* task) {
+    Worker* worker = current_worker;
+    if (worker != NULL) {
+        // run the other tasks meanwhile, the one waited for is probably one of them
+        while (!is_done(task)) {
+            Task* other = worker->depth < WORKER_MAX_DEPTH ? find_task(worker) : NULL;
+            if (other != NULL)
+                run_task(worker, other);
+            else
+                sched_yield();
+        }
+        return;
+    }
+
+    for (int tries = 0; tries < SCHEDULER_SPIN_LIMIT && !is_done(task); tries++)
+        sched_yield();
+
+    pthread_mutex_lock(&scheduler.done_lock);
+    atomic_fetch_add_explicit(&scheduler.joining, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!is_done(task))
+        pthread_cond_wait(&scheduler.task_done, &scheduler.done_lock);
+    atomic_fetch_sub_explicit(&scheduler.joining, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&scheduler.done_lock);
+}
+
+/* The vm side */
+
+void scheduler_mark(VM* vm) {
+    TaskOrigin* origin = vm->task_origin;
+    pthread_mutex_lock(&origin->lock);
+
+    for (Task* task = origin->live; task != NULL; task = task->next_live)
+        mark_object(vm, (Obj*)task->code_root);
+
+    GlobalsSnapshot** link = &origin->snapshots;
+    while (*link != NULL) {
+        GlobalsSnapshot* snapshot = *link;
+        if (snapshot->holds == 0 && snapshot != origin->current) {
+            *link = snapshot->next;
+            free_snapshot(snapshot);
+            continue;
+        }
+        for (int i = 0; i < snapshot->count; i++)
+            mark_object(vm, (Obj*)snapshot->functions[i]);
+        link = &snapshot->next;
+    }
+
+    pthread_mutex_unlock(&origin->lock);
+}
+
+void scheduler_release_vm(VM* vm) {
+    TaskOrigin* origin = vm->task_origin;
+    if (origin == NULL)
+        return;
+
+    pthread_mutex_lock(&origin->lock);
+    while (origin->live_count > 0 || origin->holds > 0)
+        pthread_cond_wait(&origin->released, &origin->lock);
+    pthread_mutex_unlock(&origin->lock);
+
+    while (origin->snapshots != NULL) {
+        GlobalsSnapshot* next = origin->snapshots->next;
+        free_snapshot(origin->snapshots);
+        origin->snapshots = next;
+    }
+    pthread_cond_destroy(&origin->released);
+    pthread_mutex_destroy(&origin->lock);
+    free(origin);
+    vm->task_origin = NULL;
+}
+
+// spawn(fn, args...), runs fn(args...) on one of the workers. Returns a
+// handle to join()
+static Value spawn_native(VM* vm, int argc, Value* args) {
+    if (argc < 1 || !IS_OBJ_FUNC(args[0]))
+        return native_error(vm, "spawn() takes a function and its arguments");
+    ObjFunction* func = OBJ_AS_FUNC(args[0]);
+    if ((int)func->arity != argc - 1)
+        return native_error(vm, "spawn() got the wrong no. of arguments for the function");
+    if (!vm->use_shared_strings)
+        return native_error(vm, "spawn() needs a vm that uses the shared strings");
+
+    Task* task = (Task*)checked(malloc(sizeof(Task)));
+    task->func = func;
+    task->arg_count = argc - 1;
+    task->args = (Value*)checked(malloc(sizeof(Value) * (argc > 1 ? argc - 1 : 1)));
+    for (int i = 0; i < task->arg_count; i++) {
+        if (!channel_export(vm, args[i + 1], &task->args[i])) {
+            for (int j = 0; j < i; j++) {
+                if (IS_VAL_OBJ(task->args[j]) && !(VAL_AS_OBJ(task->args[j])->flags & OBJ_FLAG_IMMORTAL))
+                    heap_free_detached(VAL_AS_OBJ(task->args[j]));
+            }
+            free(task->args);
+            free(task);
+            return native_error(vm, "Only nil, booleans, numbers and strings can be passed to a task");
+        }
+    }
+    atomic_init(&task->state, TASK_QUEUED);
+    atomic_init(&task->refs, 2);
+    task->failed = false;
+    task->result = MK_VAL_NIL;
+    task->prev_live = NULL;
+
+    // a task's own tasks see the same globals it does
+    if (vm->running_task != NULL) {
+        task->origin = vm->running_task->origin;
+        task->globals = vm->running_task->globals;
+        task->code_root = vm->running_task->code_root;
+    } else {
+        task->code_root = func;
+        if (vm->task_origin == NULL)
+            vm->task_origin = new_origin();
+        task->origin = vm->task_origin;
+        task->globals = current_globals(vm, task->origin);
+    }
+
+    // allocated before the task is live, as that could collect
+    ObjTask* handle = new_task_handle(vm, task);
+
+    TaskOrigin* origin = task->origin;
+    pthread_mutex_lock(&origin->lock);
+    task->next_live = origin->live;
+    if (origin->live != NULL)
+        origin->live->prev_live = task;
+    origin->live = task;
+    origin->live_count++;
+    task->globals->holds++;
+    origin->holds++;
+    pthread_mutex_unlock(&origin->lock);
+
+    pthread_once(&scheduler_started, start_scheduler);
+    queue_task(task);
+    return MK_VAL_OBJ(handle);
+}
+
+// join(handle), waits for the task and returns its result
+static Value join_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_TASK(args[0]))
+        return native_error(vm, "join() takes the handle of a task");
+
+    Task* task = OBJ_AS_TASK(args[0])->task;
+    wait_for_task(task);
+    if (task->failed)
+        return native_error(vm, "The joined task failed");
+
+    // joining again returns the same result, so it's copied rather than taken
+    Value result = task->result;
+    if (!IS_VAL_OBJ(result) || (VAL_AS_OBJ(result)->flags & OBJ_FLAG_IMMORTAL))
+        return result;
+    ObjString* string = OBJ_AS_STRING(result);
+    ObjString* copy = allocate_string(vm, string->length);
+    memcpy(copy->chars, string->chars, string->length);
+    return MK_VAL_OBJ(copy);
+}
+
+void define_scheduler_natives(VM* vm) {
+    vm_define_native(vm, "spawn", spawn_native);
+    vm_define_native(vm, "join", join_native);
+}
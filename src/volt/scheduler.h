@@ -0,0 +1,43 @@
+#pragma once
+
+#include "volt/bool.h"
+#include "volt/code/value.h"
+#include "volt/code/object.h"
+
+/*
+* Tasks run volt functions in parallel, on a fixed set of worker threads (one
+* per core, or $VOLT_WORKERS) that is started on the first spawn().
+*
+* spawn(fn, args...) queues a task and returns its handle right away, and
+* join(handle) waits for it and returns what fn returned. Any number of tasks
+* share the workers, M:N. Every worker has a Chase-Lev deque of tasks: it
+* pushes and pops the tasks it spawns itself at the bottom, and idle workers
+* steal from the top of the others'. Tasks spawned from outside the workers
+* (e.g by the main script) go through a shared queue instead.
+*
+* Each worker runs its tasks on a vm of its own, so a task has its own stack,
+* frames and heap. The code is shared: the task's function and the functions
+* in the spawning vm's globals are used as they are, which is why the spawning
+* vm has to use the shared strings (see vm_init_shared()). Nothing else is,
+* a task only sees the global functions and natives, and its arguments and
+* result follow the same rules as the values sent through a channel (see
+* channel.h).
+*
+* A worker that waits in join() runs other tasks meanwhile, so joining never
+* ties up a core.
+*/
+
+typedef struct Task Task;
+typedef struct TaskOrigin TaskOrigin;
+
+// defines spawn() and join()
+void define_scheduler_natives(VM* vm);
+
+// keeps the code used by the vm's unfinished tasks alive
+void scheduler_mark(VM* vm);
+
+// waits for all the tasks the vm has started, called by vm_free()
+void scheduler_release_vm(VM* vm);
+
+// drops the handle's reference to the task
+void task_release(Task* task);
@@ -0,0 +1,195 @@
+#include "volt/typed_array.h"
+
+#include "volt/vm.h"
+#include "volt/kernels.h"
+#include "volt/code/object.h"
+
+#define F64(array) TYPED_F64(array)
+#define I64(array) TYPED_I64(array)
+
+static Value new_array(VM* vm, ElemKind kind, int argc, Value* args) {
+    const char* usage = kind == ELEMS_F64 ? "Float64Array() takes a length or a list of numbers"
+                                          : "Int64Array() takes a length or a list of whole numbers";
+    if (argc != 1)
+        return native_error(vm, usage);
+
+    if (IS_VAL_NUMBERLIKE(args[0])) {
+        int64_t length;
+        if (!value_to_i64(args[0], &length) || length < 0 || length > TYPED_ARRAY_MAX_LENGTH)
+            return native_error(vm, usage);
+        return MK_VAL_OBJ(new_typed_array(vm, kind, (int)length));
+    }
+
+    if (!IS_OBJ_LIST(args[0]))
+        return native_error(vm, usage);
+    // the list is still in args, so it stays alive while this allocates
+    ObjList* list = OBJ_AS_LIST(args[0]);
+    ObjTypedArray* array = new_typed_array(vm, kind, list->items.count);
+    for (int i = 0; i < list->items.count; i++) {
+        if (!typed_array_store(array, i, list->items.values[i]))
+            return native_error(vm, usage);
+    }
+    return MK_VAL_OBJ(array);
+}
+
+static Value float64_array_native(VM* vm, int argc, Value* args) {
+    return new_array(vm, ELEMS_F64, argc, args);
+}
+
+static Value int64_array_native(VM* vm, int argc, Value* args) {
+    return new_array(vm, ELEMS_I64, argc, args);
+}
+
+static inline bool is_array(Value val) {
+    return IS_OBJ_TYPED_ARRAY(val);
+}
+
+static inline bool are_alike(Value a, Value b) {
+    return is_array(a) && is_array(b) &&
+           OBJ_AS_TYPED_ARRAY(a)->kind == OBJ_AS_TYPED_ARRAY(b)->kind &&
+           OBJ_AS_TYPED_ARRAY(a)->length == OBJ_AS_TYPED_ARRAY(b)->length;
+}
+
+static Value sum_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !is_array(args[0]))
+        return native_error(vm, "array_sum() takes a typed array");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    if (a->kind == ELEMS_F64)
+        return MK_VAL_NUM(kernels_get()->sum_f64(F64(a), a->length));
+    return MK_VAL_INT(kernels_get()->sum_i64(I64(a), a->length));
+}
+
+static Value min_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !is_array(args[0]))
+        return native_error(vm, "array_min() takes a typed array");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    if (a->length == 0)
+        return MK_VAL_NIL;
+    if (a->kind == ELEMS_F64)
+        return MK_VAL_NUM(kernels_get()->min_f64(F64(a), a->length));
+    return MK_VAL_INT(kernels_get()->min_i64(I64(a), a->length));
+}
+
+static Value max_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !is_array(args[0]))
+        return native_error(vm, "array_max() takes a typed array");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    if (a->length == 0)
+        return MK_VAL_NIL;
+    if (a->kind == ELEMS_F64)
+        return MK_VAL_NUM(kernels_get()->max_f64(F64(a), a->length));
+    return MK_VAL_INT(kernels_get()->max_i64(I64(a), a->length));
+}
+
+static Value dot_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !are_alike(args[0], args[1]))
+        return native_error(vm, "array_dot() takes two typed arrays of the same kind and length");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* b = OBJ_AS_TYPED_ARRAY(args[1]);
+    if (a->kind == ELEMS_F64)
+        return MK_VAL_NUM(kernels_get()->dot_f64(F64(a), F64(b), a->length));
+    return MK_VAL_INT(kernels_get()->dot_i64(I64(a), I64(b), a->length));
+}
+
+// gets a factor that can be applied to the array's elements
+static bool get_factor(ObjTypedArray* array, Value val, double* f64, int64_t* i64) {
+    if (!IS_VAL_NUMBERLIKE(val))
+        return false;
+    *f64 = NUMBERLIKE_AS_NUM(val);
+    return array->kind == ELEMS_F64 || value_to_i64(val, i64);
+}
+
+static Value scale_native(VM* vm, int argc, Value* args) {
+    double f64;
+    int64_t i64;
+    if (argc != 2 || !is_array(args[0]) || !get_factor(OBJ_AS_TYPED_ARRAY(args[0]), args[1], &f64, &i64))
+        return native_error(vm, "array_scale() takes a typed array and a number to multiply it by");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    if (a->kind == ELEMS_F64)
+        kernels_get()->scale_f64(F64(a), f64, a->length);
+    else
+        kernels_get()->scale_i64(I64(a), i64, a->length);
+    return args[0];
+}
+
+static Value axpy_native(VM* vm, int argc, Value* args) {
+    double f64;
+    int64_t i64;
+    if (argc != 3 || !are_alike(args[1], args[2]) ||
+        !get_factor(OBJ_AS_TYPED_ARRAY(args[1]), args[0], &f64, &i64))
+        return native_error(vm, "array_axpy() takes a number and two typed arrays of the same kind and length");
+    ObjTypedArray* x = OBJ_AS_TYPED_ARRAY(args[1]);
+    ObjTypedArray* y = OBJ_AS_TYPED_ARRAY(args[2]);
+    if (x->kind == ELEMS_F64)
+        kernels_get()->axpy_f64(f64, F64(x), F64(y), x->length);
+    else
+        kernels_get()->axpy_i64(i64, I64(x), I64(y), x->length);
+    return args[2];
+}
+
+static Value add_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !are_alike(args[0], args[1]))
+        return native_error(vm, "array_add() takes two typed arrays of the same kind and length");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* b = OBJ_AS_TYPED_ARRAY(args[1]);
+    ObjTypedArray* out = new_typed_array(vm, a->kind, a->length);
+    if (a->kind == ELEMS_F64)
+        kernels_get()->add_f64(F64(a), F64(b), F64(out), a->length);
+    else
+        kernels_get()->add_i64(I64(a), I64(b), I64(out), a->length);
+    return MK_VAL_OBJ(out);
+}
+
+static Value mul_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !are_alike(args[0], args[1]))
+        return native_error(vm, "array_mul() takes two typed arrays of the same kind and length");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* b = OBJ_AS_TYPED_ARRAY(args[1]);
+    ObjTypedArray* out = new_typed_array(vm, a->kind, a->length);
+    if (a->kind == ELEMS_F64)
+        kernels_get()->mul_f64(F64(a), F64(b), F64(out), a->length);
+    else
+        kernels_get()->mul_i64(I64(a), I64(b), I64(out), a->length);
+    return MK_VAL_OBJ(out);
+}
+
+static Value prefix_sum_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !is_array(args[0]))
+        return native_error(vm, "array_prefix_sum() takes a typed array");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* out = new_typed_array(vm, a->kind, a->length);
+    if (a->kind == ELEMS_F64)
+        kernels_get()->prefix_sum_f64(F64(a), F64(out), a->length);
+    else
+        kernels_get()->prefix_sum_i64(I64(a), I64(out), a->length);
+    return MK_VAL_OBJ(out);
+}
+
+static Value search_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !is_array(args[0]) || !IS_VAL_NUMBERLIKE(args[1]))
+        return native_error(vm, "array_search() takes a typed array and a number");
+    ObjTypedArray* a = OBJ_AS_TYPED_ARRAY(args[0]);
+    if (a->kind == ELEMS_F64)
+        return MK_VAL_INT(kernels_get()->search_f64(F64(a), NUMBERLIKE_AS_NUM(args[1]), a->length));
+
+    // an Int64Array can't hold anything that isn't a whole number
+    int64_t whole;
+    if (!value_to_i64(args[1], &whole))
+        return MK_VAL_INT(-1);
+    return MK_VAL_INT(kernels_get()->search_i64(I64(a), whole, a->length));
+}
+
+void define_typed_array_natives(VM* vm) {
+    vm_define_native(vm, "Float64Array", float64_array_native);
+    vm_define_native(vm, "Int64Array", int64_array_native);
+    vm_define_native(vm, "array_sum", sum_native);
+    vm_define_native(vm, "array_min", min_native);
+    vm_define_native(vm, "array_max", max_native);
+    vm_define_native(vm, "array_dot", dot_native);
+    vm_define_native(vm, "array_scale", scale_native);
+    vm_define_native(vm, "array_axpy", axpy_native);
+    vm_define_native(vm, "array_add", add_native);
+    vm_define_native(vm, "array_mul", mul_native);
+    vm_define_native(vm, "array_prefix_sum", prefix_sum_native);
+    vm_define_native(vm, "array_search", search_native);
+}
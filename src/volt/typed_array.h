@@ -0,0 +1,23 @@
+#pragma once
+
+#include "volt/code/value.h"
+
+/*
+* Float64Array(n) and Int64Array(n) make zeroed arrays of n raw doubles /
+* int64s, and Float64Array(list) / Int64Array(list) copy a list of numbers.
+* They are indexed like lists, but only ever hold numbers (whole ones, for
+* an Int64Array).
+*
+* The whole array natives run in C, on the kernels in kernels.h. They're
+* prefixed with array_, so scripts keep names like sum and add for themselves:
+*   array_sum(a), array_min(a), array_max(a)  min / max are nil for an empty array
+*   array_dot(a, b)
+*   array_scale(a, k)                         a[i] *= k, returns a
+*   array_axpy(alpha, x, y)                   y[i] += alpha * x[i], returns y
+*   array_add(a, b), array_mul(a, b)          elementwise, into a new array
+*   array_prefix_sum(a)                       running totals, into a new array
+*   array_search(a, x)                        index of the first element equal to x, or -1
+* Arrays given together must be of the same kind and length.
+*/
+
+void define_typed_array_natives(VM* vm);
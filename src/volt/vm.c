@@ -1,147 +1,691 @@
 #include "volt/vm.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
 #include "volt/code/opcodes.h"
 #include "volt/mem.h"
+#include "volt/code/hashing.h"
+#include "volt/code/shared_strings.h"
+#include "volt/channel.h"
+#include "volt/scheduler.h"
+#include "volt/typed_array.h"
+#include "volt/map.h"
+#include "volt/class.h"
 #include "volt/compiling/compiler.h"
 #include "volt/debugging/switches.h"
 #include "volt/debugging/disassembly.h"
 
-VM vm;
 typedef uint16_t short_t;
 
 
 /* Stack handling and vm initializtion */
-static inline void reset_stack() {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
+static inline void reset_stack(VM* vm) {
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
 }
 
-static inline void pushstack(Value val) {
-    // *vm.stack_top = val;
-    // vm.stack_top++;
-    *vm.stack_top++ = val;
+static void* checked_realloc(void* ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+// Makes room for atleast `slots` values in the stack. The stack is not
+// allocated through reallocate() as growing it must never trigger a collection
+static void grow_stack(VM* vm, size_t slots) {
+    size_t capacity = vm->stack_end - vm->stack;
+    if (slots <= capacity)
+        return;
+    while (capacity < slots)
+        capacity *= 2;
+
+    // copy into a fresh block, so the old one is still valid while
+    // the pointers into it are being moved over
+    Value* old_stack = vm->stack;
+    Value* new_stack = (Value*)checked_realloc(NULL, capacity * sizeof(Value));
+    memcpy(new_stack, old_stack, (vm->stack_top - old_stack) * sizeof(Value));
+
+    for (unsigned int i = 0; i < vm->frame_count; i++)
+        vm->frames[i].stack_slots = new_stack + (vm->frames[i].stack_slots - old_stack);
+    for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalue->location = new_stack + (upvalue->location - old_stack);
+    vm->stack_top = new_stack + (vm->stack_top - old_stack);
+
+    free(old_stack);
+    vm->stack = new_stack;
+    vm->stack_end = new_stack + capacity;
+}
+
+static inline void pushstack(VM* vm, Value val) {
+    // temporaries can go past a frame's headroom, so this still has to be checked
+    if (vm->stack_top == vm->stack_end)
+        grow_stack(vm, (vm->stack_end - vm->stack) + 1);
+    *vm->stack_top++ = val;
 }
-static inline Value popstack() {
-    // vm.stack_top--;
-    // return *vm.stack_top;
+static inline Value popstack(VM* vm) {
+    // vm->stack_top--;
+    // return *vm->stack_top;
     // shortcut for above
-    return *(--vm.stack_top);
+    return *(--vm->stack_top);
 }
-static inline Value peekstack(int distance) {
-    return vm.stack_top[-1 - distance];
+static inline Value peekstack(VM* vm, int distance) {
+    return vm->stack_top[-1 - distance];
 }
 
-static inline void popstack_discard(int num) {
-    vm.stack_top -= num;
+static inline void popstack_discard(VM* vm, int num) {
+    vm->stack_top -= num;
 }
 
 // this function assumes that the stack is completely empty
-static void define_native(const char* name, NativeFn fn) {
-    pushstack(MK_VAL_OBJ(copy_string(name, (int)strlen(name))));
-    pushstack(MK_VAL_OBJ(new_native(fn)));
-    hashtable_set(&vm.globals, OBJ_AS_STRING(vm.stack[0]), vm.stack[1]);
-    popstack_discard(2);
+void vm_define_native(VM* vm, const char* name, NativeFn fn) {
+    pushstack(vm, MK_VAL_OBJ(copy_string(vm, name, (int)strlen(name))));
+    pushstack(vm, MK_VAL_OBJ(new_native(vm, fn)));
+    hashtable_set(vm, &vm->globals, OBJ_AS_STRING(vm->stack[0]), vm->stack[1]);
+    popstack_discard(vm, 2);
     // ObjNativeFn* fn_obj = new_native(fn);
-    // hashtable_set(&vm.globals, copy_string( name, (int)strlen(name)), MK_VAL_OBJ(fn_obj));
+    // hashtable_set(&vm->globals, copy_string( name, (int)strlen(name)), MK_VAL_OBJ(fn_obj));
 }
 
-static Value clock_native(int argc, Value* args) {
+static Value clock_native(VM* vm, int argc, Value* args) {
     return MK_VAL_NUM((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value input_num_native(int argc, Value* args) {
-    long val;
-    scanf("%ld", &val);
-    return MK_VAL_NUM((double)val);
+// nil at the end of the input, or if it isn't a number
+static Value input_num_native(VM* vm, int argc, Value* args) {
+    long val = 0;
+    if (scanf("%ld", &val) != 1)
+        return MK_VAL_NIL;
+    return MK_VAL_INT(val);
+}
+
+// channel(name) or channel(name, capacity)
+static Value channel_native(VM* vm, int argc, Value* args) {
+    if (argc < 1 || argc > 2)
+        return native_error(vm, "channel() takes a name and optionally a capacity");
+    if (!IS_OBJ_STRINGLIKE(args[0]))
+        return native_error(vm, "The name of a channel must be a string");
+
+    size_t capacity = CHANNEL_DEFAULT_CAPACITY;
+    if (argc == 2) {
+        int64_t requested;
+        if (!value_to_i64(args[1], &requested) || requested < 1 || requested > (1 << 24))
+            return native_error(vm, "The capacity of a channel must be a positive number");
+        capacity = (size_t)requested;
+    }
+
+    // channels are process wide, so they are named by shared strings
+    ObjString* name = stringlike_flatten(vm, VAL_AS_OBJ(args[0]));
+    name = shared_strings_intern(name->chars, name->length, hash_string(name->chars, name->length));
+    return MK_VAL_OBJ(new_channel_handle(vm, channel_open(name, capacity)));
+}
+
+// send(channel, value), blocks while the channel is full
+static Value send_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !IS_OBJ_CHANNEL(args[0]))
+        return native_error(vm, "send() takes a channel and a value");
+
+    Value sendable;
+    if (!channel_export(vm, args[1], &sendable))
+        return native_error(vm, "Only nil, booleans, numbers and strings can be sent");
+    channel_send(OBJ_AS_CHANNEL(args[0])->channel, sendable);
+    return MK_VAL_NIL;
+}
+
+// recv(channel), blocks while the channel is empty
+static Value recv_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_CHANNEL(args[0]))
+        return native_error(vm, "recv() takes a channel");
+    return channel_import(vm, channel_recv(OBJ_AS_CHANNEL(args[0])->channel));
+}
+
+// fiber(fn), fn takes no parameters, or one for the first resume's value
+static Value fiber_native(VM* vm, int argc, Value* args) {
+    ObjFunction* func = argc == 1 ? value_to_function(args[0]) : NULL;
+    if (func == NULL)
+        return native_error(vm, "fiber() takes a function");
+    if (func->arity > 1)
+        return native_error(vm, "The function of a fiber can take atmost 1 parameter");
+    return MK_VAL_OBJ(new_fiber(vm, VAL_AS_OBJ(args[0])));
+}
+
+static Value is_done_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_FIBER(args[0]))
+        return native_error(vm, "is_done() takes a fiber");
+    return MK_VAL_BOOL(OBJ_AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// len(list), len(typed array), len(map) or len(string)
+static Value len_native(VM* vm, int argc, Value* args) {
+    if (argc == 1 && IS_OBJ_LIST(args[0]))
+        return MK_VAL_INT(OBJ_AS_LIST(args[0])->items.count);
+    if (argc == 1 && IS_OBJ_TYPED_ARRAY(args[0]))
+        return MK_VAL_INT(OBJ_AS_TYPED_ARRAY(args[0])->length);
+    if (argc == 1 && IS_OBJ_MAP(args[0]))
+        return MK_VAL_INT(OBJ_AS_MAP(args[0])->live_count);
+    if (argc == 1 && IS_OBJ_STRINGLIKE(args[0]))
+        return MK_VAL_INT(stringlike_length(VAL_AS_OBJ(args[0])));
+    return native_error(vm, "len() takes a list, a typed array, a map or a string");
+}
+
+// push(list, value), returns the new length
+static Value push_native(VM* vm, int argc, Value* args) {
+    if (argc != 2 || !IS_OBJ_LIST(args[0]))
+        return native_error(vm, "push() takes a list and a value");
+    ObjList* list = OBJ_AS_LIST(args[0]);
+    list_append(vm, list, args[1]);
+    return MK_VAL_INT(list->items.count);
+}
+
+// pop(list), removes and returns the last element
+static Value pop_native(VM* vm, int argc, Value* args) {
+    if (argc != 1 || !IS_OBJ_LIST(args[0]))
+        return native_error(vm, "pop() takes a list");
+    ObjList* list = OBJ_AS_LIST(args[0]);
+    if (list->items.count == 0)
+        return native_error(vm, "Cannot pop from an empty list");
+    return list->items.values[--list->items.count];
+}
+
+static void define_natives(VM* vm) {
+    vm_define_native(vm, "clock", clock_native);
+    vm_define_native(vm, "input_num", input_num_native);
+    vm_define_native(vm, "channel", channel_native);
+    vm_define_native(vm, "send", send_native);
+    vm_define_native(vm, "recv", recv_native);
+    vm_define_native(vm, "fiber", fiber_native);
+    vm_define_native(vm, "is_done", is_done_native);
+    vm_define_native(vm, "len", len_native);
+    vm_define_native(vm, "push", push_native);
+    vm_define_native(vm, "pop", pop_native);
+    define_loop_natives(vm);
+    define_scheduler_natives(vm);
+    define_typed_array_natives(vm);
+    define_map_natives(vm);
+}
+
+void vm_pushstack(VM* vm, Value val) { pushstack(vm, val); }
+Value vm_popstack(VM* vm) { return popstack(vm); }
+
+static void init_vm(VM* vm, bool use_shared_strings) {
+    hash_seed_init();
+
+    vm->stack = (Value*)checked_realloc(NULL, VM_STACK_INITIAL * sizeof(Value));
+    vm->stack_end = vm->stack + VM_STACK_INITIAL;
+    vm->stack_limit = VM_STACK_LIMIT;
+
+    vm->frames = (CallFrame*)checked_realloc(NULL, VM_FRAMES_INITIAL * sizeof(CallFrame));
+    vm->frame_capacity = VM_FRAMES_INITIAL;
+    vm->frame_limit = VM_FRAMES_LIMIT;
+
+    reset_stack(vm);
+    heap_init(&vm->heap);
+
+    vm->bytes_allocated = 0;
+    vm->next_gc = GC_INITIAL_THRESHOLD;
+    vm->is_collecting = false;
+
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+
+    vm->parser = NULL;
+    vm->open_upvalues = NULL;
+    vm->fiber = NULL;
+    vm->parking = PARK_NONE;
+    loop_init(&vm->loop);
+    vm->task_origin = NULL;
+    vm->running_task = NULL;
+    vm->native_error = NULL;
+    vm->use_shared_strings = use_shared_strings;
+    vm->is_shared = false;
+    vm->pool = NULL;
+
+    vm->out = stdout;
+    vm->err = stderr;
+
+    hashtable_init(&vm->interned_strings);
+    hashtable_init(&vm->globals);
+    vm->globals_version = 0;
+
+    define_natives(vm);
+}
+
+void vm_init(VM* vm) { init_vm(vm, false); }
+void vm_init_shared(VM* vm) { init_vm(vm, true); }
+
+void vm_reset(VM* vm) {
+    reset_stack(vm);
+    loop_reset(&vm->loop);
+    hashtable_free(vm, &vm->globals);
+    vm->globals_version++;
+    define_natives(vm);
+}
+void vm_free(VM* vm) {
+    scheduler_release_vm(vm);
+    loop_free(&vm->loop);
+    hashtable_free(vm, &vm->interned_strings);
+    hashtable_free(vm, &vm->globals);
+    free_objects(vm);
+    free(vm->gray_stack);
+    reset_stack(vm);
+
+    free(vm->stack);
+    free(vm->frames);
+    vm->stack = vm->stack_end = vm->stack_top = NULL;
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
 }
 
-void vm_init() { 
-    reset_stack();
-    vm.objects = NULL;
-    hashtable_init(&vm.interned_strings);
-    hashtable_init(&vm.globals);
 
-    define_native("clock", clock_native);
-    define_native("input_num", input_num_native);
+/* Fiber stacks */
+static void save_stacks(VM* vm, FiberStacks* stacks) {
+    stacks->frames = vm->frames;
+    stacks->frame_count = vm->frame_count;
+    stacks->frame_capacity = vm->frame_capacity;
+    stacks->stack = vm->stack;
+    stacks->stack_end = vm->stack_end;
+    stacks->stack_top = vm->stack_top;
+    stacks->open_upvalues = vm->open_upvalues;
 }
-void vm_free() {
-    free_objects(vm.objects);
-    vm_init();
-    hashtable_free(&vm.interned_strings);
-    hashtable_free(&vm.globals);
+
+static void load_stacks(VM* vm, FiberStacks* stacks) {
+    vm->frames = stacks->frames;
+    vm->frame_count = stacks->frame_count;
+    vm->frame_capacity = stacks->frame_capacity;
+    vm->stack = stacks->stack;
+    vm->stack_end = stacks->stack_end;
+    vm->stack_top = stacks->stack_top;
+    vm->open_upvalues = stacks->open_upvalues;
 }
 
+/* Upvalues */
+
+// the open upvalue of the slot, made if there isn't one yet
+static ObjUpvalue* capture_upvalue(VM* vm, Value* slot) {
+    ObjUpvalue* previous = NULL;
+    ObjUpvalue* upvalue = vm->open_upvalues;
+    while (upvalue != NULL && upvalue->location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == slot)
+        return upvalue;
+
+    // the list is a root, so the upvalues around stay put while this allocates
+    ObjUpvalue* created = new_upvalue(vm, slot, (Obj*)vm->fiber);
+    created->next = upvalue;
+    if (previous == NULL)
+        vm->open_upvalues = created;
+    else
+        previous->next = created;
+    return created;
+}
+
+// moves the values of the slots from `last` up into their upvalues
+static inline void close_upvalues(VM* vm, Value* last) {
+    while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        upvalue->owner = NULL;
+        vm->open_upvalues = upvalue->next;
+        upvalue->next = NULL;
+    }
+}
+
+
+/* Fibers */
+
+// Makes `to` the running fiber (NULL for the main script). Nothing is copied,
+// the current stacks are just put aside and the ones of `to` swapped in
+static void switch_fiber(VM* vm, ObjFiber* to) {
+    save_stacks(vm, vm->fiber != NULL ? &vm->fiber->stacks : &vm->root_stacks);
+    load_stacks(vm, to != NULL ? &to->stacks : &vm->root_stacks);
+    vm->fiber = to;
+}
+
+// Leaves the running fiber for good, and goes back to its resumer. Its stacks
+// are not needed anymore, so they are freed right away
+static void finish_fiber(VM* vm) {
+    ObjFiber* fiber = vm->fiber;
+    close_upvalues(vm, vm->stack);
+    fiber->state = FIBER_DONE;
+    switch_fiber(vm, fiber->resumer);
+    fiber->resumer = NULL;
+
+    free(fiber->stacks.stack);
+    free(fiber->stacks.frames);
+    fiber->stacks.stack = fiber->stacks.stack_end = fiber->stacks.stack_top = NULL;
+    fiber->stacks.frames = NULL;
+    fiber->stacks.frame_count = fiber->stacks.frame_capacity = 0;
+}
 
 /* Error handling */
-static void runtime_error(const char* format, ...) {
+static void runtime_error(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    // size_t instruction = vm.prog_counter - vm.cnk->code - 1;
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
     size_t instruction = frame->pc - frame->func->chunk.code - 1;
-    // int line = vm.cnk->lines[instruction];
-    // TODO: Get the real line of instruction
-    int line = 888;
-    fprintf(stderr, "[line %d] in script\n", line);
-    reset_stack();
+    int line = chunk_get_line(&frame->func->chunk, (int)instruction);
+    fprintf(vm->err, "[line %d] in script\n", line);
+
+    // the error ends the failed fiber, and all the ones waiting on it. The
+    // whole script stops, so nothing waiting in the loop runs anymore either
+    while (vm->fiber != NULL)
+        finish_fiber(vm);
+    loop_reset(&vm->loop);
+    close_upvalues(vm, vm->stack);
+    reset_stack(vm);
 }
 
 /* Misc helpers */
+
+// The position of a valid index into a list or a typed array, or -1. Indices
+// are whole numbers, from 0 upto the length
+static inline int index_position(int length, Value index) {
+    int64_t position;
+    if (IS_VAL_INT(index))
+        position = VAL_AS_INT(index);
+    else if (!value_to_i64(index, &position))
+        return -1;
+    return position >= 0 && position < length ? (int)position : -1;
+}
+
+// The index (and the value, for a store) must be reachable, as a map may
+// allocate. A key that isn't in a map gives nil
+static inline bool index_load(VM* vm, Value target, Value index, Value* result) {
+    int position;
+    if (IS_OBJ_LIST(target)) {
+        ObjList* list = OBJ_AS_LIST(target);
+        if ((position = index_position(list->items.count, index)) < 0)
+            return false;
+        *result = list->items.values[position];
+        return true;
+    }
+    if (IS_OBJ_TYPED_ARRAY(target)) {
+        ObjTypedArray* array = OBJ_AS_TYPED_ARRAY(target);
+        if ((position = index_position(array->length, index)) < 0)
+            return false;
+        *result = typed_array_load(array, position);
+        return true;
+    }
+    if (IS_OBJ_MAP(target) && map_key_valid(index)) {
+        if (!map_get(vm, OBJ_AS_MAP(target), index, result))
+            *result = MK_VAL_NIL;
+        return true;
+    }
+    return false;
+}
+
+static inline bool index_store(VM* vm, Value target, Value index, Value value) {
+    int position;
+    if (IS_OBJ_LIST(target)) {
+        ObjList* list = OBJ_AS_LIST(target);
+        if ((position = index_position(list->items.count, index)) < 0)
+            return false;
+        list->items.values[position] = value;
+        return true;
+    }
+    if (IS_OBJ_TYPED_ARRAY(target)) {
+        ObjTypedArray* array = OBJ_AS_TYPED_ARRAY(target);
+        if ((position = index_position(array->length, index)) < 0)
+            return false;
+        return typed_array_store(array, position, value);
+    }
+    if (IS_OBJ_MAP(target) && map_key_valid(index)) {
+        map_set(vm, OBJ_AS_MAP(target), index, value);
+        return true;
+    }
+    return false;
+}
+
+// works out which part of an indexing was wrong
+static void index_error(VM* vm, Value target, Value index) {
+    int length;
+    if (IS_OBJ_MAP(target)) {
+        runtime_error(vm, "Map keys must be numbers, strings, booleans or nil.");
+        return;
+    }
+    if (IS_OBJ_LIST(target))
+        length = OBJ_AS_LIST(target)->items.count;
+    else if (IS_OBJ_TYPED_ARRAY(target))
+        length = OBJ_AS_TYPED_ARRAY(target)->length;
+    else {
+        runtime_error(vm, "Only lists, typed arrays and maps can be indexed.");
+        return;
+    }
+
+    if (!IS_VAL_NUMBERLIKE(index))
+        runtime_error(vm, "Indices must be numbers.");
+    else if (index_position(length, index) < 0)
+        runtime_error(vm, "Index %g is out of range for a length of %d.", NUMBERLIKE_AS_NUM(index), length);
+    else if (OBJ_AS_TYPED_ARRAY(target)->kind == ELEMS_I64)
+        runtime_error(vm, "An Int64Array only holds whole numbers.");
+    else
+        runtime_error(vm, "A Float64Array only holds numbers.");
+}
+
 static bool is_falsey(Value val) 
 {
     // only nil and false are "falsey" 
     return IS_VAL_NIL(val) || (IS_VAL_BOOL(val) && !VAL_AS_BOOL(val));
 }
 
-static void concatenate(ObjString* a, ObjString* b)
+// expects both the operands to be on top of the stack, and replaces them
+// with the result. They are popped only after the allocations because
+// those might trigger a garbage collection
+static void concatenate(VM* vm)
 {
-    int length = a->length + b->length;
-    char* new_string = ALLOCATE(char, length + 1);
-    memcpy(new_string, a->chars, a->length);
-    memcpy(new_string + a->length, b->chars, b->length);
-    new_string[length] = '\0';
+    Obj* b = VAL_AS_OBJ(peekstack(vm, 0));
+    Obj* a = VAL_AS_OBJ(peekstack(vm, 1));
+
+    int length = stringlike_length(a) + stringlike_length(b);
+    Obj* result;
+
+    if (length < ROPE_MIN_LENGTH) {
+        // Short enough to just copy. Note that ropes are never shorter than
+        // ROPE_MIN_LENGTH so both of the operands are plain strings here
+        ObjString* str_a = (ObjString*)a;
+        ObjString* str_b = (ObjString*)b;
+
+        ObjString* new_string = allocate_string(vm, length);
+        memcpy(new_string->chars, str_a->chars, str_a->length);
+        memcpy(new_string->chars + str_a->length, str_b->chars, str_b->length);
+
+        result = (Obj*)new_string;
+    }
+    else {
+        result = (Obj*)new_rope(vm, a, b);
+    }
 
-    ObjString* string_obj = take_string(new_string, length);
-    pushstack(MK_VAL_OBJ(string_obj));
+    popstack_discard(vm, 2);
+    pushstack(vm, MK_VAL_OBJ(result));
 }
 
-static bool call_fn(ObjFunction* func, int arg_count) {
+static bool call_fn(VM* vm, ObjFunction* func, int arg_count) {
     if (func->arity != arg_count) {
-        runtime_error("Expected %d arguments, got %d", func->arity, arg_count);
+        runtime_error(vm, "Expected %d arguments, got %d", func->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("Call stack overflow");
+    if (vm->frame_count == vm->frame_capacity) {
+        if (vm->frame_count >= vm->frame_limit) {
+            runtime_error(vm, "Stack overflow");
+            return false;
+        }
+        unsigned int capacity = vm->frame_capacity * 2;
+        if (capacity > vm->frame_limit)
+            capacity = vm->frame_limit;
+        vm->frames = (CallFrame*)checked_realloc(vm->frames, capacity * sizeof(CallFrame));
+        vm->frame_capacity = capacity;
+    }
+
+    size_t base = (vm->stack_top - vm->stack) - arg_count - 1;
+    if (base + VM_FRAME_HEADROOM > vm->stack_limit) {
+        runtime_error(vm, "Stack overflow");
         return false;
     }
+    grow_stack(vm, base + VM_FRAME_HEADROOM);
 
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+    CallFrame* frame = &vm->frames[vm->frame_count++];
     frame->func = func;
+    frame->closure = NULL;
     frame->pc = func->chunk.code;
-    frame->stack_slots = vm.stack_top - arg_count - 1;
+    frame->stack_slots = vm->stack + base;
     return true;
 }
 
-static bool call_value(Value val, int arg_count) {
+static bool call_value(VM* vm, Value val, int arg_count);
+
+// Switches to a new or suspended fiber. A new one starts by calling its
+// function with the value, a suspended one gets the value as the result of
+// its yield
+static bool enter_fiber(VM* vm, ObjFiber* fiber, ObjFiber* resumer, Value value) {
+    bool is_new = fiber->state == FIBER_NEW;
+    if (is_new) {
+        fiber->stacks.stack = (Value*)checked_realloc(NULL, VM_FIBER_STACK_INITIAL * sizeof(Value));
+        fiber->stacks.stack_end = fiber->stacks.stack + VM_FIBER_STACK_INITIAL;
+        fiber->stacks.stack_top = fiber->stacks.stack;
+        fiber->stacks.frames = (CallFrame*)checked_realloc(NULL, VM_FIBER_FRAMES_INITIAL * sizeof(CallFrame));
+        fiber->stacks.frame_capacity = VM_FIBER_FRAMES_INITIAL;
+        fiber->stacks.frame_count = 0;
+    }
+
+    fiber->resumer = resumer;
+    fiber->state = FIBER_RUNNING;
+    switch_fiber(vm, fiber);
+
+    if (!is_new) {
+        pushstack(vm, value);
+        return true;
+    }
+
+    Value entry = MK_VAL_OBJ(fiber->entry);
+    int arity = value_to_function(entry)->arity;
+    pushstack(vm, entry);
+    if (arity == 1)
+        pushstack(vm, value);
+    return call_value(vm, entry, arity);
+}
+
+// resumes the fiber by hand, with the value (if any) on top of the stack
+static bool resume_fiber(VM* vm, ObjFiber* fiber, int arg_count) {
+    if (arg_count > 1) {
+        runtime_error(vm, "A fiber is resumed with atmost 1 value, got %d", arg_count);
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtime_error(vm, "Cannot resume a finished fiber");
+        return false;
+    }
+    if (fiber->state == FIBER_RUNNING) {
+        runtime_error(vm, "Cannot resume a fiber that is already running");
+        return false;
+    }
+    if (fiber->is_task) {
+        runtime_error(vm, "Cannot resume a task, the event loop runs it");
+        return false;
+    }
+
+    // the fiber stays reachable through vm->fiber once the callee is popped
+    Value value = arg_count == 1 ? peekstack(vm, 0) : MK_VAL_NIL;
+    popstack_discard(vm, arg_count + 1);
+    return enter_fiber(vm, fiber, vm->fiber, value);
+}
+
+// Parks whatever is running in the event loop, and continues with the next
+// ready waiter. Fails if there is none, as nothing could ever wake them
+static bool schedule_next(VM* vm) {
+    ReadyWaiter next;
+    if (!loop_next(&vm->loop, &next)) {
+        runtime_error(vm, "Deadlock, everything is waiting and nothing can wake it");
+        return false;
+    }
+
+    // tasks that haven't started yet, or that yielded
+    ObjFiber* fiber = next.fiber;
+    if (fiber != NULL && (fiber->state == FIBER_NEW || fiber->state == FIBER_SUSPENDED))
+        return enter_fiber(vm, fiber, NULL, next.value);
+
+    switch_fiber(vm, fiber);
+    if (next.has_value)
+        pushstack(vm, next.value);
+    return true;
+}
+
+// the native call has parked the running waiter, so it's time for the next one
+static bool park_native_call(VM* vm, int arg_count) {
+    if (vm->parking == PARK_RETRY)
+        vm->frames[vm->frame_count - 1].pc -= 2; // back to the OP_CALL
+    else
+        vm->stack_top -= arg_count + 1;
+    vm->parking = PARK_NONE;
+    return schedule_next(vm);
+}
+
+static bool call_value(VM* vm, Value val, int arg_count) {
+    if (!IS_VAL_OBJ(val)) {
+        runtime_error(vm, "Can only call functions and classes");
+        return false;
+    }
+
     switch(OBJ_TYPE(val)) {
         case OBJ_FUNCTION:
-            return call_fn(OBJ_AS_FUNC(val), arg_count);
+            return call_fn(vm, OBJ_AS_FUNC(val), arg_count);
+
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = OBJ_AS_CLOSURE(val);
+            if (!call_fn(vm, closure->func, arg_count))
+                return false;
+            vm->frames[vm->frame_count - 1].closure = closure;
+            return true;
+        }
+
+        case OBJ_FIBER:
+            return resume_fiber(vm, OBJ_AS_FIBER(val), arg_count);
+
+        case OBJ_CLASS: {
+            // the instance takes the place of the class, as `this`
+            ObjClass* klass = OBJ_AS_CLASS(val);
+            vm->stack_top[-arg_count - 1] = MK_VAL_OBJ(new_instance(vm, klass));
+            if (!IS_VAL_NIL(klass->initializer))
+                return call_value(vm, klass->initializer, arg_count);
+            if (arg_count != 0) {
+                runtime_error(vm, "Expected 0 arguments, got %d", arg_count);
+                return false;
+            }
+            return true;
+        }
+
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = OBJ_AS_BOUND_METHOD(val);
+            vm->stack_top[-arg_count - 1] = bound->receiver;
+            return call_value(vm, MK_VAL_OBJ(bound->method), arg_count);
+        }
 
         case OBJ_NATIVEFN: {
             ObjNativeFn* native_obj = OBJ_AS_NATIVEFN(val);
-            Value res = native_obj->fn(arg_count, vm.stack_top - arg_count);
-            vm.stack_top -= arg_count + 1;
-            pushstack(res);
+            Value res = native_obj->fn(vm, arg_count, vm->stack_top - arg_count);
+            if (vm->native_error != NULL) {
+                runtime_error(vm, "%s", vm->native_error);
+                vm->native_error = NULL;
+                return false;
+            }
+            if (vm->parking != PARK_NONE)
+                return park_native_call(vm, arg_count);
+            vm->stack_top -= arg_count + 1;
+            pushstack(vm, res);
             return true;
         }
 
@@ -149,47 +693,227 @@ static bool call_value(Value val, int arg_count) {
             break;
     }
 
-    runtime_error("Can only call functions and classes");
+    runtime_error(vm, "Can only call functions and classes");
     return false;
 }
 
+/* Properties */
+
+// the function's caches, if the vm is the one that may use them, or NULL
+static inline PropertyCache* function_caches(VM* vm, ObjFunction* func) {
+    return heap_owns(&vm->heap, (Obj*)func) ? func->caches : NULL;
+}
+
+// The slow paths of the property instructions, which look the property up and
+// add it to the cache (if there's one). See class.h
+
+// replaces the instance on top with the property's value
+static bool get_property(VM* vm, PropertyCache* cache, ObjString* name) {
+    Value receiver = peekstack(vm, 0);
+    if (!IS_OBJ_INSTANCE(receiver)) {
+        runtime_error(vm, "Only instances have properties.");
+        return false;
+    }
+    ObjInstance* instance = OBJ_AS_INSTANCE(receiver);
+
+    int slot = shape_find(instance->shape, name);
+    if (slot >= 0) {
+        if (cache != NULL)
+            cache_add(cache, instance->shape, slot, NULL);
+        vm->stack_top[-1] = instance->fields[slot];
+        return true;
+    }
+
+    Value method;
+    if (!hashtable_get(vm, &instance->shape->klass->methods, name, &method)) {
+        runtime_error(vm, "Undefined property \"%s\".", name->chars);
+        return false;
+    }
+    if (cache != NULL)
+        cache_add(cache, instance->shape, -1, VAL_AS_OBJ(method));
+    vm->stack_top[-1] = MK_VAL_OBJ(new_bound_method(vm, receiver, VAL_AS_OBJ(method)));
+    return true;
+}
+
+// sets the property of the instance below the value on top, leaving the value
+static bool set_property(VM* vm, PropertyCache* cache, ObjString* name) {
+    Value receiver = peekstack(vm, 1);
+    Value value = peekstack(vm, 0);
+    if (!IS_OBJ_INSTANCE(receiver)) {
+        runtime_error(vm, "Only instances have fields.");
+        return false;
+    }
+    ObjInstance* instance = OBJ_AS_INSTANCE(receiver);
+    ObjShape* shape = instance->shape;
+
+    int slot = shape_find(shape, name);
+    if (slot >= 0) {
+        if (cache != NULL)
+            cache_add(cache, shape, slot, NULL);
+        instance->fields[slot] = value;
+    }
+    else {
+        ObjShape* added = shape_add(vm, shape, name);
+        if (cache != NULL)
+            cache_add(cache, shape, added->field_count - 1, (Obj*)added);
+        instance_add_field(vm, instance, added, value);
+    }
+
+    popstack_discard(vm, 2);
+    pushstack(vm, value);
+    return true;
+}
+
+// calls the property of the instance below the arguments
+static bool invoke(VM* vm, PropertyCache* cache, ObjString* name, int arg_count) {
+    Value receiver = peekstack(vm, arg_count);
+    if (!IS_OBJ_INSTANCE(receiver)) {
+        runtime_error(vm, "Only instances have methods.");
+        return false;
+    }
+    ObjInstance* instance = OBJ_AS_INSTANCE(receiver);
+
+    // a field holding something callable
+    int slot = shape_find(instance->shape, name);
+    if (slot >= 0) {
+        if (cache != NULL)
+            cache_add(cache, instance->shape, slot, NULL);
+        vm->stack_top[-arg_count - 1] = instance->fields[slot];
+        return call_value(vm, instance->fields[slot], arg_count);
+    }
+
+    Value method;
+    if (!hashtable_get(vm, &instance->shape->klass->methods, name, &method)) {
+        runtime_error(vm, "Undefined property \"%s\".", name->chars);
+        return false;
+    }
+    if (cache != NULL)
+        cache_add(cache, instance->shape, -1, VAL_AS_OBJ(method));
+    return call_value(vm, method, arg_count);
+}
+
+// Orders an int against a double exactly, without rounding the int (like
+// values_equal() compares them). Gives <0, 0 or >0, and false for NaN, which
+// isn't ordered against anything
+static bool order_int_num(int64_t integer, double number, int* order) {
+    if (number != number)
+        return false;
+    if (number >= 9223372036854775808.0) {
+        *order = -1;
+        return true;
+    }
+    if (number < -9223372036854775808.0) {
+        *order = 1;
+        return true;
+    }
+    // the number's whole part fits, and is exact as a double
+    int64_t whole = (int64_t)number;
+    if (integer != whole)
+        *order = integer < whole ? -1 : 1;
+    else
+        *order = (double)whole < number ? -1 : (double)whole > number ? 1 : 0;
+    return true;
+}
+
 /* Actual implementation of each opcode */ 
-static InterpretResult run_machine() 
+static InterpretResult run_machine(VM* vm) 
 {
 
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
 
 #define READ_BYTE() (*frame->pc++)
 #define READ_SHORT() \
     (frame->pc += 2, (short_t)(frame->pc[-2] << 8 | frame->pc[-1]))
-// #define READ_CONST() (vm.cnk->constants.values[READ_BYTE()])
+// #define READ_CONST() (vm->cnk->constants.values[READ_BYTE()])
 #define READ_CONST() (frame->func->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() OBJ_AS_STRING(READ_CONST())
+// the instruction's property cache, or NULL if this vm doesn't own the code
+#define READ_CACHE() \
+    (frame->pc += 2, caches == NULL ? NULL : &caches[frame->pc[-2] << 8 | frame->pc[-1]])
 
 #define BINARY_OPERATION(valtype_macro, op)                             \
-    if (!IS_VAL_NUM(peekstack(0)) || !IS_VAL_NUM(peekstack(1))) { \
-        runtime_error("Operands must be numbers.");                     \
+    if (!IS_VAL_NUMBERLIKE(peekstack(vm, 0)) || !IS_VAL_NUMBERLIKE(peekstack(vm, 1))) { \
+        runtime_error(vm, "Operands must be numbers.");                     \
         return INTERPRET_RUNTIME_ERROR;                                 \
     }                                                                   \
-    double b = VAL_AS_NUM(popstack());                               \
-    double a = VAL_AS_NUM(popstack());                               \
-    pushstack(valtype_macro(a op b))
+    double b = NUMBERLIKE_AS_NUM(popstack(vm));                        \
+    double a = NUMBERLIKE_AS_NUM(popstack(vm));                        \
+    pushstack(vm, valtype_macro(a op b))
 
     /// END BINARY_OPERATION()
 
+// Two ints give an int, unless it overflows. Then (and with a double in
+// either operand) it's done with doubles instead
+#define INT_OPERATION(op, overflow_builtin)                              \
+    Value valb = peekstack(vm, 0), vala = peekstack(vm, 1);             \
+    int64_t result;                                                     \
+    if (IS_VAL_NUM(vala) && IS_VAL_NUM(valb)) {                         \
+        popstack_discard(vm, 1);                                        \
+        vm->stack_top[-1] = MK_VAL_NUM(VAL_AS_NUM(vala) op VAL_AS_NUM(valb)); \
+    } else if (IS_VAL_INT(vala) && IS_VAL_INT(valb) &&                  \
+               !overflow_builtin(VAL_AS_INT(vala), VAL_AS_INT(valb), &result)) { \
+        popstack_discard(vm, 1);                                        \
+        vm->stack_top[-1] = MK_VAL_INT(result);                         \
+    } else {                                                            \
+        BINARY_OPERATION(MK_VAL_NUM, op);                               \
+    }
+
+// comparisons are exact, an int and a double too (see order_int_num())
+#define COMPARISON(op)                                                  \
+    Value valb = peekstack(vm, 0), vala = peekstack(vm, 1);             \
+    if (IS_VAL_INT(vala) && IS_VAL_INT(valb)) {                         \
+        popstack_discard(vm, 1);                                        \
+        vm->stack_top[-1] = MK_VAL_BOOL(VAL_AS_INT(vala) op VAL_AS_INT(valb)); \
+    } else if (IS_VAL_NUM(vala) && IS_VAL_NUM(valb)) {                  \
+        popstack_discard(vm, 1);                                        \
+        vm->stack_top[-1] = MK_VAL_BOOL(VAL_AS_NUM(vala) op VAL_AS_NUM(valb)); \
+    } else if (IS_VAL_NUMBERLIKE(vala) && IS_VAL_NUMBERLIKE(valb)) {    \
+        int order;                                                      \
+        bool is_ordered = IS_VAL_INT(vala)                              \
+            ? order_int_num(VAL_AS_INT(vala), VAL_AS_NUM(valb), &order) \
+            : order_int_num(VAL_AS_INT(valb), VAL_AS_NUM(vala), &order) && (order = -order, true); \
+        popstack_discard(vm, 1);                                        \
+        vm->stack_top[-1] = MK_VAL_BOOL(is_ordered && order op 0);      \
+    } else {                                                            \
+        BINARY_OPERATION(MK_VAL_BOOL, op);                              \
+    }
+
+// The operands must be integers, whole doubles count too
+#define BITWISE_OPERATION(op)                                           \
+    int64_t a, b;                                                       \
+    if (!value_to_i64(peekstack(vm, 1), &a) || !value_to_i64(peekstack(vm, 0), &b)) { \
+        runtime_error(vm, "Operands must be integers.");                \
+        return INTERPRET_RUNTIME_ERROR;                                 \
+    }                                                                   \
+    popstack_discard(vm, 2);                                            \
+    pushstack(vm, MK_VAL_INT(a op b))
+
+#define SHIFT_OPERATION(expression)                                     \
+    int64_t a, b;                                                       \
+    if (!value_to_i64(peekstack(vm, 1), &a) || !value_to_i64(peekstack(vm, 0), &b)) { \
+        runtime_error(vm, "Operands must be integers.");                \
+        return INTERPRET_RUNTIME_ERROR;                                 \
+    }                                                                   \
+    if (b < 0 || b > 63) {                                              \
+        runtime_error(vm, "Shift counts must be from 0 to 63.");        \
+        return INTERPRET_RUNTIME_ERROR;                                 \
+    }                                                                   \
+    popstack_discard(vm, 2);                                            \
+    pushstack(vm, MK_VAL_INT(expression))
+
     byte_t instruction;
 
     for(;;) {
 
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
             printf("[ ");
-            print_val(*slot);
+            print_val(vm, *slot);
             printf(" ]");
         }
         printf("\n");
-        disassemble_instruction(&frame->func->chunk, (int)(frame->pc - frame->func->chunk.code));
+        disassemble_instruction(vm, &frame->func->chunk, (int)(frame->pc - frame->func->chunk.code));
 
 #endif
 
@@ -197,106 +921,179 @@ static InterpretResult run_machine()
 
         switch (instruction) {
             case OP_RETURN: {
-                // popstack_discard(1);
-                Value return_val = popstack();
-                vm.frame_count--;
-
-                if (vm.frame_count == 0) {
-                    popstack_discard(1);
-                    return INTERPRET_OK; 
+                // popstack_discard(vm, 1);
+                Value return_val = popstack(vm);
+                close_upvalues(vm, frame->stack_slots);
+                vm->frame_count--;
+
+                if (vm->frame_count == 0) {
+                    popstack_discard(vm, 1);
+                    ObjFiber* fiber = vm->fiber;
+
+                    if (fiber == NULL) {
+                        // left on the stack for vm_call()
+                        pushstack(vm, return_val);
+                        if (vm->loop.task_count == 0)
+                            return INTERPRET_OK;
+                        // the script is done, but the tasks it started aren't
+                        vm->loop.is_draining = true;
+                        if (!schedule_next(vm))
+                            return INTERPRET_RUNTIME_ERROR;
+                        frame = &vm->frames[vm->frame_count - 1];
+                        break;
+                    }
+
+                    if (fiber->is_task) {
+                        // nobody waits for the result of a task
+                        finish_fiber(vm);
+                        if (--vm->loop.task_count == 0 && vm->loop.is_draining) {
+                            vm->loop.is_draining = false;
+                            return INTERPRET_OK;
+                        }
+                        if (!schedule_next(vm))
+                            return INTERPRET_RUNTIME_ERROR;
+                        frame = &vm->frames[vm->frame_count - 1];
+                        break;
+                    }
+
+                    // a fiber's function returned, its resumer gets the value
+                    finish_fiber(vm);
+                    pushstack(vm, return_val);
+                    frame = &vm->frames[vm->frame_count - 1];
+                    break;
                 }
 
-                vm.stack_top = frame->stack_slots;
-                pushstack(return_val);
+                vm->stack_top = frame->stack_slots;
+                pushstack(vm, return_val);
 
-                frame = &vm.frames[vm.frame_count - 1];
+                frame = &vm->frames[vm->frame_count - 1];
                 break;
             }
-            case OP_LOADCONST:  pushstack(READ_CONST()); break;
+            case OP_LOADCONST:  pushstack(vm, READ_CONST()); break;
 
-            case OP_POP:    popstack(); break;
-            case OP_POPN:   popstack_discard(READ_BYTE()); break;
+            case OP_POP:    popstack(vm); break;
+            case OP_POPN:   popstack_discard(vm, READ_BYTE()); break;
 
             case OP_NEGATE: {
-                if (!IS_VAL_NUM(peekstack(0))) {
-                    runtime_error("Operand must be a number");
+                Value val = peekstack(vm, 0);
+                if (!IS_VAL_NUMBERLIKE(val)) {
+                    runtime_error(vm, "Operand must be a number");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                pushstack(
-                    MK_VAL_NUM(
-                        -VAL_AS_NUM( popstack() )
-                    )
-                ); 
+                popstack_discard(vm, 1);
+                // -INT64_MIN doesn't fit
+                if (IS_VAL_INT(val) && VAL_AS_INT(val) != INT64_MIN)
+                    pushstack(vm, MK_VAL_INT(-VAL_AS_INT(val)));
+                else
+                    pushstack(vm, MK_VAL_NUM(-NUMBERLIKE_AS_NUM(val)));
                 break;
             }
 
             // arithematic instructions 
             case OP_ADD: {
-                Value vala = peekstack(1);
-                Value valb = peekstack(0);
+                Value vala = peekstack(vm, 1);
+                Value valb = peekstack(vm, 0);
+                int64_t sum;
                 if (
-                    IS_OBJ_STRING(vala) && 
-                    IS_OBJ_STRING(valb)
+                    IS_VAL_NUM(vala) &&
+                    IS_VAL_NUM(valb)
+                ) {
+                    popstack_discard(vm, 1);
+                    vm->stack_top[-1] = MK_VAL_NUM(VAL_AS_NUM(vala) + VAL_AS_NUM(valb));
+                }
+                else if (
+                    IS_VAL_INT(vala) &&
+                    IS_VAL_INT(valb) &&
+                    !__builtin_add_overflow(VAL_AS_INT(vala), VAL_AS_INT(valb), &sum)
                 ) {
-                    popstack_discard(2);
-                    concatenate(OBJ_AS_STRING(vala), OBJ_AS_STRING(valb));
+                    popstack_discard(vm, 1);
+                    vm->stack_top[-1] = MK_VAL_INT(sum);
                 }
                 else if (
-                    IS_VAL_NUM(vala) && 
-                    IS_VAL_NUM(valb) 
+                    IS_OBJ_STRINGLIKE(vala) && 
+                    IS_OBJ_STRINGLIKE(valb)
                 ) {
-                    double a = VAL_AS_NUM(vala);
-                    double b = VAL_AS_NUM(valb);
-                    popstack_discard(2);
-                    pushstack(MK_VAL_NUM(a + b));
+                    concatenate(vm);
+                }
+                // a double and an int, or an int overflowed
+                else if (
+                    IS_VAL_NUMBERLIKE(vala) && 
+                    IS_VAL_NUMBERLIKE(valb) 
+                ) {
+                    double a = NUMBERLIKE_AS_NUM(vala);
+                    double b = NUMBERLIKE_AS_NUM(valb);
+                    popstack_discard(vm, 2);
+                    pushstack(vm, MK_VAL_NUM(a + b));
                 }
                 else {
-                    runtime_error("Operands must be two numbers or strings.");
+                    runtime_error(vm, "Operands must be two numbers or strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_SUBTRACT:   { BINARY_OPERATION(MK_VAL_NUM, -); break; }
-            case OP_MULTIPLY:   { BINARY_OPERATION(MK_VAL_NUM, *); break; }
+            case OP_SUBTRACT:   { INT_OPERATION(-, __builtin_sub_overflow); break; }
+            case OP_MULTIPLY:   { INT_OPERATION(*, __builtin_mul_overflow); break; }
+            // always a double, 7 / 2 is 3.5
             case OP_DIVIDE:     { BINARY_OPERATION(MK_VAL_NUM, /); break; }
 
+            // bitwise instructions, on 64 bit ints
+            case OP_BIT_AND:        { BITWISE_OPERATION(&); break; }
+            case OP_BIT_OR:         { BITWISE_OPERATION(|); break; }
+            case OP_BIT_XOR:        { BITWISE_OPERATION(^); break; }
+            // bits shifted out of the top are lost, the right shift keeps the sign
+            case OP_SHIFT_LEFT:     { SHIFT_OPERATION((int64_t)((uint64_t)a << b)); break; }
+            case OP_SHIFT_RIGHT:    { SHIFT_OPERATION(a >> b); break; }
+            case OP_BIT_NOT: {
+                int64_t a;
+                if (!value_to_i64(peekstack(vm, 0), &a)) {
+                    runtime_error(vm, "Operand must be an integer.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                popstack_discard(vm, 1);
+                pushstack(vm, MK_VAL_INT(~a));
+                break;
+            }
+
             // stack's constant instrucions
-            case OP_NIL:    pushstack(MK_VAL_NIL); break;
-            case OP_TRUE:   pushstack(MK_VAL_BOOL(true)); break;
-            case OP_FALSE:  pushstack(MK_VAL_BOOL(false)); break;
+            case OP_NIL:    pushstack(vm, MK_VAL_NIL); break;
+            case OP_TRUE:   pushstack(vm, MK_VAL_BOOL(true)); break;
+            case OP_FALSE:  pushstack(vm, MK_VAL_BOOL(false)); break;
 
-            case OP_LOGIC_NOT:  pushstack(MK_VAL_BOOL(is_falsey(popstack()))); break;
+            case OP_LOGIC_NOT:  pushstack(vm, MK_VAL_BOOL(is_falsey(popstack(vm)))); break;
 
             case OP_LOGIC_EQUAL: {
-                Value a = popstack();
-                Value b = popstack();
-                pushstack(MK_VAL_BOOL(values_equal(a, b)));
+                // comparing ropes may allocate, so pop only afterwards
+                bool equal = values_equal(vm, peekstack(vm, 0), peekstack(vm, 1));
+                popstack_discard(vm, 2);
+                pushstack(vm, MK_VAL_BOOL(equal));
                 break;
             }
-            case OP_LOGIC_GREATER:  { BINARY_OPERATION(MK_VAL_BOOL, >); break; }
-            case OP_LOGIC_LESS:     { BINARY_OPERATION(MK_VAL_BOOL, <); break; }
+            case OP_LOGIC_GREATER:  { COMPARISON(>); break; }
+            case OP_LOGIC_LESS:     { COMPARISON(<); break; }
 
             case OP_PRINT: 
-                print_val(popstack());
-                printf("\n");
+                print_val(vm, peekstack(vm, 0));
+                fputc('\n', vm->out);
+                popstack_discard(vm, 1);
                 break;
 
             // variables
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
-                hashtable_set(&vm.globals, name, peekstack(0));
-                popstack_discard(1);
+                hashtable_set(vm, &vm->globals, name, peekstack(vm, 0));
+                vm->globals_version++;
+                popstack_discard(vm, 1);
                 break;
             }
 
             case OP_GET_GLOBAL: {
                 ObjString* name = READ_STRING();
                 Value res;
-                if (hashtable_get(&vm.globals, name, &res)) {
-                    pushstack(res);
+                if (hashtable_get(vm, &vm->globals, name, &res)) {
+                    pushstack(vm, res);
                 }
                 else {
-                    runtime_error("Undefined variable \"%s\".", name->chars);
+                    runtime_error(vm, "Undefined variable \"%s\".", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
@@ -304,12 +1101,13 @@ static InterpretResult run_machine()
 
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                if (hashtable_set(&vm.globals, name, peekstack(0))) {
+                if (hashtable_set(vm, &vm->globals, name, peekstack(vm, 0))) {
                     // if it is not being overwritten
-                    hashtable_delete(&vm.globals, name);
-                    runtime_error("Undefined variable \"%s\".", name->chars);
+                    hashtable_delete(vm, &vm->globals, name);
+                    runtime_error(vm, "Undefined variable \"%s\".", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                vm->globals_version++;
                 // note that we don't pop it off the stack because
                 // assignment is an expression
                 break;
@@ -317,27 +1115,65 @@ static InterpretResult run_machine()
 
             case OP_GET_LOCAL: {
                 byte_t slot_index = READ_BYTE();
-                pushstack(frame->stack_slots[slot_index]);
+                pushstack(vm, frame->stack_slots[slot_index]);
                 break;
             }
 
             case OP_SET_LOCAL: {
                 byte_t slot_index = READ_BYTE();
-                frame->stack_slots[slot_index] = peekstack(0); // remember, don't pop because assignment is an expression
+                frame->stack_slots[slot_index] = peekstack(vm, 0); // remember, don't pop because assignment is an expression
+                break;
+            }
+
+            case OP_CLOSURE: {
+                ObjClosure* closure = new_closure(vm, OBJ_AS_FUNC(READ_CONST()));
+                // on the stack first, as capturing upvalues allocates
+                pushstack(vm, MK_VAL_OBJ(closure));
+                for (int i = 0; i < closure->capture_count; i++) {
+                    byte_t kind = READ_BYTE();
+                    byte_t index = READ_BYTE();
+                    if (kind == CAPTURE_LOCAL)
+                        closure->captures[i] = frame->stack_slots[index];
+                    else if (kind == CAPTURE_LOCAL_BOX)
+                        closure->captures[i] = MK_VAL_OBJ(capture_upvalue(vm, frame->stack_slots + index));
+                    else
+                        closure->captures[i] = frame->closure->captures[index];
+                }
+                break;
+            }
+
+            case OP_GET_CAPTURE:
+                pushstack(vm, frame->closure->captures[READ_BYTE()]);
+                break;
+
+            case OP_GET_UPVALUE: {
+                ObjUpvalue* upvalue = OBJ_AS_UPVALUE(frame->closure->captures[READ_BYTE()]);
+                pushstack(vm, *upvalue->location);
                 break;
             }
 
+            case OP_SET_UPVALUE: {
+                ObjUpvalue* upvalue = OBJ_AS_UPVALUE(frame->closure->captures[READ_BYTE()]);
+                *upvalue->location = peekstack(vm, 0); // assignment is an expression
+                break;
+            }
+
+            case OP_CLOSE_UPVALUE:
+                close_upvalues(vm, vm->stack_top - 1);
+                popstack_discard(vm, 1);
+                break;
+
             // jumps
             case OP_JUMP_IF_FALSE: {
                 short_t offset = READ_SHORT();
-                if (is_falsey(peekstack(0)))
+                if (is_falsey(peekstack(vm, 0)))
                     frame->pc += offset;
                 break;
             }
 
             case OP_JUMP_IF_TRUE: {
                 short_t offset = READ_SHORT();
-                if (!is_falsey(peekstack(0)))
+                if (!is_falsey(peekstack(vm, 0)))
                     frame->pc += offset;
                 break;
             }
@@ -354,15 +1190,283 @@ static InterpretResult run_machine()
                 break;
             }
 
+            // the counter, the limit and the loop variable are in 3 slots in a row
+            case OP_FOR_RANGE: {
+                Value* range = frame->stack_slots + READ_BYTE();
+                short_t offset = READ_SHORT();
+                if (!IS_VAL_NUMBERLIKE(range[0]) || !IS_VAL_NUMBERLIKE(range[1])) {
+                    runtime_error(vm, "The bounds of a range must be numbers");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                bool is_counting;
+                if (IS_VAL_INT(range[0]) && IS_VAL_INT(range[1])) {
+                    is_counting = VAL_AS_INT(range[0]) < VAL_AS_INT(range[1]);
+                } else {
+                    // with a double in either bound, the loop counts in doubles
+                    range[0] = MK_VAL_NUM(NUMBERLIKE_AS_NUM(range[0]));
+                    range[1] = MK_VAL_NUM(NUMBERLIKE_AS_NUM(range[1]));
+                    is_counting = VAL_AS_NUM(range[0]) < VAL_AS_NUM(range[1]);
+                }
+                if (is_counting)
+                    range[2] = range[0];
+                else
+                    frame->pc += offset;
+                break;
+            }
+
+            case OP_FOR_RANGE_LOOP: {
+                // Only this touches the counter, so both bounds are still ints
+                // or both doubles. The counter is below the limit, so +1 can't
+                // overflow. Past 2^53 +1.0 can leave a double as it is, which
+                // ends the loop rather than spinning on the same value
+                Value* range = frame->stack_slots + READ_BYTE();
+                short_t offset = READ_SHORT();
+                // closures from the iteration that's ending keep its value
+                close_upvalues(vm, range + 2);
+                bool is_counting;
+                if (IS_VAL_INT(range[0]))
+                    is_counting = ++range[0].as.integer < VAL_AS_INT(range[1]);
+                else {
+                    double next = range[0].as.number + 1;
+                    is_counting = next != range[0].as.number && next < VAL_AS_NUM(range[1]);
+                    range[0].as.number = next;
+                }
+                if (is_counting) {
+                    range[2] = range[0];
+                    frame->pc -= offset;
+                }
+                break;
+            }
+
             case OP_CALL: {
                 byte_t arg_count = READ_BYTE();
 
                 // fn arg_1 arg_2 [stack_top]
-                if (!call_value(peekstack(arg_count), arg_count)) {
+                if (!call_value(vm, peekstack(vm, arg_count), arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                frame = &vm.frames[vm.frame_count - 1];
+                frame = &vm->frames[vm->frame_count - 1];
+                break;
+            }
+
+            case OP_TAIL_CALL: {
+                byte_t arg_count = READ_BYTE();
+                Value callee = peekstack(vm, arg_count);
+                ObjFunction* func = value_to_function(callee);
+
+                // Natives and the rest don't take a frame, so they're called
+                // as usual and the OP_RETURN after returns their result. So are
+                // bad calls, for the error to have this frame in its trace
+                if (func == NULL || func->arity != arg_count) {
+                    if (!call_value(vm, callee, arg_count))
+                        return INTERPRET_RUNTIME_ERROR;
+                    frame = &vm->frames[vm->frame_count - 1];
+                    break;
+                }
+
+                // the callee and its arguments take the place of this frame's
+                close_upvalues(vm, frame->stack_slots);
+                Value* callee_slots = vm->stack_top - arg_count - 1;
+                memmove(frame->stack_slots, callee_slots, (arg_count + 1) * sizeof(Value));
+                vm->stack_top = frame->stack_slots + arg_count + 1;
+                vm->frame_count--;
+
+                if (!call_value(vm, callee, arg_count))
+                    return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frame_count - 1];
+                break;
+            }
+
+            case OP_INLINE_GUARD: {
+                byte_t arg_count = READ_BYTE();
+                Value func = READ_CONST();
+                short_t offset = READ_SHORT();
+                Value callee = peekstack(vm, arg_count);
+                if (IS_VAL_OBJ(callee) && VAL_AS_OBJ(callee) == VAL_AS_OBJ(func))
+                    frame->pc += offset;
+                break;
+            }
+
+            case OP_PEEK: {
+                byte_t distance = READ_BYTE();
+                pushstack(vm, peekstack(vm, distance));
+                break;
+            }
+
+            case OP_INLINE_RETURN: {
+                byte_t count = READ_BYTE();
+                vm->stack_top[-count - 1] = vm->stack_top[-1];
+                popstack_discard(vm, count);
+                break;
+            }
+
+            case OP_YIELD: {
+                if (vm->fiber == NULL) {
+                    runtime_error(vm, "Cannot yield outside of a fiber");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                Value value = popstack(vm);
+                ObjFiber* fiber = vm->fiber;
+                fiber->state = FIBER_SUSPENDED;
+
+                if (fiber->is_task) {
+                    // a task just lets the others run for a while
+                    loop_make_ready(&vm->loop, fiber, true, MK_VAL_NIL);
+                    if (!schedule_next(vm))
+                        return INTERPRET_RUNTIME_ERROR;
+                    frame = &vm->frames[vm->frame_count - 1];
+                    break;
+                }
+
+                switch_fiber(vm, fiber->resumer);
+                fiber->resumer = NULL;
+
+                // the value is the result of the call that resumed the fiber
+                pushstack(vm, value);
+                frame = &vm->frames[vm->frame_count - 1];
+                break;
+            }
+
+            case OP_LIST_NEW:
+                pushstack(vm, MK_VAL_OBJ(new_list(vm)));
+                break;
+
+            case OP_LIST_APPEND:
+                // the value is still on the stack while the list grows
+                list_append(vm, OBJ_AS_LIST(peekstack(vm, 1)), peekstack(vm, 0));
+                popstack_discard(vm, 1);
+                break;
+
+            case OP_INDEX_GET: {
+                Value result;
+                if (!index_load(vm, peekstack(vm, 1), peekstack(vm, 0), &result)) {
+                    index_error(vm, peekstack(vm, 1), peekstack(vm, 0));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                popstack_discard(vm, 2);
+                pushstack(vm, result);
+                break;
+            }
+
+            case OP_INDEX_SET: {
+                Value value = peekstack(vm, 0);
+                if (!index_store(vm, peekstack(vm, 2), peekstack(vm, 1), value)) {
+                    index_error(vm, peekstack(vm, 2), peekstack(vm, 1));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // assignment is an expression, so the value stays
+                popstack_discard(vm, 3);
+                pushstack(vm, value);
+                break;
+            }
+
+            case OP_MAP_NEW:
+                pushstack(vm, MK_VAL_OBJ(new_map(vm)));
+                break;
+
+            case OP_CLASS:
+                pushstack(vm, MK_VAL_OBJ(new_class(vm, READ_STRING())));
+                break;
+
+            case OP_METHOD: {
+                ObjString* name = READ_STRING();
+                ObjClass* klass = OBJ_AS_CLASS(peekstack(vm, 1));
+                // the method is still on the stack while the table grows
+                hashtable_set(vm, &klass->methods, name, peekstack(vm, 0));
+                if (name->length == 4 && memcmp(name->chars, "init", 4) == 0)
+                    klass->initializer = peekstack(vm, 0);
+                popstack_discard(vm, 1);
+                break;
+            }
+
+            // The cached cases are the fast paths, where the instance's shape
+            // is in the cache, so the slot of the field is known
+            case OP_GET_PROPERTY: {
+                PropertyCache* caches = function_caches(vm, frame->func);
+                ObjString* name = READ_STRING();
+                PropertyCache* cache = READ_CACHE();
+                Value receiver = peekstack(vm, 0);
+                if (cache != NULL && IS_OBJ_INSTANCE(receiver)) {
+                    ObjInstance* instance = OBJ_AS_INSTANCE(receiver);
+                    CacheEntry* entry = cache_lookup(cache, instance->shape);
+                    if (entry != NULL && entry->slot >= 0) {
+                        vm->stack_top[-1] = instance->fields[entry->slot];
+                        break;
+                    }
+                    if (entry != NULL) {
+                        vm->stack_top[-1] = MK_VAL_OBJ(new_bound_method(vm, receiver, entry->target));
+                        break;
+                    }
+                }
+                if (!get_property(vm, cache, name))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
+            case OP_SET_PROPERTY: {
+                PropertyCache* caches = function_caches(vm, frame->func);
+                ObjString* name = READ_STRING();
+                PropertyCache* cache = READ_CACHE();
+                Value receiver = peekstack(vm, 1);
+                if (cache != NULL && IS_OBJ_INSTANCE(receiver)) {
+                    ObjInstance* instance = OBJ_AS_INSTANCE(receiver);
+                    CacheEntry* entry = cache_lookup(cache, instance->shape);
+                    if (entry != NULL) {
+                        Value value = peekstack(vm, 0);
+                        if (entry->target == NULL)
+                            instance->fields[entry->slot] = value;
+                        else
+                            instance_add_field(vm, instance, (ObjShape*)entry->target, value);
+                        vm->stack_top[-2] = value;
+                        popstack_discard(vm, 1);
+                        break;
+                    }
+                }
+                if (!set_property(vm, cache, name))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+
+            case OP_INVOKE: {
+                PropertyCache* caches = function_caches(vm, frame->func);
+                ObjString* name = READ_STRING();
+                byte_t arg_count = READ_BYTE();
+                PropertyCache* cache = READ_CACHE();
+                Value receiver = peekstack(vm, arg_count);
+                bool called;
+                CacheEntry* entry;
+                if (cache != NULL && IS_OBJ_INSTANCE(receiver) &&
+                    (entry = cache_lookup(cache, OBJ_AS_INSTANCE(receiver)->shape)) != NULL) {
+                    if (entry->slot < 0) {
+                        // the instance stays where it is, as `this`
+                        called = call_value(vm, MK_VAL_OBJ(entry->target), arg_count);
+                    }
+                    else {
+                        Value field = OBJ_AS_INSTANCE(receiver)->fields[entry->slot];
+                        vm->stack_top[-arg_count - 1] = field;
+                        called = call_value(vm, field, arg_count);
+                    }
+                }
+                else {
+                    called = invoke(vm, cache, name, arg_count);
+                }
+                if (!called)
+                    return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frame_count - 1];
+                break;
+            }
+
+            case OP_MAP_INSERT: {
+                Value key = peekstack(vm, 1);
+                if (!map_key_valid(key)) {
+                    runtime_error(vm, "Map keys must be numbers, strings, booleans or nil.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // the key and value are still on the stack while the map grows
+                map_set(vm, OBJ_AS_MAP(peekstack(vm, 2)), key, peekstack(vm, 0));
+                popstack_discard(vm, 2);
                 break;
             }
 
@@ -372,23 +1476,47 @@ static InterpretResult run_machine()
     }
 }
 #undef BINARY_OPERATION
+#undef INT_OPERATION
+#undef COMPARISON
+#undef BITWISE_OPERATION
+#undef SHIFT_OPERATION
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONST
 #undef READ_STRING
+#undef READ_CACHE
 
 
-InterpretResult vm_execsource(const char* source) {
-    ObjFunction* func = compile(source);
+InterpretResult vm_execsource(VM* vm, const char* source) {
+    ObjFunction* func = compile(vm, source);
     if (func == NULL) return INTERPRET_COMPILE_ERROR;
 
-    // CallFrame* frame = &vm.frames[vm.frame_count++];
+    return vm_run(vm, func);
+}
+
+InterpretResult vm_run(VM* vm, ObjFunction* func) {
+    // CallFrame* frame = &vm->frames[vm->frame_count++];
     // frame->func = func;
     // frame->pc = func->chunk.code;
-    // frame->stack_slots = vm.stack_top;
+    // frame->stack_slots = vm->stack_top;
+
+    pushstack(vm, MK_VAL_OBJ(func));
+    call_fn(vm, func, 0);
+
+    InterpretResult result = run_machine(vm);
+    if (result == INTERPRET_OK)
+        popstack_discard(vm, 1);
+    return result;
+}
 
-    pushstack(MK_VAL_OBJ(func));
-    call_fn(func, 0);
+InterpretResult vm_call(VM* vm, ObjFunction* func, int arg_count, Value* args, Value* result) {
+    pushstack(vm, MK_VAL_OBJ(func));
+    for (int i = 0; i < arg_count; i++)
+        pushstack(vm, args[i]);
+    call_fn(vm, func, arg_count);
 
-    return run_machine();
+    InterpretResult status = run_machine(vm);
+    if (status == INTERPRET_OK)
+        *result = popstack(vm);
+    return status;
 }
\ No newline at end of file
@@ -1,30 +1,76 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "volt/code/chunk.h"
 #include "volt/code/value.h"
 #include "volt/code/object.h"
 #include "volt/hash_table.h"
+#include "volt/heap.h"
+#include "volt/event_loop.h"
+
+// The value stack and the call frames both start small and are grown on
+// demand, upto the limits below. The limits can be changed per vm (see
+// vm.stack_limit and vm.frame_limit) or overridden at build time
+#define VM_STACK_INITIAL 256
+#define VM_FRAMES_INITIAL 8
+
+#ifndef VM_STACK_LIMIT
+#define VM_STACK_LIMIT (1024 * 1024)
+#endif
+
+#ifndef VM_FRAMES_LIMIT
+#define VM_FRAMES_LIMIT (64 * 1024)
+#endif
 
-#define FRAMES_MAX 64
-#define VM_STACK_MAX (256 * FRAMES_MAX)
-// #define VM_STACK_MAX 256
+// There may be lots of fibers, so their stacks start out with just enough
+// room for calling the fiber's function
+#define VM_FIBER_STACK_INITIAL VM_FRAME_HEADROOM
+#define VM_FIBER_FRAMES_INITIAL 4
 
+// free slots guaranteed above the base of every new frame, so the common
+// pushes never need to grow the stack
+#define VM_FRAME_HEADROOM 256
 
-typedef struct {
+
+typedef struct CallFrame {
     ObjFunction* func;
+    // NULL when a plain function runs. The closure is kept alive by the
+    // frame's first slot, which holds whatever was called
+    ObjClosure* closure;
     byte_t* pc;
     Value* stack_slots;
 } CallFrame;
 
-typedef struct {
+// how a parked native call continues, once its waiter is ready again
+typedef enum {
+    PARK_NONE,
+    // the call is made again, from scratch
+    PARK_RETRY,
+    // the call returns whatever the waiter is continued with
+    PARK_RESULT
+} NativeParking;
+
+/*
+* An interpreter instance. Nothing in volt is global, all the state lives in
+* here (or on the C stack of the call working on it), so any number of vms can
+* be used at the same time, from different threads too, as long as each one is
+* only used by a single thread at a time
+*/
+typedef struct VM {
     // Chunk* cnk;
     // byte_t* prog_counter;
 
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     unsigned int frame_count;
+    unsigned int frame_capacity;
+    unsigned int frame_limit;
 
-    // the great stack itself
-    Value stack[VM_STACK_MAX];
+    // the great stack itself. It may move when it grows, so pointers into it
+    // (like a frame's stack_slots) must not be held across a push
+    Value* stack;
+    Value* stack_end;
+    size_t stack_limit;
 
     // the top most element is *(stack_top - 1), NOT *stack_top
     // In other words it points to the location where the next element will go 
@@ -32,12 +78,65 @@ typedef struct {
     // to the zero'th element
     Value* stack_top;
 
-    Obj* objects;
+    // the upvalues still pointing into the stack above, from the top down
+    ObjUpvalue* open_upvalues;
+
+    // The fiber running right now, NULL while the main script runs. The stack
+    // and frames above always belong to whatever is running, the main script's
+    // are kept in root_stacks meanwhile
+    ObjFiber* fiber;
+    FiberStacks root_stacks;
+
+    // all the objects and most of the other memory live here
+    Heap heap;
     HashTable interned_strings;
     HashTable globals;
-} VM;
+    // bumped whenever a global is defined or assigned, so the copies of the
+    // globals made for tasks can tell if they are still up to date
+    unsigned long globals_version;
+
+    // garbage collector state
+    size_t bytes_allocated;
+    size_t next_gc;
+    bool is_collecting;
+
+    // marked objects whose references are not yet traced
+    Obj** gray_stack;
+    int gray_count;
+    int gray_capacity;
+
+    // the compilation in progress, if any (see compile())
+    struct Parser* parser;
 
-extern VM vm;
+    // set by a native function that failed, the message of its runtime error
+    const char* native_error;
+    // set by a native function that has to wait (see native_park())
+    NativeParking parking;
+
+    EventLoop loop;
+
+    // what the tasks spawned from this vm share with it, NULL until the first
+    // spawn() (see scheduler.h)
+    struct TaskOrigin* task_origin;
+    // set while a scheduler worker runs a task on this vm
+    struct Task* running_task;
+
+    // Interns the strings in the process wide table (see shared_strings.h)
+    // instead of interned_strings. Set on all the vms that pass strings or
+    // code between each other, so that interned strings stay comparable by
+    // pointer. See vm_init_shared()
+    bool use_shared_strings;
+    // Set on a vm whose objects are used by other vms (see IsolatePool). It
+    // only collects when its owner calls collect_garbage(), and the other vms
+    // never mark or free its objects
+    bool is_shared;
+    // the pool this vm compiles programs for, whose programs are roots
+    struct IsolatePool* pool;
+
+    // where the print statement and runtime errors go
+    FILE* out;
+    FILE* err;
+} VM;
 
 typedef enum {
     INTERPRET_OK,
@@ -45,11 +144,47 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-void vm_init();
-void vm_free();
+void vm_init(VM* vm);
+// Like vm_init(), but the vm interns its strings in the process wide table, so
+// its interned strings are the same objects as those of the other such vms
+void vm_init_shared(VM* vm);
+void vm_free(VM* vm);
 
-// void vm_pushstack(Value val);
-// Value vm_popstack();
+// Used outside the vm (e.g by the compiler) to keep newly
+// created objects reachable while more memory is being allocated
+void vm_pushstack(VM* vm, Value val);
+Value vm_popstack(VM* vm);
 // Value vm_peekstack();
 
-InterpretResult vm_execsource(const char* source);
+InterpretResult vm_execsource(VM* vm, const char* source);
+
+// runs an already compiled script
+InterpretResult vm_run(VM* vm, ObjFunction* func);
+
+// Runs a function with the given arguments, like a script of its own. The
+// arguments must match its arity. result is set only if it returns normally
+InterpretResult vm_call(VM* vm, ObjFunction* func, int arg_count, Value* args, Value* result);
+
+// Drops all the globals, so the vm can run an unrelated script. Its heap and
+// interned strings are kept, which makes this a lot cheaper than a new vm
+void vm_reset(VM* vm);
+
+
+/* Natives */
+
+// makes a native available to scripts, as a global
+void vm_define_native(VM* vm, const char* name, NativeFn fn);
+
+// Makes the native call fail with a runtime error. The message must be a
+// string literal, as it's only printed once the native has returned
+static inline Value native_error(VM* vm, const char* message) {
+    vm->native_error = message;
+    return MK_VAL_NIL;
+}
+
+// Called by a native that has put the running waiter (vm->fiber) into the
+// event loop. The vm switches over to the next ready one once it returns
+static inline Value native_park(VM* vm, NativeParking how) {
+    vm->parking = how;
+    return MK_VAL_NIL;
+}